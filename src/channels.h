@@ -0,0 +1,151 @@
+#pragma once
+#include "protocol.h"
+#include "instrument.h"
+#include <RadioLib.h>
+
+extern SX1262 radio;
+extern LoraCfg cfg;
+
+// Channel plan. Channel 0 is the control channel (cfg.freq): joins, beacons
+// and every relayed hop stay there. Channels 1..N are data channels a 1-hop
+// leaf can be moved to; the gateway follows it there when polling. An empty
+// plan (-DMESH_DATA_CHANNELS=) keeps everyone on the control channel.
+#ifndef MESH_DATA_CHANNELS
+#define MESH_DATA_CHANNELS 867.1f, 867.3f, 867.5f, 867.7f, 867.9f, 868.3f, 868.5f, 869.525f
+#endif
+static constexpr float DATA_CHANNELS[] = {MESH_DATA_CHANNELS};
+static constexpr uint8_t NUM_DATA_CHANNELS = sizeof(DATA_CHANNELS) / sizeof(DATA_CHANNELS[0]);
+static constexpr uint8_t DATA_CHANNEL_SPREAD = NUM_DATA_CHANNELS ? NUM_DATA_CHANNELS : 1;
+
+static inline float channelFreq(uint8_t ch)
+{
+    return (ch && ch <= NUM_DATA_CHANNELS) ? DATA_CHANNELS[ch - 1] : cfg.freq;
+}
+// deterministic home data channel of a node
+static inline uint8_t dataChannelFor(addr_t a)
+{
+    return NUM_DATA_CHANNELS ? (uint8_t)(1 + ((uint32_t)a * 40503u >> 8) % DATA_CHANNEL_SPREAD) : 0;
+}
+
+// EU868 sub-bands (ETSI EN 300 220) and their duty-cycle limits in permille.
+enum SubBand : uint8_t
+{
+    BAND_G,  // 865.0 - 868.0 MHz, 1 %
+    BAND_G1, // 868.0 - 868.6 MHz, 1 %
+    BAND_G2, // 868.7 - 869.2 MHz, 0.1 %
+    BAND_G3, // 869.4 - 869.65 MHz, 10 %
+    BAND_COUNT
+};
+struct SubBandInfo
+{
+    float loMHz;
+    float hiMHz;
+    uint16_t permille;
+    const char *name;
+};
+static constexpr SubBandInfo SUB_BANDS[BAND_COUNT] = {
+    {865.0f, 868.0f, 10, "g"},
+    {868.0f, 868.6f, 10, "g1"},
+    {868.7f, 869.2f, 1, "g2"},
+    {869.4f, 869.65f, 100, "g3"},
+};
+
+static inline uint8_t bandOf(float mhz)
+{
+    for (uint8_t b = 0; b < BAND_COUNT; ++b)
+        if (mhz >= SUB_BANDS[b].loMHz && mhz < SUB_BANDS[b].hiMHz)
+            return b;
+    return BAND_G2; // outside the plan: account against the strictest limit
+}
+
+// Lenient token bucket per sub-band: refilled at the band's limit over
+// DC_WINDOW_MS, may be overdrawn by dcBorrowPct of its capacity (runtime
+// parameter, a third by default) before TX is deferred. Each translation
+// unit that transmits keeps its own state.
+static constexpr int16_t ERR_TX_DEFERRED = 1;
+static constexpr uint32_t DC_WINDOW_MS = 3600000UL;
+
+static constexpr int32_t dcCapMs(uint8_t b) { return (int32_t)(SUB_BANDS[b].permille * (DC_WINDOW_MS / 1000)); }
+static uint32_t dcBorrowPct = 33;
+static inline int32_t dcBorrowMs(uint8_t b) { return dcCapMs(b) * (int32_t)dcBorrowPct / 100; }
+
+struct DcBucket
+{
+    int32_t tokens_ms;
+    uint32_t last_ref_ms;
+    uint32_t ref_rem;
+    uint32_t free_at;
+};
+static DcBucket dcBuckets[BAND_COUNT] = {
+    {dcCapMs(BAND_G), 0, 0, 0},
+    {dcCapMs(BAND_G1), 0, 0, 0},
+    {dcCapMs(BAND_G2), 0, 0, 0},
+    {dcCapMs(BAND_G3), 0, 0, 0},
+};
+static uint8_t dcBand = BAND_G1; // band of the frequency the radio is on
+
+static inline void dcSetFreq(float mhz) { dcBand = bandOf(mhz); }
+
+static inline void dcRefill(uint8_t b, uint32_t now)
+{
+    DcBucket &k = dcBuckets[b];
+    if (!k.last_ref_ms)
+    {
+        k.last_ref_ms = now;
+        return;
+    }
+    uint32_t elapsed = now - k.last_ref_ms;
+    k.last_ref_ms = now;
+    uint64_t accum = (uint64_t)k.ref_rem + (uint64_t)elapsed * SUB_BANDS[b].permille;
+    k.ref_rem = (uint32_t)(accum % 1000);
+    k.tokens_ms += (int32_t)(accum / 1000);
+    if (k.tokens_ms > dcCapMs(b))
+        k.tokens_ms = dcCapMs(b);
+}
+
+static inline uint32_t dcFreeAt() { return dcBuckets[dcBand].free_at; }
+
+// Airtime left in the current band's bucket, negative while borrowing
+static inline int32_t dcTokensMs()
+{
+    dcRefill(dcBand, millis());
+    return dcBuckets[dcBand].tokens_ms;
+}
+
+static inline bool dcReady()
+{
+    return millis() >= dcFreeAt();
+}
+
+static int16_t transmitWithDC(const uint8_t *buf, size_t len)
+{
+    uint32_t now = millis();
+    if (!dcReady())
+        return ERR_TX_DEFERRED;
+    const uint8_t b = dcBand;
+    DcBucket &k = dcBuckets[b];
+    dcRefill(b, now);
+    uint32_t t0 = millis();
+    int16_t st;
+    {
+        PERF_SCOPE(PERF_TX);
+        st = radio.transmit(buf, len);
+    }
+    uint32_t t1 = millis();
+    if (st == RADIOLIB_ERR_NONE)
+    {
+        uint32_t on = (t1 > t0) ? (t1 - t0) : 1;
+        k.tokens_ms -= (int32_t)on;
+        if (k.tokens_ms < -dcBorrowMs(b))
+        {
+            int32_t deficit = (-dcBorrowMs(b) - k.tokens_ms);
+            k.free_at = t1 + (uint32_t)((uint64_t)deficit * 1000 / SUB_BANDS[b].permille);
+        }
+        else
+        {
+            k.free_at = t1;
+        }
+        radio.startReceive();
+    }
+    return st;
+}
@@ -0,0 +1,155 @@
+#pragma once
+#include <stdint.h>
+
+// Build-time protocol profile: radio settings, table sizes, timing defaults
+// and the load the network is planned for. Pick one per platformio.ini
+// environment with -D MESH_PROFILE=PROFILE_LARGE_SITE (default
+// PROFILE_SMALL_SITE); every device of a network needs the same profile.
+// Single -D overrides (GW_MAX_NODES, ...) still take precedence. The checks
+// at the bottom fail the build for a profile that cannot keep the duty
+// cycle or does not fit the board.
+struct MeshProfile
+{
+    // radio, 4/cr coding rate
+    uint8_t sf;
+    uint16_t bwKHz;
+    uint8_t cr;
+    // topology and planned load
+    uint8_t maxHops;
+    uint16_t designNodes; // nodes the gateway polls every round
+    // gateway tables
+    uint16_t gwMaxNodes;
+    uint16_t gwMaxAddrs;
+    uint8_t gwFragPool;
+    uint8_t gwStatsMax;
+    uint32_t gwRamBudget; // bytes for all of the above
+    // node tables
+    uint8_t maxChildren;
+    uint8_t maxDesc;
+    uint8_t maxTxq;
+    uint8_t upWindow;
+    uint32_t nodeRamBudget;
+    // timing defaults, ms; the runtime parameters start from these
+    uint32_t queryPeriodMs;
+    uint32_t livenessMs; // gateway child timeout, node lost-parent/child-silent
+    uint32_t testPeriodMs;
+};
+
+// A handful of nodes, up to 4 hops, SF10. Polls are spaced so that one relay
+// can carry all the others.
+constexpr MeshProfile PROFILE_SMALL_SITE = {
+    10, 125, 5,
+    4, 10,
+    128, 256, 4, 32, 48 * 1024,
+    10, 32, 16, 8, 16 * 1024,
+    1200000, 3600000, 1800000};
+
+// Hundreds of nodes close enough for SF7, up to 6 hops.
+constexpr MeshProfile PROFILE_LARGE_SITE = {
+    7, 125, 5,
+    6, 250,
+    1024, 2048, 4, 64, 128 * 1024,
+    10, 32, 16, 8, 16 * 1024,
+    1800000, 5400000, 600000};
+
+// Few long-range nodes at SF12 that report rarely.
+constexpr MeshProfile PROFILE_LOW_POWER = {
+    12, 125, 5,
+    3, 4,
+    32, 64, 2, 16, 24 * 1024,
+    4, 8, 8, 4, 12 * 1024,
+    2400000, 7200000, 3600000};
+
+#ifndef MESH_PROFILE
+#define MESH_PROFILE PROFILE_SMALL_SITE
+#endif
+constexpr MeshProfile PROFILE = MESH_PROFILE;
+
+// LoRa time-on-air in us, as loraAirtimeMs() in protocol.h but usable in
+// constant expressions.
+constexpr uint32_t cfgSymUs(uint8_t sf, uint16_t bw) { return (uint32_t)((1UL << sf) * 1000UL / bw); }
+constexpr int cfgPayloadSyms(int num, int den, uint8_t cr) { return 8 + (num > 0 ? (num + den - 1) / den : 0) * cr; }
+constexpr uint32_t cfgAirtimeUs(uint8_t sf, uint16_t bw, uint8_t cr, uint16_t len)
+{
+    return (uint32_t)((49 + 4 * (uint64_t)cfgPayloadSyms(8 * len - 4 * sf + 44,
+                                                          4 * (sf - 2 * (cfgSymUs(sf, bw) >= 16000 ? 1 : 0)), cr)) *
+                      cfgSymUs(sf, bw) / 4);
+}
+
+// Duty-cycle plan against the control channel's 1 % band, the worst case:
+// relays and leaves before ADR are all polled there. Polling may take 80 %
+// of the hour's budget, the rest is for ACKs, joins and commands. A leaf
+// answers every QUERY and sends its test frames.
+constexpr uint32_t CFG_BAND_BUDGET_US = 36000UL * 1000UL;
+constexpr uint32_t CFG_QUERY_FRAME = 8 + 4 + 4;  // header, QueryPayload, DataAckPayload
+constexpr uint32_t CFG_STATE_FRAME = 8 + 4;      // header, StatusPayload
+constexpr uint32_t CFG_TEST_FRAME = 8 + 3 + 24;  // header, DataUpHdr, test_hdr_t
+// A round's next QUERY waits until the last one is answered, or until the
+// answer had time to come back, a frame and some slack per hop each way
+// (gateway.cpp).
+constexpr uint32_t CFG_QUERY_HOP_SLACK_MS = 100;
+constexpr uint64_t CFG_QUERY_TURN_US =
+    (uint64_t)(2 * PROFILE.maxHops - 1) *
+    (cfgAirtimeUs(PROFILE.sf, PROFILE.bwKHz, PROFILE.cr, CFG_QUERY_FRAME) + CFG_QUERY_HOP_SLACK_MS * 1000);
+constexpr uint64_t CFG_ROUND_AIR_US = (uint64_t)PROFILE.designNodes *
+                                      cfgAirtimeUs(PROFILE.sf, PROFILE.bwKHz, PROFILE.cr, CFG_QUERY_FRAME);
+constexpr uint64_t CFG_ROUND_US = PROFILE.designNodes * CFG_QUERY_TURN_US;
+constexpr uint64_t CFG_GW_HOUR_US = CFG_ROUND_AIR_US * (3600000UL / PROFILE.queryPeriodMs);
+constexpr uint64_t CFG_LEAF_HOUR_US =
+    (uint64_t)cfgAirtimeUs(PROFILE.sf, PROFILE.bwKHz, PROFILE.cr, CFG_STATE_FRAME) * (3600000UL / PROFILE.queryPeriodMs) +
+    (uint64_t)cfgAirtimeUs(PROFILE.sf, PROFILE.bwKHz, PROFILE.cr, CFG_TEST_FRAME) * (3600000UL / PROFILE.testPeriodMs);
+
+// The busiest relay forwards every QUERY, STATE and test frame of its
+// subtree besides its own: at most designNodes - 1 nodes, and never more than
+// its descendant table holds. Relays stay on the control channel.
+constexpr uint32_t CFG_RELAY_SUBTREE = PROFILE.designNodes - 1u < PROFILE.maxDesc ? PROFILE.designNodes - 1u : PROFILE.maxDesc;
+constexpr uint64_t CFG_RELAY_HOUR_US =
+    CFG_LEAF_HOUR_US + CFG_RELAY_SUBTREE * (CFG_LEAF_HOUR_US + (uint64_t)cfgAirtimeUs(PROFILE.sf, PROFILE.bwKHz, PROFILE.cr, CFG_QUERY_FRAME) *
+                                                                   (3600000UL / PROFILE.queryPeriodMs));
+
+// ADR (gateway.cpp, node.cpp): a leaf on a reduced SF hears the gateway only
+// when it is polled. Both ends fall back to the base link after
+// CFG_ADR_ROLLBACK_MISSES silent rounds: the gateway counts unanswered
+// QUERYs, the leaf the time since the last one, plus half a round of slack.
+constexpr uint8_t CFG_ADR_ROLLBACK_MISSES = 2;
+constexpr uint32_t CFG_ADR_ROLLBACK_MS = CFG_ADR_ROLLBACK_MISSES * PROFILE.queryPeriodMs + PROFILE.queryPeriodMs / 2;
+
+// Reliable uplink (node.cpp). The gateway holds a DATA_ACK for
+// CFG_DATA_ACK_HOLD_MS and lets it ride on a QUERY due within
+// CFG_DATA_ACK_WAIT_MS, so the node retries once that, the way up and the
+// way back (a full frame and its echo window, three times per hop) have
+// passed. An ADR leaf transmits only after a QUERY, so its frame may wait up
+// to a whole round before it leaves.
+constexpr uint32_t CFG_DATA_ACK_HOLD_MS = 3000;
+constexpr uint32_t CFG_DATA_ACK_WAIT_MS = 20000;
+constexpr uint32_t CFG_HOP_MS = 3 * (3 * cfgAirtimeUs(PROFILE.sf, PROFILE.bwKHz, PROFILE.cr, 8 + 64) / 1000 + 400);
+constexpr uint32_t CFG_DATA_RETRY_MS = CFG_DATA_ACK_HOLD_MS + CFG_DATA_ACK_WAIT_MS + 2 * PROFILE.maxHops * CFG_HOP_MS;
+constexpr uint32_t CFG_ADR_DATA_RETRY_MS = PROFILE.queryPeriodMs + CFG_DATA_RETRY_MS;
+
+// Trickle beacon Imin (trickle.h): four full-size frames, so neighbours
+// resetting together spread out, but never under 4 s.
+constexpr uint32_t CFG_BEACON_AIR4_MS = cfgAirtimeUs(PROFILE.sf, PROFILE.bwKHz, PROFILE.cr, 8 + 64) / 250;
+constexpr uint32_t CFG_TRICKLE_IMIN_MS = CFG_BEACON_AIR4_MS > 4000 ? CFG_BEACON_AIR4_MS : 4000;
+
+static_assert(CFG_ROUND_US < PROFILE.queryPeriodMs * 1000ULL, "profile: a query round takes longer than its period");
+static_assert(CFG_GW_HOUR_US <= CFG_BAND_BUDGET_US * 8 / 10,
+              "profile: gateway polling exceeds the 1 % duty cycle; fewer designNodes, lower SF or longer queryPeriodMs");
+static_assert(CFG_LEAF_HOUR_US <= CFG_BAND_BUDGET_US * 8 / 10,
+              "profile: node reporting exceeds the 1 % duty cycle; lower SF or longer testPeriodMs");
+static_assert(CFG_RELAY_HOUR_US <= CFG_BAND_BUDGET_US * 8 / 10,
+              "profile: a relay forwarding for its subtree exceeds the 1 % duty cycle; fewer designNodes, "
+              "lower SF or longer periods");
+static_assert(PROFILE.livenessMs >= 2 * PROFILE.queryPeriodMs,
+              "profile: nodes would time out between query rounds");
+static_assert(CFG_ADR_ROLLBACK_MS < PROFILE.livenessMs,
+              "profile: an ADR leaf would detach before falling back to the base link");
+static_assert(CFG_ADR_DATA_RETRY_MS < PROFILE.livenessMs, "profile: uplink retries slower than the liveness timeout");
+static_assert(PROFILE.upWindow <= 16, "profile: uplink window larger than one DATA_ACK bitmap");
+static_assert(PROFILE.designNodes <= PROFILE.gwMaxNodes, "profile: designNodes exceeds the node table");
+static_assert(PROFILE.sf >= 7 && PROFILE.sf <= 12 && PROFILE.cr >= 5 && PROFILE.cr <= 8, "profile: bad radio settings");
+
+// ESP32-S3: static tables must leave most of the ~320 KB DRAM to the core,
+// the stacks and the heap.
+constexpr uint32_t BOARD_TABLE_RAM_MAX = 160 * 1024;
+static_assert(PROFILE.gwRamBudget <= BOARD_TABLE_RAM_MAX && PROFILE.nodeRamBudget <= BOARD_TABLE_RAM_MAX,
+              "profile: table budget does not fit the board");
@@ -0,0 +1,28 @@
+#pragma once
+#include <Arduino.h>
+
+// Line-oriented serial commands: collects input and hands every complete
+// line to onCommand.
+template <typename Fn>
+static void pollSerial(Fn onCommand)
+{
+    static char line[64];
+    static uint8_t n = 0;
+    while (Serial.available())
+    {
+        const int ch = Serial.read();
+        if (ch == '\r' || ch < 0)
+            continue;
+        if (ch == '\n')
+        {
+            line[n] = 0;
+            if (n)
+                onCommand(line);
+            n = 0;
+        }
+        else if (n < sizeof(line) - 1)
+        {
+            line[n++] = (char)ch;
+        }
+    }
+}
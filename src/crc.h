@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF), as crc16() in
+// tools/meshcap.py. Pass the previous result as crc to continue over
+// another piece.
+static uint16_t crc16(const uint8_t *p, size_t n, uint16_t crc = 0xFFFF)
+{
+    while (n--)
+    {
+        crc ^= (uint16_t)*p++ << 8;
+        for (uint8_t b = 0; b < 8; ++b)
+            crc = (crc & 0x8000) ? (uint16_t)(crc << 1 ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+// CRC-32/ISO-HDLC (reflected poly 0xEDB88320), as zlib.crc32() in Python.
+// Pass the previous result as crc to continue over another piece.
+static uint32_t crc32(const uint8_t *p, size_t n, uint32_t crc = 0)
+{
+    crc = ~crc;
+    while (n--)
+    {
+        crc ^= *p++;
+        for (uint8_t b = 0; b < 8; ++b)
+            crc = (crc & 1) ? (crc >> 1 ^ 0xEDB88320u) : (crc >> 1);
+    }
+    return ~crc;
+}
@@ -1,5 +1,16 @@
 #include "protocol.h"
+#include "channels.h"
+#include "samples.h"
+#include "instrument.h"
+#include "console.h"
+#include "params.h"
+#include "trickle.h"
+#include "power.h"
+#include "tsdb.h"
+#include "ota.h"
+#include "netcode.h"
 #include <RadioLib.h>
+#include <Preferences.h>
 #include <oled.h>
 #include <memory>
 #include <algorithm>
@@ -10,160 +21,572 @@ void meshLoopGateway() {}
 #else
 
 extern SX1262 radio;
+extern LoraCfg cfg;
 
-constexpr uint32_t BEACON_PERIOD_MS = 60000;
-constexpr uint32_t QUERY_PERIOD_MS = 50000;
-constexpr uint32_t QUERY_TIMEOUT_MS = 15000;
-constexpr uint8_t MAX_MISSES = 5;
-constexpr uint32_t CHILD_TIMEOUT_MS = 180000;
-constexpr uint32_t JOIN_ACK_GAP_MS = 2000;
+// Runtime parameters (see params.h and paramTable below); the initialisers
+// are the defaults.
+static uint32_t beaconPeriodMs = 3600000; // longest Trickle beacon interval
+static uint32_t queryPeriodMs = PROFILE.queryPeriodMs;
+static uint32_t queryTimeoutMs = 15000; // per-hop window until the first RTT sample
+static uint32_t maxMisses = 5;
+static uint32_t childTimeoutMs = PROFILE.livenessMs;
+static uint32_t joinAckGapMs = 2000;
+// node knobs, pushed with the rest (paramTable); a relay's hold also delays
+// the answers to our QUERYs
+static uint32_t nodeNetcode = 0;
+static uint32_t nodeNcHoldMs = 0;
+
+constexpr uint32_t QUERY_RTO_MIN_MS = 3000;
+constexpr uint32_t QUERY_RTO_MAX_MS = 60000;
+constexpr uint8_t QUERY_RTO_MAX_SHIFT = 3;
+constexpr uint32_t QUERY_HOP_SLACK_MS = CFG_QUERY_HOP_SLACK_MS;
 constexpr uint8_t MAX_PENDING_JOINS = 16;
+constexpr uint32_t JOIN_BATCH_WINDOW_MS = 1500;
+constexpr uint32_t ADDR_ACK_SLACK_MS = 100;
+constexpr uint8_t JOIN_BATCH_MAX = MAX_PAYLOAD / sizeof(JoinPayload);
 
-#ifndef MSG_CHILD_ADD
-enum : uint8_t
-{
-    MSG_CHILD_ADD = 0xA1,
-    MSG_CHILD_GONE = 0xA2,
-    MSG_JOIN_NACK = 0xA3
-};
+// Adaptive data rate for 1-hop leaves. Relays stay on the base SF because
+// their own children must hear them there.
+constexpr uint8_t ADR_HISTORY = 8;             // SNR samples before deciding
+constexpr int8_t ADR_MARGIN_DB = 10;           // installation margin over the demod floor
+constexpr uint8_t ADR_MIN_SF = 7;
+constexpr uint16_t ADR_SWITCH_DELAY_MS = 2000; // both ends switch this long after the command
+constexpr uint8_t ADR_ROLLBACK_MISSES = CFG_ADR_ROLLBACK_MISSES; // misses on a reduced SF before reverting
+constexpr uint32_t ADR_HOLDOFF_MS = 600000;    // no new command after a rollback
+constexpr uint32_t ADR_LINGER_MS = 1500;       // stay tuned for data flushed after STATE
+
+// Reassembly of fragmented uplink messages: a few buffers of FRAG_MAX_MSG,
+// released FRAG_REASSEMBLY_MS after the last fragment. Finished messages
+// linger so a repeated final fragment still gets a complete FRAG_ACK.
+#ifndef GW_FRAG_POOL
+#define GW_FRAG_POOL (PROFILE.gwFragPool)
+#endif
+constexpr uint32_t FRAG_REASSEMBLY_MS = 120000;
+
+// Per-source statistics for ENABLE_TEST_TX frames, fixed size; the least
+// recently heard source makes room for a new one. Dumped as one JSON line
+// by the "stats" serial command.
+#ifndef GW_STATS_MAX
+#define GW_STATS_MAX (PROFILE.gwStatsMax)
+#endif
+
+// Downlink messages from the host bridge waiting for the node's DOWN_ACK.
+// Each try waits one RTO of the node; after DOWN_MAX_TRIES the host gets a
+// timeout receipt.
+#ifndef GW_DOWN_POOL
+#define GW_DOWN_POOL 8
+#endif
+constexpr uint8_t DOWN_MAX_TRIES = 4;
+
+// Uplink data ACKs wait DATA_ACK_HOLD_MS so several frames share one, then
+// ride on the next QUERY if that goes out within DATA_ACK_WAIT_MS.
+constexpr uint32_t DATA_ACK_HOLD_MS = CFG_DATA_ACK_HOLD_MS;
+constexpr uint32_t DATA_ACK_WAIT_MS = CFG_DATA_ACK_WAIT_MS;
+
+// Gateway node table capacity, fixed at build time by the profile (config.h).
+// All gateway tables together must fit GW_TABLE_RAM_BUDGET; see the
+// static_assert below the statistics table.
+#ifndef GW_MAX_NODES
+#define GW_MAX_NODES (PROFILE.gwMaxNodes)
+#endif
+// Addresses handed out by the gateway are 1..GW_MAX_ADDRS and stay bound to
+// the node's MAC across reboots of either side.
+#ifndef GW_MAX_ADDRS
+#define GW_MAX_ADDRS (PROFILE.gwMaxAddrs)
+#endif
+#ifndef GW_TABLE_RAM_BUDGET
+#define GW_TABLE_RAM_BUDGET (PROFILE.gwRamBudget)
 #endif
 
-struct __attribute__((packed)) ChildEventPayload
+// Topology links are slot indices into children[]; NO_SLOT means "hangs off
+// the gateway" for `up` and "none" for the list links.
+using Slot = uint16_t;
+constexpr Slot NO_SLOT = 0xFFFF;
+static_assert(GW_MAX_NODES < NO_SLOT, "GW_MAX_NODES too large for Slot");
+
+struct Child
 {
-    uint8_t child;
-    uint8_t parent;
-    uint8_t hops;
+    addr_t id = 0;
+    addr_t parent = GW_ID;
+    uint8_t hops = 1;
+    uint8_t misses = 0;
+    int16_t lastRssi = -127;
+    uint16_t battMv = 0; // last reported by a test frame or sample batch, 0 = unknown
+    uint32_t lastSeen = 0;
+    uint32_t lastQuery = 0;
+    uint32_t lastJoinAck = 0;
+    uint32_t srtt = 0;   // smoothed QUERY->STATE RTT, 0 = no sample yet
+    uint32_t rttvar = 0;
+    uint32_t queryRetryAt = 0; // deferred QUERY, valid while queryQueued
+    uint8_t rtoShift = 0;      // Karn backoff, bumped per miss
+    uint8_t queryTries = 0;
+    uint8_t sf = 0;            // link SF, 0 = base SF (cfg.sf)
+    uint8_t ch = 0;            // link channel, 0 = control channel
+    uint8_t nextSf = 0;        // commanded link, applied at sfSwitchAt (nextSf 0 = none)
+    uint8_t nextCh = 0;
+    uint8_t adrMisses = 0;
+    uint8_t snrCount = 0;
+    int8_t snr[ADR_HISTORY] = {0};
+    uint32_t sfSwitchAt = 0;
+    uint32_t adrHoldUntil = 0;
+    uint32_t ackDueAt = 0;     // DATA_ACK owed from then on, 0 = nothing to ack
+    uint32_t paramRetryAt = 0; // next PARAM_SET while paramVer lags the pushed one
+    uint8_t paramVer = 0;      // parameter version the node acknowledged
+    uint8_t paramTries = 0;
+    uint16_t rxNext = 0;       // uplink receive window, see DataAckPayload
+    uint16_t rxMask = 0;
+    bool rxSynced = false;
+    bool queryQueued = false;
+    bool answeredSinceQuery = false;
+    uint8_t otaSt = 0; // OTA_ST_ for the image being rolled out, 0 = nothing heard
+    Slot up = NO_SLOT;
+    Slot firstChild = NO_SLOT;
+    Slot nextSibling = NO_SLOT;
 };
+static Child children[GW_MAX_NODES];
+static Slot childCount = 0;
+static Slot allocCursor = 0;
+static uint32_t evictedLru = 0;
+static addr_t lastEvictedLru = 0;
+
+// Open-addressed id -> slot index so per-frame lookups stay O(1) at full
+// table size. Sized to the next power of two >= 2x capacity.
+constexpr size_t idxSizeFor(size_t n, size_t p = 1) { return p >= 2 * n ? p : idxSizeFor(n, p * 2); }
+constexpr size_t ID_INDEX_SIZE = idxSizeFor(GW_MAX_NODES);
+static Slot idIndex[ID_INDEX_SIZE];
 
-static constexpr int16_t ERR_TX_DEFERRED = 1;
-static constexpr uint32_t DC_WINDOW_MS = 3600000UL;
-static constexpr uint32_t DC_CAP_MS = 36000UL;
-static constexpr int32_t DC_BORROW_MS = 12000;
+static_assert(GW_MAX_ADDRS < ADDR_UNASSIGNED, "GW_MAX_ADDRS overlaps reserved addresses");
 
-static uint32_t dc_free_at = 0;
-static int32_t dc_tokens_ms = (int32_t)DC_CAP_MS;
-static uint32_t dc_last_ref_ms = 0;
-static uint16_t dc_ref_rem = 0;
+// addrMac[a - 1] is the MAC that owns short address a. ADDR_FILE on
+// LittleFS holds the same records back to back; a new binding is appended,
+// so each assignment writes 6 bytes however large the table is.
+static uint8_t addrMac[GW_MAX_ADDRS][6];
+static uint16_t addrCount = 0;
+static bool addrStored = false; // ADDR_FILE is usable
+constexpr const char *ADDR_FILE = "/addr.bin";
 
-static inline void dcRefill(uint32_t now)
+#if ENABLE_PERF
+enum : uint8_t
+{
+    MARK_NODES,
+    MARK_PENDING,
+    MARK_REASM,
+    MARK_STATS,
+    MARK_DOWN,
+    MARK_COUNT
+};
+static PerfMark perfMarks[MARK_COUNT] = {
+    {"nodes", GW_MAX_NODES, 0, 0},
+    {"pend", MAX_PENDING_JOINS, 0, 0},
+    {"reasm", GW_FRAG_POOL, 0, 0},
+    {"stats", GW_STATS_MAX, 0, 0},
+    {"down", GW_DOWN_POOL, 0, 0},
+};
+#endif
+
+// Miss window for one QUERY (Jacobson: srtt + 4*rttvar). Before the first
+// sample fall back to queryTimeoutMs per hop so deep nodes are not charged
+// misses while the estimator warms up.
+static inline uint8_t linkSf(const Child &c) { return c.sf ? c.sf : cfg.sf; }
+
+static uint32_t queryRto(const Child &c)
+{
+    uint32_t perHop = queryTimeoutMs;
+    if (c.sf)
+        perHop = (uint32_t)((uint64_t)perHop * loraAirtimeMs(c.sf, cfg.bw, cfg.cr, 16) /
+                            loraAirtimeMs(cfg.sf, cfg.bw, cfg.cr, 16));
+    uint32_t rto = c.srtt ? c.srtt + 4 * c.rttvar
+                          : perHop * (c.hops ? c.hops : 1);
+    rto <<= c.rtoShift;
+    if (rto < QUERY_RTO_MIN_MS)
+        rto = QUERY_RTO_MIN_MS;
+    if (rto > QUERY_RTO_MAX_MS)
+        rto = QUERY_RTO_MAX_MS;
+    return rto;
+}
+static void rttSample(Child &c, uint32_t rtt)
 {
-    if (!dc_last_ref_ms)
+    if (!c.srtt)
     {
-        dc_last_ref_ms = now;
+        c.srtt = rtt ? rtt : 1;
+        c.rttvar = rtt / 2;
         return;
     }
-    uint32_t elapsed = now - dc_last_ref_ms;
-    dc_last_ref_ms = now;
-    uint32_t accum = dc_ref_rem + (elapsed % 100);
-    uint32_t add = elapsed / 100;
-    if (accum >= 100)
+    uint32_t err = (rtt > c.srtt) ? (rtt - c.srtt) : (c.srtt - rtt);
+    c.rttvar = (3 * c.rttvar + err) / 4;
+    c.srtt = (7 * c.srtt + rtt) / 8;
+    if (!c.srtt)
+        c.srtt = 1;
+}
+
+static Slot slotOf(const Child &c) { return (Slot)(&c - children); }
+
+static inline size_t idxHome(addr_t id) { return ((uint32_t)id * 40503u) & (ID_INDEX_SIZE - 1); }
+
+static void idxInit()
+{
+    for (auto &e : idIndex)
+        e = NO_SLOT;
+}
+static void idxInsert(addr_t id, Slot s)
+{
+    size_t i = idxHome(id);
+    while (idIndex[i] != NO_SLOT)
+        i = (i + 1) & (ID_INDEX_SIZE - 1);
+    idIndex[i] = s;
+}
+// linear-probe delete with backward shift, no tombstones
+static void idxErase(addr_t id)
+{
+    size_t i = idxHome(id);
+    while (idIndex[i] != NO_SLOT && children[idIndex[i]].id != id)
+        i = (i + 1) & (ID_INDEX_SIZE - 1);
+    if (idIndex[i] == NO_SLOT)
+        return;
+    size_t j = i;
+    for (;;)
     {
-        add += 1;
-        accum -= 100;
+        idIndex[i] = NO_SLOT;
+        for (;;)
+        {
+            j = (j + 1) & (ID_INDEX_SIZE - 1);
+            if (idIndex[j] == NO_SLOT)
+                return;
+            size_t k = idxHome(children[idIndex[j]].id);
+            // stay put if home k lies cyclically in (i, j]
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            break;
+        }
+        idIndex[i] = idIndex[j];
+        i = j;
     }
-    dc_ref_rem = (uint16_t)accum;
-    dc_tokens_ms += (int32_t)add;
-    if (dc_tokens_ms > (int32_t)DC_CAP_MS)
-        dc_tokens_ms = (int32_t)DC_CAP_MS;
 }
 
-static inline bool dcReady()
+static Child *findChild(addr_t id)
 {
-    return millis() >= dc_free_at;
+    if (!id)
+        return nullptr;
+    for (size_t i = idxHome(id); idIndex[i] != NO_SLOT; i = (i + 1) & (ID_INDEX_SIZE - 1))
+        if (children[idIndex[i]].id == id)
+            return &children[idIndex[i]];
+    return nullptr;
 }
 
-static int16_t transmitWithDC(const uint8_t *buf, size_t len)
+// Subtree sizes per slot and the depth of the whole tree, for the status
+// output. Rebuilt only after the tree changed: every node adds itself to
+// each of its (at most MAX_HOPS) ancestors, so a rebuild is O(N * hops).
+static uint16_t subSize[GW_MAX_NODES];
+static uint8_t treeDepth = 0;
+static bool subDirty = true;
+
+static void treeUnlink(Child &c)
 {
-    uint32_t now = millis();
-    if (!dcReady())
-        return ERR_TX_DEFERRED;
-    dcRefill(now);
-    uint32_t t0 = millis();
-    int16_t st = radio.transmit(buf, len);
-    uint32_t t1 = millis();
-    if (st == RADIOLIB_ERR_NONE)
+    if (c.up != NO_SLOT)
+    {
+        const Slot me = slotOf(c);
+        Slot *link = &children[c.up].firstChild;
+        while (*link != NO_SLOT && *link != me)
+            link = &children[*link].nextSibling;
+        if (*link == me)
+            *link = c.nextSibling;
+    }
+    c.up = NO_SLOT;
+    c.nextSibling = NO_SLOT;
+    subDirty = true;
+}
+static void treeAttach(Child &c, Slot up)
+{
+    c.up = up;
+    subDirty = true;
+    if (up == NO_SLOT)
+        return;
+    c.nextSibling = children[up].firstChild;
+    children[up].firstChild = slotOf(c);
+}
+// true if slot s lies in the subtree rooted at c (c included)
+static bool treeContains(const Child &c, Slot s)
+{
+    const Slot root = slotOf(c);
+    for (size_t guard = 0; s != NO_SLOT && guard < sizeof(children) / sizeof(children[0]);
+         ++guard, s = children[s].up)
+        if (s == root)
+            return true;
+    return false;
+}
+// Re-parent c; its whole subtree moves with it.
+static void treeSetParent(Child &c, addr_t parentId)
+{
+    c.parent = parentId;
+    Slot np = NO_SLOT;
+    if (parentId != GW_ID)
+        if (Child *p = findChild(parentId))
+            np = slotOf(*p);
+    if (np != NO_SLOT && treeContains(c, np))
+        np = NO_SLOT; // stale report would close a loop, hang it off the GW
+    if (np == c.up)
+        return;
+    treeUnlink(c);
+    treeAttach(c, np);
+}
+
+// Pre-order walk over the subtree rooted at c; fn(child, depth) returns false
+// to stop early. Depth is relative to c.
+template <typename Fn>
+static void treeWalk(Child &c, Fn fn)
+{
+    const Slot root = slotOf(c);
+    Slot s = root;
+    uint8_t d = 0;
+    for (;;)
     {
-        uint32_t on = (t1 > t0) ? (t1 - t0) : 1;
-        dc_tokens_ms -= (int32_t)on;
-        if (dc_tokens_ms < -DC_BORROW_MS)
+        if (!fn(children[s], d))
+            return;
+        if (children[s].firstChild != NO_SLOT)
         {
-            int32_t deficit = (-DC_BORROW_MS - dc_tokens_ms);
-            dc_free_at = t1 + (uint32_t)deficit * 100UL;
+            s = children[s].firstChild;
+            ++d;
+            continue;
         }
-        else
+        while (s != root && children[s].nextSibling == NO_SLOT)
         {
-            dc_free_at = t1;
+            s = children[s].up;
+            --d;
         }
-        radio.startReceive();
+        if (s == root)
+            return;
+        s = children[s].nextSibling;
     }
-    return st;
 }
-
-struct Child
+static void subtreeRefresh()
 {
-    uint8_t id = 0;
-    uint8_t parent = GW_ID;
-    uint8_t hops = 1;
-    uint8_t misses = 0;
-    int16_t lastRssi = -127;
-    uint32_t lastSeen = 0;
-    uint32_t lastQuery = 0;
-    uint32_t lastJoinAck = 0;
-    bool answeredSinceQuery = false;
-};
-static Child children[64];
+    memset(subSize, 0, sizeof(subSize));
+    treeDepth = 0;
+    for (Slot i = 0; i < GW_MAX_NODES; ++i)
+    {
+        if (!children[i].id)
+            continue;
+        ++subSize[i];
+        uint16_t k = 1;
+        for (Slot s = children[i].up; s != NO_SLOT && k < GW_MAX_NODES; s = children[s].up)
+        {
+            ++subSize[s];
+            ++k;
+        }
+        treeDepth = (uint8_t)std::max<uint16_t>(treeDepth, std::min<uint16_t>(k, 255));
+    }
+    subDirty = false;
+}
+// Nodes in the subtree rooted at c, c included
+static uint16_t subtreeSize(const Child &c)
+{
+    if (subDirty)
+        subtreeRefresh();
+    return subSize[slotOf(c)];
+}
+// true if nobody in c's subtree has been heard since `since`
+static bool branchSilentSince(Child &c, uint32_t since)
+{
+    bool silent = true;
+    treeWalk(c, [&](Child &x, uint8_t)
+             { if ((int32_t)(x.lastSeen - since) >= 0) silent = false; return silent; });
+    return silent;
+}
+
+static void eraseChild(Child &c);
+static void tsNote(const Child &c, uint8_t ev, int16_t rssi, uint8_t hops);
 
-static Child *findChild(uint8_t id)
+// Table full: drop the least recently heard leaf. Relays are kept since
+// evicting one would orphan everything routed through it.
+static Child *evictLru()
 {
+    Child *lru = nullptr;
     for (auto &c : children)
-        if (c.id == id)
-            return &c;
-    return nullptr;
+        if (c.id && c.firstChild == NO_SLOT &&
+            (!lru || (int32_t)(c.lastSeen - lru->lastSeen) < 0))
+            lru = &c;
+    if (!lru)
+        return nullptr;
+    lastEvictedLru = lru->id;
+    ++evictedLru;
+    Serial.printf("node table full, evicted LRU %04X (total %lu)\n",
+                  lastEvictedLru, (unsigned long)evictedLru);
+    eraseChild(*lru);
+    return lru;
 }
-static Child *allocChild(uint8_t id)
+
+static Child *allocChild(addr_t id)
 {
+    if (!id || id >= ADDR_UNASSIGNED)
+        return nullptr;
     if (auto *c = findChild(id))
         return c;
-    for (auto &s : children)
+    Child *slot = nullptr;
+    if (childCount < GW_MAX_NODES)
     {
-        if (!s.id)
+        for (Slot n = 0; n < GW_MAX_NODES && !slot; ++n)
         {
-            s.id = id;
-            s.lastQuery = 0;
-            s.answeredSinceQuery = false;
-            s.misses = 0;
-            return &s;
+            Child &c = children[allocCursor];
+            allocCursor = (Slot)((allocCursor + 1) % GW_MAX_NODES);
+            if (!c.id)
+                slot = &c;
         }
     }
-    return nullptr;
+    if (!slot)
+    {
+        PERF_OVERFLOW(MARK_NODES);
+        slot = evictLru();
+    }
+    if (!slot)
+        return nullptr;
+    *slot = Child{};
+    slot->id = id;
+    idxInsert(id, slotOf(*slot));
+    ++childCount;
+    subDirty = true;
+    PERF_LEVEL(MARK_NODES, childCount);
+    // adopt entries that reported us as parent before we were known
+    for (auto &o : children)
+        if (o.id && &o != slot && o.parent == id && o.up == NO_SLOT)
+            treeAttach(o, slotOf(*slot));
+    return slot;
 }
-static void eraseChild(Child &c) { memset(&c, 0, sizeof(c)); }
-static int numChildren()
+static void eraseChild(Child &c)
 {
-    int n = 0;
-    for (auto &c : children)
-        if (c.id)
-            ++n;
-    return n;
+    if (!c.id)
+        return;
+    tsNote(c, TS_GONE, c.lastRssi, c.hops);
+    idxErase(c.id);
+    --childCount;
+    treeUnlink(c);
+    // orphans hang off the gateway until someone reports their new parent
+    for (Slot s = c.firstChild; s != NO_SLOT;)
+    {
+        Slot next = children[s].nextSibling;
+        children[s].up = NO_SLOT;
+        children[s].nextSibling = NO_SLOT;
+        s = next;
+    }
+    c = Child{};
+}
+// Drop c and everything routed through it, leaves first: each leaf is its
+// parent's first child, so every unlink is O(1) and the whole pass O(subtree).
+static uint16_t evictSubtree(Child &c)
+{
+    const Slot root = slotOf(c);
+    Slot s = root;
+    uint16_t n = 0;
+    for (;;)
+    {
+        while (children[s].firstChild != NO_SLOT)
+            s = children[s].firstChild;
+        const Slot up = children[s].up;
+        const bool last = (s == root);
+        eraseChild(children[s]);
+        ++n;
+        if (last)
+            return n;
+        s = up;
+    }
+}
+static int numChildren() { return childCount; }
+
+// Rewrites ADDR_FILE from addrMac[]; false if the whole table did not go out.
+static bool addrRewrite()
+{
+    File f = LittleFS.open(ADDR_FILE, "w");
+    const size_t n = (size_t)addrCount * 6;
+    const bool ok = f && f.write(&addrMac[0][0], n) == n;
+    if (f)
+        f.close();
+    return ok;
+}
+
+static void addrLoad()
+{
+    addrStored = LittleFS.begin(true);
+    if (!addrStored)
+    {
+        Serial.println(F("address table: no LittleFS, joins refused"));
+        return;
+    }
+    File f = LittleFS.open(ADDR_FILE, "r");
+    if (f)
+    {
+        const size_t size = f.size();
+        addrCount = (uint16_t)std::min<size_t>(size / 6, GW_MAX_ADDRS);
+        if (f.read(&addrMac[0][0], (size_t)addrCount * 6) != (size_t)addrCount * 6)
+            addrCount = 0;
+        f.close();
+        // a torn last record (power cut while appending) was never acked
+        if (size != (size_t)addrCount * 6)
+            addrStored = addrRewrite();
+        return;
+    }
+    // bindings of an older build, one Preferences key per MAC
+    Preferences p;
+    p.begin("gwaddr", false);
+    addrCount = std::min<uint16_t>(p.getUShort("n", 0), GW_MAX_ADDRS);
+    char key[8];
+    for (uint16_t i = 0; i < addrCount; ++i)
+    {
+        snprintf(key, sizeof(key), "m%u", (unsigned)i);
+        if (p.getBytes(key, addrMac[i], 6) != 6)
+            memset(addrMac[i], 0, 6);
+    }
+    addrStored = addrRewrite();
+    if (addrStored)
+        p.clear();
+    p.end();
+}
+// Short address bound to mac, assigning (and persisting) the next free one
+// on first sight. 0 if the address space is exhausted or the binding could
+// not be stored: after a reboot an unsaved address would go to a second MAC.
+static addr_t addrFor(const uint8_t mac[6])
+{
+    for (uint16_t i = 0; i < addrCount; ++i)
+        if (!memcmp(addrMac[i], mac, 6))
+            return (addr_t)(i + 1);
+    if (addrCount >= GW_MAX_ADDRS || !addrStored)
+        return 0;
+    File f = LittleFS.open(ADDR_FILE, "a");
+    const bool ok = f && f.size() == (size_t)addrCount * 6 && f.write(mac, 6) == 6;
+    if (f)
+        f.close();
+    if (!ok)
+    {
+        // drop whatever part of the record made it, or stop assigning
+        addrStored = addrRewrite();
+        Serial.printf("address table: write failed at %u entries\n", addrCount);
+        return 0;
+    }
+    const uint16_t i = addrCount++;
+    memcpy(addrMac[i], mac, 6);
+    Serial.printf("addr %04X -> %02X:%02X:%02X:%02X:%02X:%02X\n", i + 1,
+                  mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    return (addr_t)(i + 1);
 }
 
 struct PendingJoin
 {
-    uint8_t id = 0;
+    addr_t id = 0;                // assigned address
+    addr_t replyTo = 0;           // address the joiner is listening on
+    addr_t via = GW_ID;           // relay that asked with ADDR_REQ, GW_ID if direct
+    uint8_t mac[6] = {0};
     uint32_t nextTry = 0;
     uint8_t tries = 0;
     uint32_t lastSeen = 0;
 };
 static PendingJoin pend[MAX_PENDING_JOINS];
 
-static PendingJoin *findPending(uint8_t id)
+static PendingJoin *findPending(addr_t id)
 {
     for (auto &p : pend)
         if (p.id == id)
             return &p;
     return nullptr;
 }
-static PendingJoin *allocPending(uint8_t id)
+static PendingJoin *allocPending(addr_t id)
 {
     if (auto *p = findPending(id))
         return p;
@@ -171,11 +594,14 @@ static PendingJoin *allocPending(uint8_t id)
         if (!slot.id)
         {
             slot.id = id;
+            PERF_LEVEL(MARK_PENDING, std::count_if(pend, pend + MAX_PENDING_JOINS,
+                                                   [](const PendingJoin &p) { return p.id != 0; }));
             return &slot;
         }
+    PERF_OVERFLOW(MARK_PENDING);
     return nullptr;
 }
-static void removePending(uint8_t id)
+static void removePending(addr_t id)
 {
     for (auto &p : pend)
         if (p.id == id)
@@ -185,46 +611,63 @@ static void removePending(uint8_t id)
         }
 }
 
-constexpr uint8_t MAX_PENDING_QUERIES = 32;
-struct PendingQuery
-{
-    uint8_t id = 0;
-    uint32_t nextTry = 0;
-    uint8_t tries = 0;
-};
-static PendingQuery pq[MAX_PENDING_QUERIES];
+// Telemetry store (tsdb.h) under /ts: every STATE, delivered DATA_UP,
+// missed poll, join and departure, with the RSSI the gateway heard, the
+// path length and the battery of the node's last test frame. Misses and
+// departures repeat the last known RSSI. "ts" on the console queries it.
+static TsStore tsdb;
 
-static PendingQuery *findPendingQuery(uint8_t id)
+static void tsNote(const Child &c, uint8_t ev, int16_t rssi, uint8_t hops)
 {
-    for (auto &x : pq)
-        if (x.id == id)
-            return &x;
-    return nullptr;
+    tsAdd(tsdb, tsRecord(tsNow(tsdb), c.id, ev, hops, rssi, c.battMv));
 }
-static PendingQuery *allocPendingQuery(uint8_t id)
+
+// Capture mode ("capture on"): every received frame and every TX attempt,
+// deferrals included, goes to the serial stream as a binary record between
+// the text logs, for tools/meshcap.py. Little endian:
+//
+//   'C' 0xA7 | kind | len | t_ms u32 | value i16 | snr*4 i8 | sf << 4 | ch
+//   frame[len] | crc16
+//
+// value is the RSSI in dBm for CAP_RX and the transmit status for CAP_TX
+// (ERR_TX_DEFERRED for a deferral). The CRC (CCITT, init 0xFFFF) covers
+// kind up to the end of the frame, so the tool can resync on noise.
+enum : uint8_t
 {
-    if (auto *x = findPendingQuery(id))
-        return x;
-    for (auto &slot : pq)
-        if (!slot.id)
-        {
-            slot.id = id;
-            return &slot;
-        }
-    return nullptr;
-}
-static void removePendingQuery(uint8_t id)
+    CAP_RX = 1,
+    CAP_TX = 2
+};
+static bool capturing = false;
+static uint8_t rxSf = 0;
+static uint8_t rxCh = 0;
+
+static void capture(uint8_t kind, const uint8_t *frame, size_t len, int16_t value, float snr)
 {
-    for (auto &x : pq)
-        if (x.id == id)
-        {
-            memset(&x, 0, sizeof(x));
-            return;
-        }
+    if (!capturing)
+        return;
+    PERF_SCOPE(PERF_SERIAL);
+    uint8_t rec[12 + sizeof(MeshHeader) + MAX_PAYLOAD + 2];
+    if (len > sizeof(MeshHeader) + MAX_PAYLOAD)
+        len = sizeof(MeshHeader) + MAX_PAYLOAD;
+    const uint32_t t = millis();
+    rec[0] = 'C';
+    rec[1] = 0xA7;
+    rec[2] = kind;
+    rec[3] = (uint8_t)len;
+    memcpy(rec + 4, &t, sizeof(t));
+    memcpy(rec + 8, &value, sizeof(value));
+    rec[10] = (uint8_t)(int8_t)constrain(snr * 4.0f, -128.0f, 127.0f);
+    rec[11] = (uint8_t)(rxSf << 4 | (rxCh & 0x0F));
+    memcpy(rec + 12, frame, len);
+    const uint16_t crc = crc16(rec + 2, 10 + len);
+    memcpy(rec + 12 + len, &crc, sizeof(crc));
+    Serial.write(rec, 14 + len);
 }
-static bool isPendingQuery(uint8_t id) { return findPendingQuery(id) != nullptr; }
 
-static int16_t sendPacket(uint8_t dst, MsgType type,
+// Our last unicasts, for decoding what relays XOR-code with them (netcode.h)
+static NcSent<NC_SENT_GW> ncSent;
+
+static int16_t sendPacket(addr_t dst, MsgType type,
                           const uint8_t *pl = nullptr, uint8_t len = 0)
 {
     MeshHeader h{HDR_MAGIC, GW_ID, dst, 0, type, len};
@@ -233,115 +676,1826 @@ static int16_t sendPacket(uint8_t dst, MsgType type,
     memcpy(buf, &h, sizeof(h));
     if (L)
         memcpy(buf + sizeof(h), pl, L);
+    const int8_t ts = gwTimeOffset(type);
+    if (ts >= 0 && L >= ts + sizeof(uint32_t))
+    {
+        const uint32_t t = millis();
+        memcpy(buf + sizeof(h) + ts, &t, sizeof(t));
+    }
     int16_t st = transmitWithDC(buf, sizeof(h) + L);
+    capture(CAP_TX, buf, sizeof(h) + L, st, 0);
     if (st == ERR_TX_DEFERRED)
         return st;
     if (st != RADIOLIB_ERR_NONE)
         Serial.printf("TX err %d\n", st);
+    else
+        ncRemember(ncSent, buf);
+    return st;
+}
+
+// The radio listens on the base SF and control channel. Talking to a child
+// on another link profile holds the radio there until the exchange is over
+// (tunedUntil); other traffic waits.
+static addr_t tunedFor = 0;
+static uint32_t tunedUntil = 0;
+
+static void radioTune(uint8_t sf, uint8_t ch)
+{
+    if (sf == rxSf && ch == rxCh)
+        return;
+    if (ch != rxCh)
+    {
+        radio.setFrequency(channelFreq(ch));
+        dcSetFreq(channelFreq(ch));
+    }
+    if (sf != rxSf)
+        radio.setSpreadingFactor(sf);
+    radio.startReceive();
+    rxSf = sf;
+    rxCh = ch;
+}
+static inline bool radioBusy() { return tunedFor != 0; }
+
+static int16_t sendToChild(Child &c, MsgType type,
+                           const uint8_t *pl = nullptr, uint8_t len = 0)
+{
+    const uint8_t sf = linkSf(c);
+    if (radioBusy() && tunedFor != c.id)
+        return ERR_TX_DEFERRED;
+    radioTune(sf, c.ch);
+    int16_t st = sendPacket(c.id, type, pl, len);
+    if (sf != cfg.sf || c.ch)
+    {
+        if (st == RADIOLIB_ERR_NONE)
+        {
+            tunedFor = c.id;
+            tunedUntil = millis() + ((type == QUERY) ? queryRto(c) : ADR_LINGER_MS);
+        }
+        else if (!radioBusy())
+        {
+            radioTune(cfg.sf, 0);
+        }
+    }
     return st;
 }
 
-static bool trySendJoinAck(uint8_t id)
+// Lowest SF whose demodulation floor (-7.5 dB at SF7, 2.5 dB per step) still
+// leaves ADR_MARGIN_DB under the best recent SNR, LoRaWAN style.
+static uint8_t adrTargetSf(const Child &c)
+{
+    int8_t best = -128;
+    for (uint8_t i = 0; i < ADR_HISTORY; ++i)
+        best = std::max(best, c.snr[i]);
+    for (uint8_t sf = ADR_MIN_SF; sf < cfg.sf; ++sf)
+    {
+        const int floorX10 = -75 - 25 * (sf - 7);
+        if (best * 10 - floorX10 >= ADR_MARGIN_DB * 10)
+            return sf;
+    }
+    return cfg.sf;
+}
+
+static void adrSample(Child &c, float snr)
+{
+    c.snr[c.snrCount % ADR_HISTORY] = (int8_t)std::max(-128.0f, std::min(127.0f, snr));
+    if (c.snrCount < 0xFF)
+        ++c.snrCount;
+}
+
+static bool adrCommand(Child &c, uint8_t sf, uint8_t ch)
+{
+    AdrCmdPayload cmd{sf, ch, ADR_SWITCH_DELAY_MS};
+    if (sendToChild(c, (MsgType)MSG_ADR_CMD, (uint8_t *)&cmd, sizeof(cmd)) != RADIOLIB_ERR_NONE)
+        return false;
+    c.nextSf = sf;
+    c.nextCh = ch;
+    c.sfSwitchAt = millis() + ADR_SWITCH_DELAY_MS;
+    Serial.printf("ADR %04X: SF%u/ch%u -> SF%u/ch%u\n", c.id, linkSf(c), c.ch, sf, ch);
+    return true;
+}
+
+static OtaServe otaTx; // firmware rollout, see otaStart()
+
+static void adrEvaluate(Child &c, uint32_t now)
+{
+    // a firmware rollout keeps everyone on the base link
+    if (otaTx.id || c.parent != GW_ID || c.firstChild != NO_SLOT || c.nextSf ||
+        c.snrCount < ADR_HISTORY || (int32_t)(now - c.adrHoldUntil) < 0)
+        return;
+    // leaves also move off the control channel to their home data channel,
+    // which spreads the gateway's downlink over several sub-band budgets
+    const uint8_t target = adrTargetSf(c);
+    const uint8_t targetCh = dataChannelFor(c.id);
+    if (target == linkSf(c) && targetCh == c.ch)
+        return;
+    (void)adrCommand(c, target, targetCh);
+}
+
+static void adrApply(Child &c, uint8_t sf, uint8_t ch)
+{
+    c.sf = (sf == cfg.sf) ? 0 : sf;
+    c.ch = ch;
+    c.nextSf = 0;
+    c.nextCh = 0;
+    c.adrMisses = 0;
+    c.snrCount = 0;
+    c.srtt = 0; // new link, new RTT
+    c.rttvar = 0;
+}
+
+static void deferJoin(PendingJoin &p, int16_t st, uint32_t now)
+{
+    uint32_t slack = 50;
+    if (st == ERR_TX_DEFERRED)
+        p.nextTry = (dcFreeAt() + slack);
+    else
+        p.nextTry = now + joinAckGapMs;
+    p.tries = (uint8_t)std::min<uint8_t>(p.tries + 1, 200);
+}
+
+// ADDR_ACK to the relay that forwarded a join; the relay then sends JOIN_ACK
+// and CHILD_ADD itself. A 1-hop relay's CHILD_ADD gets no hop ACK from us,
+// so the node goes in the table now, as a batch JOIN_ACK's do; CHILD_ADD
+// only confirms it.
+static bool trySendAddrAck(PendingJoin &p)
 {
     uint32_t now = millis();
+    JoinPayload jp;
+    memcpy(jp.mac, p.mac, sizeof(jp.mac));
+    jp.addr = p.id;
+    int16_t st = sendPacket(p.via, (MsgType)MSG_ADDR_ACK, (uint8_t *)&jp, sizeof(jp));
+    if (st == RADIOLIB_ERR_NONE)
+    {
+        const Child *via = findChild(p.via);
+        const uint8_t hops = (uint8_t)(via && via->hops ? via->hops + 1 : 2);
+        if (Child *c = allocChild(p.id))
+        {
+            treeSetParent(*c, p.via);
+            c->hops = hops;
+            c->misses = 0;
+            c->lastSeen = now;
+            c->answeredSinceQuery = true;
+        }
+        removePending(p.id);
+        return true;
+    }
+    deferJoin(p, st, now);
+    return false;
+}
+
+// Join admission: direct JOIN_REQs are collected for JOIN_BATCH_WINDOW_MS
+// and answered together with one broadcast JOIN_ACK listing every admitted
+// (mac, addr) pair, so a site-wide power-up costs a handful of frames.
+static uint32_t joinBatchAt = 0; // 0 = no admission window open
+
+static bool trySendJoinBatch()
+{
+    uint32_t now = millis();
+    JoinPayload batch[JOIN_BATCH_MAX];
+    PendingJoin *members[JOIN_BATCH_MAX];
+    uint8_t n = 0;
+    bool more = false;
+    uint32_t laterAt = 0; // earliest entry not ready for this batch
+    auto later = [&](uint32_t t)
+    { if (!laterAt || (int32_t)(t - laterAt) < 0) laterAt = t ? t : 1; };
+    for (auto &p : pend)
+    {
+        if (!p.id || p.via != GW_ID)
+            continue;
+        if (now < p.nextTry)
+        {
+            later(p.nextTry);
+            continue;
+        }
+        if (Child *c = findChild(p.id))
+            if (c->lastJoinAck && now - c->lastJoinAck < joinAckGapMs)
+            {
+                later(c->lastJoinAck + joinAckGapMs);
+                continue;
+            }
+        if (n == JOIN_BATCH_MAX)
+        {
+            more = true;
+            break;
+        }
+        memcpy(batch[n].mac, p.mac, sizeof(batch[n].mac));
+        batch[n].addr = p.id;
+        members[n++] = &p;
+    }
+    if (!n)
+    {
+        joinBatchAt = laterAt;
+        return false;
+    }
+    int16_t st = sendPacket(ADDR_BCAST, JOIN_ACK, (uint8_t *)batch, (uint8_t)(n * sizeof(JoinPayload)));
+    if (st != RADIOLIB_ERR_NONE)
+    {
+        for (uint8_t i = 0; i < n; ++i)
+            deferJoin(*members[i], st, now);
+        joinBatchAt = members[0]->nextTry;
+        return false;
+    }
+    Serial.printf("JOIN_ACK batch: admitted %u\n", n);
+    for (uint8_t i = 0; i < n; ++i)
+    {
+        if (Child *c = allocChild(members[i]->id))
+        {
+            treeSetParent(*c, GW_ID);
+            c->hops = 1;
+            c->misses = 0;
+            c->lastSeen = now;
+            c->lastJoinAck = now;
+            c->answeredSinceQuery = true;
+            tsNote(*c, TS_JOIN, c->lastRssi, 1);
+        }
+        removePending(members[i]->id);
+    }
+    joinBatchAt = more ? now : laterAt;
+    return true;
+}
+
+// JOIN_REQ from a neighbour (via == GW_ID) or ADDR_REQ relayed by `via`
+static void onJoinRequest(addr_t from, addr_t via, const JoinPayload &jp, uint32_t now)
+{
+    const addr_t id = addrFor(jp.mac);
+    if (!id)
+    {
+        JoinPayload nack = jp;
+        nack.addr = 0;
+        if (via != GW_ID)
+            (void)sendPacket(via, (MsgType)MSG_ADDR_ACK, (uint8_t *)&nack, sizeof(nack));
+        else
+            (void)sendPacket(from, (MsgType)MSG_JOIN_NACK, (uint8_t *)&nack, sizeof(nack));
+        return;
+    }
+    // whatever window we hold is from before; the node restarts with DATA_SYN
     if (Child *c = findChild(id))
+        c->rxSynced = false;
+    // A self-picked address from before assignment existed names nobody
+    // once the node is re-addressed; addresses in range belong to their MAC.
+    if (from != id && from > GW_MAX_ADDRS && from < ADDR_UNASSIGNED)
+        if (Child *stale = findChild(from))
+            eraseChild(*stale);
+    if (auto *p = allocPending(id))
+    {
+        p->replyTo = from;
+        p->via = via;
+        memcpy(p->mac, jp.mac, sizeof(p->mac));
+        p->lastSeen = now;
+        if (via != GW_ID)
+        {
+            // the relay's parent may be forwarding this same ADDR_REQ right
+            // now, and the relay would hear both frames at once
+            if (!p->nextTry)
+                p->nextTry = now + loraAirtimeMs(cfg.sf, cfg.bw, cfg.cr, sizeof(MeshHeader) + sizeof(JoinPayload)) +
+                             ADDR_ACK_SLACK_MS;
+        }
+        else if (!joinBatchAt)
+        {
+            joinBatchAt = now + JOIN_BATCH_WINDOW_MS;
+        }
+    }
+}
+
+// Receive window per node: rxNext is the oldest seq not yet seen and bit i of
+// rxMask is rxNext + 1 + i. A DATA_SYN frame names the oldest seq its sender
+// still holds, and the window opens (or moves up to) there. Without a window
+// only DATA_SYN frames are taken: any other frame may not be the oldest, and
+// the ACK asks for a resync instead. Returns true if the frame is new.
+static void rxAdvance(Child &c)
+{
+    ++c.rxNext;
+    while (c.rxMask & 1)
+    {
+        c.rxMask >>= 1;
+        ++c.rxNext;
+    }
+    c.rxMask >>= 1;
+}
+static bool dataAccept(Child &c, const DataUpHdr &d)
+{
+    if (d.flags & DATA_SYN)
+    {
+        const uint16_t base = (uint16_t)(d.seq - (d.flags >> DATA_BASE_SHIFT));
+        const int16_t ahead = (int16_t)(base - c.rxNext);
+        if (!c.rxSynced || ahead < -(int16_t)DATA_ACK_BITS || ahead > (int16_t)DATA_ACK_BITS)
+        {
+            c.rxSynced = true;
+            c.rxNext = base;
+            c.rxMask = 0;
+        }
+        while ((int16_t)(base - c.rxNext) > 0)
+            rxAdvance(c); // the node holds nothing older
+    }
+    else if (!c.rxSynced)
+        return false;
+    const int16_t off = (int16_t)(d.seq - c.rxNext);
+    if (off < 0)
+        return false;
+    if (off == 0)
+    {
+        rxAdvance(c);
+        return true;
+    }
+    // beyond the window: leave it unacked, the node resends it later
+    if (off > (int16_t)DATA_ACK_BITS)
+        return false;
+    const uint16_t bit = (uint16_t)(1u << (off - 1));
+    if (c.rxMask & bit)
+        return false;
+    c.rxMask |= bit;
+    return true;
+}
+static DataAckPayload rxAck(const Child &c)
+{
+    return c.rxSynced ? DataAckPayload{c.rxNext, c.rxMask} : DataAckPayload{0, DATA_ACK_RESYNC};
+}
+
+static int16_t trySendDataAck(Child &c)
+{
+    DataAckPayload ack = rxAck(c);
+    int16_t st = sendToChild(c, DATA_ACK, (uint8_t *)&ack, sizeof(ack));
+    if (st == RADIOLIB_ERR_NONE)
+        c.ackDueAt = 0;
+    return st;
+}
+
+// A round's QUERYs go out one at a time: the next waits until the last is
+// answered or its answer is overdue (config.h). Sent earlier, it collides
+// at the first relay with the forwards of the last one and its answer, or
+// drowns a 1-hop child's answer here.
+static uint32_t queryGapUntil = 0;
+static addr_t queryGapFor = GW_ID; // the node the last QUERY went to, GW_ID once over
+static inline bool queryGapOver(uint32_t t) { return queryGapFor == GW_ID || (int32_t)(t - queryGapUntil) >= 0; }
+
+static bool trySendQuery(Child &c)
+{
+    const uint32_t now = millis();
+    // sendPacket stamps the time; an owed data ACK rides along for free
+    uint8_t pl[sizeof(QueryPayload) + sizeof(DataAckPayload)] = {0};
+    DataAckPayload ack = rxAck(c);
+    const bool withAck = c.ackDueAt != 0;
+    memcpy(pl + sizeof(QueryPayload), &ack, sizeof(ack));
+    int16_t st = sendToChild(c, QUERY, pl, withAck ? sizeof(pl) : sizeof(QueryPayload));
+    if (st == RADIOLIB_ERR_NONE)
+    {
+        if (withAck)
+            c.ackDueAt = 0;
+        // open the window once the QUERY has left the radio, so the RTT
+        // sample does not include our own airtime
+        c.lastQuery = millis();
+        const uint8_t hops = c.hops ? c.hops : 1;
+        queryGapUntil = c.lastQuery +
+                        (2 * hops - 1) * (loraAirtimeMs(cfg.sf, cfg.bw, cfg.cr, CFG_QUERY_FRAME) + QUERY_HOP_SLACK_MS) +
+                        (nodeNetcode ? 2 * (hops - 1) * nodeNcHoldMs : 0); // each relay may hold it, both ways
+        queryGapFor = c.id;
+        c.answeredSinceQuery = false;
+        c.queryQueued = false;
+        c.queryTries = 0;
+        return true;
+    }
+    uint32_t slack = 50;
+    c.queryQueued = true;
+    c.queryRetryAt = (st == ERR_TX_DEFERRED) ? (dcFreeAt() + slack) : (now + 50);
+    c.queryTries = (uint8_t)std::min<uint8_t>(c.queryTries + 1, 200);
+    return false;
+}
+
+// Host bridge. "bridge on" turns the console into a binary link for a
+// backend (tools/meshbridge.py). Both directions carry COBS-encoded frames
+// delimited by 0x00:
+//   seq u8 | records... | crc16 (CCITT, over seq and records)
+// and a record is
+//   type u8 | len u16 | body[len]
+// Towards the host, records are batched into one frame until it would
+// exceed BRIDGE_BATCH_MAX or the oldest is BRIDGE_FLUSH_MS old. Encoded
+// frames queue in a ring and go out whole, only as far as the port
+// takes them without blocking. A full ring drops the batch, counted in the
+// BR_STATUS heartbeat, so the loop never waits for the host. Text output
+// (logs, command replies) still shares the port; the host skips it like a
+// corrupt frame. The host sends BR_DOWN to reach a node, BR_OTA to upload
+// a firmware image and BR_CMD for console commands; "bridge off" ends the
+// mode.
+enum : uint8_t
+{
+    BR_UP = 0x01,      // src u16, seq u16, t u32, rssi i16, snr*4 i8, hops u8, data
+    BR_MSG = 0x02,     // src u16, msgId u16, t u32, total u16, offset u16, data chunk
+    BR_STATE = 0x03,   // src u16, parent u16, hops u8, parent rssi i8, rssi i16, snr*4 i8, t u32
+    BR_RECEIPT = 0x04, // id u16, dst u16, status u8, tries u8
+    BR_STATUS = 0x05,  // dropped u32, ring free u16, downlink slots free u8, nodes u16
+    BR_OTA_ACK = 0x06, // image size u32, ok u8
+    BR_DOWN = 0x81,    // id u16, dst u16, data
+    BR_CMD = 0x82,     // console line
+    BR_OTA = 0x83      // offset u32, data: appended to the image, offset 0 starts a new one
+};
+enum : uint8_t
+{
+    DOWN_DELIVERED,
+    DOWN_QUEUED,
+    DOWN_NO_ROUTE, // unknown node, or it left the table
+    DOWN_FULL,     // every GW_DOWN_POOL slot busy
+    DOWN_TIMEOUT,
+    DOWN_TOO_LONG
+};
+constexpr size_t BRIDGE_BATCH_MAX = 200; // fits the CDC TX buffer once encoded
+constexpr uint32_t BRIDGE_FLUSH_MS = 20;
+constexpr size_t BRIDGE_RING = 4096;
+constexpr size_t BRIDGE_ENC_MAX = BRIDGE_BATCH_MAX + BRIDGE_BATCH_MAX / 254 + 3; // with both delimiters
+constexpr uint8_t DOWN_MAX_DATA = MAX_PAYLOAD - sizeof(DataDownHdr);
+
+static bool bridgeOn = false;
+static uint8_t brBatch[BRIDGE_BATCH_MAX];
+static size_t brLen = 0; // 0 = empty, else seq plus records
+static uint8_t brSeq = 0;
+static uint32_t brFirstAt = 0;
+static uint8_t brRing[BRIDGE_RING];
+static size_t brHead = 0, brTail = 0; // bytes in use: brHead - brTail
+static uint32_t brDropped = 0;
+static uint8_t brRx[BRIDGE_BATCH_MAX + 2];
+static size_t brRxLen = 0;
+static bool brRxOverflow = false;
+
+struct DownMsg
+{
+    uint16_t id;
+    addr_t dst; // GW_ID = free
+    uint8_t len;
+    uint8_t tries;
+    uint32_t retryAt;
+    uint8_t data[DOWN_MAX_DATA];
+};
+static DownMsg down[GW_DOWN_POOL];
+
+static void onCommand(const char *line);
+
+static size_t cobsEncode(const uint8_t *in, size_t n, uint8_t *out)
+{
+    size_t o = 1, code = 0;
+    uint8_t run = 1;
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (in[i])
+        {
+            out[o++] = in[i];
+            ++run;
+        }
+        if (!in[i] || run == 0xFF)
+        {
+            out[code] = run;
+            code = o++;
+            run = 1;
+        }
+    }
+    out[code] = run;
+    return o;
+}
+
+// Decoded length, 0 for a malformed frame
+static size_t cobsDecode(const uint8_t *in, size_t n, uint8_t *out)
+{
+    size_t i = 0, o = 0;
+    while (i < n)
+    {
+        const uint8_t run = in[i++];
+        if (!run || i + run - 1 > n)
+            return 0;
+        for (uint8_t k = 1; k < run; ++k)
+            out[o++] = in[i++];
+        if (run < 0xFF && i < n)
+            out[o++] = 0;
+    }
+    return o;
+}
+
+static void bridgeFlush()
+{
+    if (brLen <= 1)
+        return;
+    const uint16_t crc = crc16(brBatch, brLen);
+    memcpy(brBatch + brLen, &crc, sizeof(crc)); // BRIDGE_BATCH_MAX leaves room
+    uint8_t enc[BRIDGE_ENC_MAX];
+    enc[0] = 0; // resynchronises the host after text output
+    const size_t n = cobsEncode(brBatch, brLen + sizeof(crc), enc + 1) + 2;
+    enc[n - 1] = 0;
+    brLen = 0;
+    if (BRIDGE_RING - (brHead - brTail) < n)
+    {
+        ++brDropped;
+        return;
+    }
+    for (size_t i = 0; i < n; ++i)
+        brRing[brHead++ % BRIDGE_RING] = enc[i];
+}
+
+// Append one record, flushing the batch first if it would not fit
+static void bridgeRecord(uint8_t type, const void *a, size_t na, const uint8_t *b = nullptr, size_t nb = 0)
+{
+    if (!bridgeOn)
+        return;
+    const size_t need = 3 + na + nb;
+    if (1 + need + 2 > BRIDGE_BATCH_MAX)
+        return; // callers keep records small
+    if (brLen && brLen + need + 2 > BRIDGE_BATCH_MAX)
+        bridgeFlush();
+    if (!brLen)
+    {
+        brBatch[0] = brSeq++;
+        brLen = 1;
+        brFirstAt = millis();
+    }
+    const uint16_t len = (uint16_t)(na + nb);
+    brBatch[brLen] = type;
+    memcpy(brBatch + brLen + 1, &len, sizeof(len));
+    memcpy(brBatch + brLen + 3, a, na);
+    if (nb)
+        memcpy(brBatch + brLen + 3 + na, b, nb);
+    brLen += need;
+}
+
+// Hand whole frames to the port while it has room for them
+static void bridgeDrain()
+{
+    if (brLen && millis() - brFirstAt >= BRIDGE_FLUSH_MS)
+        bridgeFlush();
+    while (brHead != brTail)
+    {
+        // a frame runs from its leading 0 to the next 0
+        size_t n = 1;
+        while (brTail + n < brHead && brRing[(brTail + n) % BRIDGE_RING])
+            ++n;
+        ++n;
+        if ((size_t)Serial.availableForWrite() < n)
+            return;
+        PERF_SCOPE(PERF_SERIAL);
+        uint8_t out[BRIDGE_ENC_MAX];
+        for (size_t i = 0; i < n; ++i)
+            out[i] = brRing[(brTail + i) % BRIDGE_RING];
+        Serial.write(out, n);
+        brTail += n;
+    }
+}
+
+static void bridgeReceipt(const DownMsg &m, uint8_t status)
+{
+    struct __attribute__((packed))
+    {
+        uint16_t id;
+        addr_t dst;
+        uint8_t status, tries;
+    } r{m.id, m.dst, status, m.tries};
+    bridgeRecord(BR_RECEIPT, &r, sizeof(r));
+}
+
+static void bridgeUp(const Child &c, const MeshHeader &h, const DataUpHdr &du, int16_t rssi, float snr,
+                     const uint8_t *d, uint8_t n, uint32_t now)
+{
+    struct __attribute__((packed))
+    {
+        addr_t src;
+        uint16_t seq;
+        uint32_t t;
+        int16_t rssi;
+        int8_t snr4;
+        uint8_t hops;
+    } r{c.id, du.seq, now, rssi, (int8_t)constrain(snr * 4.0f, -128.0f, 127.0f), (uint8_t)(h.hops + 1)};
+    bridgeRecord(BR_UP, &r, sizeof(r), d, n);
+}
+
+// A reassembled message, in chunks that each fit a batch
+static void bridgeMsg(addr_t src, uint16_t msgId, const uint8_t *d, uint16_t total, uint32_t now)
+{
+    struct __attribute__((packed))
+    {
+        addr_t src;
+        uint16_t msgId;
+        uint32_t t;
+        uint16_t total, offset;
+    } r{src, msgId, now, total, 0};
+    constexpr size_t CHUNK = BRIDGE_BATCH_MAX - 1 - 3 - sizeof(r) - 2;
+    do
+    {
+        const size_t n = std::min<size_t>(CHUNK, total - r.offset);
+        bridgeRecord(BR_MSG, &r, sizeof(r), d + r.offset, n);
+        r.offset = (uint16_t)(r.offset + n);
+    } while (r.offset < total);
+}
+
+static void bridgeState(const Child &c, const StatusPayload &p, int16_t rssi, float snr, uint32_t now)
+{
+    struct __attribute__((packed))
+    {
+        addr_t src, parent;
+        uint8_t hops;
+        int8_t parentRssi;
+        int16_t rssi;
+        int8_t snr4;
+        uint32_t t;
+    } r{c.id, p.parent, p.hops, p.rssi, rssi, (int8_t)constrain(snr * 4.0f, -128.0f, 127.0f), now};
+    bridgeRecord(BR_STATE, &r, sizeof(r));
+}
+
+static void bridgeStatus()
+{
+    uint8_t freeSlots = 0;
+    for (auto &m : down)
+        if (m.dst == GW_ID)
+            ++freeSlots;
+    struct __attribute__((packed))
+    {
+        uint32_t dropped;
+        uint16_t ringFree;
+        uint8_t downFree;
+        uint16_t nodes;
+    } r{brDropped, (uint16_t)std::min<size_t>(0xFFFF, BRIDGE_RING - (brHead - brTail)), freeSlots,
+        (uint16_t)numChildren()};
+    bridgeRecord(BR_STATUS, &r, sizeof(r));
+}
+
+static void downQueue(uint16_t id, addr_t dst, const uint8_t *d, size_t n)
+{
+    DownMsg m;
+    memset(&m, 0, sizeof(m));
+    m.id = id;
+    m.dst = dst;
+    const uint8_t refused = (n > DOWN_MAX_DATA) ? DOWN_TOO_LONG : (dst == GW_ID || !findChild(dst)) ? DOWN_NO_ROUTE : 0;
+    if (refused)
+    {
+        bridgeReceipt(m, refused);
+        return;
+    }
+    DownMsg *slot = nullptr;
+    for (auto &x : down)
+        if (x.dst == GW_ID)
+        {
+            slot = &x;
+            break;
+        }
+    if (!slot)
+    {
+        PERF_OVERFLOW(MARK_DOWN);
+        bridgeReceipt(m, DOWN_FULL);
+        return;
+    }
+    m.len = (uint8_t)n;
+    m.retryAt = millis();
+    memcpy(m.data, d, n);
+    *slot = m;
+    PERF_LEVEL(MARK_DOWN, std::count_if(down, down + GW_DOWN_POOL, [](const DownMsg &x) { return x.dst != GW_ID; }));
+    bridgeReceipt(m, DOWN_QUEUED);
+}
+
+// At most one DATA_DOWN per loop pass, like PARAM_SET
+static void downPump(uint32_t now)
+{
+    for (auto &m : down)
+    {
+        if (m.dst == GW_ID || (int32_t)(now - m.retryAt) < 0)
+            continue;
+        Child *c = findChild(m.dst);
+        if (!c || m.tries >= DOWN_MAX_TRIES)
+        {
+            bridgeReceipt(m, c ? DOWN_TIMEOUT : DOWN_NO_ROUTE);
+            m.dst = GW_ID;
+            continue;
+        }
+        if (radioBusy())
+            return;
+        uint8_t buf[MAX_PAYLOAD];
+        const DataDownHdr hdr{m.id};
+        memcpy(buf, &hdr, sizeof(hdr));
+        memcpy(buf + sizeof(hdr), m.data, m.len);
+        const int16_t st = sendToChild(*c, (MsgType)MSG_DATA_DOWN, buf, (uint8_t)(sizeof(hdr) + m.len));
+        if (st == ERR_TX_DEFERRED)
+            m.retryAt = dcFreeAt() + 50;
+        else
+        {
+            ++m.tries;
+            m.retryAt = now + queryRto(*c);
+        }
+        return;
+    }
+}
+
+static void onDownAck(addr_t src, uint16_t id)
+{
+    for (auto &m : down)
+        if (m.dst == src && m.id == id)
+        {
+            bridgeReceipt(m, DOWN_DELIVERED);
+            m.dst = GW_ID;
+        }
+}
+
+// Firmware rollout (see ota.h). The host uploads the delta image with
+// BR_OTA records, each answered with BR_OTA_ACK, and starts it with the
+// "ota start" command; the gateway then serves its 1-hop children and the
+// relays take it further. ADR leaves are called back to the base link for
+// the rollout, since the broadcasts go out there.
+static uint32_t otaId = 0; // image being rolled out, 0 = none
+static uint32_t otaLen = 0;
+static uint32_t otaCrc = 0;
+static uint32_t otaStartedAt = 0;
+
+static void otaUpload(uint32_t off, const uint8_t *d, size_t n)
+{
+    bool ok = tsdb.ready && off + n <= OTA_MAX_BYTES;
+    if (ok && !off)
+    {
+        // a new image replaces the one being served
+        otaTx.id = 0;
+        otaId = 0;
+        LittleFS.mkdir(OTA_DIR);
+    }
+    File f;
+    if (ok)
+        f = LittleFS.open(OTA_FILE, off ? "a" : "w");
+    ok = ok && f && f.size() == off && f.write(d, n) == n;
+    struct __attribute__((packed))
+    {
+        uint32_t size;
+        uint8_t ok;
+    } r{f ? (uint32_t)f.size() : 0, ok};
+    if (f)
+        f.close();
+    bridgeRecord(BR_OTA_ACK, &r, sizeof(r));
+}
+
+static int16_t otaBroadcast(MsgType type, const uint8_t *pl, uint8_t len)
+{
+    return sendPacket(ADDR_BCAST, type, pl, len);
+}
+
+static void otaStart()
+{
+    File f = LittleFS.open(OTA_FILE, "r");
+    OtaImageHdr hdr;
+    const uint32_t len = f ? (uint32_t)f.size() : 0;
+    const bool ok = f && f.read((uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == OTA_IMAGE_MAGIC &&
+                    hdr.version == OTA_IMAGE_VERSION;
+    if (f)
+        f.close();
+    uint32_t crc;
+    if (!ok || len > OTA_MAX_BYTES || !otaFileCrc(len, crc))
+    {
+        Serial.println(F("ota: no valid image uploaded"));
+        return;
+    }
+    otaId = otaImageId(hdr);
+    otaLen = len;
+    otaCrc = crc;
+    otaStartedAt = millis();
+    for (auto &c : children)
+        c.otaSt = 0;
+    otaServeStart(otaTx, otaId, len, crc, loraAirtimeMs(cfg.sf, cfg.bw, cfg.cr, sizeof(MeshHeader) + MAX_PAYLOAD),
+                  true);
+    Serial.printf("ota: image %08lX, %lu B, %u chunks\n", (unsigned long)otaId, (unsigned long)len, otaTx.chunks);
+}
+
+// NEED from a 1-hop child, also once the round is over
+static void otaOnNeed(const uint8_t *pl, uint8_t len)
+{
+    if (!otaId)
+        return;
+    if (otaTx.id != otaId)
+    {
+        uint32_t crc;
+        if (!otaFileCrc(otaLen, crc) || crc != otaCrc)
+            return;
+        otaServeStart(otaTx, otaId, otaLen, crc,
+                      loraAirtimeMs(cfg.sf, cfg.bw, cfg.cr, sizeof(MeshHeader) + MAX_PAYLOAD), false);
+    }
+    otaServeNeed(otaTx, pl, len);
+}
+
+static void otaPump(uint32_t now)
+{
+    if (!otaTx.id || radioBusy())
+        return;
+    // leaves on a reduced-SF link or a data channel would not hear it
+    for (auto &c : children)
+        if (c.id && (c.sf || c.ch) && !c.nextSf && adrCommand(c, cfg.sf, 0))
+            return;
+    otaServePump(otaTx, now, otaBroadcast);
+}
+
+static void otaCommand(const char *line)
+{
+    if (!strcmp(line, "ota start"))
+        otaStart();
+    else if (!strcmp(line, "ota stop"))
+    {
+        otaTx.id = 0;
+        Serial.println(F("ota: stopped"));
+    }
+    else if (!strcmp(line, "ota"))
+    {
+        uint16_t n[OTA_ST_ROLLED_BACK + 1] = {0};
+        for (auto &c : children)
+            if (c.id)
+                ++n[c.otaSt];
+        Serial.printf("{\"ota\":{\"id\":%lu,\"len\":%lu,\"serving\":%d,\"sent\":%lu,\"needs\":%lu,\"elapsed_s\":%lu,"
+                      "\"nodes\":{\"pending\":%u,\"complete\":%u,\"activating\":%u,\"running\":%u,"
+                      "\"base_mismatch\":%u,\"bad_image\":%u,\"flash_error\":%u,\"rolled_back\":%u}}}\n",
+                      (unsigned long)otaId, (unsigned long)otaLen, otaTx.id != 0, (unsigned long)otaTx.sent,
+                      (unsigned long)otaTx.needs, otaId ? (unsigned long)((millis() - otaStartedAt) / 1000) : 0UL,
+                      n[0], n[OTA_ST_COMPLETE], n[OTA_ST_ACTIVATING], n[OTA_ST_RUNNING], n[OTA_ST_BASE_MISMATCH],
+                      n[OTA_ST_BAD_IMAGE], n[OTA_ST_FLASH_ERROR], n[OTA_ST_ROLLED_BACK]);
+    }
+    else
+        Serial.printf("unknown command: %s\n", line);
+}
+
+static void bridgeHandle(const uint8_t *f, size_t n)
+{
+    if (n < 3)
+        return;
+    uint16_t crc;
+    memcpy(&crc, f + n - 2, sizeof(crc));
+    if (crc != crc16(f, n - 2))
+        return;
+    for (size_t i = 1; i + 3 <= n - 2;)
+    {
+        uint16_t len;
+        memcpy(&len, f + i + 1, sizeof(len));
+        const uint8_t *b = f + i + 3;
+        if (i + 3 + len > n - 2)
+            return;
+        if (f[i] == BR_DOWN && len >= 4)
+        {
+            uint16_t id;
+            addr_t dst;
+            memcpy(&id, b, sizeof(id));
+            memcpy(&dst, b + 2, sizeof(dst));
+            downQueue(id, dst, b + 4, len - 4);
+        }
+        else if (f[i] == BR_OTA && len > 4)
+        {
+            uint32_t off;
+            memcpy(&off, b, sizeof(off));
+            otaUpload(off, b + 4, len - 4);
+        }
+        else if (f[i] == BR_CMD && len < 64)
+        {
+            char line[64];
+            memcpy(line, b, len);
+            line[len] = 0;
+            onCommand(line);
+        }
+        i += 3 + len;
+    }
+}
+
+// Console input while the bridge is on
+static void bridgePoll()
+{
+    while (Serial.available())
+    {
+        const int ch = Serial.read();
+        if (ch < 0)
+            break;
+        if (ch)
+        {
+            if (brRxLen < sizeof(brRx))
+                brRx[brRxLen++] = (uint8_t)ch;
+            else
+                brRxOverflow = true;
+            continue;
+        }
+        if (brRxLen && !brRxOverflow)
+        {
+            uint8_t f[sizeof(brRx)];
+            bridgeHandle(f, cobsDecode(brRx, brRxLen, f));
+        }
+        brRxLen = 0;
+        brRxOverflow = false;
+    }
+}
+
+struct Reasm
+{
+    addr_t src;
+    uint16_t msgId;
+    uint8_t count;
+    uint8_t got;
+    bool done;
+    uint16_t len;
+    uint32_t lastRx;
+    uint8_t have[FRAG_MAX_COUNT / 8];
+    uint8_t data[FRAG_MAX_MSG];
+};
+static Reasm reasm[GW_FRAG_POOL];
+
+static Reasm *reasmFor(addr_t src, const FragHdr &f, uint32_t now)
+{
+    Reasm *freeSlot = nullptr, *doneSlot = nullptr;
+    for (auto &r : reasm)
+    {
+        if (r.src == src && r.msgId == f.msgId && r.count)
+        {
+            if (r.count == f.count)
+                return &r;
+            r.count = 0; // same id, different shape: the node rebooted
+        }
+        if (!r.count || now - r.lastRx > FRAG_REASSEMBLY_MS)
+            freeSlot = &r;
+        else if (r.done && (!doneSlot || r.lastRx < doneSlot->lastRx))
+            doneSlot = &r;
+    }
+    Reasm *r = freeSlot ? freeSlot : doneSlot;
+    if (!r)
+    {
+        PERF_OVERFLOW(MARK_REASM);
+        return nullptr; // every buffer busy: the sender retries later
+    }
+    memset(r->have, 0, sizeof(r->have));
+    r->src = src;
+    r->msgId = f.msgId;
+    r->count = f.count;
+    PERF_LEVEL(MARK_REASM, std::count_if(reasm, reasm + GW_FRAG_POOL, [](const Reasm &x) { return x.count != 0; }));
+    r->got = 0;
+    r->done = false;
+    r->len = 0;
+    return r;
+}
+
+static void sendFragAck(Child *c, addr_t src, const Reasm &r)
+{
+    uint8_t pl[sizeof(FragAckHdr) + sizeof(r.have)];
+    FragAckHdr a{r.msgId, r.count, (uint8_t)(r.done ? FRAG_DONE : 0)};
+    const uint8_t bytes = (uint8_t)((r.count + 7) / 8);
+    memcpy(pl, &a, sizeof(a));
+    memcpy(pl + sizeof(a), r.have, bytes);
+    if (c)
+        (void)sendToChild(*c, (MsgType)MSG_FRAG_ACK, pl, (uint8_t)(sizeof(a) + bytes));
+    else
+        (void)sendPacket(src, (MsgType)MSG_FRAG_ACK, pl, (uint8_t)(sizeof(a) + bytes));
+}
+
+static void onFragment(Child *c, addr_t src, const FragHdr &f, const uint8_t *data, uint8_t n, uint32_t now)
+{
+    if (!f.count || f.count > FRAG_MAX_COUNT || f.idx >= f.count ||
+        (f.idx + 1 < f.count && n != FRAG_DATA) || (size_t)f.idx * FRAG_DATA + n > FRAG_MAX_MSG)
+        return;
+    Reasm *r = reasmFor(src, f, now);
+    if (!r)
+        return;
+    r->lastRx = now;
+    const uint8_t bit = (uint8_t)(1u << (f.idx & 7));
+    if (!(r->have[f.idx / 8] & bit))
+    {
+        r->have[f.idx / 8] |= bit;
+        memcpy(r->data + (size_t)f.idx * FRAG_DATA, data, n);
+        ++r->got;
+        if (f.idx + 1 == f.count)
+            r->len = (uint16_t)(f.idx * FRAG_DATA + n);
+        if (r->got == r->count)
+        {
+            r->done = true;
+            Serial.printf("MSG %04X id %u: %u B in %u fragments\n", src, r->msgId, r->len, r->count);
+            bridgeMsg(src, r->msgId, r->data, r->len, now);
+            sendFragAck(c, src, *r);
+            return;
+        }
+    }
+    if (f.flags & FRAG_ACKREQ)
+        sendFragAck(c, src, *r);
+}
+
+// Runtime parameters. The radio profile entries mirror cfg; on the gateway
+// they only change through "radio", which pushes the new profile to every
+// node and switches the whole tree, gateway included, at one network time.
+// The node-side entries are kept here to be pushed with "param push": the
+// new version floods out in beacons first, and nodes that have not acked it
+// after PARAM_RETRY_MS get it unicast.
+constexpr uint32_t PARAM_RETRY_MS = 15000;
+constexpr uint8_t PARAM_MAX_TRIES = 5;
+constexpr uint32_t RADIO_SWITCH_DELAY_S = 300; // default lead time of "radio"
+
+static uint32_t radioSf = 0, radioBw = 0, radioCr = 0;
+static uint32_t nodeTestPeriodMs = PROFILE.testPeriodMs;
+static uint32_t nodeLostParentMs = PROFILE.livenessMs;
+static uint32_t nodeChildSilentMs = PROFILE.livenessMs;
+
+static const Param paramTable[] = {
+    {P_SF, "sf", &radioSf, 7, 12, PF_RADIO | PF_NODE},
+    {P_BW, "bw", &radioBw, 125, 500, PF_RADIO | PF_NODE},
+    {P_CR, "cr", &radioCr, 5, 8, PF_RADIO | PF_NODE},
+    {P_DC_BORROW_PCT, "dc_borrow_pct", &dcBorrowPct, 0, 100, PF_NODE},
+    {P_TEST_PERIOD_MS, "test_period", &nodeTestPeriodMs, 5000, 86400000, PF_NODE},
+    {P_LOST_PARENT_MS, "lost_parent", &nodeLostParentMs, 30000, 86400000, PF_NODE},
+    {P_CHILD_SILENT_MS, "child_silent", &nodeChildSilentMs, 30000, 86400000, PF_NODE},
+    {P_QUERY_PERIOD_MS, "query_period", &queryPeriodMs, 1000, 3600000, 0},
+    {P_QUERY_TIMEOUT_MS, "query_timeout", &queryTimeoutMs, 500, 120000, 0},
+    {P_MAX_MISSES, "max_misses", &maxMisses, 1, 100, 0},
+    {P_CHILD_TIMEOUT_MS, "child_timeout", &childTimeoutMs, 30000, 86400000, 0},
+    {P_JOIN_ACK_GAP_MS, "join_ack_gap", &joinAckGapMs, 100, 60000, 0},
+    {P_BEACON_PERIOD_MS, "beacon_period", &beaconPeriodMs, 5000, 86400000, PF_NODE},
+    {P_NETCODE, "netcode", &nodeNetcode, 0, 1, PF_NODE},
+    {P_NC_HOLD_MS, "nc_hold", &nodeNcHoldMs, 0, 2000, PF_NODE},
+};
+constexpr size_t PARAM_COUNT = sizeof(paramTable) / sizeof(paramTable[0]);
+
+static uint8_t paramVer = 0;       // version being pushed, 0 = none yet
+static uint8_t paramBody[MAX_PAYLOAD - sizeof(BeaconPayload)]; // its PARAM_SET body, fixed at the push
+static uint8_t paramLen = 0;
+static uint32_t radioSwitchAt = 0; // pending profile change (millis = network time), 0 = none
+static uint32_t nextSf = 0, nextBw = 0, nextCr = 0;
+
+static Trickle beacon;
+
+static void radioApply(uint32_t sf, uint32_t bw, uint32_t cr)
+{
+    cfg.sf = (uint8_t)sf;
+    cfg.bw = (float)bw;
+    cfg.cr = (uint8_t)cr;
+    radioSf = sf;
+    radioBw = bw;
+    radioCr = cr;
+    radio.setBandwidth(cfg.bw);
+    radio.setCodingRate(cfg.cr);
+    radio.setSpreadingFactor(cfg.sf);
+    rxSf = cfg.sf;
+    tunedFor = 0;
+    radioTune(cfg.sf, 0);
+    radio.startReceive();
+    // ADR links were measured on the old profile; nodes drop theirs too
+    for (auto &c : children)
+        if (c.id)
+            adrApply(c, cfg.sf, 0);
+    Serial.printf("radio now SF%u BW%.0f CR4/%u\n", cfg.sf, cfg.bw, cfg.cr);
+    // neighbours that missed the switch are gone; let the rest re-find us
+    trickleReset(beacon, millis());
+}
+
+// PARAM_SET body for a new version from the current values into buf;
+// returns its length. It must also fit behind a BeaconPayload, which caps
+// the node entries.
+static uint8_t paramBuild(uint8_t *buf)
+{
+    ParamSetHdr hdr{paramVer, 0, radioSwitchAt};
+    uint8_t len = sizeof(hdr);
+    for (auto &p : paramTable)
+    {
+        if (!(p.flags & PF_NODE))
+            continue;
+        if (sizeof(BeaconPayload) + len + sizeof(ParamEntry) > MAX_PAYLOAD)
+            break;
+        uint32_t v = *p.value;
+        if (radioSwitchAt && p.id == P_SF)
+            v = nextSf;
+        else if (radioSwitchAt && p.id == P_BW)
+            v = nextBw;
+        else if (radioSwitchAt && p.id == P_CR)
+            v = nextCr;
+        ParamEntry e{(uint8_t)p.id, v};
+        memcpy(buf + len, &e, sizeof(e));
+        len += sizeof(e);
+        ++hdr.count;
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+    return len;
+}
+
+static void paramPushStart()
+{
+    if (!++paramVer)
+        paramVer = 1;
+    paramLen = paramBuild(paramBody);
+    // version and values in one NVS write: after a reboot we send this
+    // version with the same values, so nodes holding it stay consistent
+    Preferences p;
+    p.begin("params", false);
+    if (p.putBytes("cfg", paramBody, paramLen) != paramLen)
+        Serial.println(F("param push: not saved, a reboot forgets it"));
+    p.end();
+    const uint32_t now = millis();
+    for (auto &c : children)
+    {
+        c.paramTries = 0;
+        c.paramRetryAt = now + PARAM_RETRY_MS;
+    }
+    trickleReset(beacon, now);
+    Serial.printf("param push v%u to %d nodes\n", paramVer, numChildren());
+}
+
+static void trySendParams(Child &c, uint32_t now)
+{
+    int16_t st = sendToChild(c, (MsgType)MSG_PARAM_SET, paramBody, paramLen);
+    if (st == ERR_TX_DEFERRED)
+    {
+        c.paramRetryAt = dcFreeAt() + 50;
+        return;
+    }
+    c.paramRetryAt = now + PARAM_RETRY_MS;
+    if (++c.paramTries == PARAM_MAX_TRIES)
+        Serial.printf("param v%u: %04X does not answer, giving up\n", paramVer, c.id);
+}
+
+// The pushed version and its values from Preferences. They override the
+// saved node parameters: what the nodes hold is what we send them again.
+static void paramRestore()
+{
+    Preferences p;
+    p.begin("params", true);
+    const size_t n = p.isKey("cfg") ? p.getBytes("cfg", paramBody, sizeof(paramBody)) : 0;
+    const uint8_t oldVer = p.getUChar("cfg_ver", 0); // firmware that kept only the version
+    p.end();
+    ParamSetHdr hdr;
+    if (n < sizeof(hdr))
+    {
+        paramVer = oldVer;
+        paramLen = paramVer ? paramBuild(paramBody) : 0;
+        return;
+    }
+    memcpy(&hdr, paramBody, sizeof(hdr));
+    for (uint8_t i = 0; i < hdr.count && sizeof(hdr) + (i + 1) * sizeof(ParamEntry) <= n; ++i)
+    {
+        ParamEntry e;
+        memcpy(&e, paramBody + sizeof(hdr) + i * sizeof(ParamEntry), sizeof(e));
+        const Param *q = paramById(paramTable, PARAM_COUNT, e.id);
+        if (q && paramValid(*q, e.value))
+            *q->value = e.value;
+    }
+    // network time restarted with us: a switch still pending happens now
+    hdr.switchAt = 0;
+    memcpy(paramBody, &hdr, sizeof(hdr));
+    paramVer = hdr.ver;
+    paramLen = (uint8_t)n;
+}
+
+static void paramStatus()
+{
+    paramPrint(paramTable, PARAM_COUNT);
+    if (radioSwitchAt)
+        Serial.printf("  radio -> SF%lu BW%lu CR4/%lu in %ld s\n", (unsigned long)nextSf,
+                      (unsigned long)nextBw, (unsigned long)nextCr, (long)(radioSwitchAt - millis()) / 1000);
+    if (paramVer)
+    {
+        int acked = 0;
+        for (auto &c : children)
+            if (c.id && c.paramVer == paramVer)
+                ++acked;
+        Serial.printf("  push v%u: %d/%d nodes acked\n", paramVer, acked, numChildren());
+    }
+    tricklePrint(beacon);
+}
+
+// "param ...": list, set, save, push. "radio <sf> <bw> <cr> [delay_s]".
+static void onParamCommand(const char *line)
+{
+    char name[24];
+    unsigned long v, sf, bw, cr, delayS = RADIO_SWITCH_DELAY_S;
+    if (!strcmp(line, "param"))
+        paramStatus();
+    else if (!strcmp(line, "param save"))
+    {
+        paramSave(paramTable, PARAM_COUNT);
+        Serial.println(F("params saved"));
+    }
+    else if (!strcmp(line, "param push"))
+        paramPushStart();
+    else if (sscanf(line, "param %23s %lu", name, &v) == 2)
+    {
+        const Param *p = paramFind(paramTable, PARAM_COUNT, name);
+        if (!p)
+            Serial.printf("unknown param: %s\n", name);
+        else if (p->flags & PF_RADIO)
+            Serial.println(F("radio profile: use radio <sf> <bw> <cr> [delay_s]"));
+        else if (!paramValid(*p, v))
+            Serial.printf("%s: out of range %lu..%lu\n", p->name, (unsigned long)p->lo, (unsigned long)p->hi);
+        else
+        {
+            *p->value = v;
+            Serial.printf("%s = %lu%s\n", p->name, v, (p->flags & PF_NODE) ? " (param push to send)" : "");
+        }
+    }
+    else if (sscanf(line, "radio %lu %lu %lu %lu", &sf, &bw, &cr, &delayS) >= 3)
+    {
+        if (!paramValid(paramTable[0], sf) || !paramValid(paramTable[1], bw) || !paramValid(paramTable[2], cr))
+        {
+            Serial.println(F("radio: sf 7..12, bw 125/250/500, cr 5..8"));
+            return;
+        }
+        nextSf = sf;
+        nextBw = bw;
+        nextCr = cr;
+        radioSwitchAt = millis() + delayS * 1000;
+        if (!radioSwitchAt)
+            radioSwitchAt = 1;
+        paramPushStart();
+    }
+    else
+        Serial.printf("unknown command: %s\n", line);
+}
+
+void meshSetupGateway()
+{
+    oledPrintfLines(0, 0, 12, "Gateway ready\nID 0000");
+    idxInit();
+    addrLoad();
+    radioSf = cfg.sf;
+    radioBw = (uint32_t)cfg.bw;
+    radioCr = cfg.cr;
+    paramLoad(paramTable, PARAM_COUNT);
+    paramRestore();
+    trickleInit(beacon, CFG_TRICKLE_IMIN_MS, TRICKLE_K);
+    if (tsBegin(tsdb, "/ts"))
+        Serial.printf("telemetry store: %lu segments, time %lu s\n", (unsigned long)(tsdb.segHi - tsdb.segLo + 1),
+                      (unsigned long)tsNow(tsdb));
+    else
+        Serial.println(F("telemetry store: no LittleFS, disabled"));
+    powerSetup(radio);
+    trickleStart(beacon, millis());
+    if (radioSf != cfg.sf || radioBw != (uint32_t)cfg.bw || radioCr != cfg.cr)
+        radioApply(radioSf, radioBw, radioCr);
+    rxSf = cfg.sf;
+    dcSetFreq(cfg.freq);
+    // duty-cycle budget per sub-band the channel plan touches
+    bool used[BAND_COUNT] = {false};
+    used[bandOf(cfg.freq)] = true;
+    for (uint8_t ch = 1; ch <= NUM_DATA_CHANNELS; ++ch)
+        used[bandOf(channelFreq(ch))] = true;
+    uint32_t total = 0;
+    for (uint8_t b = 0; b < BAND_COUNT; ++b)
+        if (used[b])
+        {
+            Serial.printf("band %-2s  %2u.%u%%  %6ld ms/h\n", SUB_BANDS[b].name,
+                          SUB_BANDS[b].permille / 10, SUB_BANDS[b].permille % 10, (long)dcCapMs(b));
+            total += (uint32_t)dcCapMs(b);
+        }
+    Serial.printf("TX budget %lu ms/h over %u data channels (control only: %ld)\n",
+                  (unsigned long)total, NUM_DATA_CHANNELS, (long)dcCapMs(bandOf(cfg.freq)));
+    Serial.printf("MeshHeader=%u bytes\n", (unsigned)sizeof(MeshHeader));
+    Serial.printf("node table: %u slots, %u bytes (+%u index, +%u addr map)\n",
+                  (unsigned)GW_MAX_NODES, (unsigned)sizeof(children), (unsigned)sizeof(idIndex),
+                  (unsigned)sizeof(addrMac));
+    Serial.printf("addresses assigned: %u/%u\n", addrCount, (unsigned)GW_MAX_ADDRS);
+    radio.startReceive();
+}
+
+constexpr int16_t STATS_RSSI_LO = -140; // first RSSI bucket, dBm
+constexpr uint8_t STATS_RSSI_STEP = 10;
+constexpr uint8_t STATS_RSSI_BUCKETS = 12;
+constexpr uint32_t STATS_RESTART_GAP = 1000; // seq this far back = node rebooted (no boot id)
+
+struct TestStats
+{
+    addr_t id;
+    uint32_t firstSeq;
+    uint32_t maxSeq;
+    uint32_t window;       // bit i: maxSeq - i arrived
+    uint32_t rx;
+    uint32_t dup;
+    uint32_t reorder;
+    uint32_t restarts;
+    uint32_t rxBefore;       // receptions and span of the runs before
+    uint32_t expectedBefore; // the last node reboot
+    uint32_t lastRx;
+    uint32_t battFirstAt;
+    uint32_t battLastAt;
+    uint32_t latSum;       // test frames stamped with network time (ver 2)
+    uint32_t latN;
+    uint32_t latMin;
+    uint32_t latMax;
+    uint16_t battFirst;
+    uint16_t battLast;
+    uint16_t battMin;
+    uint16_t boot; // test_hdr_t.boot of the current run
+    uint16_t hops[MAX_HOPS]; // by path length 1..MAX_HOPS
+    uint16_t rssi[STATS_RSSI_BUCKETS];
+};
+static TestStats stats[GW_STATS_MAX];
+
+static_assert(sizeof(children) + sizeof(idIndex) + sizeof(subSize) + sizeof(addrMac) + sizeof(pend) + sizeof(reasm) + sizeof(stats) +
+                      sizeof(down) + sizeof(tsdb) + sizeof(otaTx) <=
+                  GW_TABLE_RAM_BUDGET,
+              "gateway tables exceed GW_TABLE_RAM_BUDGET");
+
+static TestStats &statsFor(addr_t id, uint32_t now)
+{
+    TestStats *lru = &stats[0];
+    for (auto &t : stats)
+    {
+        if (t.rx && t.id == id)
+            return t;
+        if (!t.rx)
+            lru = &t; // free slots first
+        else if (lru->rx && now - t.lastRx > now - lru->lastRx)
+            lru = &t;
+    }
+    if (lru->rx)
+        PERF_OVERFLOW(MARK_STATS);
+    memset(lru, 0, sizeof(*lru));
+    lru->id = id;
+    PERF_LEVEL(MARK_STATS, std::count_if(stats, stats + GW_STATS_MAX, [](const TestStats &t) { return t.rx != 0; }) + 1);
+    return *lru;
+}
+
+static void statsUpdate(addr_t id, const test_hdr_t &th, uint8_t hops, int16_t rssi, uint32_t now)
+{
+    TestStats &t = statsFor(id, now);
+    if (t.rx && (th.boot ? th.boot != t.boot : th.seq + STATS_RESTART_GAP < t.maxSeq))
+    {
+        t.expectedBefore += t.maxSeq - t.firstSeq + 1;
+        t.rxBefore += t.rx;
+        ++t.restarts;
+        t.rx = 0;
+    }
+    if (!t.rx)
+    {
+        t.firstSeq = t.maxSeq = th.seq;
+        t.window = 1;
+        t.boot = th.boot;
+    }
+    else if (th.seq > t.maxSeq)
+    {
+        const uint32_t shift = th.seq - t.maxSeq;
+        t.window = (shift >= 32) ? 1 : (t.window << shift) | 1;
+        t.maxSeq = th.seq;
+    }
+    else
+    {
+        const uint32_t back = t.maxSeq - th.seq;
+        if (back < 32 && (t.window & (1u << back)))
+        {
+            ++t.dup;
+            t.lastRx = now;
+            return;
+        }
+        if (back < 32)
+            t.window |= 1u << back;
+        if (th.seq < t.firstSeq)
+            t.firstSeq = th.seq;
+        ++t.reorder;
+    }
+    ++t.rx;
+    t.lastRx = now;
+    if (th.ver >= 2 && (int32_t)(now - th.tx_epoch_ms) >= 0)
+    {
+        const uint32_t lat = now - th.tx_epoch_ms;
+        t.latMin = t.latN ? std::min(t.latMin, lat) : lat;
+        t.latMax = std::max(t.latMax, lat);
+        t.latSum += lat;
+        ++t.latN;
+    }
+    ++t.hops[std::min<uint8_t>(std::max<uint8_t>(hops, 1), MAX_HOPS) - 1];
+    int b = (rssi - STATS_RSSI_LO) / STATS_RSSI_STEP;
+    t.rssi[std::max(0, std::min(b, STATS_RSSI_BUCKETS - 1))]++;
+    if (th.batt_mV)
+    {
+        if (!t.battFirst)
+        {
+            t.battFirst = t.battMin = th.batt_mV;
+            t.battFirstAt = now;
+        }
+        t.battLast = th.batt_mV;
+        t.battLastAt = now;
+        t.battMin = std::min(t.battMin, th.batt_mV);
+    }
+}
+
+static void statsDump()
+{
+    const uint32_t now = millis();
+    Serial.printf("{\"stats\":{\"now\":%lu,\"rssi_lo\":%d,\"rssi_step\":%u,\"nodes\":[",
+                  (unsigned long)now, STATS_RSSI_LO, STATS_RSSI_STEP);
+    bool first = true;
+    for (auto &t : stats)
+    {
+        if (!t.rx)
+            continue;
+        // every sequence run since the first frame, across node reboots
+        const uint32_t expected = t.expectedBefore + t.maxSeq - t.firstSeq + 1;
+        const uint32_t delivered = t.rxBefore + t.rx;
+        Serial.printf("%s{\"id\":%u,\"rx\":%lu,\"expected\":%lu,\"pdr\":%.4f,\"dup\":%lu,\"reorder\":%lu,"
+                      "\"restarts\":%lu,\"max_seq\":%lu,\"age_ms\":%lu,\"hops\":[",
+                      first ? "" : ",", t.id, (unsigned long)delivered, (unsigned long)expected,
+                      expected ? (double)delivered / expected : 0.0, (unsigned long)t.dup,
+                      (unsigned long)t.reorder, (unsigned long)t.restarts, (unsigned long)t.maxSeq,
+                      (unsigned long)(now - t.lastRx));
+        for (uint8_t i = 1; i <= MAX_HOPS; ++i)
+            Serial.printf("%s%u", i > 1 ? "," : "", t.hops[i - 1]);
+        Serial.printf("],\"lat_ms\":{\"n\":%lu,\"min\":%lu,\"avg\":%lu,\"max\":%lu},\"rssi\":[",
+                      (unsigned long)t.latN, (unsigned long)t.latMin,
+                      (unsigned long)(t.latN ? t.latSum / t.latN : 0), (unsigned long)t.latMax);
+        for (uint8_t i = 0; i < STATS_RSSI_BUCKETS; ++i)
+            Serial.printf("%s%u", i ? "," : "", t.rssi[i]);
+        const float hours = (t.battLastAt - t.battFirstAt) / 3600000.0f;
+        Serial.printf("],\"batt\":{\"first\":%u,\"last\":%u,\"min\":%u,\"mv_per_h\":%.1f}}",
+                      t.battFirst, t.battLast, t.battMin,
+                      hours > 0.1f ? ((int)t.battLast - (int)t.battFirst) / hours : 0.0f);
+        first = false;
+    }
+    Serial.println("]}}");
+}
+
+// "bench": times the lookup and parsing paths the loop runs on every frame,
+// against the live tables, and prints ns per call as one JSON line for
+// tools/benchcmp.py. Nothing is modified, so it is safe on a running gateway.
+static volatile uint32_t benchSink;
+
+template <typename Fn>
+static uint32_t benchNs(uint32_t iters, Fn fn)
+{
+    const uint32_t c0 = ESP.getCycleCount();
+    for (uint32_t i = 0; i < iters; ++i)
+        fn(i);
+    const uint32_t cycles = ESP.getCycleCount() - c0;
+    return (uint32_t)((uint64_t)cycles * 1000 / ((uint64_t)iters * ESP.getCpuFreqMHz()));
+}
+
+static void benchRun()
+{
+    const uint32_t N = 2000, now = millis();
+    addr_t ids[64];
+    uint8_t nIds = 0;
+    for (size_t i = 0; i < GW_MAX_NODES && nIds < 64; ++i)
+        if (children[i].id)
+            ids[nIds++] = children[i].id;
+
+    uint8_t frame[sizeof(MeshHeader) + MAX_PAYLOAD];
+    for (size_t i = 0; i < sizeof(frame); ++i)
+        frame[i] = (uint8_t)(i * 37);
+    MeshHeader h{HDR_MAGIC, 0x0123, GW_ID, 2, DATA_UP, MAX_PAYLOAD};
+
+    Sample smp[SAMPLE_MAX_N];
+    for (uint8_t i = 0; i < SAMPLE_MAX_N; ++i)
+    {
+        smp[i].t = 60000u * i;
+        smp[i].v[0] = 3700 - i / 4;
+        smp[i].v[1] = -90 + (i % 5);
+    }
+    uint8_t batch[MAX_PAYLOAD - sizeof(DataUpHdr)];
+    // as many readings as fit one frame, as a node sends them
+    uint8_t batchN = SAMPLE_MAX_N;
+    size_t batchLen = 0;
+    while (batchN > 1 && !(batchLen = sampleEncode(smp, batchN, 2, batch, sizeof(batch))))
+        --batchN;
+
+    const uint32_t dcRefillNs = benchNs(N, [&](uint32_t) { dcRefill(dcBand, now); });
+    const uint32_t hitNs = nIds ? benchNs(N, [&](uint32_t i) { benchSink += (uintptr_t)findChild(ids[i % nIds]); }) : 0;
+    const uint32_t missNs = benchNs(N, [&](uint32_t i) { benchSink += (uintptr_t)findChild((addr_t)(0xF000 | (i & 0x0FFF))); });
+    const uint32_t pendNs = benchNs(N, [&](uint32_t i) { benchSink += (uintptr_t)findPending((addr_t)(0xF000 | i)); });
+    const uint32_t hashNs = benchNs(N, [&](uint32_t) { benchSink += frameHash(h, frame + sizeof(MeshHeader)); });
+    uint8_t nch;
+    auto decode = [&](uint32_t) { benchSink += sampleDecode(batch, batchLen, smp, SAMPLE_MAX_N, nch); };
+    const uint32_t decodeNs = batchLen ? benchNs(N / 10, decode) : 0;
+
+    Serial.printf("{\"bench\":{\"cpu_mhz\":%lu,\"nodes\":%d,\"max_nodes\":%u,\"ns\":{"
+                  "\"dc_refill\":%lu,\"find_child_hit\":%lu,\"find_child_miss\":%lu,"
+                  "\"find_pending\":%lu,\"frame_hash\":%lu,\"sample_decode\":%lu}}}\n",
+                  (unsigned long)ESP.getCpuFreqMHz(), numChildren(), (unsigned)GW_MAX_NODES,
+                  (unsigned long)dcRefillNs, (unsigned long)hitNs, (unsigned long)missNs,
+                  (unsigned long)pendNs, (unsigned long)hashNs, (unsigned long)decodeNs);
+}
+
+// Downsampled query output: one bucket of `step` seconds. RSSI and hops
+// come from STATE replies and uplink only; the other events only count.
+struct TsBucket
+{
+    uint32_t t;
+    uint32_t n;
+    uint32_t ev[TS_EVENTS];
+    int32_t rssiSum;
+    uint32_t rssiN;
+    int16_t rssiMin, rssiMax;
+    uint8_t hopsMin, hopsMax;
+    uint16_t batt; // last seen
+};
+
+static void tsBucketStart(TsBucket &b, uint32_t t)
+{
+    memset(&b, 0, sizeof(b));
+    b.t = t;
+    b.rssiMin = INT16_MAX;
+    b.rssiMax = INT16_MIN;
+    b.hopsMin = 0xFF;
+}
+
+static void tsBucketAdd(TsBucket &b, const Sample &s)
+{
+    const uint8_t ev = tsEvent(s);
+    ++b.n;
+    ++b.ev[ev];
+    if (s.v[3])
+        b.batt = (uint16_t)s.v[3];
+    if (ev != TS_STATE && ev != TS_UP)
+        return;
+    const int16_t rssi = (int16_t)s.v[2];
+    b.rssiSum += rssi;
+    ++b.rssiN;
+    b.rssiMin = std::min(b.rssiMin, rssi);
+    b.rssiMax = std::max(b.rssiMax, rssi);
+    b.hopsMin = std::min(b.hopsMin, tsHops(s));
+    b.hopsMax = std::max(b.hopsMax, tsHops(s));
+}
+
+static void tsBucketPrint(const TsBucket &b)
+{
+    Serial.printf("{\"tsd\":{\"t\":%lu,\"n\":%lu,\"state\":%lu,\"up\":%lu,\"miss\":%lu,\"join\":%lu,\"gone\":%lu",
+                  (unsigned long)b.t, (unsigned long)b.n, (unsigned long)b.ev[TS_STATE], (unsigned long)b.ev[TS_UP],
+                  (unsigned long)b.ev[TS_MISS], (unsigned long)b.ev[TS_JOIN], (unsigned long)b.ev[TS_GONE]);
+    if (b.rssiN)
+        Serial.printf(",\"rssi\":[%d,%ld,%d],\"hops\":[%u,%u]", b.rssiMin, (long)(b.rssiSum / (int32_t)b.rssiN),
+                      b.rssiMax, b.hopsMin, b.hopsMax);
+    Serial.printf(",\"batt\":%u}}\n", b.batt);
+}
+
+// "ts bench": ingest rate and query latency on the real flash, with a
+// scratch store in /tsbench filled with synthetic traffic from 32 nodes
+// and deleted afterwards. Blocks the loop for a second or two.
+static void tsBench()
+{
+    const uint32_t N = 4096;
+    std::unique_ptr<TsStore> st(new TsStore());
+    if (!tsBegin(*st, "/tsbench"))
+    {
+        Serial.println(F("ts bench: no LittleFS"));
+        return;
+    }
+    tsClear(*st);
+    uint32_t t = 0;
+    uint32_t c0 = micros();
+    for (uint32_t i = 0; i < N; ++i)
+    {
+        const uint16_t node = (uint16_t)(1 + random(32));
+        const uint8_t ev = random(8) ? (random(2) ? TS_STATE : TS_UP) : TS_MISS;
+        t += (uint32_t)random(20);
+        tsAdd(*st, tsRecord(t, node, ev, (uint8_t)(1 + node % 3), (int16_t)(-70 - node - random(4)),
+                            (uint16_t)(3600 + 10 * node)));
+    }
+    tsFlush(*st);
+    const uint32_t ingestUs = micros() - c0;
+    uint32_t sink = 0;
+    auto count = [&sink](const Sample &s) { sink += s.t; };
+    c0 = micros();
+    const TsScan win = tsQuery(*st, t / 2, t / 2 + t / 10, count); // a tenth of the span
+    const uint32_t winUs = micros() - c0;
+    c0 = micros();
+    const TsScan full = tsQuery(*st, 0, t, count);
+    const uint32_t fullUs = micros() - c0;
+    Serial.printf("{\"ts_bench\":{\"records\":%lu,\"bytes\":%lu,\"bytes_per_record\":%.2f,\"blocks\":%lu,"
+                  "\"ingest_us\":%lu,\"ingest_per_s\":%lu,\"lost\":%lu,"
+                  "\"window\":{\"records\":%lu,\"blocks\":%lu,\"skipped\":%lu,\"us\":%lu},"
+                  "\"full\":{\"records\":%lu,\"blocks\":%lu,\"us\":%lu}}}\n",
+                  (unsigned long)N, (unsigned long)st->bytes, (double)st->bytes / N, (unsigned long)st->blocks,
+                  (unsigned long)ingestUs, (unsigned long)((uint64_t)N * 1000000 / (ingestUs ? ingestUs : 1)),
+                  (unsigned long)st->lost, (unsigned long)win.records, (unsigned long)win.blocks,
+                  (unsigned long)win.skipped, (unsigned long)winUs, (unsigned long)full.records,
+                  (unsigned long)full.blocks, (unsigned long)fullUs);
+    tsClear(*st);
+    LittleFS.rmdir("/tsbench");
+}
+
+// A running "ts" query. tsJobPump() takes one block's worth of records
+// per loop pass, so a query over months of history never holds up polling.
+constexpr uint32_t TS_QUERY_STEP = TS_BLOCK_N;
+struct TsJob
+{
+    bool active;
+    bool all;
+    addr_t node;
+    uint32_t lo, step;
+    uint32_t matched;
+    uint32_t startMs;
+    TsCursor cur;
+    TsBucket b;
+    bool open; // b holds records
+};
+static TsJob tsJob;
+
+static void tsJobRecord(const Sample &s)
+{
+    TsJob &j = tsJob;
+    if (!j.all && (addr_t)s.v[0] != j.node)
+        return;
+    ++j.matched;
+    if (!j.step)
+    {
+        Serial.printf("{\"ts\":{\"t\":%lu,\"node\":\"%04X\",\"ev\":\"%s\",\"rssi\":%ld,\"hops\":%u,\"batt\":%ld}}\n",
+                      (unsigned long)s.t, (unsigned)s.v[0], tsEventNames[tsEvent(s)], (long)s.v[2], tsHops(s),
+                      (long)s.v[3]);
+        return;
+    }
+    const uint32_t bt = j.lo + (s.t - j.lo) / j.step * j.step;
+    if (j.open && bt != j.b.t)
+    {
+        tsBucketPrint(j.b);
+        j.open = false;
+    }
+    if (!j.open)
+    {
+        tsBucketStart(j.b, bt);
+        j.open = true;
+    }
+    tsBucketAdd(j.b, s);
+}
+
+static void tsJobEnd(bool stopped)
+{
+    TsJob &j = tsJob;
+    if (j.open)
+        tsBucketPrint(j.b);
+    Serial.printf("{\"ts_end\":{\"matched\":%lu,\"scanned\":%lu,\"blocks\":%lu,\"skipped\":%lu,\"ms\":%lu%s}}\n",
+                  (unsigned long)j.matched, (unsigned long)j.cur.scan.records, (unsigned long)j.cur.scan.blocks,
+                  (unsigned long)j.cur.scan.skipped, (unsigned long)(millis() - j.startMs),
+                  stopped ? ",\"stopped\":true" : "");
+    j.active = false;
+}
+
+// Call every loop pass
+static void tsJobPump()
+{
+    if (!tsJob.active)
+        return;
+    PERF_SCOPE(PERF_SERIAL);
+    if (!tsStep(tsdb, tsJob.cur, TS_QUERY_STEP, tsJobRecord))
+        tsJobEnd(false);
+}
+
+// "ts": store summary. "ts <node|*> <from> [<to> [<step>]]": the records of
+// one node (hex) or all in a time range, in store seconds as printed by
+// "ts"; negative times count back from now, `to` defaults to now. With a
+// step, one {"tsd"} line per bucket of that many seconds instead of one
+// {"ts"} line per record. The lines come over the following loop passes
+// and end with {"ts_end"}; "ts stop" ends a query early. "ts clear"
+// deletes everything, "ts bench" runs tsBench().
+static void tsCommand(const char *line)
+{
+    const uint32_t now = tsNow(tsdb);
+    if (!strcmp(line, "ts"))
+    {
+        const uint32_t onFlash = tsdb.records - tsdb.n - tsdb.lost;
+        Serial.printf("{\"ts\":{\"ready\":%s,\"now\":%lu,\"first\":%lu,\"segments\":%lu,\"flash_kb\":%lu,"
+                      "\"buffered\":%u,\"records\":%lu,\"blocks\":%lu,\"bytes_per_record\":%.2f,\"lost\":%lu,"
+                      "\"dropped_segments\":%lu}}\n",
+                      tsdb.ready ? "true" : "false", (unsigned long)now,
+                      (unsigned long)tsdb.first[tsdb.segLo % TS_MAX_SEGMENTS],
+                      (unsigned long)(tsdb.segHi - tsdb.segLo + (tsdb.segBytes ? 1 : 0)),
+                      (unsigned long)(tsFlashBytes(tsdb) / 1024), tsdb.n, (unsigned long)tsdb.records,
+                      (unsigned long)tsdb.blocks, onFlash ? (double)tsdb.bytes / onFlash : 0.0,
+                      (unsigned long)tsdb.lost, (unsigned long)tsdb.droppedSegs);
+        return;
+    }
+    if (!strcmp(line, "ts stop"))
     {
-        if (now - c->lastJoinAck < JOIN_ACK_GAP_MS)
-            return false;
+        if (tsJob.active)
+            tsJobEnd(true);
+        return;
     }
-    uint8_t seq = 0;
-    int16_t st = sendPacket(id, JOIN_ACK, &seq, 1);
-    if (st == RADIOLIB_ERR_NONE)
+    if (!strcmp(line, "ts clear"))
     {
-        Serial.println("sent ack fr");
-        Child *c = allocChild(id);
-        if (c)
-        {
-            c->parent = GW_ID;
-            c->hops = 1;
-            c->misses = 0;
-            c->lastSeen = now;
-            c->lastJoinAck = now;
-            c->answeredSinceQuery = true;
-        }
-        removePending(id);
-        return true;
+        tsClear(tsdb);
+        Serial.println(F("telemetry store cleared"));
+        return;
     }
-    if (auto *p = allocPending(id))
+    if (!strcmp(line, "ts bench"))
     {
-        uint32_t slack = 50;
-        if (st == ERR_TX_DEFERRED)
-            p->nextTry = (dc_free_at + slack);
-        else
-            p->nextTry = now + JOIN_ACK_GAP_MS;
-        p->tries = (uint8_t)std::min<uint8_t>(p->tries + 1, 200);
+        tsBench();
+        return;
     }
-    return false;
+    char who[8];
+    long from = 0, to = 0;
+    unsigned long step = 0;
+    const int got = sscanf(line + 2, "%7s %ld %ld %lu", who, &from, &to, &step);
+    if (got < 2)
+    {
+        Serial.println(F("usage: ts [<node|*> <from_s> [<to_s> [<step_s>]]] | ts stop | ts clear | ts bench"));
+        return;
+    }
+    if (tsJob.active)
+    {
+        Serial.println(F("ts: a query is still running, ts stop ends it"));
+        return;
+    }
+    auto at = [now](long t) {
+        const int64_t a = t < 0 ? (int64_t)now + t : t;
+        return (uint32_t)(a < 0 ? 0 : a);
+    };
+    TsJob &j = tsJob;
+    memset(&j, 0, sizeof(j));
+    j.lo = at(from);
+    const uint32_t hi = (got < 3 || to == 0) ? now : at(to);
+    j.all = !strcmp(who, "*");
+    j.node = (addr_t)strtoul(who, nullptr, 16);
+    j.step = step;
+    j.startMs = millis();
+    tsCursorStart(tsdb, j.cur, j.lo, hi);
+    j.active = true;
 }
 
-static bool trySendQuery(Child &c)
+// Serial console commands (see console.h)
+static void onCommand(const char *line)
 {
-    const uint32_t now = millis();
-    int16_t st = sendPacket(c.id, QUERY);
-    if (st == RADIOLIB_ERR_NONE)
+    if (!strcmp(line, "stats"))
+        statsDump();
+    else if (!strcmp(line, "stats reset"))
     {
-        c.lastQuery = now;
-        c.answeredSinceQuery = false;
-        removePendingQuery(c.id);
-        return true;
+        memset(stats, 0, sizeof(stats));
+        Serial.println(F("stats cleared"));
     }
-    if (auto *q = allocPendingQuery(c.id))
+    else if (!strcmp(line, "bench"))
+        benchRun();
+    else if (!strncmp(line, "ts", 2) && (!line[2] || line[2] == ' '))
+        tsCommand(line);
+    else if (!strncmp(line, "ota", 3) && (!line[3] || line[3] == ' '))
+        otaCommand(line);
+    else if (!strcmp(line, "nc"))
+        ncPrint(ncSent, nodeNetcode);
+    else if (!strncmp(line, "param", 5) || !strncmp(line, "radio ", 6))
+        onParamCommand(line);
+#if ENABLE_PERF
+    else if (!strcmp(line, "perf"))
+        perfDump("gateway", perfMarks, MARK_COUNT);
+    else if (!strcmp(line, "perf reset"))
     {
-        uint32_t slack = 50;
-        q->nextTry = (st == ERR_TX_DEFERRED) ? (dc_free_at + slack) : (now + 50);
-        q->tries = (uint8_t)std::min<uint8_t>(q->tries + 1, 200);
+        perfReset(perfMarks, MARK_COUNT);
+        Serial.println(F("perf cleared"));
     }
-    return false;
+#endif
+#if GW_LIGHT_SLEEP
+    else if (!strcmp(line, "power"))
+        powerDump();
+    else if (!strcmp(line, "power reset"))
+    {
+        powerReset();
+        Serial.println(F("power stats cleared"));
+    }
+#endif
+    else if (!strcmp(line, "bridge on") || !strcmp(line, "bridge off"))
+    {
+        // the reply to "bridge on" is the last text the host has to skip
+        Serial.printf("bridge %s\n", !strcmp(line, "bridge on") ? "on" : "off");
+        bridgeOn = !strcmp(line, "bridge on");
+        brLen = 0;
+        brRxLen = 0;
+    }
+    else if (!strcmp(line, "capture on") || !strcmp(line, "capture off"))
+    {
+        capturing = !strcmp(line, "capture on");
+        Serial.printf("capture %s\n", capturing ? "on" : "off");
+    }
+    else
+        Serial.printf("unknown command: %s\n", line);
 }
 
-void meshSetupGateway()
+// A test frame's header into th; older firmware sends it without `boot`.
+static bool testFrame(const uint8_t *d, uint8_t n, test_hdr_t &th)
 {
-    oledPrintfLines(0, 0, 12, "Gateway ready\nID 00");
-    Serial.printf("MeshHeader=%u bytes\n", (unsigned)sizeof(MeshHeader));
-    radio.startReceive();
+    if (n < offsetof(test_hdr_t, boot))
+        return false;
+    memset(&th, 0, sizeof(th));
+    memcpy(&th, d, std::min<size_t>(n, sizeof(th)));
+    return th.ver >= 1 && th.test_id == TEST_MAGIC;
 }
 
-static void handleRx()
+// Delivered uplink application data, once per sequence number
+static void onAppData(Child &c, const DataUpHdr &du, const uint8_t *d, uint8_t n)
 {
-    size_t pktLen = radio.getPacketLength();
-    const size_t MAX_FRAME = sizeof(MeshHeader) + MAX_PAYLOAD;
-    if (pktLen == 0 || pktLen > MAX_FRAME)
+    test_hdr_t th;
+    if (testFrame(d, n, th))
     {
-        uint8_t scratch[32];
-        (void)radio.readData(scratch, sizeof(scratch));
-        return;
+        if (th.batt_mV)
+            c.battMv = th.batt_mV;
+        return; // counted by statsUpdate on arrival
     }
-    std::unique_ptr<uint8_t[]> buf(new uint8_t[pktLen]);
-    int16_t rc = radio.readData(buf.get(), pktLen);
-    if (rc == RADIOLIB_ERR_RX_TIMEOUT)
-        return;
-    if (rc != RADIOLIB_ERR_NONE)
+    if (n && d[0] == SAMPLE_MAGIC)
     {
-        Serial.printf("RX err %d\n", rc);
-        radio.startReceive();
+        Sample s[SAMPLE_MAX_N];
+        uint8_t nch = 0;
+        const uint8_t k = sampleDecode(d, n, s, SAMPLE_MAX_N, nch);
+        if (!k)
+        {
+            Serial.printf("DATA %04X #%u: bad sample batch\n", c.id, du.seq);
+            return;
+        }
+        for (uint8_t i = 0; i < k; ++i)
+        {
+            Serial.printf("SAMPLE %04X t=%lu", c.id, (unsigned long)s[i].t);
+            for (uint8_t ch = 0; ch < nch; ++ch)
+                Serial.printf(" %ld", (long)s[i].v[ch]);
+            Serial.println();
+        }
         return;
     }
-    auto *h = reinterpret_cast<MeshHeader *>(buf.get());
-    if (h->magic != HDR_MAGIC)
+    Serial.printf("DATA %04X #%u %u B\n", c.id, du.seq, n);
+}
+
+// One frame off the air, or decoded from a MSG_XOR
+static void handleFrame(uint8_t *buf, size_t pktLen, int16_t rssi, float snr)
+{
+    auto *h = reinterpret_cast<MeshHeader *>(buf);
+    if (pktLen < sizeof(MeshHeader) || h->magic != HDR_MAGIC || sizeof(MeshHeader) + h->len > pktLen)
         return;
     const uint32_t now = millis();
-    const int16_t rssi = radio.getRSSI();
 
     switch (h->type)
     {
     case JOIN_REQ:
     {
-        if (auto *p = allocPending(h->src))
-        {
-            p->lastSeen = now;
-            if (now >= p->nextTry)
-                (void)trySendJoinAck(h->src);
-        }
+        if (h->len < sizeof(JoinPayload))
+            break;
+        onJoinRequest(h->src, GW_ID, *reinterpret_cast<JoinPayload *>(buf + sizeof(MeshHeader)), now);
         if (Child *c = findChild(h->src))
         {
             c->lastSeen = now;
@@ -354,43 +2508,190 @@ static void handleRx()
 
     case DATA_UP:
     {
+        if (h->len < sizeof(DataUpHdr))
+            break;
+        auto *du = reinterpret_cast<DataUpHdr *>(buf + sizeof(MeshHeader));
         if (Child *c = allocChild(h->src))
         {
             c->lastSeen = now;
             c->lastRssi = rssi;
             c->misses = 0;
             c->answeredSinceQuery = true;
+            if (c->parent == GW_ID)
+                adrSample(*c, snr);
+            if (tunedFor == c->id)
+                tunedUntil = now + ADR_LINGER_MS;
+            const uint8_t *d = buf + sizeof(MeshHeader) + sizeof(DataUpHdr);
+            const uint8_t n = (uint8_t)(h->len - sizeof(DataUpHdr));
+            // test statistics see every copy, so retransmissions count as dups;
+            // hops counts relays, the histogram is by path length
+            test_hdr_t th;
+            if (testFrame(d, n, th))
+                statsUpdate(c->id, th, (uint8_t)(h->hops + 1), rssi, now);
+            if (dataAccept(*c, *du))
+            {
+                bridgeUp(*c, *h, *du, rssi, snr, d, n, now);
+                onAppData(*c, *du, d, n);
+                tsNote(*c, TS_UP, rssi, (uint8_t)(h->hops + 1));
+            }
+            // duplicates are acked again: the last ACK was evidently lost
+            if (!c->ackDueAt)
+                c->ackDueAt = now + DATA_ACK_HOLD_MS;
+        }
+        break;
+    }
+
+    case BEACON:
+    {
+        // a node looking for a parent, or one advertising an old
+        // configuration: beacon fast; a consistent one counts towards
+        // suppression
+        const auto *b = reinterpret_cast<BeaconPayload *>(buf + sizeof(MeshHeader));
+        if (h->len < sizeof(BeaconPayload))
+            trickleReset(beacon, now);
+        else if (b->cfgVer != paramVer)
+            trickleMismatch(beacon, paramVer, now);
+        else
+            trickleHeard(beacon);
+        break;
+    }
+
+    case (MsgType)MSG_DOWN_ACK:
+    {
+        if (h->len < sizeof(DownAckPayload))
+            break;
+        DownAckPayload a;
+        memcpy(&a, buf + sizeof(MeshHeader), sizeof(a));
+        onDownAck(h->src, a.id);
+        if (Child *c = findChild(h->src))
+        {
+            c->lastSeen = now;
+            c->answeredSinceQuery = true;
+        }
+        break;
+    }
+
+    case (MsgType)MSG_OTA_NEED:
+        if (h->dst == GW_ID && h->len >= sizeof(OtaNeedHdr))
+            otaOnNeed(buf + sizeof(MeshHeader), h->len);
+        break;
+
+    case (MsgType)MSG_OTA_STATUS:
+    {
+        if (h->len < sizeof(OtaStatusPayload))
+            break;
+        OtaStatusPayload st;
+        memcpy(&st, buf + sizeof(MeshHeader), sizeof(st));
+        Child *c = findChild(h->src);
+        if (c && st.id == otaId && st.status <= OTA_ST_ROLLED_BACK)
+        {
+            c->otaSt = st.status;
+            c->lastSeen = now;
+        }
+        Serial.printf("OTA %04X: image %08lX status %u\n", h->src, (unsigned long)st.id, st.status);
+        break;
+    }
+
+    case (MsgType)MSG_PARAM_ACK:
+    {
+        if (h->len < sizeof(ParamAckPayload))
+            break;
+        if (Child *c = findChild(h->src))
+        {
+            c->paramVer = reinterpret_cast<ParamAckPayload *>(buf + sizeof(MeshHeader))->ver;
+            c->lastSeen = now;
+            c->answeredSinceQuery = true;
+        }
+        break;
+    }
+
+    case (MsgType)MSG_DATA_FRAG:
+    {
+        if (h->len < sizeof(FragHdr))
+            break;
+        auto *fh = reinterpret_cast<FragHdr *>(buf + sizeof(MeshHeader));
+        Child *c = allocChild(h->src);
+        if (c)
+        {
+            c->lastSeen = now;
+            c->lastRssi = rssi;
+            c->misses = 0;
+            c->answeredSinceQuery = true;
+            if (tunedFor == c->id)
+                tunedUntil = now + ADR_LINGER_MS;
         }
-        sendPacket(h->src, DATA_ACK);
+        onFragment(c, h->src, *fh, buf + sizeof(MeshHeader) + sizeof(FragHdr),
+                   (uint8_t)(h->len - sizeof(FragHdr)), now);
         break;
     }
 
     case STATE:
     {
-        auto *p = reinterpret_cast<StatusPayload *>(buf.get());
+        if (h->len < sizeof(StatusPayload))
+            break;
+        auto *p = reinterpret_cast<StatusPayload *>(buf + sizeof(MeshHeader));
         if (Child *c = allocChild(h->src))
         {
+            if (c->hops != p->hops)
+            {
+                // path changed, old estimate is meaningless
+                c->srtt = 0;
+                c->rttvar = 0;
+            }
+            // Karn: a reply to a QUERY sent after a miss is ambiguous
+            if (c->lastQuery && !c->rtoShift)
+                rttSample(*c, now - c->lastQuery);
+            c->rtoShift = 0;
             c->misses = 0;
             c->lastQuery = 0;
             c->answeredSinceQuery = true;
+            if (queryGapFor == c->id)
+                queryGapFor = GW_ID; // the round goes on
             c->lastSeen = now;
             c->lastRssi = rssi;
-            c->parent = p->parent;
+            treeSetParent(*c, p->parent);
+            bridgeState(*c, *p, rssi, snr, now);
             c->hops = p->hops;
+            tsNote(*c, TS_STATE, rssi, p->hops);
+            c->adrMisses = 0;
+            if (tunedFor == c->id)
+                tunedUntil = now + ADR_LINGER_MS; // catch data it flushes next
+            if (c->parent == GW_ID)
+            {
+                adrSample(*c, snr);
+                adrEvaluate(*c, now);
+            }
+        }
+        break;
+    }
+
+    case (MsgType)MSG_ADDR_REQ:
+    {
+        if (h->len < sizeof(JoinPayload))
+            break;
+        auto *jp = reinterpret_cast<JoinPayload *>(buf + sizeof(MeshHeader));
+        onJoinRequest(jp->addr, h->src, *jp, now);
+        if (Child *c = findChild(h->src))
+        {
+            c->lastSeen = now;
+            c->lastRssi = rssi;
         }
         break;
     }
 
     case (MsgType)MSG_CHILD_ADD:
     {
-        auto *ev = reinterpret_cast<ChildEventPayload *>(buf.get());
+        if (h->len < sizeof(ChildEventPayload))
+            break;
+        auto *ev = reinterpret_cast<ChildEventPayload *>(buf + sizeof(MeshHeader));
         if (Child *gc = allocChild(ev->child))
         {
-            gc->parent = ev->parent;
+            treeSetParent(*gc, ev->parent);
             gc->hops = ev->hops;
             gc->lastSeen = now;
             gc->misses = 0;
             gc->answeredSinceQuery = true;
+            tsNote(*gc, TS_JOIN, gc->lastRssi, ev->hops);
         }
         removePending(ev->child);
         break;
@@ -398,13 +2699,29 @@ static void handleRx()
 
     case (MsgType)MSG_CHILD_GONE:
     {
-        auto *ev = reinterpret_cast<ChildEventPayload *>(buf.get());
+        if (h->len < sizeof(ChildEventPayload))
+            break;
+        auto *ev = reinterpret_cast<ChildEventPayload *>(buf + sizeof(MeshHeader));
         if (Child *gc = findChild(ev->child))
-            eraseChild(*gc);
+        {
+            // everything below it was routed through the departed link
+            if (gc->parent == ev->parent)
+                evictSubtree(*gc);
+        }
         removePending(ev->child);
         break;
     }
 
+    case (MsgType)MSG_XOR:
+    {
+        // a relay coded one of our downlinks with an uplink for us
+        uint8_t f[sizeof(MeshHeader) + MAX_PAYLOAD];
+        const uint8_t n = ncReceive(ncSent, buf + sizeof(MeshHeader), h->len, f);
+        if (n && reinterpret_cast<MeshHeader *>(f)->type != (MsgType)MSG_XOR)
+            handleFrame(f, n, rssi, snr);
+        break;
+    }
+
     default:
     {
         if (Child *c = findChild(h->src))
@@ -419,138 +2736,331 @@ static void handleRx()
     }
 }
 
-static uint32_t lastBeacon = 0, lastQueryRound = 0;
-void meshLoopGateway()
+static void handleRx()
 {
-    handleRx();
-    uint32_t now = millis();
-
-    for (auto &p : pend)
+    if (!radioIrqTake())
+        return;
+    size_t pktLen = radio.getPacketLength();
+    const size_t MAX_FRAME = sizeof(MeshHeader) + MAX_PAYLOAD;
+    if (pktLen == 0 || pktLen > MAX_FRAME)
     {
-        if (!p.id)
-            continue;
-        if (now >= p.nextTry)
-            (void)trySendJoinAck(p.id);
+        uint8_t scratch[32];
+        (void)radio.readData(scratch, sizeof(scratch));
+        return;
+    }
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[pktLen]);
+    int16_t rc = radio.readData(buf.get(), pktLen);
+    if (rc == RADIOLIB_ERR_RX_TIMEOUT)
+        return;
+    PERF_SCOPE(PERF_RX);
+    if (rc != RADIOLIB_ERR_NONE)
+    {
+        Serial.printf("RX err %d\n", rc);
+        radio.startReceive();
+        return;
     }
+    const int16_t rssi = radio.getRSSI();
+    const float snr = radio.getSNR();
+    capture(CAP_RX, buf.get(), pktLen, rssi, snr);
+    handleFrame(buf.get(), pktLen, rssi, snr);
+}
+
+constexpr uint32_t STATUS_PERIOD_MS = 5000; // node table print and OLED refresh
+constexpr uint16_t STATUS_ROWS = 32;         // node table rows per print
+static uint32_t lastQueryRound = 0, lastStat = 0;
+static Slot statusCursor = 0; // slot the next page of the node table starts at
+
+// Node table, pending joins and queries as text, every STATUS_PERIOD_MS. A
+// large table is printed STATUS_ROWS at a time, each print continuing where
+// the last one stopped, so one print stays short at 1024 nodes.
+static void statusPrint(uint32_t now)
+{
+    if (evictedLru)
+        Serial.printf("\nLRU evictions: %lu (last %04X)\n", (unsigned long)evictedLru, lastEvictedLru);
 
-    for (auto &q : pq)
+    const uint16_t total = (uint16_t)numChildren();
+    Serial.printf("\nnodes: %u", total);
+    if (total > STATUS_ROWS)
+        Serial.printf(" (%u per print, from slot %u)", STATUS_ROWS, statusCursor);
+    Serial.println();
+    Serial.println(F("ID    P     H  SF  Ch  RSSI  Age(ms)  Miss   SRTT    RTO  Sub  Pending"));
+    Serial.println(F("----------------------------------------------------------------------"));
+    uint16_t rows = 0;
+    Slot s = total > STATUS_ROWS ? statusCursor : 0;
+    for (Slot n = 0; n < GW_MAX_NODES && rows < STATUS_ROWS; ++n, s = (Slot)((s + 1) % GW_MAX_NODES))
     {
-        if (!q.id)
+        Child &c = children[s];
+        if (!c.id)
             continue;
-        if (now >= q.nextTry)
+        ++rows;
+        bool pending = (c.lastQuery != 0);
+        const uint16_t sub = subtreeSize(c);
+        Serial.printf("%04X  %04X  %u  %2u  %2u  %4d  %7lu  %4u  %5lu  %5lu  %3u   %c\n",
+                      c.id, c.parent, c.hops, linkSf(c), c.ch, c.lastRssi,
+                      (unsigned long)(now - c.lastSeen), c.misses,
+                      (unsigned long)c.srtt, (unsigned long)queryRto(c),
+                      sub - 1, pending ? 'Y' : 'N');
+    }
+    statusCursor = s;
+
+    bool anyPend = false;
+    for (auto &p : pend)
+        if (p.id)
         {
-            if (Child *c = findChild(q.id))
-                (void)trySendQuery(*c);
-            else
-                removePendingQuery(q.id);
+            anyPend = true;
+            break;
         }
+    if (anyPend)
+    {
+        Serial.println(F("\nPENDING JOINS: id  tries  due(ms)"));
+        for (auto &p : pend)
+            if (p.id)
+            {
+                long due = (long)p.nextTry - (long)now;
+                if (due < 0)
+                    due = 0;
+                Serial.printf("               %04X   %3u   %ld\n", p.id, p.tries, due);
+            }
     }
 
+    uint16_t queued = 0;
+    for (auto &c : children)
+        if (c.id && c.queryQueued)
+        {
+            if (!queued++)
+                Serial.println(F("\nPENDING QUERIES: id    tries  due(ms)"));
+            if (queued > STATUS_ROWS)
+                continue;
+            long due = (long)c.queryRetryAt - (long)now;
+            if (due < 0)
+                due = 0;
+            Serial.printf("                  %04X   %3u   %ld\n", c.id, c.queryTries, due);
+        }
+    if (queued > STATUS_ROWS)
+        Serial.printf("                  ... %u more\n", queued - STATUS_ROWS);
+}
+
+#if GW_LIGHT_SLEEP
+// Earliest millis() at which meshLoopGateway() has work, from the same
+// conditions it checks below. Anything already due (or blocked behind a
+// retuned radio, which ends at tunedUntil) keeps the loop awake; frames and
+// console input wake it early.
+static uint32_t nextDeadline(uint32_t now)
+{
+    uint32_t next = lastStat + STATUS_PERIOD_MS + 1;
+    auto at = [&next](uint32_t t) {
+        if ((int32_t)(t - next) < 0)
+            next = t;
+    };
+    if (radioBusy())
+        at(tunedUntil);
+    for (auto &p : pend)
+        if (p.id && p.via != GW_ID)
+            at(p.nextTry);
+    if (joinBatchAt)
+        at(joinBatchAt);
+    if (radioSwitchAt)
+        at(radioSwitchAt);
+    at(lastQueryRound + queryPeriodMs + 1);
+    if (beacon.i)
+        at(beacon.start + (beacon.fired ? beacon.i : beacon.t));
     for (auto &c : children)
     {
-        if (c.id && now - c.lastSeen > CHILD_TIMEOUT_MS)
-            eraseChild(c);
+        if (!c.id)
+            continue;
+        at(c.lastSeen + childTimeoutMs + 1);
+        if (c.nextSf)
+            at(c.sfSwitchAt);
+        if (c.queryQueued)
+            at(queryGapOver(c.queryRetryAt) ? c.queryRetryAt : queryGapUntil);
+        // a held ACK that will ride on the next QUERY waits for the round
+        if (c.ackDueAt && !c.queryQueued && now - lastQueryRound + DATA_ACK_WAIT_MS < queryPeriodMs)
+            at(c.ackDueAt);
+        if (paramVer && c.paramVer != paramVer && c.paramTries < PARAM_MAX_TRIES)
+            at(c.paramRetryAt);
+        if (c.lastQuery)
+            at(c.lastQuery + queryRto(c) + 1);
     }
+    for (auto &m : down)
+        if (m.dst != GW_ID)
+            at(m.retryAt);
+    if (tsdb.n)
+        at(tsdb.bufSince + TS_FLUSH_MS);
+    if (tsJob.active)
+        at(now);
+    if (otaTx.id)
+        at(otaTx.nextAt);
+    return next;
+}
+#endif
+
+void meshLoopGateway()
+{
+    PERF_SCOPE(PERF_LOOP);
+    handleRx();
+    if (bridgeOn)
+        bridgePoll();
+    else
+        pollSerial(onCommand);
+    uint32_t now = millis();
 
-    if (now - lastQueryRound > QUERY_PERIOD_MS)
+    if (radioBusy() && (int32_t)(now - tunedUntil) >= 0)
     {
-        for (auto &c : children)
-        {
-            if (!c.id)
-                continue;
-            if (c.lastQuery || isPendingQuery(c.id))
-                continue;
-            (void)trySendQuery(c);
-        }
-        lastQueryRound = now;
+        tunedFor = 0;
+        radioTune(cfg.sf, 0);
+    }
+
+    for (auto &p : pend)
+    {
+        if (!p.id || p.via == GW_ID)
+            continue;
+        if (now >= p.nextTry && !radioBusy())
+            (void)trySendAddrAck(p);
+    }
+    if (joinBatchAt && (int32_t)(now - joinBatchAt) >= 0 && !radioBusy())
+        (void)trySendJoinBatch();
+
+    if (radioSwitchAt && (int32_t)(now - radioSwitchAt) >= 0)
+    {
+        radioSwitchAt = 0;
+        radioApply(nextSf, nextBw, nextCr);
+        // the nodes keep it too; a gateway back on the old profile would strand them
+        paramSave(paramTable, PARAM_COUNT, PF_RADIO);
     }
 
+    // one pass over the node table: deferred QUERYs, timeouts, miss windows,
+    // parameter pushes
+    const bool queryRound = (now - lastQueryRound > queryPeriodMs);
+    bool paramSent = false;
+    if (queryGapOver(now))
+        queryGapFor = GW_ID;
     for (auto &c : children)
     {
         if (!c.id)
             continue;
-        if (c.lastQuery && (now - c.lastQuery > QUERY_TIMEOUT_MS))
+
+        if (now - c.lastSeen > childTimeoutMs)
+        {
+            if (branchSilentSince(c, now - childTimeoutMs))
+                evictSubtree(c);
+            else
+                eraseChild(c);
+            continue;
+        }
+
+        if (c.nextSf && (int32_t)(now - c.sfSwitchAt) >= 0)
+            adrApply(c, c.nextSf, c.nextCh);
+
+        if (c.queryQueued)
+        {
+            if (now >= c.queryRetryAt && !radioBusy() && queryGapOver(millis()))
+                (void)trySendQuery(c);
+        }
+        else if (queryRound && !c.lastQuery)
+        {
+            if (radioBusy() || !queryGapOver(millis()))
+            {
+                // radio is on someone else's SF, or the last QUERY is still
+                // out; poll as soon as that is over
+                c.queryQueued = true;
+                c.queryRetryAt = now;
+            }
+            else
+            {
+                (void)trySendQuery(c);
+            }
+        }
+
+        // owed data ACK with no QUERY coming soon: send it on its own
+        if (c.ackDueAt && (int32_t)(now - c.ackDueAt) >= 0 && !c.queryQueued &&
+            now - lastQueryRound + DATA_ACK_WAIT_MS < queryPeriodMs && !radioBusy())
+        {
+            int16_t st = trySendDataAck(c);
+            if (st != RADIOLIB_ERR_NONE)
+                c.ackDueAt = (st == ERR_TX_DEFERRED) ? dcFreeAt() + 50 : now + 200;
+        }
+
+        // one PARAM_SET per pass, so polling is not starved
+        if (paramVer && !paramSent && c.paramVer != paramVer && c.paramTries < PARAM_MAX_TRIES &&
+            (int32_t)(now - c.paramRetryAt) >= 0 && !radioBusy())
+        {
+            paramSent = true;
+            trySendParams(c, now);
+        }
+
+        // signed: a QUERY sent earlier in this pass left the radio after `now`
+        if (c.lastQuery && (int32_t)(now - c.lastQuery) > (int32_t)queryRto(c))
         {
             bool unanswered = !c.answeredSinceQuery;
+            const uint32_t sentAt = c.lastQuery;
             c.lastQuery = 0;
             c.answeredSinceQuery = false;
             if (unanswered)
             {
-                if (++c.misses > MAX_MISSES)
-                    eraseChild(c);
+                if (c.rtoShift < QUERY_RTO_MAX_SHIFT)
+                    ++c.rtoShift;
+                ++c.misses;
+                tsNote(c, TS_MISS, c.lastRssi, c.hops);
+                if ((c.sf || c.ch) && ++c.adrMisses >= ADR_ROLLBACK_MISSES)
+                {
+                    // node times out on its side too and returns to the base link
+                    Serial.printf("ADR %04X: silent on SF%u/ch%u, rollback\n", c.id, linkSf(c), c.ch);
+                    adrApply(c, cfg.sf, 0);
+                    c.adrHoldUntil = now + ADR_HOLDOFF_MS;
+                }
+                // A relay whose whole branch went quiet for one window is
+                // gone; don't keep polling its descendants one by one.
+                const bool dark = (c.firstChild != NO_SLOT) && branchSilentSince(c, sentAt);
+                if (dark || c.misses > maxMisses)
+                {
+                    uint16_t n = evictSubtree(c);
+                    if (n > 1)
+                        Serial.printf("evicted subtree of %u nodes\n", n);
+                }
             }
         }
     }
+    if (queryRound)
+        lastQueryRound = now;
 
-    if (numChildren() == 0 && now - lastBeacon > BEACON_PERIOD_MS)
+    downPump(now);
+    otaPump(now);
+    bridgeDrain();
+    tsPoll(tsdb, now);
+    tsJobPump();
+
+    // sendPacket stamps gwTime; a deferred beacon is just skipped
+    if (trickleDue(beacon, now, beaconPeriodMs) && !radioBusy())
     {
-        uint8_t seq = 0;
-        (void)sendPacket(0xFF, BEACON, &seq, 1);
-        lastBeacon = now;
+        uint8_t pl[MAX_PAYLOAD];
+        BeaconPayload b{0, 0, paramVer};
+        memcpy(pl, &b, sizeof(b));
+        memcpy(pl + sizeof(b), paramBody, paramLen);
+        (void)sendPacket(ADDR_BCAST, BEACON, pl, (uint8_t)(sizeof(b) + paramLen));
     }
 
-    static uint32_t lastStat = 0;
-    if (now - lastStat > 5000)
+    if (now - lastStat > STATUS_PERIOD_MS)
     {
+        PERF_SCOPE(PERF_SERIAL);
         int16_t worst = 0;
         for (auto &c : children)
             if (c.id && c.lastRssi < worst)
                 worst = c.lastRssi;
-        oledPrintfLines(0, 10, 12, "Nodes:%u\nWorst:%ddBm", numChildren(), worst);
-
-        Serial.println(F("\nID  P  H  RSSI  Age(ms)  Miss  Pending"));
-        Serial.println(F("---------------------------------------"));
-        for (auto &c : children)
-            if (c.id)
-            {
-                bool pending = (c.lastQuery != 0);
-                Serial.printf("%02X  %02X  %u  %4d  %7lu  %4u   %c\n",
-                              c.id, c.parent, c.hops, c.lastRssi,
-                              (unsigned long)(now - c.lastSeen), c.misses, pending ? 'Y' : 'N');
-            }
-
-        bool anyPend = false;
-        for (auto &p : pend)
-            if (p.id)
-            {
-                anyPend = true;
-                break;
-            }
-        if (anyPend)
-        {
-            Serial.println(F("\nPENDING JOINS: id  tries  due(ms)"));
-            for (auto &p : pend)
-                if (p.id)
-                {
-                    long due = (long)p.nextTry - (long)now;
-                    if (due < 0)
-                        due = 0;
-                    Serial.printf("               %02X   %3u   %ld\n", p.id, p.tries, due);
-                }
-        }
-
-        bool anyPQ = false;
-        for (auto &q : pq)
-            if (q.id)
-            {
-                anyPQ = true;
-                break;
-            }
-        if (anyPQ)
-        {
-            Serial.println(F("\nPENDING QUERIES: id  tries  due(ms)"));
-            for (auto &q : pq)
-                if (q.id)
-                {
-                    long due = (long)q.nextTry - (long)now;
-                    if (due < 0)
-                        due = 0;
-                    Serial.printf("                  %02X   %3u   %ld\n", q.id, q.tries, due);
-                }
-        }
-
+        if (subDirty)
+            subtreeRefresh();
+        oledPrintfLines(0, 10, 12, "Nodes:%u\nWorst:%ddBm\nDepth:%u", numChildren(), worst, treeDepth);
+        if (bridgeOn)
+            bridgeStatus();
+        else
+            statusPrint(now);
         lastStat = now;
     }
+
+#if GW_LIGHT_SLEEP
+    // a capture or bridge host is on the USB console, which sleep would drop
+    if (!capturing && !bridgeOn)
+        powerSleepUntil(nextDeadline(millis()));
+#endif
 }
 
 #endif
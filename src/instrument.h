@@ -0,0 +1,118 @@
+#pragma once
+#include <Arduino.h>
+
+// Hot-path instrumentation. The ESP32 cycle counter times loop passes, the
+// handling of a received frame, blocking radio.transmit() calls and bulk
+// serial output into log2 histograms. Fixed tables report their
+// high-watermark and how many insertions they refused. "perf" on the serial
+// console dumps everything as one JSON line; "perf reset" clears it.
+// ENABLE_PERF=0 compiles it all out. Each translation unit keeps its own
+// state, like the duty-cycle buckets.
+#ifndef ENABLE_PERF
+#define ENABLE_PERF 1
+#endif
+
+#if ENABLE_PERF
+enum PerfId : uint8_t
+{
+    PERF_LOOP,
+    PERF_RX,
+    PERF_TX,
+    PERF_SERIAL,
+    PERF_COUNT
+};
+// bucket i counts durations under 2^i us (at least 2^(i-1)); the last one
+// is open-ended
+constexpr uint8_t PERF_BUCKETS = 22;
+
+struct PerfHist
+{
+    uint32_t n;
+    uint32_t maxUs;
+    uint64_t sumUs;
+    uint32_t b[PERF_BUCKETS];
+};
+static PerfHist perfHist[PERF_COUNT];
+static const char *const PERF_NAMES[PERF_COUNT] = {"loop", "rx", "tx", "serial"};
+
+// A fixed table: capacity, most entries ever in use, insertions refused
+struct PerfMark
+{
+    const char *name;
+    uint16_t cap;
+    uint16_t high;
+    uint32_t overflow;
+};
+
+static inline void perfRecord(uint8_t id, uint32_t cycles)
+{
+    const uint32_t us = cycles / ESP.getCpuFreqMHz();
+    PerfHist &p = perfHist[id];
+    ++p.n;
+    p.sumUs += us;
+    if (us > p.maxUs)
+        p.maxUs = us;
+    const uint8_t b = us ? (uint8_t)(32 - __builtin_clz(us)) : 0;
+    ++p.b[b < PERF_BUCKETS ? b : PERF_BUCKETS - 1];
+}
+
+class PerfScope
+{
+public:
+    explicit PerfScope(uint8_t id) : id(id), c0(ESP.getCycleCount()) {}
+    ~PerfScope() { perfRecord(id, ESP.getCycleCount() - c0); }
+
+private:
+    uint8_t id;
+    uint32_t c0;
+};
+
+static inline void perfLevel(PerfMark &m, uint16_t used)
+{
+    if (used > m.high)
+        m.high = used;
+}
+
+static void perfDump(const char *role, const PerfMark *marks, size_t nMarks)
+{
+    Serial.printf("{\"perf\":{\"role\":\"%s\",\"hist\":\"log2_us\"", role);
+    for (uint8_t i = 0; i < PERF_COUNT; ++i)
+    {
+        const PerfHist &p = perfHist[i];
+        Serial.printf(",\"%s\":{\"n\":%lu,\"avg_us\":%lu,\"max_us\":%lu,\"b\":[", PERF_NAMES[i],
+                      (unsigned long)p.n, (unsigned long)(p.n ? p.sumUs / p.n : 0), (unsigned long)p.maxUs);
+        uint8_t last = PERF_BUCKETS;
+        while (last && !p.b[last - 1])
+            --last;
+        for (uint8_t b = 0; b < last; ++b)
+            Serial.printf("%s%lu", b ? "," : "", (unsigned long)p.b[b]);
+        Serial.print("]}");
+    }
+    Serial.print(",\"tables\":{");
+    for (size_t i = 0; i < nMarks; ++i)
+        Serial.printf("%s\"%s\":{\"cap\":%u,\"high\":%u,\"overflow\":%lu}", i ? "," : "", marks[i].name,
+                      marks[i].cap, marks[i].high, (unsigned long)marks[i].overflow);
+    Serial.printf("},\"heap\":{\"free\":%lu,\"min_free\":%lu,\"max_alloc\":%lu},\"stack_free\":%u}}\n",
+                  (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMinFreeHeap(),
+                  (unsigned long)ESP.getMaxAllocHeap(), (unsigned)uxTaskGetStackHighWaterMark(nullptr));
+}
+
+static void perfReset(PerfMark *marks, size_t nMarks)
+{
+    memset(perfHist, 0, sizeof(perfHist));
+    for (size_t i = 0; i < nMarks; ++i)
+    {
+        marks[i].high = 0;
+        marks[i].overflow = 0;
+    }
+}
+
+// PERF_LEVEL / PERF_OVERFLOW index the translation unit's own perfMarks[]
+#define PERF_SCOPE(id) PerfScope perfScope_##id(id)
+#define PERF_LEVEL(mark, used) perfLevel(perfMarks[mark], (uint16_t)(used))
+#define PERF_OVERFLOW(mark) (++perfMarks[mark].overflow)
+#else
+#define PERF_SCOPE(id)
+#define PERF_LEVEL(mark, used) do { } while (0)
+#define PERF_OVERFLOW(mark) do { } while (0)
+#endif
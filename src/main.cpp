@@ -12,18 +12,11 @@
 #include "protocol.h"
 
 SX1262 radio = new Module(LORA_CS, LORA_DIO1, LORA_RST, LORA_BUSY);
-struct LoraCfg
-{
-  float freq;
-  float bw;
-  uint8_t sf;
-  uint8_t cr;
-  uint8_t sw;
-} cfg;
+LoraCfg cfg;
 
 int16_t initRadio()
 {
-  cfg = {868.0, 125.0, 12, 5, 0x12};
+  cfg = {868.0, (float)PROFILE.bwKHz, PROFILE.sf, PROFILE.cr, 0x12};
 
   int16_t st = radio.begin(cfg.freq);
   if (st)
@@ -46,6 +39,10 @@ void meshLoopGateway();
 #else
 void meshSetupNode();
 void meshLoopNode();
+bool meshSendLarge(const uint8_t *data, uint16_t len);
+bool meshRecordSample(const int32_t *v, uint8_t nch);
+bool meshNetworkTime(uint32_t &t);
+void meshOnDownlink(void (*fn)(const uint8_t *data, uint8_t len));
 #endif
 
 void setup()
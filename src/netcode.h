@@ -0,0 +1,163 @@
+#pragma once
+#include <Arduino.h>
+#include <algorithm>
+#include "protocol.h"
+
+// Two-way network coding at relays ("netcode" param). A relay that holds
+// an uplink frame from one child and a downlink frame for that same child
+// sends both as a single MSG_XOR broadcast. The parent still holds the
+// downlink frame it sent and XORs it out to get the uplink one. The child
+// does the same with its uplink frame. Two transmissions become one, and
+// on a polled line that applies on every hop a QUERY passes while the
+// STATE replies come back up.
+//
+// Hops and the network timestamp change on every hop, so they are zeroed
+// before the XOR and sent in XorHdr. The hash in XorHdr checks the decoded
+// frame. An end that no longer holds its own frame drops the XOR, and the
+// hop ACK retries (node.cpp) deliver the other frame as usual. So a relay
+// only codes forwards that get those retries: both next hops relay the
+// frame further. The gateway and a destination child send no echo, so a
+// frame to either always goes out plain.
+constexpr uint8_t NC_MAX_FRAME = MAX_PAYLOAD - sizeof(XorHdr); // header + payload that still codes
+constexpr uint8_t NC_SENT_NODE = 8; // own frames kept for decoding: a node's last few ...
+constexpr uint8_t NC_SENT_GW = 32;  // ... and a whole poll round of the gateway's
+
+static inline bool ncTimed(const uint8_t *f)
+{
+    const auto &h = *reinterpret_cast<const MeshHeader *>(f);
+    const int8_t ts = gwTimeOffset(h.type);
+    return ts >= 0 && h.len >= ts + sizeof(uint32_t);
+}
+
+// Zeroes hops and the network timestamp in place; returns the timestamp.
+static uint32_t ncCanonical(uint8_t *f)
+{
+    auto &h = *reinterpret_cast<MeshHeader *>(f);
+    h.hops = 0;
+    uint32_t t = 0;
+    if (!ncTimed(f))
+        return t;
+    uint8_t *ts = f + sizeof(MeshHeader) + gwTimeOffset(h.type);
+    memcpy(&t, ts, sizeof(t));
+    memset(ts, 0, sizeof(t));
+    return t;
+}
+
+static inline uint8_t ncFrameLen(const uint8_t *f)
+{
+    return (uint8_t)(sizeof(MeshHeader) + reinterpret_cast<const MeshHeader *>(f)->len);
+}
+
+// MSG_XOR body for two frames as they would go out (hops and time final)
+// into pl; returns its length, 0 if they do not code together.
+static uint8_t ncEncode(const uint8_t *a, const uint8_t *b, uint8_t *pl)
+{
+    const uint8_t la = ncFrameLen(a), lb = ncFrameLen(b);
+    if (la > NC_MAX_FRAME || lb > NC_MAX_FRAME || (ncTimed(a) && ncTimed(b)))
+        return 0;
+    uint8_t ca[NC_MAX_FRAME] = {0}, cb[NC_MAX_FRAME] = {0};
+    memcpy(ca, a, la);
+    memcpy(cb, b, lb);
+    const auto &ha = *reinterpret_cast<const MeshHeader *>(a);
+    const auto &hb = *reinterpret_cast<const MeshHeader *>(b);
+    XorHdr x;
+    x.hash[0] = frameHash(ha, a + sizeof(MeshHeader));
+    x.hash[1] = frameHash(hb, b + sizeof(MeshHeader));
+    x.hops[0] = ha.hops;
+    x.hops[1] = hb.hops;
+    x.gwTime = ncCanonical(ca) | ncCanonical(cb); // at most one is set
+    memcpy(pl, &x, sizeof(x));
+    const uint8_t n = std::max(la, lb);
+    for (uint8_t i = 0; i < n; ++i)
+        pl[sizeof(x) + i] = ca[i] ^ cb[i];
+    return (uint8_t)(sizeof(x) + n);
+}
+
+// Recovers the other frame of a MSG_XOR body into out, given `own`, the
+// frame with hash x.hash[which]; returns its length, 0 if it does not check.
+static uint8_t ncDecode(const uint8_t *pl, uint8_t len, const uint8_t *own, uint8_t which, uint8_t *out)
+{
+    XorHdr x;
+    if (len <= sizeof(x) || which > 1)
+        return 0;
+    memcpy(&x, pl, sizeof(x));
+    const uint8_t n = (uint8_t)(len - sizeof(x)), lo = ncFrameLen(own);
+    if (lo > n || n > NC_MAX_FRAME)
+        return 0;
+    uint8_t co[NC_MAX_FRAME] = {0};
+    memcpy(co, own, lo);
+    ncCanonical(co);
+    for (uint8_t i = 0; i < n; ++i)
+        out[i] = pl[sizeof(x) + i] ^ co[i];
+    auto &h = *reinterpret_cast<MeshHeader *>(out);
+    if (h.magic != HDR_MAGIC || sizeof(MeshHeader) + h.len > n)
+        return 0;
+    h.hops = x.hops[!which];
+    if (ncTimed(out))
+        memcpy(out + sizeof(MeshHeader) + gwTimeOffset(h.type), &x.gwTime, sizeof(x.gwTime));
+    if (frameHash(h, out + sizeof(MeshHeader)) != x.hash[!which])
+        return 0;
+    return ncFrameLen(out);
+}
+
+// The last N unicast frames a device sent, looked up by frameHash when a
+// relay codes one of them
+template <uint8_t N>
+struct NcSent
+{
+    uint32_t hash[N];
+    uint8_t frame[N][NC_MAX_FRAME];
+    uint8_t next;
+    uint32_t coded, decoded, undecodable; // for the console
+};
+
+template <uint8_t N>
+static void ncRemember(NcSent<N> &s, const uint8_t *f)
+{
+    const uint8_t n = ncFrameLen(f);
+    const auto &h = *reinterpret_cast<const MeshHeader *>(f);
+    if (n > NC_MAX_FRAME || h.dst == ADDR_BCAST)
+        return;
+    const uint32_t hash = frameHash(h, f + sizeof(MeshHeader));
+    // a retransmission refreshes its entry rather than taking a second one
+    uint8_t i = 0;
+    while (i < N && !(s.hash[i] == hash && s.frame[i][0] == HDR_MAGIC))
+        ++i;
+    if (i == N)
+    {
+        i = s.next;
+        s.next = (uint8_t)((s.next + 1) % N);
+    }
+    s.hash[i] = hash;
+    memcpy(s.frame[i], f, n);
+}
+
+// Decodes a MSG_XOR body against the frames in s into out; returns the
+// frame's length, 0 if we hold neither or it does not check.
+template <uint8_t N>
+static uint8_t ncReceive(NcSent<N> &s, const uint8_t *pl, uint8_t len, uint8_t *out)
+{
+    XorHdr x;
+    if (len <= sizeof(x))
+        return 0;
+    memcpy(&x, pl, sizeof(x));
+    for (uint8_t which = 0; which < 2; ++which)
+        for (uint8_t i = 0; i < N; ++i)
+            if (s.hash[i] == x.hash[which] && s.frame[i][0] == HDR_MAGIC)
+            {
+                const uint8_t n = ncDecode(pl, len, s.frame[i], which, out);
+                if (n)
+                    ++s.decoded;
+                else
+                    ++s.undecodable;
+                return n;
+            }
+    return 0;
+}
+
+template <uint8_t N>
+static void ncPrint(const NcSent<N> &s, bool on)
+{
+    Serial.printf("{\"netcode\":{\"on\":%d,\"coded\":%lu,\"decoded\":%lu,\"undecodable\":%lu}}\n", on,
+                  (unsigned long)s.coded, (unsigned long)s.decoded, (unsigned long)s.undecodable);
+}
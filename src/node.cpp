@@ -1,30 +1,101 @@
 #include "protocol.h"
+#include "channels.h"
+#include "samples.h"
+#include "instrument.h"
+#include "console.h"
+#include "params.h"
+#include "trickle.h"
+#include "ota.h"
+#include "netcode.h"
 #include <RadioLib.h>
 #include <Preferences.h>
+#include <LittleFS.h>
+#include <algorithm>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
 
 #ifndef ENABLE_TEST_TX
 #define ENABLE_TEST_TX 0
 #endif
+// Sample batching: built-in battery/parent-RSSI sampler period (0 = off),
+// batch size target and the longest a reading may wait for its batch.
+#ifndef SAMPLE_PERIOD_MS
+#define SAMPLE_PERIOD_MS 0
+#endif
+#ifndef SAMPLE_FLUSH_BYTES
+#define SAMPLE_FLUSH_BYTES UP_MAX_DATA
+#endif
+#ifndef SAMPLE_MAX_LATENCY_MS
+#define SAMPLE_MAX_LATENCY_MS 600000
+#endif
 
 extern SX1262 radio;
+extern LoraCfg cfg;
 #define LED_BUILTIN 35
 
-constexpr uint32_t LOST_PARENT_MS = 300000;
-constexpr uint32_t CHILD_SILENT_MS = 180000;
-constexpr uint8_t MAX_CHILDREN = 10;
+// Runtime parameters (see params.h and paramTable below); the initialisers
+// are the defaults.
+static uint32_t lostParentMs = PROFILE.livenessMs;
+static uint32_t childSilentMs = PROFILE.livenessMs;
+static uint32_t testPeriodMs = PROFILE.testPeriodMs;
+constexpr uint8_t MAX_CHILDREN = PROFILE.maxChildren;
+constexpr uint8_t MAX_DESC = PROFILE.maxDesc; // descendants a relay routes to
+constexpr uint8_t MAX_TXQ = PROFILE.maxTxq;
+constexpr uint8_t MAX_HELD_JOINS = 4;
+constexpr uint8_t UP_WINDOW = PROFILE.upWindow; // unacknowledged DATA_UP frames
+
+#if ENABLE_PERF
+enum : uint8_t
+{
+    MARK_CHILDREN,
+    MARK_DESC,
+    MARK_TXQ,
+    MARK_HELD,
+    MARK_UPQ,
+    MARK_COUNT
+};
+static PerfMark perfMarks[MARK_COUNT] = {
+    {"children", MAX_CHILDREN, 0, 0},
+    {"desc", MAX_DESC, 0, 0},
+    {"txq", MAX_TXQ, 0, 0},
+    {"held_joins", MAX_HELD_JOINS, 0, 0},
+    {"upq", UP_WINDOW, 0, 0},
+};
+#endif
 
 static uint32_t nextJoinAt = 0;
 static uint32_t joinAckDeadline = 0;
-static uint8_t joinParentTrying = 0xFF;
+static addr_t joinParentTrying = ADDR_NONE;
 
 constexpr uint32_t JOIN_RETRY_MS = 5000;
 constexpr uint32_t JOIN_ACK_TIMEOUT_MS = 10000;
+constexpr uint32_t JOIN_BACKOFF_MAX_MS = 120000;
+static uint8_t joinAttempts = 0;
+
+// With no candidate parent at all, a joiner solicits beacons with an empty
+// BEACON, backing off to JOIN_RETRY_MS << SOLICIT_MAX_SHIFT.
+constexpr uint8_t SOLICIT_MAX_SHIFT = 6;
+static uint8_t solicits = 0;
+static uint32_t nextSolicitAt = 0;
+
+// Equal-jitter exponential backoff: nodes powered up together spread their
+// retries instead of colliding on the same JOIN_RETRY_MS tick.
+static uint32_t joinBackoff()
+{
+    uint32_t cap = JOIN_RETRY_MS << std::min<uint8_t>(joinAttempts, 5);
+    if (cap > JOIN_BACKOFF_MAX_MS)
+        cap = JOIN_BACKOFF_MAX_MS;
+    return cap / 2 + (uint32_t)random(0, cap / 2 + 1);
+}
 
 #if ENABLE_TEST_TX
-static constexpr uint32_t TEST_PERIOD_MS = 90000;
 static uint32_t lastTestTx = 0;
 static uint32_t testSeq = 0;
+static uint16_t testBoot = 0; // test_hdr_t.boot, so the gateway sees a reboot at once
+#endif
 
+#if ENABLE_TEST_TX || SAMPLE_PERIOD_MS
 #if (defined(TBEAM_S3_NODE) || defined(HELTEC_V3_NODE)) && defined(ROLE_NODE)
 #include "XPowersAXP2101.tpp"
 #include "XPowersLibInterface.hpp"
@@ -43,98 +114,31 @@ static inline uint16_t battery_mV() { return 0; }
 #endif
 #endif
 
-#ifndef MAX_HOPS
-#define MAX_HOPS 3
-#endif
-
-static constexpr int16_t ERR_TX_DEFERRED = 1;
-static constexpr uint32_t DC_WINDOW_MS = 3600000UL;
-static constexpr uint32_t DC_CAP_MS = 36000UL;
-static constexpr int32_t DC_BORROW_MS = 12000;
-
-static uint32_t dc_free_at = 0;
-static int32_t dc_tokens_ms = (int32_t)DC_CAP_MS;
-static uint32_t dc_last_ref_ms = 0;
-static uint16_t dc_ref_rem = 0;
-
-static inline void dcRefill(uint32_t now)
-{
-    if (!dc_last_ref_ms)
-    {
-        dc_last_ref_ms = now;
-        return;
-    }
-    uint32_t elapsed = now - dc_last_ref_ms;
-    dc_last_ref_ms = now;
-    uint32_t accum = dc_ref_rem + (elapsed % 100);
-    uint32_t add = elapsed / 100;
-    if (accum >= 100)
-    {
-        add += 1;
-        accum -= 100;
-    }
-    dc_ref_rem = (uint16_t)accum;
-    dc_tokens_ms += (int32_t)add;
-    if (dc_tokens_ms > (int32_t)DC_CAP_MS)
-        dc_tokens_ms = (int32_t)DC_CAP_MS;
-}
-
-static inline bool dcReady()
-{
-    return millis() >= dc_free_at;
-}
-
-static int16_t transmitWithDC(const uint8_t *buf, size_t len)
-{
-    uint32_t now = millis();
-    if (!dcReady())
-        return ERR_TX_DEFERRED;
-    dcRefill(now);
-    uint32_t t0 = millis();
-    int16_t st = radio.transmit(buf, len);
-    uint32_t t1 = millis();
-    if (st == RADIOLIB_ERR_NONE)
-    {
-        uint32_t on = (t1 > t0) ? (t1 - t0) : 1;
-        dc_tokens_ms -= (int32_t)on;
-        if (dc_tokens_ms < -DC_BORROW_MS)
-        {
-            int32_t deficit = (-DC_BORROW_MS - dc_tokens_ms);
-            dc_free_at = t1 + (uint32_t)deficit * 100UL;
-        }
-        else
-        {
-            dc_free_at = t1;
-        }
-        radio.startReceive();
-    }
-    return st;
-}
-
 struct Cand
 {
-    uint8_t id = 0xFF;
+    addr_t id = ADDR_NONE;
     int16_t rssi = -127;
     uint8_t hops = 0xFF;
+    uint8_t depth = 0xFF; // its distance to the gateway, from its BEACON
     uint32_t lastSeen = 0;
 };
 static Cand cand[MAX_CAND];
 
 struct Child
 {
-    uint8_t id = 0;
+    addr_t id = 0;
     uint32_t lastSeen = 0;
 };
 static Child children[MAX_CHILDREN];
 
-static Child *findChild(uint8_t id)
+static Child *findChild(addr_t id)
 {
     for (auto &c : children)
-        if (c.id == id)
+        if (c.id && c.id == id)
             return &c;
     return nullptr;
 }
-static bool isChild(uint8_t id) { return findChild(id); }
+static bool isChild(addr_t id) { return findChild(id); }
 static int childCount()
 {
     int n = 0;
@@ -143,20 +147,26 @@ static int childCount()
             ++n;
     return n;
 }
-static bool addChildLocal(uint8_t id)
+static bool addChildLocal(addr_t id)
 {
-    if (isChild(id) || childCount() >= MAX_CHILDREN)
+    if (isChild(id))
+        return false;
+    if (childCount() >= MAX_CHILDREN)
+    {
+        PERF_OVERFLOW(MARK_CHILDREN);
         return false;
+    }
     for (auto &c : children)
         if (!c.id)
         {
             c.id = id;
             c.lastSeen = millis();
+            PERF_LEVEL(MARK_CHILDREN, childCount());
             return true;
         }
     return false;
 }
-static void removeChildLocal(uint8_t id)
+static void removeChildLocal(addr_t id)
 {
     for (auto &c : children)
         if (c.id == id)
@@ -167,47 +177,146 @@ static void removeChildLocal(uint8_t id)
 }
 
 static Preferences prefs;
-static uint8_t myId = 0;
-static uint8_t parentId = 0xFF;
+static addr_t myId = ADDR_UNASSIGNED;
+static uint8_t myMac[6];
+static addr_t parentId = ADDR_NONE;
 static int16_t parentRssi = -140;
 static uint32_t lastParentRx = 0;
 static uint8_t myHopToGW = 0xFF;
 
-#ifndef MSG_CHILD_ADD
-enum : uint8_t
+// Nodes deeper in our subtree, learned from the CHILD_ADD reports we relay
+// up. `via` is the direct child they hang under.
+struct Desc
 {
-    MSG_CHILD_ADD = 0xA1,
-    MSG_CHILD_GONE = 0xA2,
-    MSG_JOIN_NACK = 0xA3
+    addr_t id = 0;
+    addr_t via = 0;
+    uint32_t lastSeen = 0;
 };
-#endif
+static Desc desc[MAX_DESC];
 
-struct __attribute__((packed)) ChildEventPayload
+static Desc *findDesc(addr_t id)
 {
-    uint8_t child;
-    uint8_t parent;
-    uint8_t hops;
+    for (auto &d : desc)
+        if (d.id && d.id == id)
+            return &d;
+    return nullptr;
+}
+static inline bool inSubtree(addr_t id) { return isChild(id) || findDesc(id); }
+static addr_t viaFor(addr_t id)
+{
+    if (isChild(id))
+        return id;
+    Desc *d = findDesc(id);
+    return d ? d->via : ADDR_NONE;
+}
+static void learnDesc(addr_t id, addr_t via)
+{
+    if (!id || id >= ADDR_UNASSIGNED || id == myId || isChild(id) || via == ADDR_NONE)
+        return;
+    Desc *d = findDesc(id);
+    for (uint8_t i = 0; !d && i < MAX_DESC; ++i)
+        if (!desc[i].id)
+            d = &desc[i];
+    if (!d)
+    {
+        PERF_OVERFLOW(MARK_DESC);
+        d = &desc[0];
+        for (auto &o : desc)
+            if (o.lastSeen < d->lastSeen)
+                d = &o;
+    }
+    d->id = id;
+    d->via = via;
+    d->lastSeen = millis();
+}
+static void forgetDesc(addr_t id)
+{
+    if (Desc *d = findDesc(id))
+        d->id = 0;
+}
+// a child left: so did everything below it
+static void forgetVia(addr_t via)
+{
+    for (auto &d : desc)
+        if (d.via == via)
+            d.id = 0;
+}
+
+// Joins this relay is holding while the gateway assigns the address
+struct HeldJoin
+{
+    bool in_use = false;
+    uint8_t mac[6];
+    addr_t replyTo;
+    uint32_t since;
 };
+static HeldJoin heldJoins[MAX_HELD_JOINS];
 
-#ifndef MAX_PAYLOAD
-#define MAX_PAYLOAD 64
-#endif
-constexpr uint8_t MAX_TXQ = 16;
+static HeldJoin *findHeldJoin(const uint8_t mac[6])
+{
+    for (auto &j : heldJoins)
+        if (j.in_use && !memcmp(j.mac, mac, 6))
+            return &j;
+    return nullptr;
+}
+static bool holdJoin(const uint8_t mac[6], addr_t replyTo)
+{
+    HeldJoin *j = findHeldJoin(mac);
+    for (uint8_t i = 0; !j && i < MAX_HELD_JOINS; ++i)
+        if (!heldJoins[i].in_use || millis() - heldJoins[i].since > JOIN_ACK_TIMEOUT_MS)
+            j = &heldJoins[i];
+    if (!j)
+    {
+        PERF_OVERFLOW(MARK_HELD);
+        return false;
+    }
+    j->in_use = true;
+    memcpy(j->mac, mac, 6);
+    j->replyTo = replyTo;
+    j->since = millis();
+    return true;
+}
 
 struct PendingTx
 {
     bool in_use = false;
-    uint8_t src, dst, hops;
+    addr_t src, dst;
+    uint8_t hops;
     MsgType type;
     uint8_t len;
     uint8_t data[MAX_PAYLOAD];
     uint32_t nextTry = 0;
     uint8_t tries = 0;
+    uint32_t hash = 0;  // frameHash, to match the next hop's forward
+    bool echo = false;  // next hop relays it: wait to overhear that
+    uint8_t retx = 0;   // transmissions so far while waiting
+    uint32_t rxAt = 0;  // forwarded frame: when we received it
 };
 static PendingTx txq[MAX_TXQ];
 
-static bool enqueueTx(uint8_t src, uint8_t dst, uint8_t hops, MsgType type,
-                      const uint8_t *pl, uint8_t len, uint32_t when)
+// Hop-by-hop implicit ACK. When the next hop is a relay rather than the
+// destination, hearing it forward our frame (same identity, one hop
+// further) acknowledges it. Until then the frame stays in txq and is sent
+// again after one echo window, at most HOP_MAX_RETX times. Links straight
+// to the gateway are covered by its own replies instead.
+constexpr uint8_t HOP_MAX_RETX = 2;
+constexpr uint32_t HOP_ACK_SLACK_MS = 400;
+
+static bool expectsEcho(addr_t dst)
+{
+    if (findDesc(dst))
+        return true; // downlink through a child relay
+    return dst == GW_ID && parentId != GW_ID && parentId != ADDR_NONE;
+}
+// The relay's forward takes one airtime; allow as much again for whatever
+// it had queued. Relays always stay on the base SF.
+static uint32_t echoWindowMs(uint8_t len)
+{
+    return 2 * loraAirtimeMs(cfg.sf, cfg.bw, cfg.cr, sizeof(MeshHeader) + len) + HOP_ACK_SLACK_MS;
+}
+
+static PendingTx *enqueueTx(addr_t src, addr_t dst, uint8_t hops, MsgType type,
+                            const uint8_t *pl, uint8_t len, uint32_t when, uint32_t rxAt = 0)
 {
     for (auto &e : txq)
     {
@@ -223,24 +332,147 @@ static bool enqueueTx(uint8_t src, uint8_t dst, uint8_t hops, MsgType type,
                 memcpy(e.data, pl, e.len);
             e.nextTry = when;
             e.tries = 0;
-            return true;
+            MeshHeader h{HDR_MAGIC, src, dst, hops, type, e.len};
+            e.hash = frameHash(h, e.data);
+            e.echo = expectsEcho(dst);
+            e.retx = 0;
+            e.rxAt = rxAt;
+            PERF_LEVEL(MARK_TXQ, std::count_if(txq, txq + MAX_TXQ, [](const PendingTx &t) { return t.in_use; }));
+            return &e;
         }
     }
+    PERF_OVERFLOW(MARK_TXQ);
+    return nullptr;
+}
+
+// Overheard frame: is it the next hop forwarding one of ours?
+static bool hopAcked(uint32_t hash, uint8_t hops)
+{
+    for (auto &e : txq)
+    {
+        if (!e.in_use || !e.echo || !e.retx || e.hash != hash || hops != e.hops + 1)
+            continue;
+        if (e.retx > 1)
+            Serial.printf("hop ACK 0x%04X after %u tries\n", e.dst, e.retx);
+        e.in_use = false;
+        if (e.dst == GW_ID)
+            lastParentRx = millis(); // the parent is alive, it just relayed
+        return true;
+    }
     return false;
 }
 
-static bool trySendOne(PendingTx &e)
+// Relay side of network time: add the previous hop's airtime and how long
+// we held the frame, right before it goes out again. Relays are always on
+// the base SF.
+static void gwTimeAdvance(uint8_t *frame, uint32_t rxAt)
+{
+    const auto &h = *reinterpret_cast<MeshHeader *>(frame);
+    const int8_t ts = gwTimeOffset(h.type);
+    if (!rxAt || ts < 0 || h.len < ts + sizeof(uint32_t))
+        return;
+    uint32_t t;
+    memcpy(&t, frame + sizeof(MeshHeader) + ts, sizeof(t));
+    t += loraAirtimeMs(cfg.sf, cfg.bw, cfg.cr, sizeof(MeshHeader) + h.len) + (millis() - rxAt);
+    memcpy(frame + sizeof(MeshHeader) + ts, &t, sizeof(t));
+}
+
+// The frame of a txq entry as it goes out now; returns its length.
+static uint8_t txFrame(const PendingTx &e, uint8_t *buf)
 {
     MeshHeader h{HDR_MAGIC, e.src, e.dst, e.hops, e.type, e.len};
-    uint8_t buf[sizeof(MeshHeader) + MAX_PAYLOAD];
     memcpy(buf, &h, sizeof(h));
     if (e.len)
         memcpy(buf + sizeof(h), e.data, e.len);
+    gwTimeAdvance(buf, e.rxAt);
+    return (uint8_t)(sizeof(h) + e.len);
+}
+
+// A txq entry went out: wait for its echo, or it is done.
+static void txSent(PendingTx &e)
+{
+    if (e.echo && e.retx++ < HOP_MAX_RETX)
+        e.nextTry = millis() + echoWindowMs(e.len);
+    else
+        e.in_use = false;
+}
+
+// Network coding (netcode.h). Both ends of a coded pair look up their own
+// frame here, so it keeps every unicast we send, not only hop-ACKed ones.
+static uint32_t ncEnabled = 0;
+static uint32_t ncHoldMs = 0; // stay well under the previous hop's echoWindowMs
+static NcSent<NC_SENT_NODE> ncSent;
+
+static inline bool ncUplink(addr_t dst) { return dst == GW_ID; }
+// The child at the far end of a forward from src to dst: where it came
+// from going up, where it goes going down. ADDR_NONE if it does not code:
+// too long, or the next hop is the gateway or the destination itself. Only
+// a relay's forward is hop-ACKed, and that retry is what recovers a frame
+// whose far end could not decode the XOR.
+static addr_t ncChild(addr_t src, addr_t dst, uint8_t len)
+{
+    if (sizeof(MeshHeader) + len > NC_MAX_FRAME || !expectsEcho(dst))
+        return ADDR_NONE;
+    return viaFor(ncUplink(dst) ? src : dst);
+}
+static inline bool ncWaiting(const PendingTx &e) { return e.in_use && !e.retx && e.rxAt; }
+
+// A forward queued the other way between our parent and the same child
+static PendingTx *ncPartner(addr_t src, addr_t dst, uint8_t len, const PendingTx *self = nullptr)
+{
+    const addr_t c = ncChild(src, dst, len);
+    if (!ncEnabled || c == ADDR_NONE)
+        return nullptr;
+    for (auto &f : txq)
+        if (&f != self && ncWaiting(f) && ncUplink(f.dst) != ncUplink(dst) && ncChild(f.src, f.dst, f.len) == c)
+            return &f;
+    return nullptr;
+}
+
+// Sends e together with its partner as one MSG_XOR; false if e has no
+// partner or the pair does not code, and it should go out on its own.
+static bool ncSend(PendingTx &e)
+{
+    PendingTx *f = ncWaiting(e) ? ncPartner(e.src, e.dst, e.len, &e) : nullptr;
+    if (!f)
+        return false;
+    uint8_t a[sizeof(MeshHeader) + MAX_PAYLOAD], b[sizeof(MeshHeader) + MAX_PAYLOAD];
+    txFrame(e, a);
+    txFrame(*f, b);
+    uint8_t buf[sizeof(MeshHeader) + MAX_PAYLOAD];
+    const uint8_t len = ncEncode(a, b, buf + sizeof(MeshHeader));
+    if (!len)
+        return false;
+    MeshHeader h{HDR_MAGIC, myId, ADDR_BCAST, 0, (MsgType)MSG_XOR, len};
+    memcpy(buf, &h, sizeof(h));
+    const int16_t st = transmitWithDC(buf, sizeof(h) + len);
+    if (st == ERR_TX_DEFERRED)
+    {
+        e.nextTry = f->nextTry = dcFreeAt() + 50;
+        return true;
+    }
+    if (st != RADIOLIB_ERR_NONE)
+        return false;
+    ++ncSent.coded;
+    ncRemember(ncSent, a); // a relay further up or down may code it again
+    ncRemember(ncSent, b);
+    txSent(e);
+    txSent(*f);
+    return true;
+}
+
+static bool trySendOne(PendingTx &e)
+{
+    uint8_t buf[sizeof(MeshHeader) + MAX_PAYLOAD];
+    const uint8_t len = txFrame(e, buf);
 
-    int16_t st = transmitWithDC(buf, sizeof(h) + e.len);
+    if (e.retx)
+        Serial.printf("hop retx 0x%04X->0x%04X #%u\n", e.src, e.dst, e.retx);
+    int16_t st = transmitWithDC(buf, len);
     if (st == RADIOLIB_ERR_NONE)
     {
-        e.in_use = false;
+        ncRemember(ncSent, buf);
+        txSent(e);
         return true;
     }
     uint32_t now = millis();
@@ -248,7 +480,7 @@ static bool trySendOne(PendingTx &e)
     if (st == ERR_TX_DEFERRED)
     {
         Serial.println("que AGAINnoiw");
-        e.nextTry = dc_free_at + slack;
+        e.nextTry = dcFreeAt() + slack;
     }
     else
     {
@@ -258,20 +490,108 @@ static bool trySendOne(PendingTx &e)
     return false;
 }
 
+// Gateway-commanded spreading factor (1-hop leaves only). On a reduced SF the
+// gateway only listens to us right after it polls us or sends us a
+// downlink, so uplink waits in txq until one of those opens an answer window. Silence for about two rounds means
+// the gateway has given up on the link too (config.h).
+constexpr uint32_t ADR_ANSWER_WINDOW_MS = 1000;
+constexpr uint32_t ADR_ROLLBACK_MS = CFG_ADR_ROLLBACK_MS;
+static uint8_t curSf = 0;
+static uint8_t curCh = 0;
+static uint8_t adrNextSf = 0;
+static uint8_t adrNextCh = 0;
+static uint32_t adrSwitchAt = 0;
+static uint32_t lastQueryRx = 0;
+
+static void setLink(uint8_t sf, uint8_t ch)
+{
+    if (sf == curSf && ch == curCh)
+        return;
+    if (ch != curCh)
+    {
+        radio.setFrequency(channelFreq(ch));
+        dcSetFreq(channelFreq(ch));
+    }
+    if (sf != curSf)
+        radio.setSpreadingFactor(sf);
+    radio.startReceive();
+    Serial.printf("SF%u/ch%u -> SF%u/ch%u\n", curSf, curCh, sf, ch);
+    curSf = sf;
+    curCh = ch;
+}
+static inline bool offBaseLink() { return curSf != cfg.sf || curCh != 0; }
+static inline bool txHeld()
+{
+    return curSf && offBaseLink() && millis() - lastQueryRx > ADR_ANSWER_WINDOW_MS;
+}
+
+// Network time: offset and drift of the gateway clock against ours, from
+// the timestamps in BEACON and QUERY frames (see BeaconPayload).
+constexpr uint32_t TS_DRIFT_SPAN_MS = 10000; // shortest baseline for a drift sample
+constexpr int32_t TS_STEP_MS = 1000;         // bigger jumps: the gateway restarted
+constexpr float TS_MAX_DRIFT = 500e-6f;
+static bool tsValid = false;
+static uint32_t tsLocal = 0; // reference point: our millis() ...
+static uint32_t tsGw = 0;    // ... and gateway time then
+static float tsDrift = 0;    // gateway ms per local ms, minus one
+
+static uint32_t netTimeAt(uint32_t local)
+{
+    const int32_t dl = (int32_t)(local - tsLocal);
+    return tsGw + (uint32_t)dl + (uint32_t)(int32_t)(dl * tsDrift);
+}
+
+static void timeSample(const MeshHeader &h, const uint8_t *pl, uint32_t rxAt)
+{
+    const int8_t ts = gwTimeOffset(h.type);
+    if (ts < 0 || h.len < ts + sizeof(uint32_t))
+        return;
+    uint32_t gw;
+    memcpy(&gw, pl + ts, sizeof(gw));
+    gw += loraAirtimeMs(curSf ? curSf : cfg.sf, cfg.bw, cfg.cr, sizeof(MeshHeader) + h.len);
+    const int32_t err = tsValid ? (int32_t)(gw - netTimeAt(rxAt)) : 0;
+    if (!tsValid || err > TS_STEP_MS || err < -TS_STEP_MS)
+    {
+        tsValid = true;
+        tsLocal = rxAt;
+        tsGw = gw;
+        tsDrift = 0;
+        return;
+    }
+    const uint32_t dl = rxAt - tsLocal;
+    if (dl >= TS_DRIFT_SPAN_MS)
+    {
+        tsDrift += ((float)err / dl) / 4;
+        tsDrift = std::max(-TS_MAX_DRIFT, std::min(TS_MAX_DRIFT, tsDrift));
+    }
+    // move the reference halfway towards the new reading
+    tsGw = netTimeAt(rxAt) + err / 2;
+    tsLocal = rxAt;
+}
+
+// Gateway clock now; false until a BEACON or QUERY has been heard.
+bool meshNetworkTime(uint32_t &t)
+{
+    t = netTimeAt(millis());
+    return tsValid;
+}
+
 static void processTxQueue()
 {
+    if (txHeld())
+        return;
     uint32_t now = millis();
     for (auto &e : txq)
     {
         if (!e.in_use)
             continue;
-        if (now >= e.nextTry)
+        if (now >= e.nextTry && !ncSend(e))
             (void)trySendOne(e);
     }
 }
 
-static int16_t sendPacket(uint8_t src, uint8_t dst, uint8_t hops, MsgType type,
-                          const uint8_t *pl = nullptr, uint8_t len = 0)
+static int16_t sendPacket(addr_t src, addr_t dst, uint8_t hops, MsgType type,
+                          const uint8_t *pl = nullptr, uint8_t len = 0, uint32_t rxAt = 0)
 {
     MeshHeader h{HDR_MAGIC, src, dst, hops, type, len};
     uint8_t buf[sizeof(MeshHeader) + MAX_PAYLOAD];
@@ -280,152 +600,1472 @@ static int16_t sendPacket(uint8_t src, uint8_t dst, uint8_t hops, MsgType type,
     if (L)
         memcpy(buf + sizeof(h), pl, L);
 
+    if (txHeld())
+    {
+        (void)enqueueTx(src, dst, hops, type, pl, L, millis(), rxAt);
+        return ERR_TX_DEFERRED;
+    }
+    // a forward goes out coded with one queued the other way, or waits
+    // ncHoldMs for one
+    const bool codes = rxAt && ncEnabled && ncChild(src, dst, L) != ADDR_NONE;
+    const bool paired = codes && ncPartner(src, dst, L);
+    if (paired || (codes && ncHoldMs))
+    {
+        if (PendingTx *e = enqueueTx(src, dst, hops, type, pl, L, millis() + ncHoldMs, rxAt))
+        {
+            if (paired && !ncSend(*e))
+                (void)trySendOne(*e);
+            return RADIOLIB_ERR_NONE;
+        }
+    }
+    gwTimeAdvance(buf, rxAt);
     int16_t st = transmitWithDC(buf, sizeof(h) + L);
     if (st == ERR_TX_DEFERRED)
     {
-        uint32_t when = dc_free_at + 50;
+        uint32_t when = dcFreeAt() + 50;
         Serial.println("que for noiw");
-        (void)enqueueTx(src, dst, hops, type, pl, L, when);
+        (void)enqueueTx(src, dst, hops, type, pl, L, when, rxAt);
         return st;
     }
     if (st != RADIOLIB_ERR_NONE)
     {
         Serial.printf("TX err %d\n", st);
+        return st;
+    }
+    ncRemember(ncSent, buf);
+    if (expectsEcho(dst))
+    {
+        if (PendingTx *e = enqueueTx(src, dst, hops, type, pl, L, 0, rxAt))
+        {
+            e->retx = 1;
+            e->nextTry = millis() + echoWindowMs(L);
+        }
     }
     return st;
 }
 
-#if ENABLE_TEST_TX
-static void sendTestFrame()
+// Reliable uplink. Data stays in upq until the gateway's cumulative ACK
+// covers it. A hole below the newest acknowledged seq is resent at once,
+// anything else once its ACK is overdue (config.h): DATA_RETRY_MS, or a
+// round longer while ADR holds our uplink until the next QUERY.
+constexpr uint8_t UP_MAX_DATA = MAX_PAYLOAD - sizeof(DataUpHdr);
+constexpr uint32_t DATA_RETRY_MS = CFG_DATA_RETRY_MS;
+constexpr uint32_t DATA_GAP_GUARD_MS = 5000; // too recent to be a hole yet
+struct UpSlot
 {
-    test_hdr_t th{};
-    th.ver = 1;
-    th.test_id = TEST_MAGIC;
-    th.seq = ++testSeq;
-    th.src = (uint32_t)myId;
-    th.tx_epoch_ms = millis();
-    th.hop_cnt = 0;
-    th.batt_mV = battery_mV();
-
-    (void)sendPacket(myId, GW_ID, MAX_HOPS, DATA_UP,
-                     reinterpret_cast<uint8_t *>(&th), sizeof(th));
-}
-#endif
+    bool used = false;
+    uint16_t seq = 0;
+    uint8_t len = 0;
+    uint8_t tries = 0;
+    uint32_t sentAt = 0;
+    uint32_t retryAt = 0;
+    uint8_t data[UP_MAX_DATA];
+};
+static UpSlot upq[UP_WINDOW];
+static uint16_t upSeq = 0;    // next sequence number, random per boot
+static bool upSynced = false; // gateway has acked something since we joined
+static bool gwAnswered = false; // a JOIN_ACK or DATA_ACK reached us since boot (see otaLoop)
 
-static void candUpdate(uint8_t id, int16_t rssi, uint8_t hops)
+static void upSend(UpSlot &u)
 {
-    if (rssi < -120 || hops > 6)
-        return;
-    int slot = -1, oldest = 0;
-    for (uint8_t i = 0; i < MAX_CAND; ++i)
+    uint8_t buf[MAX_PAYLOAD];
+    DataUpHdr d{u.seq, 0};
+    if (!upSynced)
     {
-        if (cand[i].id == id)
-        {
-            slot = i;
-            break;
-        }
-        if (cand[i].lastSeen < cand[oldest].lastSeen)
-            oldest = i;
+        // distance to the oldest frame still held; sendData keeps it < DATA_ACK_BITS
+        uint16_t back = 0;
+        for (auto &o : upq)
+            if (o.used && (int16_t)(u.seq - o.seq) > (int16_t)back)
+                back = (uint16_t)(u.seq - o.seq);
+        d.flags = (uint8_t)(DATA_SYN | back << DATA_BASE_SHIFT);
     }
-    if (slot == -1)
-        slot = oldest;
-    cand[slot].id = id;
-    cand[slot].rssi = rssi;
-    cand[slot].hops = hops;
-    cand[slot].lastSeen = millis();
+    memcpy(buf, &d, sizeof(d));
+    memcpy(buf + sizeof(d), u.data, u.len);
+    (void)sendPacket(myId, GW_ID, 0, DATA_UP, buf, (uint8_t)(sizeof(d) + u.len));
+    u.sentAt = millis();
+    u.retryAt = u.sentAt + (offBaseLink() ? CFG_ADR_DATA_RETRY_MS : DATA_RETRY_MS);
+    if (u.tries < 0xFF)
+        ++u.tries;
 }
-static uint8_t pickParent()
+
+// Queue application data for reliable delivery; false if it does not fit.
+static bool sendData(const uint8_t *data, uint8_t len)
 {
-    int best = -1;
-    for (uint8_t i = 0; i < MAX_CAND; ++i)
+    if (len > UP_MAX_DATA)
+        return false;
+    UpSlot *slot = nullptr;
+    for (auto &u : upq)
     {
-        if (millis() - cand[i].lastSeen > 90000)
-            continue;
-        if (best == -1)
-        {
-            best = i;
-            continue;
-        }
-        if (cand[i].rssi > cand[best].rssi)
+        if (!u.used)
         {
-            best = i;
+            if (!slot)
+                slot = &u;
             continue;
         }
-        if (cand[i].rssi < cand[best].rssi)
-            continue;
-        if (cand[i].hops < cand[best].hops)
+        // keep the spread inside what one ACK can describe
+        if ((uint16_t)(upSeq - u.seq) >= DATA_ACK_BITS)
         {
-            best = i;
-            continue;
+            PERF_OVERFLOW(MARK_UPQ);
+            return false;
         }
-        if (cand[i].hops > cand[best].hops)
-            continue;
-        if (cand[i].id < cand[best].id)
-            best = i;
     }
-    if (best == -1)
-        return 0xFF;
-    parentRssi = cand[best].rssi;
-    return cand[best].id;
+    if (!slot)
+    {
+        PERF_OVERFLOW(MARK_UPQ);
+        return false;
+    }
+    slot->used = true;
+    PERF_LEVEL(MARK_UPQ, std::count_if(upq, upq + UP_WINDOW, [](const UpSlot &u) { return u.used; }));
+    slot->seq = upSeq++;
+    slot->len = len;
+    memcpy(slot->data, data, len);
+    slot->tries = 0;
+    if (parentId != ADDR_NONE && myId < ADDR_UNASSIGNED)
+        upSend(*slot);
+    else
+        slot->retryAt = millis();
+    return true;
 }
 
-static bool shouldRelay(const MeshHeader &h)
+// The gateway's window is gone, or we (re)joined: everything in upq goes
+// out again, with DATA_SYN until an ACK shows the gateway has a window.
+static void upResync()
 {
-    return (h.src == parentId) || isChild(h.src);
+    upSynced = false;
+    const uint32_t now = millis();
+    for (auto &u : upq)
+        if (u.used)
+            u.retryAt = now;
 }
-static void forward(MeshHeader &h, uint8_t *pl)
+
+static void onDataAck(const DataAckPayload &a)
 {
-    if (!shouldRelay(h) || h.hops >= MAX_HOPS)
+    if (a.mask == DATA_ACK_RESYNC)
+    {
+        upResync();
         return;
-
-#if ENABLE_TEST_TX
-    if (h.len >= sizeof(test_hdr_t))
+    }
+    upSynced = true;
+    gwAnswered = true;
+    uint16_t newest = (uint16_t)(a.next - 1);
+    for (uint8_t i = DATA_ACK_BITS; i > 0; --i)
+        if ((a.mask >> (i - 1)) & 1)
+        {
+            newest = (uint16_t)(a.next + i);
+            break;
+        }
+    const uint32_t now = millis();
+    for (auto &u : upq)
     {
-        auto *th = reinterpret_cast<test_hdr_t *>(pl);
-        if (th->ver == 1 && th->test_id == TEST_MAGIC)
+        if (!u.used)
+            continue;
+        int16_t off = (int16_t)(u.seq - a.next);
+        if (off < 0 || (off > 0 && off <= DATA_ACK_BITS && ((a.mask >> (off - 1)) & 1)))
         {
-            th->hop_cnt++;
+            u.used = false;
+            continue;
         }
+        if ((int16_t)(u.seq - newest) < 0 && now - u.sentAt > DATA_GAP_GUARD_MS)
+            u.retryAt = now;
     }
-#endif
-    ++h.hops;
-    sendPacket(h.src, h.dst, h.hops, h.type, pl, h.len);
 }
 
-void meshSetupNode()
+// Store-and-forward. Data that finds the uplink window full (no parent,
+// lost ACKs, congestion) is appended to a ring of segment files on
+// LittleFS, which does the wear levelling. It drains oldest first into upq,
+// one record per free duty-cycle slot. A full log discards its oldest
+// segment (SF_DROP_OLDEST) or refuses new data.
+#ifndef SF_MAX_SEGMENTS
+#define SF_MAX_SEGMENTS 16
+#endif
+#ifndef SF_DROP_OLDEST
+#define SF_DROP_OLDEST 1
+#endif
+static_assert(SF_MAX_SEGMENTS >= 2, "store-and-forward needs two segments");
+constexpr uint16_t SF_SEG_RECORDS = 64;
+constexpr uint8_t SF_REC_SIZE = 1 + UP_MAX_DATA; // length byte + data
+constexpr uint32_t SF_RETRY_MS = 1000;
+static bool sfReady = false;
+static uint32_t sfTail = 0;     // oldest segment
+static uint32_t sfHead = 0;     // segment being appended to
+static uint16_t sfRd = 0;       // records of sfTail already drained
+static uint16_t sfHeadRecs = 0; // records in sfHead
+static uint32_t sfDropped = 0;
+static uint32_t sfNextTry = 0;
+
+static void sfPath(char *p, size_t n, uint32_t seg) { snprintf(p, n, "/sf/%08lx", (unsigned long)seg); }
+
+static inline bool sfEmpty() { return sfTail == sfHead && sfRd >= sfHeadRecs; }
+static uint32_t sfPending()
 {
-    pinMode(LED_BUILTIN, OUTPUT);
-    prefs.begin("mesh", false);
-    myId = prefs.getUChar("id", 0);
-    if (!myId)
-    {
-        myId = random(1, 0xFE);
-        prefs.putUChar("id", myId);
-    }
-    Serial.printf("MeshHeader=%u bytes\n", (unsigned)sizeof(MeshHeader));
-    radio.startReceive();
+    if (sfTail == sfHead)
+        return sfHeadRecs - sfRd;
+    return (uint32_t)(SF_SEG_RECORDS - sfRd) + (sfHead - sfTail - 1) * SF_SEG_RECORDS + sfHeadRecs;
 }
 
-static void handleRx()
+static void sfSave()
 {
+    prefs.putUInt("sfTail", sfTail);
+    prefs.putUInt("sfHead", sfHead);
+    prefs.putUShort("sfRd", sfRd);
+}
+
+static void sfBegin()
+{
+    sfReady = LittleFS.begin(true);
+    if (!sfReady)
+    {
+        Serial.println(F("store-and-forward: no LittleFS, disabled"));
+        return;
+    }
+    LittleFS.mkdir("/sf");
+    sfTail = prefs.getUInt("sfTail", 0);
+    sfHead = prefs.getUInt("sfHead", 0);
+    sfRd = prefs.getUShort("sfRd", 0);
+    char path[20];
+    sfPath(path, sizeof(path), sfHead);
+    File f = LittleFS.open(path, "r");
+    sfHeadRecs = f ? (uint16_t)(f.size() / SF_REC_SIZE) : 0;
+    if (f)
+        f.close();
+    if ((int32_t)(sfHead - sfTail) < 0 || sfHead - sfTail >= SF_MAX_SEGMENTS)
+    {
+        sfTail = sfHead; // inconsistent bookkeeping: keep the newest segment
+        sfRd = 0;
+    }
+    Serial.printf("store-and-forward: %lu records waiting\n", (unsigned long)sfPending());
+}
+
+static void sfDropTail()
+{
+    char path[20];
+    sfPath(path, sizeof(path), sfTail);
+    LittleFS.remove(path);
+    ++sfTail;
+    sfRd = 0;
+}
+
+static bool sfAppend(const uint8_t *d, uint8_t len)
+{
+    if (!sfReady || len > UP_MAX_DATA)
+        return false;
+    if (sfHeadRecs >= SF_SEG_RECORDS)
+    {
+        if (sfHead - sfTail + 1 >= SF_MAX_SEGMENTS)
+        {
+#if SF_DROP_OLDEST
+            sfDropped += SF_SEG_RECORDS - sfRd;
+            sfDropTail();
+#else
+            ++sfDropped;
+#endif
+            Serial.printf("store-and-forward: log full, %lu records dropped\n", (unsigned long)sfDropped);
+#if !SF_DROP_OLDEST
+            return false;
+#endif
+        }
+        ++sfHead;
+        sfHeadRecs = 0;
+        sfSave();
+    }
+    uint8_t rec[SF_REC_SIZE] = {0};
+    rec[0] = len;
+    memcpy(rec + 1, d, len);
+    char path[20];
+    sfPath(path, sizeof(path), sfHead);
+    File f = LittleFS.open(path, "a");
+    if (!f)
+        return false;
+    const bool ok = f.write(rec, SF_REC_SIZE) == SF_REC_SIZE;
+    f.close();
+    if (ok)
+        ++sfHeadRecs;
+    return ok;
+}
+
+static void sfDrain()
+{
+    const uint32_t now = millis();
+    if (!sfReady || sfEmpty() || parentId == ADDR_NONE || myId >= ADDR_UNASSIGNED ||
+        !dcReady() || (int32_t)(now - sfNextTry) < 0)
+        return;
+    uint8_t rec[SF_REC_SIZE];
+    char path[20];
+    sfPath(path, sizeof(path), sfTail);
+    File f = LittleFS.open(path, "r");
+    const bool ok = f && f.seek((uint32_t)sfRd * SF_REC_SIZE) && f.read(rec, SF_REC_SIZE) == SF_REC_SIZE;
+    if (f)
+        f.close();
+    if (ok && rec[0] <= UP_MAX_DATA && !sendData(rec + 1, rec[0]))
+    {
+        sfNextTry = now + SF_RETRY_MS; // window still full
+        return;
+    }
+    // sent, or unreadable and skipped
+    ++sfRd;
+    if (sfTail != sfHead && sfRd >= SF_SEG_RECORDS)
+        sfDropTail();
+    else if (sfTail == sfHead && sfRd >= sfHeadRecs)
+    {
+        LittleFS.remove(path);
+        sfRd = 0;
+        sfHeadRecs = 0;
+    }
+    sfSave();
+}
+
+// Uplink for application data: straight into the reliable window unless
+// older data is still waiting in flash, so delivery stays oldest first.
+static bool uplink(const uint8_t *d, uint8_t len)
+{
+    if ((!sfReady || sfEmpty()) && sendData(d, len))
+        return true;
+    return sfAppend(d, len);
+}
+
+// Fragmented uplink for messages over one frame, one message at a time.
+// Fragments go out in blocks of FRAG_BLOCK as fast as the duty-cycle bucket
+// allows; the last of each block asks for a FRAG_ACK, whose bitmap decides
+// what the next block resends. Relays forward fragments like any frame.
+constexpr uint8_t FRAG_BLOCK = 8;
+constexpr uint8_t FRAG_MAX_POLLS = 5;
+constexpr uint32_t FRAG_ACK_SLACK_MS = 2000;
+struct FragTx
+{
+    bool active = false;
+    bool waiting = false; // block sent, FRAG_ACK outstanding
+    uint16_t msgId = 0;
+    uint16_t len = 0;
+    uint8_t count = 0;
+    uint8_t cursor = 0;
+    uint8_t inBlock = 0;
+    uint8_t polls = 0;
+    uint32_t ackBy = 0;
+    uint8_t acked[FRAG_MAX_COUNT / 8];
+    uint8_t data[FRAG_MAX_MSG];
+};
+static FragTx fragTx;
+
+static inline bool fragAcked(uint8_t i) { return fragTx.acked[i / 8] & (1u << (i & 7)); }
+
+// Time for the last fragment to climb to the gateway and the ACK to return
+static uint32_t fragAckTimeoutMs()
+{
+    const uint8_t depth = (myHopToGW == 0xFF) ? 1 : myHopToGW;
+    return 2 * depth * loraAirtimeMs(cfg.sf, cfg.bw, cfg.cr, sizeof(MeshHeader) + MAX_PAYLOAD) + FRAG_ACK_SLACK_MS;
+}
+
+static bool fragSend(uint8_t idx, bool ackReq)
+{
+    uint8_t buf[MAX_PAYLOAD];
+    const uint8_t n = (uint8_t)std::min<uint16_t>(FRAG_DATA, fragTx.len - idx * FRAG_DATA);
+    FragHdr f{fragTx.msgId, idx, fragTx.count, (uint8_t)(ackReq ? FRAG_ACKREQ : 0)};
+    memcpy(buf, &f, sizeof(f));
+    memcpy(buf + sizeof(f), fragTx.data + idx * FRAG_DATA, n);
+    int16_t st = sendPacket(myId, GW_ID, 0, (MsgType)MSG_DATA_FRAG, buf, (uint8_t)(sizeof(f) + n));
+    return st == RADIOLIB_ERR_NONE || st == ERR_TX_DEFERRED;
+}
+
+// Send up to FRAG_MAX_MSG bytes to the gateway; false while the previous
+// message is still in flight.
+bool meshSendLarge(const uint8_t *data, uint16_t len)
+{
+    if (fragTx.active || !len || len > FRAG_MAX_MSG)
+        return false;
+    if (!fragTx.msgId)
+        fragTx.msgId = (uint16_t)random(1, 0x10000);
+    else
+        ++fragTx.msgId;
+    memcpy(fragTx.data, data, len);
+    memset(fragTx.acked, 0, sizeof(fragTx.acked));
+    fragTx.len = len;
+    fragTx.count = (uint8_t)((len + FRAG_DATA - 1) / FRAG_DATA);
+    fragTx.cursor = 0;
+    fragTx.inBlock = 0;
+    fragTx.polls = 0;
+    fragTx.waiting = false;
+    fragTx.active = true;
+    return true;
+}
+
+static void onFragAck(const FragAckHdr &a, const uint8_t *bits, uint8_t n)
+{
+    if (!fragTx.active || a.msgId != fragTx.msgId || a.count != fragTx.count)
+        return;
+    for (uint8_t i = 0; i < n && i < sizeof(fragTx.acked); ++i)
+        fragTx.acked[i] |= bits[i];
+    uint8_t missing = 0;
+    for (uint8_t i = 0; i < fragTx.count; ++i)
+        if (!fragAcked(i))
+            ++missing;
+    if ((a.flags & FRAG_DONE) || !missing)
+    {
+        Serial.printf("large msg %u delivered (%u B)\n", fragTx.msgId, fragTx.len);
+        fragTx.active = false;
+        return;
+    }
+    fragTx.waiting = false;
+    fragTx.cursor = 0;
+    fragTx.inBlock = 0;
+    fragTx.polls = 0;
+}
+
+static void fragPump()
+{
+    if (!fragTx.active || parentId == ADDR_NONE || myId >= ADDR_UNASSIGNED || txHeld())
+        return;
+    const uint32_t now = millis();
+    if (fragTx.waiting)
+    {
+        if ((int32_t)(now - fragTx.ackBy) < 0 || !dcReady())
+            return;
+        if (++fragTx.polls > FRAG_MAX_POLLS)
+        {
+            Serial.printf("large msg %u: no FRAG_ACK, dropped\n", fragTx.msgId);
+            fragTx.active = false;
+            return;
+        }
+        // ACK or the block's last fragment lost: ask again with one fragment
+        uint8_t last = fragTx.count;
+        while (last && fragAcked(last - 1))
+            --last;
+        if (last)
+            (void)fragSend((uint8_t)(last - 1), true);
+        fragTx.ackBy = now + fragAckTimeoutMs();
+        return;
+    }
+    if (!dcReady())
+        return;
+    while (fragTx.cursor < fragTx.count && fragAcked(fragTx.cursor))
+        ++fragTx.cursor;
+    if (fragTx.cursor >= fragTx.count)
+        return;
+    uint8_t next = (uint8_t)(fragTx.cursor + 1);
+    while (next < fragTx.count && fragAcked(next))
+        ++next;
+    const bool ackReq = ++fragTx.inBlock >= FRAG_BLOCK || next >= fragTx.count;
+    if (!fragSend(fragTx.cursor, ackReq))
+    {
+        --fragTx.inBlock;
+        return;
+    }
+    fragTx.cursor = next;
+    if (ackReq)
+    {
+        fragTx.waiting = true;
+        fragTx.inBlock = 0;
+        fragTx.ackBy = now + fragAckTimeoutMs();
+    }
+}
+
+// Readings accumulate in sampleBuf and leave as one compressed DATA_UP
+// once the next reading would push the batch past SAMPLE_FLUSH_BYTES, or
+// the oldest has waited SAMPLE_MAX_LATENCY_MS. Larger batches cost less
+// airtime per sample, the latency cap bounds how stale they get.
+static Sample sampleBuf[SAMPLE_MAX_N];
+static uint8_t sampleCount = 0;
+static uint8_t sampleCh = 0;
+static_assert(SAMPLE_FLUSH_BYTES <= UP_MAX_DATA, "SAMPLE_FLUSH_BYTES exceeds a DATA_UP payload");
+
+static bool sampleFlush()
+{
+    if (!sampleCount)
+        return true;
+    uint8_t out[UP_MAX_DATA];
+    const size_t n = sampleEncode(sampleBuf, sampleCount, sampleCh, out, SAMPLE_FLUSH_BYTES);
+    if (!n || !uplink(out, (uint8_t)n))
+        return false;
+    Serial.printf("samples: %u in %u B\n", sampleCount, (unsigned)n);
+    sampleCount = 0;
+    return true;
+}
+
+// Record one reading of nch application channels, timestamped now.
+bool meshRecordSample(const int32_t *v, uint8_t nch)
+{
+    if (!nch || nch > SAMPLE_MAX_CH)
+        return false;
+    if (sampleCount && nch != sampleCh && !sampleFlush())
+        return false; // previous batch still stuck in a full uplink window
+    Sample rec{};
+    rec.t = millis();
+    memcpy(rec.v, v, nch * sizeof(int32_t));
+    if (sampleCount == SAMPLE_MAX_N && !sampleFlush())
+    {
+        // window full: keep the newest readings
+        memmove(sampleBuf, sampleBuf + 1, (SAMPLE_MAX_N - 1) * sizeof(Sample));
+        --sampleCount;
+    }
+    sampleBuf[sampleCount++] = rec;
+    sampleCh = nch;
+    uint8_t out[UP_MAX_DATA];
+    if (sampleCount > 1 && !sampleEncode(sampleBuf, sampleCount, sampleCh, out, SAMPLE_FLUSH_BYTES))
+    {
+        // this reading tipped the batch over: send the rest, start anew with it
+        --sampleCount;
+        if (sampleFlush())
+            sampleBuf[sampleCount++] = rec;
+        else
+        {
+            memmove(sampleBuf, sampleBuf + 1, (sampleCount - 1) * sizeof(Sample));
+            sampleBuf[sampleCount - 1] = rec;
+        }
+    }
+    return true;
+}
+
+#if ENABLE_TEST_TX
+static void sendTestFrame()
+{
+    test_hdr_t th{};
+    uint32_t net;
+    th.ver = meshNetworkTime(net) ? 2 : 1;
+    th.tx_epoch_ms = (th.ver == 2) ? net : millis();
+    th.test_id = TEST_MAGIC;
+    th.seq = ++testSeq;
+    th.src = (uint32_t)myId;
+    th.hop_cnt = 0;
+    th.batt_mV = battery_mV();
+    th.boot = testBoot;
+
+    if (!uplink(reinterpret_cast<uint8_t *>(&th), sizeof(th)))
+        Serial.println(F("test frame dropped: uplink window and flash log full"));
+}
+#endif
+
+static void candUpdate(addr_t id, int16_t rssi, uint8_t hops, uint8_t depth = 0xFF)
+{
+    if (rssi < -120 || hops >= MAX_HOPS || (depth != 0xFF && depth >= MAX_HOPS))
+        return;
+    int slot = -1, oldest = 0;
+    for (uint8_t i = 0; i < MAX_CAND; ++i)
+    {
+        if (cand[i].id == id)
+        {
+            slot = i;
+            break;
+        }
+        if (cand[i].lastSeen < cand[oldest].lastSeen)
+            oldest = i;
+    }
+    if (slot == -1)
+    {
+        slot = oldest;
+        cand[slot].depth = 0xFF;
+    }
+    cand[slot].id = id;
+    cand[slot].rssi = rssi;
+    cand[slot].hops = hops;
+    if (depth != 0xFF)
+        cand[slot].depth = depth;
+    cand[slot].lastSeen = millis();
+}
+static addr_t pickParent()
+{
+    int best = -1;
+    for (uint8_t i = 0; i < MAX_CAND; ++i)
+    {
+        if (millis() - cand[i].lastSeen > 90000)
+            continue;
+        if (best == -1)
+        {
+            best = i;
+            continue;
+        }
+        if (cand[i].rssi > cand[best].rssi)
+        {
+            best = i;
+            continue;
+        }
+        if (cand[i].rssi < cand[best].rssi)
+            continue;
+        if (cand[i].hops < cand[best].hops)
+        {
+            best = i;
+            continue;
+        }
+        if (cand[i].hops > cand[best].hops)
+            continue;
+        if (cand[i].id < cand[best].id)
+            best = i;
+    }
+    if (best == -1)
+        return ADDR_NONE;
+    parentRssi = cand[best].rssi;
+    return cand[best].id;
+}
+
+// Frames relayed recently. A copy arriving again with the same hop count is
+// the previous hop retrying because it missed our forward; any other copy is
+// an echo (our own forward relayed on, or a sibling path) and is dropped.
+constexpr uint8_t MAX_SEEN = 16;
+constexpr uint32_t SEEN_TTL_MS = 30000;
+struct Seen
+{
+    uint32_t hash = 0;
+    uint8_t hops = 0;
+    uint32_t at = 0;
+};
+static Seen seen[MAX_SEEN];
+static uint8_t seenNext = 0;
+
+static_assert(sizeof(cand) + sizeof(children) + sizeof(desc) + sizeof(heldJoins) + sizeof(txq) + sizeof(upq) +
+                      sizeof(fragTx) + sizeof(sampleBuf) + sizeof(seen) + sizeof(ncSent) <=
+                  PROFILE.nodeRamBudget,
+              "node tables exceed the profile's nodeRamBudget");
+
+static bool duplicate(uint32_t hash, uint8_t hops)
+{
+    uint32_t now = millis();
+    for (auto &s : seen)
+    {
+        if (!s.at || s.hash != hash || now - s.at > SEEN_TTL_MS)
+            continue;
+        if (s.hops != hops)
+            return true;
+        for (auto &e : txq)
+            if (e.in_use && e.hash == hash)
+            {
+                // already sent and waiting for our own echo: resend now,
+                // which is also the retrying hop's ACK
+                if (e.echo && e.retx)
+                    e.nextTry = now;
+                return true;
+            }
+        s.at = now;
+        return false;
+    }
+    Seen &s = seen[seenNext];
+    seenNext = (uint8_t)((seenNext + 1) % MAX_SEEN);
+    s.hash = hash;
+    s.hops = hops;
+    s.at = now;
+    return false;
+}
+
+// Downlink goes to whichever of our children leads to dst; uplink from our
+// subtree goes to the parent. Everything else is not ours to carry.
+static void forward(MeshHeader &h, uint8_t *pl, uint32_t hash, uint32_t rxAt)
+{
+    // replies to a joiner without an address are link-local, broadcasts one hop
+    if (h.hops >= MAX_HOPS || h.dst >= ADDR_UNASSIGNED)
+        return;
+    const bool down = inSubtree(h.dst);
+    if (down ? inSubtree(h.src) : (!inSubtree(h.src) || parentId == ADDR_NONE))
+        return;
+    if (duplicate(hash, h.hops))
+        return;
+
+    if (!down)
+    {
+        if (Desc *d = findDesc(h.src))
+            d->lastSeen = millis();
+        if (h.len >= sizeof(ChildEventPayload))
+        {
+            auto *ev = reinterpret_cast<ChildEventPayload *>(pl);
+            if (h.type == (MsgType)MSG_CHILD_ADD)
+                learnDesc(ev->child, viaFor(h.src));
+            else if (h.type == (MsgType)MSG_CHILD_GONE)
+                forgetDesc(ev->child);
+        }
+    }
+    ++h.hops;
+    sendPacket(h.src, h.dst, h.hops, h.type, pl, h.len, rxAt);
+}
+
+// Runtime parameters. Set locally on the console or pushed by the gateway,
+// unicast with PARAM_SET or flooded in BEACONs; a pushed radio profile is
+// applied at the network time it names, so the whole tree switches together.
+static uint32_t radioSf = 0, radioBw = 0, radioCr = 0;
+static uint32_t beaconPeriodMs = 3600000; // longest Trickle beacon interval
+
+static const Param paramTable[] = {
+    {P_SF, "sf", &radioSf, 7, 12, PF_RADIO},
+    {P_BW, "bw", &radioBw, 125, 500, PF_RADIO},
+    {P_CR, "cr", &radioCr, 5, 8, PF_RADIO},
+    {P_DC_BORROW_PCT, "dc_borrow_pct", &dcBorrowPct, 0, 100, 0},
+    {P_TEST_PERIOD_MS, "test_period", &testPeriodMs, 5000, 86400000, 0},
+    {P_LOST_PARENT_MS, "lost_parent", &lostParentMs, 30000, 86400000, 0},
+    {P_CHILD_SILENT_MS, "child_silent", &childSilentMs, 30000, 86400000, 0},
+    {P_BEACON_PERIOD_MS, "beacon_period", &beaconPeriodMs, 5000, 86400000, 0},
+    {P_NETCODE, "netcode", &ncEnabled, 0, 1, 0},
+    {P_NC_HOLD_MS, "nc_hold", &ncHoldMs, 0, 2000, 0},
+};
+constexpr size_t PARAM_COUNT = sizeof(paramTable) / sizeof(paramTable[0]);
+
+static uint32_t radioSwitchAt = 0;  // local millis, 0 = nothing pending
+static uint32_t radioSwitchNet = 0; // network time of a switch heard before we had the time, 0 = none
+static uint32_t nextSf = 0, nextBw = 0, nextCr = 0;
+static uint32_t keptSf = 0, keptBw = 0, keptCr = 0; // profile in Preferences
+static uint32_t radioHuntAt = 0; // while detached, try the other profile from then on
+
+// The configuration last received from the gateway, kept to pass on in our
+// own beacons. cfgVer 0: none yet.
+static uint8_t cfgVer = 0;
+static uint8_t cfgBody[MAX_PAYLOAD - sizeof(BeaconPayload)];
+static uint8_t cfgLen = 0;
+static Trickle beacon;
+
+static void radioApply(uint32_t sf, uint32_t bw, uint32_t cr)
+{
+    cfg.sf = (uint8_t)sf;
+    cfg.bw = (float)bw;
+    cfg.cr = (uint8_t)cr;
+    radioSf = sf;
+    radioBw = bw;
+    radioCr = cr;
+    radio.setBandwidth(cfg.bw);
+    radio.setCodingRate(cfg.cr);
+    radio.setSpreadingFactor(cfg.sf);
+    curSf = cfg.sf;
+    adrNextSf = 0;
+    setLink(cfg.sf, 0);
+    radio.startReceive();
+    Serial.printf("radio now SF%u BW%.0f CR4/%u\n", cfg.sf, cfg.bw, cfg.cr);
+}
+
+// The profile we run is the network's (pushed to us, or we attached on it):
+// keep it across reboots.
+static void radioKeep()
+{
+    if (radioSf == keptSf && radioBw == keptBw && radioCr == keptCr)
+        return;
+    paramSave(paramTable, PARAM_COUNT, PF_RADIO);
+    keptSf = radioSf;
+    keptBw = radioBw;
+    keptCr = radioCr;
+}
+
+static void radioSwitch()
+{
+    radioApply(nextSf, nextBw, nextCr);
+    radioKeep();
+}
+
+// A pushed switch at network time `at` (0 = now)
+static void radioSchedule(uint32_t at)
+{
+    uint32_t net;
+    const int32_t wait = (at && meshNetworkTime(net)) ? (int32_t)(at - net) : 0;
+    if (wait <= 0)
+    {
+        radioSwitch();
+        return;
+    }
+    radioSwitchAt = millis() + (uint32_t)wait;
+    if (!radioSwitchAt)
+        radioSwitchAt = 1;
+    Serial.printf("radio -> SF%lu BW%lu CR4/%lu in %ld ms\n", (unsigned long)nextSf,
+                  (unsigned long)nextBw, (unsigned long)nextCr, (long)wait);
+}
+
+// Detached for lostParentMs: try the other of the default and the kept
+// profile. A node that missed a switch, or whose network went back to the
+// default (a gateway that lost its settings), finds its parents again.
+static void radioHunt()
+{
+    if (radioSf != PROFILE.sf || radioBw != PROFILE.bwKHz || radioCr != PROFILE.cr)
+        radioApply(PROFILE.sf, PROFILE.bwKHz, PROFILE.cr);
+    else if (keptSf != radioSf || keptBw != radioBw || keptCr != radioCr)
+        radioApply(keptSf, keptBw, keptCr);
+}
+
+// Apply a PARAM_SET body and keep it for the beacons; false if malformed
+static bool paramAdopt(const uint8_t *pl, uint8_t len)
+{
+    if (len < sizeof(ParamSetHdr) || len > sizeof(cfgBody))
+        return false;
+    ParamSetHdr hdr;
+    memcpy(&hdr, pl, sizeof(hdr));
+    memcpy(cfgBody, pl, len);
+    cfgLen = len;
+    cfgVer = hdr.ver;
+    nextSf = radioSf;
+    nextBw = radioBw;
+    nextCr = radioCr;
+    for (uint8_t i = 0; i < hdr.count && sizeof(hdr) + (i + 1) * sizeof(ParamEntry) <= len; ++i)
+    {
+        ParamEntry e;
+        memcpy(&e, pl + sizeof(hdr) + i * sizeof(ParamEntry), sizeof(e));
+        const Param *p = paramById(paramTable, PARAM_COUNT, e.id);
+        if (!p || !paramValid(*p, e.value))
+            continue; // newer gateway, or nonsense: keep ours
+        if (p->id == P_SF)
+            nextSf = e.value;
+        else if (p->id == P_BW)
+            nextBw = e.value;
+        else if (p->id == P_CR)
+            nextCr = e.value;
+        else
+            *p->value = e.value;
+    }
+    radioSwitchAt = 0;
+    radioSwitchNet = 0;
+    if (nextSf != radioSf || nextBw != radioBw || nextCr != radioCr)
+    {
+        uint32_t net;
+        if (hdr.switchAt && !meshNetworkTime(net))
+        {
+            // switching now could leave the tree before it moves; wait for the time
+            radioSwitchNet = hdr.switchAt;
+            Serial.println(F("radio switch waits for network time"));
+        }
+        else
+            radioSchedule(hdr.switchAt);
+    }
+    return true;
+}
+
+static void paramAck()
+{
+    ParamAckPayload ack{cfgVer};
+    (void)sendPacket(myId, GW_ID, 0, (MsgType)MSG_PARAM_ACK, (uint8_t *)&ack, sizeof(ack));
+}
+
+static void onParamSet(const uint8_t *pl, uint8_t len)
+{
+    if (!paramAdopt(pl, len))
+        return;
+    trickleReset(beacon, millis());
+    paramAck();
+}
+
+// BEACON from a neighbour: a newer configuration from the gateway or our
+// parent is adopted and acked, a differing version (theirs or ours is
+// stale) or a solicitation makes us beacon fast, and a matching one counts
+// towards suppressing ours. Like PARAM_SET, a body is only taken on a path
+// back to the gateway: anyone else's may be forged or from another network.
+static void onBeacon(const MeshHeader &h, const uint8_t *pl)
+{
+    const uint32_t now = millis();
+    if (h.len < sizeof(BeaconPayload))
+    {
+        trickleReset(beacon, now);
+        return;
+    }
+    BeaconPayload b;
+    memcpy(&b, pl, sizeof(b));
+    if (b.cfgVer == cfgVer)
+    {
+        trickleHeard(beacon);
+        return;
+    }
+    const bool upstream = h.src == GW_ID || (parentId != ADDR_NONE && h.src == parentId);
+    if (upstream && paramVerNewer(b.cfgVer, cfgVer) && paramAdopt(pl + sizeof(b), (uint8_t)(h.len - sizeof(b))))
+    {
+        trickleReset(beacon, now);
+        Serial.printf("config v%u from beacon of 0x%04X\n", cfgVer, h.src);
+        if (parentId != ADDR_NONE && myId < ADDR_UNASSIGNED)
+            paramAck();
+        return;
+    }
+    trickleMismatch(beacon, cfgVer, now);
+}
+
+// Our BEACON: distance to the gateway, network time and the configuration
+// we hold. Sent now or not at all; a queued one would carry a stale time.
+static void sendBeacon()
+{
+    uint32_t net;
+    if (txHeld() || !meshNetworkTime(net))
+        return;
+    BeaconPayload b{myHopToGW, net, cfgVer};
+    const uint8_t len = (uint8_t)(sizeof(b) + cfgLen);
+    MeshHeader h{HDR_MAGIC, myId, ADDR_BCAST, 0, BEACON, len};
+    uint8_t buf[sizeof(MeshHeader) + MAX_PAYLOAD];
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), &b, sizeof(b));
+    memcpy(buf + sizeof(h) + sizeof(b), cfgBody, cfgLen);
+    (void)transmitWithDC(buf, sizeof(h) + len);
+}
+
+static void onParamCommand(const char *line)
+{
+    char name[24];
+    unsigned long v;
+    if (!strcmp(line, "param"))
+    {
+        paramPrint(paramTable, PARAM_COUNT);
+        Serial.printf("  config v%u\n", cfgVer);
+        tricklePrint(beacon);
+    }
+    else if (!strcmp(line, "param save"))
+    {
+        paramSave(paramTable, PARAM_COUNT);
+        Serial.println(F("params saved"));
+    }
+    else if (sscanf(line, "param %23s %lu", name, &v) == 2)
+    {
+        const Param *p = paramFind(paramTable, PARAM_COUNT, name);
+        if (!p)
+            Serial.printf("unknown param: %s\n", name);
+        else if (!paramValid(*p, v))
+            Serial.printf("%s: out of range %lu..%lu\n", p->name, (unsigned long)p->lo, (unsigned long)p->hi);
+        else if (p->flags & PF_RADIO)
+            radioApply(p->id == P_SF ? v : radioSf, p->id == P_BW ? v : radioBw, p->id == P_CR ? v : radioCr);
+        else
+        {
+            *p->value = v;
+            Serial.printf("%s = %lu\n", p->name, v);
+        }
+    }
+    else
+        Serial.printf("unknown command: %s\n", line);
+}
+
+// Downlink from the gateway's host bridge. Every copy is acked, since the
+// gateway retries until it hears one; the last few ids filter the repeats.
+constexpr uint8_t DOWN_SEEN = 4;
+static uint16_t downSeen[DOWN_SEEN];
+static uint8_t downSeenCount = 0, downSeenNext = 0;
+static void (*downHandler)(const uint8_t *data, uint8_t len) = nullptr;
+
+void meshOnDownlink(void (*fn)(const uint8_t *data, uint8_t len)) { downHandler = fn; }
+
+static void onDataDown(const uint8_t *pl, uint8_t len)
+{
+    DataDownHdr hdr;
+    memcpy(&hdr, pl, sizeof(hdr));
+    DownAckPayload ack{hdr.id};
+    (void)sendPacket(myId, GW_ID, 0, (MsgType)MSG_DOWN_ACK, (uint8_t *)&ack, sizeof(ack));
+    for (uint8_t i = 0; i < downSeenCount; ++i)
+        if (downSeen[i] == hdr.id)
+            return;
+    downSeen[downSeenNext] = hdr.id;
+    downSeenNext = (uint8_t)((downSeenNext + 1) % DOWN_SEEN);
+    if (downSeenCount < DOWN_SEEN)
+        ++downSeenCount;
+    const uint8_t n = (uint8_t)(len - sizeof(hdr));
+    if (downHandler)
+        downHandler(pl + sizeof(hdr), n);
+    else
+        Serial.printf("DOWN #%u %u B\n", hdr.id, n);
+}
+
+// Firmware update, receiving and relaying (see ota.h). Chunks from any
+// neighbour count once their parent has offered the image; the complete
+// image stays in OTA_FILE, so a relay serves its children from it, also
+// after a reboot. A transfer cut by a reboot starts over at the next offer.
+// The update is built and activated once nothing is left to serve.
+#ifndef OTA_REBOOT_DELAY_MS
+#define OTA_REBOOT_DELAY_MS 15000 // lets OTA_STATUS reach the gateway first
+#endif
+#ifndef OTA_CONFIRM_MS
+#define OTA_CONFIRM_MS 1800000 // a new image the gateway has not answered by then is rolled back
+#endif
+static_assert(OTA_CONFIRM_MS >= 4 * JOIN_BACKOFF_MAX_MS, "OTA_CONFIRM_MS must leave room for a few joins");
+// The Arduino core marks every image valid at boot unless this says the
+// app does it, and the bootloader only goes back when built for rollback.
+extern "C" bool verifyRollbackLater() { return true; }
+#if !CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+#error "OTA rollback needs CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE in the bootloader"
+#endif
+constexpr uint32_t OTA_NEED_RETRY_MS = 300000;
+constexpr size_t OTA_PAGE = 4096;
+struct OtaRecv
+{
+    uint32_t id; // 0 = none
+    uint32_t len;
+    uint32_t crc;
+    uint16_t chunks;
+    uint16_t count; // chunks in
+    uint8_t have[OTA_MAP_BYTES];
+    uint32_t needAt; // 0 = no NEED due
+    bool ready;      // OTA_FILE holds the whole image, CRC checked
+    bool applied;    // built (or failed to build) into the update partition
+};
+static OtaRecv otaRx;
+static OtaServe otaTx;
+static uint32_t otaRebootAt = 0;
+static uint32_t otaRunId = 0;  // booted into this image: keep it once the gateway answers
+static uint32_t otaBackId = 0; // that image failed and the bootloader went back: report it
+
+static void otaReport(uint32_t id, uint8_t status)
+{
+    OtaStatusPayload s{id, status};
+    (void)sendPacket(myId, GW_ID, 0, (MsgType)MSG_OTA_STATUS, (uint8_t *)&s, sizeof(s));
+}
+
+static void otaStatus(uint8_t status)
+{
+    if (myId < ADDR_UNASSIGNED)
+        otaReport(otaRx.id, status);
+}
+
+// One-hop broadcast for otaServePump, sent now or not at all like BEACON
+static int16_t otaBroadcast(MsgType type, const uint8_t *pl, uint8_t len)
+{
+    if (txHeld())
+        return ERR_TX_DEFERRED;
+    MeshHeader h{HDR_MAGIC, myId, ADDR_BCAST, 0, type, len};
     uint8_t buf[sizeof(MeshHeader) + MAX_PAYLOAD];
-    int16_t rc = radio.readData(buf, sizeof(buf));
-    if (rc == RADIOLIB_ERR_RX_TIMEOUT)
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), pl, len);
+    return transmitWithDC(buf, sizeof(h) + len);
+}
+
+static uint32_t otaGapMs() { return loraAirtimeMs(cfg.sf, cfg.bw, cfg.cr, sizeof(MeshHeader) + MAX_PAYLOAD); }
+
+static bool otaRecvStart(const OtaOfferPayload &o)
+{
+    memset(&otaRx, 0, sizeof(otaRx));
+    otaTx.id = 0;
+    prefs.remove("ota_id");
+    if (!sfReady || o.len > OTA_MAX_BYTES)
+        return false;
+    // written out in full now, so chunks land with a seek
+    LittleFS.mkdir(OTA_DIR);
+    File f = LittleFS.open(OTA_FILE, "w");
+    if (!f)
+        return false;
+    uint8_t zero[256] = {0};
+    for (uint32_t off = 0; off < o.len; off += sizeof(zero))
+        if (!f.write(zero, std::min<uint32_t>(sizeof(zero), o.len - off)))
+        {
+            f.close();
+            return false;
+        }
+    f.close();
+    otaRx.id = o.id;
+    otaRx.len = o.len;
+    otaRx.crc = o.crc;
+    otaRx.chunks = otaChunks(o.len);
+    Serial.printf("OTA: image %08lX, %lu B offered\n", (unsigned long)o.id, (unsigned long)o.len);
+    return true;
+}
+
+static void onOtaOffer(const MeshHeader &h, const uint8_t *pl)
+{
+    if (h.src != parentId || h.len < sizeof(OtaOfferPayload))
         return;
-    if (rc != RADIOLIB_ERR_NONE)
+    OtaOfferPayload o;
+    memcpy(&o, pl, sizeof(o));
+    if (!o.id || (o.id != otaRx.id && !otaRecvStart(o)))
+        return;
+    // answer an asking offer, also ahead of a pending retry
+    const uint32_t now = millis();
+    if (o.ask && !otaRx.ready && (!otaRx.needAt || (int32_t)(otaRx.needAt - now) > (int32_t)OTA_NEED_JITTER_MS))
+        otaRx.needAt = now + 1 + (uint32_t)random(0, OTA_NEED_JITTER_MS);
+}
+
+static void otaComplete()
+{
+    uint32_t crc;
+    if (!otaFileCrc(otaRx.len, crc) || crc != otaRx.crc)
     {
-        radio.startReceive();
+        Serial.println(F("OTA: image CRC mismatch, fetching again"));
+        memset(otaRx.have, 0, sizeof(otaRx.have));
+        otaRx.count = 0;
+        otaRx.needAt = millis() + 1 + (uint32_t)random(0, OTA_NEED_JITTER_MS);
+        return;
+    }
+    otaRx.ready = true;
+    otaRx.needAt = 0;
+    prefs.putUInt("ota_len", otaRx.len);
+    prefs.putUInt("ota_crc", otaRx.crc);
+    prefs.putUInt("ota_id", otaRx.id);
+    Serial.printf("OTA: image %08lX complete\n", (unsigned long)otaRx.id);
+    otaStatus(OTA_ST_COMPLETE);
+    if (childCount() > 0)
+        otaServeStart(otaTx, otaRx.id, otaRx.len, otaRx.crc, otaGapMs(), true);
+}
+
+static void onOtaChunk(const uint8_t *pl, uint8_t len)
+{
+    OtaChunkHdr c;
+    memcpy(&c, pl, sizeof(c));
+    if (!otaRx.id || otaRx.ready || c.id != otaRx.id || c.idx >= otaRx.chunks || otaBit(otaRx.have, c.idx) ||
+        len - sizeof(c) != otaChunkLen(otaRx.len, c.idx))
+        return;
+    File f = LittleFS.open(OTA_FILE, "r+");
+    const bool ok = f && f.seek((uint32_t)c.idx * OTA_CHUNK) &&
+                    f.write(pl + sizeof(c), len - sizeof(c)) == len - sizeof(c);
+    if (f)
+        f.close();
+    if (!ok)
+        return;
+    // chunks are flowing: the next NEED waits for the sender to ask
+    if (otaRx.needAt)
+        otaRx.needAt = millis() + OTA_NEED_RETRY_MS;
+    otaSetBit(otaRx.have, c.idx);
+    if (++otaRx.count == otaRx.chunks)
+        otaComplete();
+}
+
+// The first missing chunk and up to OTA_NEED_BYTES * 8 after it
+static void otaSendNeed()
+{
+    uint8_t pl[sizeof(OtaNeedHdr) + OTA_NEED_BYTES] = {0};
+    OtaNeedHdr h{otaRx.id, 0};
+    while (h.base < otaRx.chunks && otaBit(otaRx.have, h.base))
+        ++h.base;
+    uint8_t *bits = pl + sizeof(h);
+    uint8_t n = 0;
+    for (uint16_t i = 0; i < OTA_NEED_BYTES * 8 && h.base + i < otaRx.chunks; ++i)
+        if (!otaBit(otaRx.have, (uint16_t)(h.base + i)))
+        {
+            otaSetBit(bits, i);
+            n = (uint8_t)(i / 8 + 1);
+        }
+    memcpy(pl, &h, sizeof(h));
+    (void)sendPacket(myId, parentId, 0, (MsgType)MSG_OTA_NEED, pl, (uint8_t)(sizeof(h) + n));
+}
+
+// NEED from a child: serve it from the complete image, also after our own
+// round has ended
+static void onOtaNeed(const MeshHeader &h, const uint8_t *pl)
+{
+    if (!isChild(h.src) || h.len < sizeof(OtaNeedHdr) || !otaRx.ready)
+        return;
+    if (otaTx.id != otaRx.id)
+        otaServeStart(otaTx, otaRx.id, otaRx.len, otaRx.crc, otaGapMs(), false);
+    otaServeNeed(otaTx, pl, h.len);
+}
+
+// Buffered reader over the delta in OTA_FILE
+struct OtaReader
+{
+    File f;
+    uint8_t buf[256];
+    uint16_t pos, end;
+};
+static bool otaGet(OtaReader &r, uint8_t &b)
+{
+    if (r.pos == r.end)
+    {
+        r.end = (uint16_t)r.f.read(r.buf, sizeof(r.buf));
+        r.pos = 0;
+        if (!r.end)
+            return false;
+    }
+    b = r.buf[r.pos++];
+    return true;
+}
+static bool otaVarint(OtaReader &r, uint32_t &v)
+{
+    v = 0;
+    for (uint8_t shift = 0; shift < 35; shift += 7)
+    {
+        uint8_t b;
+        if (!otaGet(r, b))
+            return false;
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Output side: whole pages go to esp_ota_write; the page being filled
+// serves COPY_NEW sources that are not in flash yet.
+struct OtaWriter
+{
+    esp_ota_handle_t h;
+    const esp_partition_t *part;
+    uint8_t *page;
+    uint32_t base, fill; // page offset in the image, bytes in it
+    mbedtls_sha256_context sha;
+};
+static bool otaPut(OtaWriter &w, const uint8_t *p, size_t n)
+{
+    while (n)
+    {
+        const size_t k = std::min(n, OTA_PAGE - w.fill);
+        memcpy(w.page + w.fill, p, k);
+        w.fill += k;
+        p += k;
+        n -= k;
+        if (w.fill == OTA_PAGE)
+        {
+            mbedtls_sha256_update(&w.sha, w.page, OTA_PAGE);
+            if (esp_ota_write(w.h, w.page, OTA_PAGE) != ESP_OK)
+                return false;
+            w.base += OTA_PAGE;
+            w.fill = 0;
+        }
+    }
+    return true;
+}
+
+static bool otaSha(const esp_partition_t *part, uint32_t len, uint8_t out[32])
+{
+    uint8_t buf[256];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    bool ok = len <= part->size;
+    for (uint32_t off = 0; ok && off < len; off += sizeof(buf))
+    {
+        const size_t k = std::min<uint32_t>(sizeof(buf), len - off);
+        ok = esp_partition_read(part, off, buf, k) == ESP_OK;
+        mbedtls_sha256_update(&sha, buf, k);
+    }
+    mbedtls_sha256_finish(&sha, out);
+    mbedtls_sha256_free(&sha);
+    return ok;
+}
+
+// Builds the new firmware from the delta into the next OTA partition and
+// makes it the boot partition; returns an OTA_ST_ code. Takes a few seconds
+// of flash work, during which the radio is not serviced.
+static uint8_t otaApply()
+{
+    OtaReader r;
+    r.pos = r.end = 0;
+    r.f = LittleFS.open(OTA_FILE, "r");
+    OtaImageHdr hdr;
+    if (!r.f || r.f.read((uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != OTA_IMAGE_MAGIC ||
+        hdr.version != OTA_IMAGE_VERSION)
+    {
+        if (r.f)
+            r.f.close();
+        return OTA_ST_BAD_IMAGE;
+    }
+    const esp_partition_t *run = esp_ota_get_running_partition();
+    uint8_t sha[32];
+    if (hdr.oldLen && (!otaSha(run, hdr.oldLen, sha) || memcmp(sha, hdr.oldSha, sizeof(sha))))
+    {
+        r.f.close();
+        return OTA_ST_BASE_MISMATCH;
+    }
+    OtaWriter w;
+    w.part = esp_ota_get_next_update_partition(nullptr);
+    w.page = (uint8_t *)malloc(OTA_PAGE);
+    w.base = w.fill = 0;
+    if (!w.part || !w.page || hdr.newLen > w.part->size || esp_ota_begin(w.part, hdr.newLen, &w.h) != ESP_OK)
+    {
+        free(w.page);
+        r.f.close();
+        return OTA_ST_FLASH_ERROR;
+    }
+    mbedtls_sha256_init(&w.sha);
+    mbedtls_sha256_starts(&w.sha, 0);
+    uint8_t st = OTA_ST_BAD_IMAGE;
+    uint8_t tmp[256];
+    uint32_t cursor = 0; // in the running image
+    for (;;)
+    {
+        const uint32_t out = w.base + w.fill;
+        if (out == hdr.newLen)
+        {
+            st = OTA_ST_ACTIVATING;
+            break;
+        }
+        uint32_t v, arg = 0;
+        if (!otaVarint(r, v) || ((v & 3) != OTA_OP_LITERAL && !otaVarint(r, arg)))
+            break;
+        uint32_t n = v >> 2;
+        if (n > hdr.newLen - out)
+            break;
+        bool ok = true;
+        if ((v & 3) == OTA_OP_LITERAL)
+        {
+            for (uint8_t b; ok && n && otaGet(r, b); --n)
+                ok = otaPut(w, &b, 1);
+            ok = ok && !n;
+        }
+        else if ((v & 3) == OTA_OP_COPY_OLD)
+        {
+            cursor += (arg >> 1) ^ (0u - (arg & 1)); // zigzag
+            if (cursor > hdr.oldLen || n > hdr.oldLen - cursor)
+                break;
+            for (; ok && n; n -= (uint32_t)std::min<uint32_t>(n, sizeof(tmp)))
+            {
+                const size_t k = std::min<uint32_t>(n, sizeof(tmp));
+                ok = esp_partition_read(run, cursor, tmp, k) == ESP_OK && otaPut(w, tmp, k);
+                cursor += k;
+            }
+        }
+        else if ((v & 3) == OTA_OP_COPY_NEW)
+        {
+            if (!arg || arg > out)
+                break;
+            for (uint32_t src = out - arg; ok && n;)
+            {
+                if (src >= w.base)
+                {
+                    // may overlap what it writes, so byte by byte
+                    const uint8_t b = w.page[src++ - w.base];
+                    ok = otaPut(w, &b, 1);
+                    --n;
+                    continue;
+                }
+                const size_t k = std::min<uint32_t>(std::min<uint32_t>(n, sizeof(tmp)), w.base - src);
+                ok = esp_partition_read(w.part, src, tmp, k) == ESP_OK && otaPut(w, tmp, k);
+                src += k;
+                n -= k;
+            }
+        }
+        else
+            break;
+        if (!ok)
+        {
+            st = OTA_ST_FLASH_ERROR;
+            break;
+        }
+    }
+    r.f.close();
+    if (st == OTA_ST_ACTIVATING && w.fill)
+    {
+        mbedtls_sha256_update(&w.sha, w.page, w.fill);
+        if (esp_ota_write(w.h, w.page, w.fill) != ESP_OK)
+            st = OTA_ST_FLASH_ERROR;
+    }
+    mbedtls_sha256_finish(&w.sha, sha);
+    mbedtls_sha256_free(&w.sha);
+    free(w.page);
+    if (st == OTA_ST_ACTIVATING && memcmp(sha, hdr.newSha, sizeof(sha)))
+        st = OTA_ST_BAD_IMAGE;
+    if (st != OTA_ST_ACTIVATING)
+    {
+        esp_ota_abort(w.h);
+        return st;
+    }
+    if (esp_ota_end(w.h) != ESP_OK || esp_ota_set_boot_partition(w.part) != ESP_OK)
+        return OTA_ST_FLASH_ERROR;
+    return st;
+}
+
+static void otaActivate()
+{
+    otaRx.applied = true;
+    prefs.putUInt("ota_ap", otaRx.id);
+    const uint8_t st = otaApply();
+    Serial.printf("OTA: image %08lX -> status %u\n", (unsigned long)otaRx.id, st);
+    otaStatus(st);
+    if (st != OTA_ST_ACTIVATING)
+        return;
+    prefs.putUInt("ota_run", otaRx.id);
+    otaRebootAt = millis() + OTA_REBOOT_DELAY_MS;
+}
+
+// Boot: the kept image, and whether we are running one we just built. The
+// bootloader boots a new image once, pending verification; if it resets
+// before otaLoop() marks it valid, the old image comes back.
+static void otaBegin()
+{
+    otaRunId = prefs.getUInt("ota_run", 0);
+    esp_ota_img_states_t state;
+    if (otaRunId && (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) != ESP_OK ||
+                     state != ESP_OTA_IMG_PENDING_VERIFY))
+    {
+        otaBackId = otaRunId;
+        otaRunId = 0;
+        prefs.remove("ota_run");
+    }
+    const uint32_t id = prefs.getUInt("ota_id", 0);
+    const uint32_t len = prefs.getUInt("ota_len", 0);
+    uint32_t crc;
+    if (!id || !sfReady || len > OTA_MAX_BYTES || !otaFileCrc(len, crc) || crc != prefs.getUInt("ota_crc", 0))
+        return;
+    otaRx.id = id;
+    otaRx.len = len;
+    otaRx.crc = crc;
+    otaRx.chunks = otaRx.count = otaChunks(len);
+    for (uint16_t i = 0; i < otaRx.chunks; ++i)
+        otaSetBit(otaRx.have, i);
+    otaRx.ready = true;
+    otaRx.applied = prefs.getUInt("ota_ap", 0) == id;
+}
+
+static void otaLoop(uint32_t now)
+{
+    if (otaRebootAt && (int32_t)(now - otaRebootAt) >= 0)
+        ESP.restart();
+    if (otaRunId && !gwAnswered && now > OTA_CONFIRM_MS)
+    {
+        Serial.printf("OTA: image %08lX never reached the gateway, rolling back\n", (unsigned long)otaRunId);
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+    if (parentId == ADDR_NONE || myId >= ADDR_UNASSIGNED)
         return;
+    if (otaRunId && gwAnswered)
+    {
+        // the gateway answered us on the new image: keep it
+        esp_ota_mark_app_valid_cancel_rollback();
+        otaReport(otaRunId, OTA_ST_RUNNING);
+        prefs.remove("ota_run");
+        otaRunId = 0;
+    }
+    if (otaBackId)
+    {
+        otaReport(otaBackId, OTA_ST_ROLLED_BACK);
+        otaBackId = 0;
     }
+    if (otaRx.needAt && (int32_t)(now - otaRx.needAt) >= 0)
+    {
+        otaSendNeed();
+        otaRx.needAt = now + OTA_NEED_RETRY_MS;
+    }
+    otaServePump(otaTx, now, otaBroadcast);
+    if (otaRx.ready && !otaRx.applied && !otaTx.id && !otaRebootAt)
+        otaActivate();
+}
+
+static void otaPrint()
+{
+    Serial.printf("{\"ota\":{\"id\":%lu,\"len\":%lu,\"chunks\":%u,\"have\":%u,\"ready\":%d,\"applied\":%d,"
+                  "\"serving\":%d,\"sent\":%lu,\"needs\":%lu}}\n",
+                  (unsigned long)otaRx.id, (unsigned long)otaRx.len, otaRx.chunks, otaRx.count, otaRx.ready, otaRx.applied,
+                  otaTx.id != 0, (unsigned long)otaTx.sent, (unsigned long)otaTx.needs);
+}
+
+void meshSetupNode()
+{
+    pinMode(LED_BUILTIN, OUTPUT);
+    prefs.begin("mesh", false);
+    uint64_t mac = ESP.getEfuseMac();
+    for (uint8_t i = 0; i < 6; ++i)
+        myMac[i] = (uint8_t)(mac >> (8 * i));
+    // address assigned by the gateway on a previous join, if any
+    myId = prefs.getUShort("id16", ADDR_UNASSIGNED);
+    if (!myId)
+        myId = ADDR_UNASSIGNED;
+    Serial.printf("MeshHeader=%u bytes\n", (unsigned)sizeof(MeshHeader));
+    curSf = cfg.sf;
+    radioSf = cfg.sf;
+    radioBw = (uint32_t)cfg.bw;
+    radioCr = cfg.cr;
+    paramLoad(paramTable, PARAM_COUNT);
+    keptSf = radioSf;
+    keptBw = radioBw;
+    keptCr = radioCr;
+    if (radioSf != cfg.sf || radioBw != (uint32_t)cfg.bw || radioCr != cfg.cr)
+        radioApply(radioSf, radioBw, radioCr);
+    dcSetFreq(cfg.freq);
+    // desynchronise the first JOIN_REQ of nodes powered up together
+    nextJoinAt = millis() + (uint32_t)random(0, JOIN_RETRY_MS);
+    radioHuntAt = millis() + lostParentMs;
+    upSeq = (uint16_t)random(0, 0x10000);
+#if ENABLE_TEST_TX
+    testBoot = (uint16_t)random(1, 0x10000);
+#endif
+    trickleInit(beacon, CFG_TRICKLE_IMIN_MS, TRICKLE_K);
+    sfBegin();
+    otaBegin();
+    radio.startReceive();
+}
 
+// One frame off the air, or decoded from a MSG_XOR, which handles the
+// frame exactly as if the relay had sent it on its own
+static void handleFrame(uint8_t *buf, int16_t rssi, uint32_t rxAt)
+{
     auto &h = *reinterpret_cast<MeshHeader *>(buf);
-    if (h.magic != HDR_MAGIC)
+    if (h.magic != HDR_MAGIC || h.len > MAX_PAYLOAD)
         return;
 
-    int16_t rssi = radio.getRSSI();
+    const uint32_t hash = frameHash(h, buf + sizeof(MeshHeader));
+    if (hopAcked(hash, h.hops))
+        return;
+    timeSample(h, buf + sizeof(MeshHeader), rxAt);
 
-    if (h.src != myId)
-        candUpdate(h.src, rssi, h.hops);
+    if (h.src != myId && h.src < ADDR_UNASSIGNED)
+    {
+        if (h.type != BEACON)
+            candUpdate(h.src, rssi, h.hops);
+        else if (h.len >= sizeof(BeaconPayload))
+            candUpdate(h.src, rssi, h.hops, buf[sizeof(MeshHeader)]); // BeaconPayload::hops
+    }
 
     if (h.src == parentId)
         lastParentRx = millis();
@@ -436,9 +2076,22 @@ static void handleRx()
             c->lastSeen = millis();
     }
 
-    if (h.dst != myId && h.dst != 0xFF)
+    // A child of ours admitted by someone else never heard our JOIN_ACK, or
+    // has moved; forwarding for it as well would only collide with its parent
+    if (h.type == JOIN_ACK && h.src != myId)
+        for (uint8_t off = 0; off + sizeof(JoinPayload) <= h.len; off += sizeof(JoinPayload))
+        {
+            const addr_t id = reinterpret_cast<JoinPayload *>(buf + sizeof(MeshHeader) + off)->addr;
+            if (isChild(id))
+            {
+                removeChildLocal(id);
+                forgetVia(id);
+            }
+        }
+
+    if (h.dst != myId && h.dst != ADDR_BCAST)
     {
-        forward(h, buf + sizeof(MeshHeader));
+        forward(h, buf + sizeof(MeshHeader), hash, rxAt);
         return;
     }
 
@@ -446,112 +2099,338 @@ static void handleRx()
     {
     case JOIN_REQ:
     {
-        if (parentId == 0xFF)
+        if (parentId == ADDR_NONE || myId >= ADDR_UNASSIGNED || h.len < sizeof(JoinPayload))
             break;
 
-        if (childCount() < MAX_CHILDREN && addChildLocal(h.src))
+        // the gateway owns the address space: ask it before accepting
+        auto *jp = reinterpret_cast<JoinPayload *>(buf + sizeof(MeshHeader));
+        if (childCount() < MAX_CHILDREN && holdJoin(jp->mac, h.src))
+            sendPacket(myId, GW_ID, 0, (MsgType)MSG_ADDR_REQ, (uint8_t *)jp, sizeof(*jp));
+        else
+            sendPacket(myId, h.src, 0, (MsgType)MSG_JOIN_NACK, (uint8_t *)jp, sizeof(*jp));
+        break;
+    }
+
+    case (MsgType)MSG_ADDR_ACK:
+    {
+        if (h.len < sizeof(JoinPayload))
+            break;
+        auto *jp = reinterpret_cast<JoinPayload *>(buf + sizeof(MeshHeader));
+        HeldJoin *hj = findHeldJoin(jp->mac);
+        if (!hj)
+            break;
+        hj->in_use = false;
+        // already ours: our last JOIN_ACK to it was lost
+        if (jp->addr && (isChild(jp->addr) || addChildLocal(jp->addr)))
         {
-            sendPacket(myId, h.src, MAX_HOPS, JOIN_ACK);
-            ChildEventPayload ev{h.src, myId, (uint8_t)((myHopToGW == 0xFF) ? 0xFF : (myHopToGW + 1))};
-            sendPacket(myId, GW_ID, MAX_HOPS, (MsgType)MSG_CHILD_ADD, (uint8_t *)&ev, sizeof(ev));
+            sendPacket(myId, hj->replyTo, 0, JOIN_ACK, (uint8_t *)jp, sizeof(*jp));
+            ChildEventPayload ev{jp->addr, myId, (uint8_t)((myHopToGW == 0xFF) ? 0xFF : (myHopToGW + 1))};
+            sendPacket(myId, GW_ID, 0, (MsgType)MSG_CHILD_ADD, (uint8_t *)&ev, sizeof(ev));
         }
         else
         {
-            sendPacket(myId, h.src, MAX_HOPS, (MsgType)MSG_JOIN_NACK);
+            sendPacket(myId, hj->replyTo, 0, (MsgType)MSG_JOIN_NACK, (uint8_t *)jp, sizeof(*jp));
         }
         break;
     }
 
     case JOIN_ACK:
-        if (h.dst == myId)
+    {
+        // Unicast from a relay or a gateway batch listing several joiners;
+        // unassigned nodes share ADDR_UNASSIGNED, so the MAC decides.
+        const JoinPayload *jp = nullptr;
+        for (uint8_t off = 0; off + sizeof(JoinPayload) <= h.len; off += sizeof(JoinPayload))
         {
-            if (parentId != 0xFF)
+            auto *e = reinterpret_cast<JoinPayload *>(buf + sizeof(MeshHeader) + off);
+            if (!memcmp(e->mac, myMac, 6))
             {
-                radio.startReceive();
-                return;
+                jp = e;
+                break;
             }
-            parentId = h.src;
-            lastParentRx = millis();
-            Serial.printf("JOIN_ACK from 0x%02X -> parent set\n", parentId);
         }
+        if ((h.dst != myId && h.dst != ADDR_BCAST) || !jp)
+            break;
+        if (parentId != ADDR_NONE)
+        {
+            radio.startReceive();
+            return;
+        }
+        if (jp->addr != myId && jp->addr && jp->addr < ADDR_UNASSIGNED)
+        {
+            myId = jp->addr;
+            prefs.putUShort("id16", myId);
+            Serial.printf("assigned address 0x%04X\n", myId);
+        }
+        parentId = h.src;
+        lastParentRx = millis();
+        gwAnswered = true;
+        upResync();
+        radioKeep();
+        joinAttempts = 0;
+        solicits = 0;
+        for (auto &c : cand)
+            if (c.id == parentId && c.depth != 0xFF)
+                myHopToGW = c.depth + 1;
+        // a new relay: announce ourselves to whoever is still looking
+        trickleStart(beacon, millis());
+        Serial.printf("JOIN_ACK from 0x%04X -> parent set\n", parentId);
         break;
+    }
 
     case (MsgType)MSG_JOIN_NACK:
-        if (h.dst == myId)
+    {
+        auto *jp = reinterpret_cast<JoinPayload *>(buf + sizeof(MeshHeader));
+        if (h.dst == myId && (h.len < sizeof(JoinPayload) || !memcmp(jp->mac, myMac, 6)))
         {
-            parentId = 0xFF;
+            parentId = ADDR_NONE;
+            trickleStop(beacon);
         }
         break;
+    }
 
     case QUERY:
     {
-        myHopToGW = h.hops;
-        StatusPayload sp{parentId, h.hops, int8_t(parentRssi)};
+        if (myId >= ADDR_UNASSIGNED)
+            break;
+        lastQueryRx = millis();
+        if (h.len >= sizeof(QueryPayload) + sizeof(DataAckPayload))
+            onDataAck(*reinterpret_cast<DataAckPayload *>(buf + sizeof(MeshHeader) + sizeof(QueryPayload)));
+        myHopToGW = h.hops + 1;
+        StatusPayload sp{parentId, myHopToGW, int8_t(parentRssi)};
         Serial.println("they want me fr");
-        int st = sendPacket(myId, GW_ID, MAX_HOPS, STATE, (uint8_t *)&sp, sizeof(sp));
+        int st = sendPacket(myId, GW_ID, 0, STATE, (uint8_t *)&sp, sizeof(sp));
         Serial.printf("n ey got me %d", st);
         break;
     }
 
+    case (MsgType)MSG_FRAG_ACK:
+        if (h.dst == myId && h.src == GW_ID && h.len >= sizeof(FragAckHdr))
+            onFragAck(*reinterpret_cast<FragAckHdr *>(buf + sizeof(MeshHeader)),
+                      buf + sizeof(MeshHeader) + sizeof(FragAckHdr), (uint8_t)(h.len - sizeof(FragAckHdr)));
+        break;
+
     case DATA_ACK:
+        if (h.src == GW_ID && h.len >= sizeof(DataAckPayload))
+            onDataAck(*reinterpret_cast<DataAckPayload *>(buf + sizeof(MeshHeader)));
+        break;
+
+    case BEACON:
+        onBeacon(h, buf + sizeof(MeshHeader));
+        break;
+
+    case (MsgType)MSG_DATA_DOWN:
+        if (h.dst == myId && h.src == GW_ID && h.len >= sizeof(DataDownHdr))
+        {
+            // the gateway lingers on our link after a downlink (ADR_LINGER_MS),
+            // so the DOWN_ACK may go out now rather than after the next QUERY
+            lastQueryRx = millis();
+            onDataDown(buf + sizeof(MeshHeader), h.len);
+        }
+        break;
+
+    case (MsgType)MSG_PARAM_SET:
+        if (h.dst == myId && h.src == GW_ID)
+            onParamSet(buf + sizeof(MeshHeader), h.len);
+        break;
+
+    case (MsgType)MSG_OTA_OFFER:
+        onOtaOffer(h, buf + sizeof(MeshHeader));
+        break;
+
+    case (MsgType)MSG_OTA_CHUNK:
+        if (h.len > sizeof(OtaChunkHdr))
+            onOtaChunk(buf + sizeof(MeshHeader), h.len);
+        break;
+
+    case (MsgType)MSG_OTA_NEED:
+        if (h.dst == myId)
+            onOtaNeed(h, buf + sizeof(MeshHeader));
+        break;
+
+    case (MsgType)MSG_ADR_CMD:
+    {
+        // only a leaf hanging directly off the gateway may leave the base SF
+        if (h.dst != myId || h.len < sizeof(AdrCmdPayload) || h.src != GW_ID ||
+            parentId != GW_ID || childCount() > 0)
+            break;
+        auto *cmd = reinterpret_cast<AdrCmdPayload *>(buf + sizeof(MeshHeader));
+        if (cmd->sf < 7 || cmd->sf > 12 || cmd->ch > NUM_DATA_CHANNELS)
+            break;
+        adrNextSf = cmd->sf;
+        adrNextCh = cmd->ch;
+        adrSwitchAt = millis() + cmd->switchInMs;
+        break;
+    }
+
+    case (MsgType)MSG_XOR:
+    {
+        if (h.len <= sizeof(XorHdr))
+            break;
+        // the relay forwarded both, whether or not one of them is ours
+        XorHdr x;
+        memcpy(&x, buf + sizeof(MeshHeader), sizeof(x));
+        (void)hopAcked(x.hash[0], x.hops[0]);
+        (void)hopAcked(x.hash[1], x.hops[1]);
+        uint8_t f[sizeof(MeshHeader) + MAX_PAYLOAD];
+        if (ncReceive(ncSent, buf + sizeof(MeshHeader), h.len, f) &&
+            reinterpret_cast<MeshHeader *>(f)->type != (MsgType)MSG_XOR)
+            handleFrame(f, rssi, rxAt);
         break;
+    }
 
     default:
         break;
     }
 }
 
+static void handleRx()
+{
+    uint8_t buf[sizeof(MeshHeader) + MAX_PAYLOAD];
+    int16_t rc = radio.readData(buf, sizeof(buf));
+    if (rc == RADIOLIB_ERR_RX_TIMEOUT)
+        return;
+    PERF_SCOPE(PERF_RX);
+    if (rc != RADIOLIB_ERR_NONE)
+    {
+        radio.startReceive();
+        return;
+    }
+    const uint32_t rxAt = millis();
+    handleFrame(buf, radio.getRSSI(), rxAt);
+}
+
 static void pruneChildren()
 {
     uint32_t now = millis();
     for (auto &c : children)
     {
-        if (c.id && now - c.lastSeen > CHILD_SILENT_MS)
+        if (c.id && now - c.lastSeen > childSilentMs)
         {
             ChildEventPayload ev{c.id, myId, (uint8_t)((myHopToGW == 0xFF) ? 0xFF : (myHopToGW + 1))};
-            sendPacket(myId, GW_ID, MAX_HOPS, (MsgType)MSG_CHILD_GONE, (uint8_t *)&ev, sizeof(ev));
-            Serial.printf("Child 0x%02X aged out\n", c.id);
+            sendPacket(myId, GW_ID, 0, (MsgType)MSG_CHILD_GONE, (uint8_t *)&ev, sizeof(ev));
+            Serial.printf("Child 0x%04X aged out\n", c.id);
+            forgetVia(c.id);
             c.id = 0;
         }
     }
+    for (auto &d : desc)
+        if (d.id && now - d.lastSeen > childSilentMs)
+            d.id = 0;
+}
+
+// Serial console commands (see console.h)
+static void onCommand(const char *line)
+{
+    if (!strcmp(line, "ota"))
+        otaPrint();
+    else if (!strcmp(line, "nc"))
+        ncPrint(ncSent, ncEnabled);
+#if ENABLE_PERF
+    else if (!strcmp(line, "perf"))
+        perfDump("node", perfMarks, MARK_COUNT);
+    else if (!strcmp(line, "perf reset"))
+    {
+        perfReset(perfMarks, MARK_COUNT);
+        Serial.println(F("perf cleared"));
+    }
+    else
+#endif
+        onParamCommand(line);
 }
 
 void meshLoopNode()
 {
+    PERF_SCOPE(PERF_LOOP);
     processTxQueue();
     handleRx();
     pruneChildren();
+    pollSerial(onCommand);
 
     uint32_t now = millis();
 
-    digitalWrite(LED_BUILTIN, (parentId != 0xFF) ? ((now >> 8) & 1) : ((now >> 10) & 1));
+    digitalWrite(LED_BUILTIN, (parentId != ADDR_NONE) ? ((now >> 8) & 1) : ((now >> 10) & 1));
+
+    uint32_t net;
+    if (radioSwitchNet && meshNetworkTime(net))
+    {
+        const uint32_t at = radioSwitchNet;
+        radioSwitchNet = 0;
+        radioSchedule(at);
+    }
+    if (radioSwitchAt && (int32_t)(now - radioSwitchAt) >= 0)
+    {
+        radioSwitchAt = 0;
+        radioSwitch();
+    }
+    if (adrNextSf && (int32_t)(now - adrSwitchAt) >= 0)
+    {
+        setLink(adrNextSf, adrNextCh);
+        adrNextSf = 0;
+        lastParentRx = now; // rollback timer starts at the switch
+    }
+    if (offBaseLink() && now - lastParentRx > ADR_ROLLBACK_MS)
+    {
+        Serial.println(F("ADR: gateway silent, back to base link"));
+        setLink(cfg.sf, 0);
+    }
 
-    if (parentId != 0xFF && now - lastParentRx > LOST_PARENT_MS)
+    if (parentId != ADDR_NONE && now - lastParentRx > lostParentMs)
     {
         Serial.println(F("Parent silent → detach"));
-        parentId = 0xFF;
+        parentId = ADDR_NONE;
+        trickleStop(beacon);
         for (auto &c : children)
             c.id = 0;
+        for (auto &d : desc)
+            d.id = 0;
+        setLink(cfg.sf, 0);
+        upResync();
+        if (radioSwitchNet)
+        {
+            // the tree has most likely moved without us
+            radioSwitchNet = 0;
+            radioSwitch();
+        }
+        else if (pickParent() == ADDR_NONE)
+            radioHunt();
+        radioHuntAt = now + lostParentMs;
+    }
+    else if (parentId == ADDR_NONE && (int32_t)(now - radioHuntAt) >= 0)
+    {
+        // nobody to join on this profile for a whole liveness period
+        if (pickParent() == ADDR_NONE)
+            radioHunt();
+        radioHuntAt = now + lostParentMs;
     }
 
-    if (parentId == 0xFF)
+    if (parentId == ADDR_NONE)
     {
         if (now >= nextJoinAt)
         {
-            uint8_t p = pickParent();
-            if (p == 0xFF)
+            addr_t p = pickParent();
+            if (p == ADDR_NONE)
             {
                 nextJoinAt = now + JOIN_RETRY_MS;
+                // nobody heard: ask the neighbourhood to beacon, backing off
+                if ((int32_t)(now - nextSolicitAt) >= 0)
+                {
+                    (void)sendPacket(myId, ADDR_BCAST, 0, BEACON);
+                    nextSolicitAt = now + (JOIN_RETRY_MS << std::min<uint8_t>(solicits, SOLICIT_MAX_SHIFT));
+                    if (solicits < 0xFF)
+                        ++solicits;
+                }
             }
             else
             {
-                Serial.printf("JOIN_REQ -> 0x%02X\n", p);
-                int16_t st = sendPacket(myId, p, MAX_HOPS, JOIN_REQ);
+                Serial.printf("JOIN_REQ -> 0x%04X\n", p);
+                JoinPayload jp;
+                memcpy(jp.mac, myMac, sizeof(jp.mac));
+                jp.addr = myId;
+                int16_t st = sendPacket(myId, p, 0, JOIN_REQ, (uint8_t *)&jp, sizeof(jp));
                 if (st == ERR_TX_DEFERRED)
                 {
-                    extern uint32_t dc_free_at;
                     uint32_t slack = 50;
-                    nextJoinAt = max(now + 200, dc_free_at + slack);
+                    nextJoinAt = max(now + 200, dcFreeAt() + slack);
                     Serial.printf("JOIN deferred; retry at +%lu ms\n",
                                   (unsigned long)(nextJoinAt - now));
                 }
@@ -559,14 +2438,45 @@ void meshLoopNode()
                 {
                     joinParentTrying = p;
                     joinAckDeadline = now + JOIN_ACK_TIMEOUT_MS;
-                    nextJoinAt = now + JOIN_RETRY_MS;
+                    nextJoinAt = now + joinBackoff();
+                    if (joinAttempts < 0xFF)
+                        ++joinAttempts;
                 }
             }
         }
     }
 
+    fragPump();
+    sfDrain();
+    if (parentId != ADDR_NONE && myId < ADDR_UNASSIGNED)
+    {
+        for (auto &u : upq)
+            if (u.used && (int32_t)(now - u.retryAt) >= 0)
+            {
+                upSend(u);
+                break;
+            }
+    }
+
+    if (sampleCount && now - sampleBuf[0].t >= SAMPLE_MAX_LATENCY_MS && parentId != ADDR_NONE)
+        (void)sampleFlush();
+#if SAMPLE_PERIOD_MS
+    static uint32_t lastSample = 0;
+    if (now - lastSample >= SAMPLE_PERIOD_MS)
+    {
+        const int32_t v[2] = {battery_mV(), parentRssi};
+        (void)meshRecordSample(v, 2);
+        lastSample = now;
+    }
+#endif
+
+    if (parentId != ADDR_NONE && trickleDue(beacon, now, beaconPeriodMs))
+        sendBeacon();
+    otaLoop(now);
+
 #if ENABLE_TEST_TX
-    if (parentId != 0xFF && now - lastTestTx > TEST_PERIOD_MS)
+    // detached, the frames wait in the store-and-forward log
+    if (myId < ADDR_UNASSIGNED && now - lastTestTx > testPeriodMs)
     {
         sendTestFrame();
         lastTestTx = now;
@@ -0,0 +1,235 @@
+#pragma once
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "protocol.h"
+#include "channels.h"
+#include "crc.h"
+
+// Firmware distribution over the mesh. The host uploads a delta image
+// (tools/mkdelta.py) to the gateway's OTA_FILE through the bridge, and the
+// gateway broadcasts it to its 1-hop children: OTA_OFFER, every chunk, then
+// an OTA_OFFER with `ask` set. Children write the chunks into their own
+// OTA_FILE and answer the asking offer with an OTA_NEED bitmap of what is
+// missing; the sender rebroadcasts the union of the requests and asks
+// again, until a few offers go unanswered. A relay that holds the whole
+// image serves its own children from its copy the same way, so each chunk
+// crosses each link once, plus repairs. Chunks only go out while the
+// duty-cycle bucket is at least OTA_DC_RESERVE_PCT full, which keeps
+// airtime for polling and ACKs; the rollout runs at roughly the band's
+// refill rate.
+//
+// The delta image, little endian, applied by the node into the next OTA
+// partition against the image it runs:
+//
+//   OtaImageHdr
+//   ops until newLen bytes are out, each a varint v, op = v & 3, n = v >> 2:
+//     OTA_OP_LITERAL   n bytes follow
+//     OTA_OP_COPY_OLD  zigzag varint moves the cursor in the running image,
+//                      then n bytes are copied from there
+//     OTA_OP_COPY_NEW  varint d: n bytes from d back in the new image,
+//                      LZ77 style, may overlap
+//
+// oldLen 0 is a self-contained image that needs no base.
+#ifndef OTA_MAX_BYTES
+#define OTA_MAX_BYTES 131072
+#endif
+#ifndef OTA_DC_RESERVE_PCT
+#define OTA_DC_RESERVE_PCT 50
+#endif
+constexpr uint16_t OTA_MAX_CHUNKS = (OTA_MAX_BYTES + OTA_CHUNK - 1) / OTA_CHUNK;
+constexpr size_t OTA_MAP_BYTES = (OTA_MAX_CHUNKS + 7) / 8;
+constexpr uint32_t OTA_PREP_MS = 5000;        // after the first offer: children create their file
+constexpr uint32_t OTA_NEED_JITTER_MS = 4000; // children spread their NEEDs over this
+constexpr uint32_t OTA_OFFER_MS = 30000;      // between asking offers while nothing is wanted
+constexpr uint8_t OTA_QUIET_OFFERS = 4;       // unanswered asking offers before a sender goes idle
+constexpr uint8_t OTA_REOFFER_CHUNKS = 32;    // chunks between offers, for children that missed one
+static const char OTA_DIR[] = "/ota";
+static const char OTA_FILE[] = "/ota/img";
+static_assert(OTA_MAX_CHUNKS < 0xFFFF, "OTA_MAX_BYTES needs more chunk numbers");
+
+constexpr uint32_t OTA_IMAGE_MAGIC = 0x544C4451; // "QDLT"
+constexpr uint8_t OTA_IMAGE_VERSION = 1;
+enum : uint8_t
+{
+    OTA_OP_LITERAL = 0,
+    OTA_OP_COPY_OLD = 1,
+    OTA_OP_COPY_NEW = 2
+};
+struct __attribute__((packed)) OtaImageHdr
+{
+    uint32_t magic;
+    uint8_t version;
+    uint8_t flags; // none defined
+    uint16_t reserved;
+    uint32_t oldLen; // bytes of the base image, 0 = none
+    uint32_t newLen;
+    uint8_t oldSha[32]; // SHA-256 of the first oldLen bytes of the running partition
+    uint8_t newSha[32]; // SHA-256 of the image built
+};
+
+static inline bool otaBit(const uint8_t *m, uint16_t i) { return m[i / 8] & (1u << (i & 7)); }
+static inline void otaSetBit(uint8_t *m, uint16_t i) { m[i / 8] |= (uint8_t)(1u << (i & 7)); }
+static inline void otaClearBit(uint8_t *m, uint16_t i) { m[i / 8] &= (uint8_t)~(1u << (i & 7)); }
+static inline uint16_t otaChunks(uint32_t len) { return (uint16_t)((len + OTA_CHUNK - 1) / OTA_CHUNK); }
+static inline uint8_t otaChunkLen(uint32_t len, uint16_t idx)
+{
+    return (uint8_t)std::min<uint32_t>(OTA_CHUNK, len - (uint32_t)idx * OTA_CHUNK);
+}
+
+// CRC-32 over the first len bytes of OTA_FILE; false if it is shorter
+static bool otaFileCrc(uint32_t len, uint32_t &crc)
+{
+    File f = LittleFS.open(OTA_FILE, "r");
+    if (!f || f.size() < len)
+        return false;
+    uint8_t buf[256];
+    crc = 0;
+    for (uint32_t off = 0; off < len;)
+    {
+        const size_t k = std::min<uint32_t>(sizeof(buf), len - off);
+        if (f.read(buf, k) != k)
+            break;
+        crc = crc32(buf, k, crc);
+        off += k;
+    }
+    const bool ok = f.position() >= len;
+    f.close();
+    return ok;
+}
+
+// Image id from the new firmware's SHA-256, never 0
+static inline uint32_t otaImageId(const OtaImageHdr &h)
+{
+    uint32_t id;
+    memcpy(&id, h.newSha, sizeof(id));
+    return id ? id : 1;
+}
+
+// Sending side, the gateway's and every relay's
+struct OtaServe
+{
+    uint32_t id; // 0 = idle
+    uint32_t len;
+    uint32_t crc;
+    uint16_t chunks;
+    uint8_t want[OTA_MAP_BYTES]; // chunks to broadcast
+    uint16_t cursor;
+    uint8_t quiet;      // asking offers since the last NEED
+    uint8_t sinceOffer; // chunks since the last offer
+    bool offerDue;      // an offer without `ask` goes before the next chunk
+    uint32_t nextAt;
+    uint32_t gapMs; // between chunks: one frame's airtime, so children can answer
+    uint32_t sent, needs;
+};
+
+// Starts serving the image in OTA_FILE; `all` queues every chunk, otherwise
+// only what OTA_NEEDs ask for.
+static void otaServeStart(OtaServe &s, uint32_t id, uint32_t len, uint32_t crc, uint32_t gapMs, bool all)
+{
+    memset(&s, 0, sizeof(s));
+    s.id = id;
+    s.len = len;
+    s.crc = crc;
+    s.chunks = otaChunks(len);
+    s.gapMs = gapMs;
+    s.offerDue = all;
+    s.nextAt = millis();
+    if (all)
+        for (uint16_t i = 0; i < s.chunks; ++i)
+            otaSetBit(s.want, i);
+}
+
+static bool otaWanted(const OtaServe &s)
+{
+    for (uint16_t i = 0; i < (s.chunks + 7) / 8; ++i)
+        if (s.want[i])
+            return true;
+    return false;
+}
+
+static void otaServeNeed(OtaServe &s, const uint8_t *pl, uint8_t len)
+{
+    OtaNeedHdr h;
+    memcpy(&h, pl, sizeof(h));
+    if (h.id != s.id)
+        return;
+    // the first NEED of a round waits for the other children's
+    if (!otaWanted(s))
+        s.nextAt = millis() + OTA_NEED_JITTER_MS;
+    const uint8_t *bits = pl + sizeof(h);
+    for (uint16_t i = 0; i < (uint16_t)(len - sizeof(h)) * 8; ++i)
+        if (otaBit(bits, i) && h.base + i < s.chunks)
+            otaSetBit(s.want, (uint16_t)(h.base + i));
+    s.quiet = 0;
+    ++s.needs;
+}
+
+// Call every loop pass. send(type, payload, len) broadcasts one frame now
+// and returns the transmit status.
+template <typename Send>
+static void otaServePump(OtaServe &s, uint32_t now, Send send)
+{
+    if (!s.id || (int32_t)(now - s.nextAt) < 0)
+        return;
+    const int32_t reserve = dcCapMs(dcBand) * OTA_DC_RESERVE_PCT / 100;
+    const int32_t tokens = dcTokensMs();
+    if (tokens < reserve)
+    {
+        s.nextAt = now + (uint32_t)((int64_t)(reserve - tokens) * 1000 / SUB_BANDS[dcBand].permille);
+        return;
+    }
+    uint8_t pl[MAX_PAYLOAD];
+    int16_t st;
+    const bool wanted = !s.offerDue && otaWanted(s);
+    if (wanted)
+    {
+        uint16_t idx = s.cursor % s.chunks;
+        while (!otaBit(s.want, idx))
+            idx = (uint16_t)((idx + 1) % s.chunks);
+        OtaChunkHdr h{s.id, idx};
+        const uint8_t n = otaChunkLen(s.len, idx);
+        File f = LittleFS.open(OTA_FILE, "r");
+        const bool ok = f && f.seek((uint32_t)idx * OTA_CHUNK) && f.read(pl + sizeof(h), n) == n;
+        if (f)
+            f.close();
+        if (!ok)
+        {
+            Serial.println(F("OTA: image file unreadable, stopped"));
+            s.id = 0;
+            return;
+        }
+        memcpy(pl, &h, sizeof(h));
+        st = send((MsgType)MSG_OTA_CHUNK, pl, (uint8_t)(sizeof(h) + n));
+        if (st == RADIOLIB_ERR_NONE)
+        {
+            otaClearBit(s.want, idx);
+            s.cursor = (uint16_t)(idx + 1);
+            ++s.sent;
+            if (++s.sinceOffer >= OTA_REOFFER_CHUNKS)
+                s.offerDue = true;
+            s.nextAt = now + s.gapMs;
+            return;
+        }
+    }
+    else
+    {
+        if (!s.offerDue && s.quiet >= OTA_QUIET_OFFERS)
+        {
+            s.id = 0; // nobody is missing anything
+            return;
+        }
+        OtaOfferPayload o{s.id, s.len, s.crc, (uint8_t)!s.offerDue};
+        st = send((MsgType)MSG_OTA_OFFER, (const uint8_t *)&o, sizeof(o));
+        if (st == RADIOLIB_ERR_NONE)
+        {
+            // the opening offer gives children time to set up
+            s.nextAt = now + (!s.offerDue ? OTA_OFFER_MS : s.sent ? s.gapMs : OTA_PREP_MS);
+            if (!s.offerDue)
+                ++s.quiet;
+            s.offerDue = false;
+            s.sinceOffer = 0;
+            return;
+        }
+    }
+    s.nextAt = (st == ERR_TX_DEFERRED ? dcFreeAt() : now) + 100;
+}
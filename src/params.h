@@ -0,0 +1,97 @@
+#pragma once
+#include <Arduino.h>
+#include <Preferences.h>
+
+// Runtime-tunable parameters. Each role keeps a table of the knobs it uses,
+// backed by plain variables, so the hot paths read them like constants.
+// Ids are shared across roles: the gateway pushes values to nodes with
+// PARAM_SET. "param" on the serial console lists the table,
+// "param <name> <value>" sets one and "param save" persists the table in
+// Preferences ("params" namespace), where it is loaded from at boot.
+enum ParamId : uint8_t
+{
+    P_SF = 1,
+    P_BW,              // kHz
+    P_CR,              // 4/cr
+    P_DC_BORROW_PCT,   // duty-cycle overdraft, % of the bucket
+    P_TEST_PERIOD_MS,  // node
+    P_LOST_PARENT_MS,  // node
+    P_CHILD_SILENT_MS, // node
+    P_QUERY_PERIOD_MS, // gateway from here on
+    P_QUERY_TIMEOUT_MS,
+    P_MAX_MISSES,
+    P_CHILD_TIMEOUT_MS,
+    P_JOIN_ACK_GAP_MS,
+    P_BEACON_PERIOD_MS, // both: longest Trickle beacon interval
+    P_NETCODE,          // node: relays XOR-code two-way traffic, 0/1
+    P_NC_HOLD_MS,       // node: a codeable forward waits this long for a partner
+};
+
+enum : uint8_t
+{
+    PF_RADIO = 0x01, // part of the radio profile: every device must agree
+    PF_NODE = 0x02   // the gateway pushes it to nodes
+};
+
+struct Param
+{
+    ParamId id;
+    const char *name; // also the Preferences key, at most 15 chars
+    uint32_t *value;
+    uint32_t lo, hi;
+    uint8_t flags;
+};
+
+static const Param *paramFind(const Param *t, size_t n, const char *name)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (!strcmp(t[i].name, name))
+            return &t[i];
+    return nullptr;
+}
+static const Param *paramById(const Param *t, size_t n, uint8_t id)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (t[i].id == id)
+            return &t[i];
+    return nullptr;
+}
+
+static bool paramValid(const Param &p, uint32_t v)
+{
+    if (p.id == P_BW)
+        return v == 125 || v == 250 || v == 500;
+    return v >= p.lo && v <= p.hi;
+}
+
+static void paramPrint(const Param *t, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        Serial.printf("  %-16s %lu\n", t[i].name, (unsigned long)*t[i].value);
+}
+
+// flags != 0 saves only the entries with one of them, e.g. PF_RADIO for
+// the radio profile a device has just switched to.
+static void paramSave(const Param *t, size_t n, uint8_t flags = 0)
+{
+    Preferences p;
+    p.begin("params", false);
+    for (size_t i = 0; i < n; ++i)
+        if (!flags || (t[i].flags & flags))
+            p.putUInt(t[i].name, *t[i].value);
+    p.end();
+}
+
+// Stored values replace the defaults; out-of-range ones are ignored.
+static void paramLoad(const Param *t, size_t n)
+{
+    Preferences p;
+    p.begin("params", true);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const uint32_t v = p.getUInt(t[i].name, *t[i].value);
+        if (paramValid(t[i], v))
+            *t[i].value = v;
+    }
+    p.end();
+}
@@ -0,0 +1,136 @@
+#pragma once
+#include <Arduino.h>
+#include <RadioLib.h>
+
+// Gateway light sleep between deadlines (GW_LIGHT_SLEEP=1). The SX1262
+// keeps receiving while the ESP32 sleeps; its DIO1 line rises on RX done
+// and stays high until the IRQ is cleared by readData()/startReceive(), so
+// a level-triggered wake cannot miss a frame: a frame that lands between
+// the last check and esp_light_sleep_start() wakes the chip straight away.
+// The level wake shares the pin's interrupt type with the DIO1 ISR, which
+// would refire for as long as the line is high, so it is armed only around
+// the sleep and the rising edge is restored after it.
+// A byte on UART0 wakes it too; the bytes that trigger the wake are lost,
+// so send a newline before a console command. The USB CDC console
+// disconnects while asleep, so sleeping sites want a UART host or none.
+// millis() keeps counting across light sleep, so deadlines stay valid.
+#ifndef GW_LIGHT_SLEEP
+#define GW_LIGHT_SLEEP 0
+#endif
+
+// Nominal currents in mA for the idle estimate printed by "power":
+// ESP32-S3 running the loop at 240 MHz, ESP32-S3 in light sleep and the
+// SX1262 in continuous RX (DC-DC, boosted gain). Board extras (PMU, OLED,
+// LEDs) are not included; measure the real figure at the battery.
+#ifndef POWER_AWAKE_MA
+#define POWER_AWAKE_MA 40.0f
+#endif
+#ifndef POWER_SLEEP_MA
+#define POWER_SLEEP_MA 0.24f
+#endif
+#ifndef POWER_RADIO_RX_MA
+#define POWER_RADIO_RX_MA 5.3f
+#endif
+
+#if GW_LIGHT_SLEEP
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+#include <driver/uart.h>
+
+// Shorter waits are not worth the wake-up cost
+constexpr uint32_t SLEEP_MIN_MS = 5;
+constexpr uint8_t UART_WAKE_EDGES = 3;
+
+struct PowerStats
+{
+    uint32_t sleeps;
+    uint32_t wakeRadio, wakeUart, wakeTimer;
+    uint64_t asleepUs;
+    int64_t since; // esp_timer us at the last reset
+};
+static PowerStats powerStats;
+static uint8_t powerIrqPin = 0;
+
+// Set from the DIO1 ISR; the loop only touches the radio when it is set
+static volatile bool radioIrq = true;
+static void IRAM_ATTR onRadioIrq() { radioIrq = true; }
+
+static void powerSetup(SX1262 &r)
+{
+    powerIrqPin = (uint8_t)r.getMod()->getIrq();
+    r.setDio1Action(onRadioIrq);
+    esp_sleep_enable_gpio_wakeup();
+    uart_set_wakeup_threshold(UART_NUM_0, UART_WAKE_EDGES);
+    esp_sleep_enable_uart_wakeup(UART_NUM_0);
+    memset(&powerStats, 0, sizeof(powerStats));
+    powerStats.since = esp_timer_get_time();
+}
+
+// Take the pending-frame flag; true if handleRx() has work.
+static inline bool radioIrqTake()
+{
+    if (!radioIrq)
+        return false;
+    radioIrq = false;
+    return true;
+}
+
+// Light-sleep until `deadline` (millis), a frame or a console byte.
+static void powerSleepUntil(uint32_t deadline)
+{
+    const int32_t wait = (int32_t)(deadline - millis());
+    if (wait < (int32_t)SLEEP_MIN_MS || radioIrq)
+        return;
+    if (digitalRead(powerIrqPin))
+    {
+        radioIrq = true; // raised before the ISR was armed, or still pending
+        return;
+    }
+    Serial.flush();
+    esp_sleep_enable_timer_wakeup((uint64_t)wait * 1000);
+    const gpio_num_t pin = (gpio_num_t)powerIrqPin;
+    gpio_wakeup_enable(pin, GPIO_INTR_HIGH_LEVEL);
+    const int64_t t0 = esp_timer_get_time();
+    esp_light_sleep_start();
+    powerStats.asleepUs += (uint64_t)(esp_timer_get_time() - t0);
+    gpio_wakeup_disable(pin);
+    gpio_set_intr_type(pin, GPIO_INTR_POSEDGE);
+    ++powerStats.sleeps;
+    switch (esp_sleep_get_wakeup_cause())
+    {
+    case ESP_SLEEP_WAKEUP_GPIO:
+        ++powerStats.wakeRadio;
+        radioIrq = true; // the ISR does not run for a wake from sleep
+        break;
+    case ESP_SLEEP_WAKEUP_UART:
+        ++powerStats.wakeUart;
+        break;
+    default:
+        ++powerStats.wakeTimer;
+        break;
+    }
+}
+
+static void powerDump()
+{
+    const uint64_t span = (uint64_t)(esp_timer_get_time() - powerStats.since);
+    const float asleep = span ? (float)powerStats.asleepUs / span : 0;
+    const float mA = POWER_RADIO_RX_MA + POWER_AWAKE_MA * (1 - asleep) + POWER_SLEEP_MA * asleep;
+    Serial.printf("{\"power\":{\"span_s\":%lu,\"asleep_pct\":%.1f,\"sleeps\":%lu,\"wake\":{\"radio\":%lu,"
+                  "\"uart\":%lu,\"timer\":%lu},\"est_mA\":%.1f}}\n",
+                  (unsigned long)(span / 1000000), asleep * 100, (unsigned long)powerStats.sleeps,
+                  (unsigned long)powerStats.wakeRadio, (unsigned long)powerStats.wakeUart,
+                  (unsigned long)powerStats.wakeTimer, mA);
+}
+
+static void powerReset()
+{
+    memset(&powerStats, 0, sizeof(powerStats));
+    powerStats.since = esp_timer_get_time();
+}
+#else
+static inline void powerSetup(SX1262 &) {}
+static inline bool radioIrqTake() { return true; }
+static inline void powerSleepUntil(uint32_t) {}
+#endif
@@ -1,5 +1,6 @@
 #pragma once
 #include <Arduino.h>
+#include "config.h"
 
 enum MsgType : uint8_t
 {
@@ -16,16 +17,63 @@ enum MsgType : uint8_t
 #define MSG_CHILD_ADD 0xA1
 #define MSG_CHILD_GONE 0xA2
 #define MSG_JOIN_NACK 0xA3
+#define MSG_ADDR_REQ 0xA4
+#define MSG_ADDR_ACK 0xA5
+#define MSG_ADR_CMD 0xA6
+#define MSG_DATA_FRAG 0xA7
+#define MSG_FRAG_ACK 0xA8
+#define MSG_PARAM_SET 0xA9
+#define MSG_PARAM_ACK 0xAA
+#define MSG_DATA_DOWN 0xAB
+#define MSG_DOWN_ACK 0xAC
+#define MSG_OTA_OFFER 0xAD
+#define MSG_OTA_CHUNK 0xAE
+#define MSG_OTA_NEED 0xAF
+#define MSG_OTA_STATUS 0xB0
+#define MSG_XOR 0xB1
 #endif
 
+// The magic byte doubles as the frame format version. v1 (0xA5) carried 8-bit
+// addresses and is no longer emitted; receivers drop anything but HDR_MAGIC.
 enum : uint8_t
 {
-  HDR_MAGIC = 0xA5
+  HDR_MAGIC_V1 = 0xA5,
+  HDR_MAGIC = 0xA6
 };
-constexpr uint8_t GW_ID = 0x00;
-constexpr uint8_t MAX_HOPS = 6; 
+
+// 16-bit short addresses. 0x0000 is the gateway, 0xFFFF doubles as broadcast
+// and "no parent".
+typedef uint16_t addr_t;
+constexpr addr_t GW_ID = 0x0000;
+constexpr addr_t ADDR_BCAST = 0xFFFF;
+constexpr addr_t ADDR_NONE = 0xFFFF;
+constexpr addr_t ADDR_UNASSIGNED = 0xFFFE; // joining node, no address yet
+constexpr uint8_t MAX_HOPS = PROFILE.maxHops;
 constexpr uint8_t MAX_CAND = 5;
 
+// Radio profile shared by every device; the live copy is `cfg` in main.cpp.
+struct LoraCfg
+{
+  float freq;
+  float bw;
+  uint8_t sf;
+  uint8_t cr;
+  uint8_t sw;
+};
+
+// LoRa time-on-air in ms (SX126x datasheet): explicit header, CRC on,
+// 8-symbol preamble, low data rate optimisation when a symbol is >= 16 ms.
+// cr is the denominator of 4/cr, as in LoraCfg.
+inline uint32_t loraAirtimeMs(uint8_t sf, float bwKHz, uint8_t cr, size_t len)
+{
+  const float tSym = (float)(1UL << sf) / bwKHz;
+  const int de = (tSym >= 16.0f) ? 1 : 0;
+  const int num = 8 * (int)len - 4 * sf + 28 + 16;
+  const int den = 4 * (sf - 2 * de);
+  const int nPay = 8 + ((num > 0) ? (num + den - 1) / den : 0) * cr;
+  return (uint32_t)((8 + 4.25f + nPay) * tSym + 0.5f);
+}
+
 #ifndef MAX_PAYLOAD
 #define MAX_PAYLOAD 64 
 #endif
@@ -33,30 +81,259 @@ constexpr uint8_t MAX_CAND = 5;
 struct __attribute__((packed)) MeshHeader
 {
   uint8_t magic;
-  uint8_t src;
-  uint8_t dst;
+  addr_t src;
+  addr_t dst;
   uint8_t hops;
   MsgType type;
   uint8_t len;
 };
-static_assert(sizeof(MeshHeader) == 6, "Header mis-sized");
+static_assert(sizeof(MeshHeader) == 8, "Header mis-sized");
+
+// Network time is the gateway's millis(). BEACON and QUERY carry it, stamped
+// as the frame starts transmitting. A relay adds the previous hop's airtime
+// and its own holding time before forwarding, so every receiver can take
+// gwTime + airtime as "gateway time now".
+//
+// BEACONs advertise a parent: the gateway and attached relays send them on
+// a Trickle timer (trickle.h), with their distance to the gateway and the
+// version of the network-wide configuration they hold. A non-zero cfgVer is
+// followed by that configuration as a PARAM_SET body, so beacons flood it.
+// A BEACON without payload is a solicitation from a node that hears no
+// parent.
+struct __attribute__((packed)) BeaconPayload
+{
+  uint8_t hops; // 0 = gateway
+  uint32_t gwTime;
+  uint8_t cfgVer;
+};
+// QUERY body: gateway time, optionally followed by a DataAckPayload
+struct __attribute__((packed)) QueryPayload
+{
+  uint32_t gwTime;
+};
+// payload offset of the network timestamp in frames of this type, -1 if none
+inline int8_t gwTimeOffset(uint8_t type)
+{
+  return (type == QUERY) ? 0 : (type == BEACON) ? 1 : -1;
+}
+
+// Identity of a frame across hops: FNV-1a over everything a relay leaves
+// untouched (all of the header except `hops`, and the payload minus the
+// network timestamp).
+inline uint32_t frameHash(const MeshHeader &h, const uint8_t *pl)
+{
+  uint32_t x = 2166136261u;
+  const uint8_t fixed[] = {(uint8_t)h.src, (uint8_t)(h.src >> 8), (uint8_t)h.dst,
+                           (uint8_t)(h.dst >> 8), (uint8_t)h.type, h.len};
+  for (uint8_t b : fixed)
+    x = (x ^ b) * 16777619u;
+  const int8_t ts = gwTimeOffset(h.type);
+  for (uint8_t i = 0; i < h.len; ++i)
+    x = (x ^ ((ts >= 0 && i >= ts && i < ts + 4) ? 0 : pl[i])) * 16777619u;
+  return x;
+}
 
 struct __attribute__((packed)) StatusPayload
 {
-  uint8_t parent;
+  addr_t parent;
   uint8_t hops;
   int8_t rssi;
 };
 
+// JOIN_REQ / JOIN_ACK / JOIN_NACK / ADDR_REQ / ADDR_ACK body. Nodes are
+// identified by their eFuse MAC until the gateway hands out `addr`; in a
+// request `addr` is the node's current address (or ADDR_UNASSIGNED) as a
+// hint, in an ACK it is the assigned one (0 = refused).
+struct __attribute__((packed)) JoinPayload
+{
+  uint8_t mac[6];
+  addr_t addr;
+};
+
+// Gateway -> 1-hop leaf: move to spreading factor `sf` on channel `ch`
+// (0 = control channel) switchInMs after reception. Either side falls back
+// to the base SF and control channel if the link goes quiet.
+struct __attribute__((packed)) AdrCmdPayload
+{
+  uint8_t sf;
+  uint8_t ch;
+  uint16_t switchInMs;
+};
+
+struct __attribute__((packed)) ChildEventPayload
+{
+  addr_t child;
+  addr_t parent;
+  uint8_t hops;
+};
+
+// DATA_UP body: sequence header, then application data. A node starts its
+// sequence at a random value each boot. From every join until the gateway
+// acknowledges something it sets DATA_SYN, with seq minus the oldest seq it
+// still holds in the high nibble of flags, so the gateway opens its window
+// at that frame whichever one arrives first.
+enum : uint8_t
+{
+  DATA_SYN = 0x01
+};
+constexpr uint8_t DATA_BASE_SHIFT = 4;
+struct __attribute__((packed)) DataUpHdr
+{
+  uint16_t seq;
+  uint8_t flags;
+};
+
+// DATA_DOWN body: the host's message id, then application data. The node
+// answers every copy with a DOWN_ACK carrying the id and delivers it once.
+struct __attribute__((packed)) DataDownHdr
+{
+  uint16_t id;
+};
+struct __attribute__((packed)) DownAckPayload
+{
+  uint16_t id;
+};
+
+// Cumulative + selective ACK, sent as DATA_ACK or appended to a QUERY:
+// everything before `next` arrived, bit i of `mask` is seq next + 1 + i.
+// A gateway without a window for the node (it dropped the entry, or never
+// saw a DATA_SYN) sends mask DATA_ACK_RESYNC instead, and the node resends
+// everything with DATA_SYN. A real window never has the top bit set: the
+// node holds `next` and keeps its seqs within DATA_ACK_BITS - 1 of it.
+constexpr uint8_t DATA_ACK_BITS = 16;
+constexpr uint16_t DATA_ACK_RESYNC = 0xFFFF;
+static_assert(DATA_ACK_BITS <= (0xFF >> DATA_BASE_SHIFT) + 1, "DATA_SYN base offset does not fit in flags");
+struct __attribute__((packed)) DataAckPayload
+{
+  uint16_t next;
+  uint16_t mask;
+};
+
+// DATA_FRAG body: fragment `idx` of `count` of message `msgId`, then up to
+// FRAG_DATA bytes. Every fragment but the last is full. The sender asks for
+// a FRAG_ACK at the end of each block.
+enum : uint8_t
+{
+  FRAG_ACKREQ = 0x01
+};
+struct __attribute__((packed)) FragHdr
+{
+  uint16_t msgId;
+  uint8_t idx;
+  uint8_t count;
+  uint8_t flags;
+};
+constexpr uint8_t FRAG_DATA = MAX_PAYLOAD - sizeof(FragHdr);
+constexpr uint8_t FRAG_MAX_COUNT = 128;
+#ifndef FRAG_MAX_MSG
+#define FRAG_MAX_MSG 4096
+#endif
+static_assert(FRAG_MAX_MSG <= FRAG_MAX_COUNT * FRAG_DATA, "FRAG_MAX_MSG needs more than FRAG_MAX_COUNT fragments");
+
+// FRAG_ACK body: header, then ceil(count / 8) bytes of bitmap where bit i
+// (LSB first) means fragment i has arrived.
+enum : uint8_t
+{
+  FRAG_DONE = 0x01
+};
+struct __attribute__((packed)) FragAckHdr
+{
+  uint16_t msgId;
+  uint8_t count;
+  uint8_t flags;
+};
+static_assert(sizeof(FragAckHdr) + FRAG_MAX_COUNT / 8 <= MAX_PAYLOAD, "FRAG_ACK bitmap does not fit");
+
+// PARAM_SET body: header, then `count` entries (ids from params.h). Radio
+// profile entries take effect at network time `switchAt` on every device,
+// so the whole tree moves at once; everything else applies on receipt. The
+// node answers with a PARAM_ACK carrying `ver`. Versions wrap; 0 is "none".
+struct __attribute__((packed)) ParamSetHdr
+{
+  uint8_t ver;
+  uint8_t count;
+  uint32_t switchAt;
+};
+struct __attribute__((packed)) ParamEntry
+{
+  uint8_t id;
+  uint32_t value;
+};
+struct __attribute__((packed)) ParamAckPayload
+{
+  uint8_t ver;
+};
+inline bool paramVerNewer(uint8_t a, uint8_t b) { return a && (!b || (int8_t)(a - b) > 0); }
+
+// Firmware update (see ota.h). OTA_OFFER and OTA_CHUNK are one-hop
+// broadcasts from whoever holds the whole delta image to its children;
+// `ask` marks an offer sent after the chunks, which children missing some
+// answer with OTA_NEED to their parent. Chunk idx carries bytes
+// idx * OTA_CHUNK onwards; every chunk but the last is full. The image id
+// is the first four bytes of the built firmware's SHA-256 (OtaImageHdr
+// newSha), so two different images practically never share one.
+struct __attribute__((packed)) OtaOfferPayload
+{
+  uint32_t id;  // image id, never 0
+  uint32_t len; // delta image bytes
+  uint32_t crc; // CRC-32 of the whole delta image
+  uint8_t ask;
+};
+struct __attribute__((packed)) OtaChunkHdr
+{
+  uint32_t id;
+  uint16_t idx;
+};
+constexpr uint8_t OTA_CHUNK = MAX_PAYLOAD - sizeof(OtaChunkHdr);
+
+// OTA_NEED body: header, then up to OTA_NEED_BYTES of bitmap where bit i
+// (LSB first) asks for chunk base + i.
+constexpr uint8_t OTA_NEED_BYTES = 16;
+struct __attribute__((packed)) OtaNeedHdr
+{
+  uint32_t id;
+  uint16_t base;
+};
+
+// OTA_STATUS, node to gateway: progress and outcome for image `id`
+enum : uint8_t
+{
+  OTA_ST_COMPLETE = 1, // every chunk in, CRC good
+  OTA_ST_ACTIVATING,   // image built and verified, rebooting into it
+  OTA_ST_RUNNING,      // booted the new image and reached the gateway
+  OTA_ST_BASE_MISMATCH,
+  OTA_ST_BAD_IMAGE,
+  OTA_ST_FLASH_ERROR,
+  OTA_ST_ROLLED_BACK   // the new image never reached the gateway; running the old one
+};
+struct __attribute__((packed)) OtaStatusPayload
+{
+  uint32_t id;
+  uint8_t status;
+};
+
+// XOR: a relay's two forwards, one to its parent and one to a child, sent
+// as one broadcast (see netcode.h). The body is the XOR of both frames,
+// header included, with hops and the network timestamp zeroed and the
+// shorter one padded with zeros. Each end holds the frame it sent the
+// relay, finds it by hash and XORs it out to get the other.
+struct __attribute__((packed)) XorHdr
+{
+  uint32_t hash[2]; // frameHash of each frame
+  uint8_t hops[2];  // hop counts as relayed
+  uint32_t gwTime;  // network time of the one that carries it, relay-adjusted
+};
+
 typedef struct __attribute__((packed))
 {
   uint8_t ver;
   uint32_t test_id;
   uint32_t seq;
   uint32_t src;
-  uint32_t tx_epoch_ms;
-  uint8_t hop_cnt;
+  uint32_t tx_epoch_ms;  // ver 1: node millis(), ver 2: network time
+  uint8_t hop_cnt;      // set by the origin; relays leave payloads intact, MeshHeader.hops counts hops
   uint16_t batt_mV;     // 0 if unknown
+  uint16_t boot;        // random per node boot, never 0; absent (0) from older firmware
 } test_hdr_t;
 
 #ifndef TEST_MAGIC
@@ -0,0 +1,188 @@
+#pragma once
+#include <Arduino.h>
+
+// Sample batch codec: the node encodes, the gateway decodes. A batch is one
+// DATA_UP application payload:
+//
+//   SAMPLE_MAGIC, series S, count N
+//   S x zigzag varint        first value of each series
+//   S x (order << 6 | w)     residual order (1 = delta, 2 = delta of delta)
+//                            and bits per residual
+//   bitstream, LSB first     per series, N - 1 zigzagged residuals of w bits
+//
+// Series 0 is the sample time (node millis), series 1..S-1 the channels.
+// Periodic timestamps and slow-moving readings mostly pack into a few bits.
+
+constexpr uint8_t SAMPLE_MAGIC = 0xB7; // never a test_hdr_t version
+constexpr uint8_t SAMPLE_MAX_CH = 4;
+constexpr uint8_t SAMPLE_MAX_N = 32;
+
+struct Sample
+{
+    uint32_t t;
+    int32_t v[SAMPLE_MAX_CH];
+};
+
+static inline uint32_t zigzag(int32_t x) { return ((uint32_t)x << 1) ^ (uint32_t)(x >> 31); }
+static inline int32_t unzigzag(uint32_t z) { return (int32_t)(z >> 1) ^ -(int32_t)(z & 1); }
+
+static inline uint32_t sampleAt(const Sample *s, uint8_t series, uint8_t i)
+{
+    return series ? (uint32_t)s[i].v[series - 1] : s[i].t;
+}
+static inline void sampleSet(Sample *s, uint8_t series, uint8_t i, uint32_t x)
+{
+    if (series)
+        s[i].v[series - 1] = (int32_t)x;
+    else
+        s[i].t = x;
+}
+
+// residual of sample i (i >= 1); order 2 falls back to a plain delta at i == 1
+static inline int32_t sampleResidual(const Sample *s, uint8_t series, uint8_t i, uint8_t order)
+{
+    uint32_t d = sampleAt(s, series, i) - sampleAt(s, series, i - 1);
+    if (order == 2 && i >= 2)
+        d -= sampleAt(s, series, i - 1) - sampleAt(s, series, i - 2);
+    return (int32_t)d;
+}
+
+static inline uint8_t bitWidth(uint32_t z)
+{
+    uint8_t w = 0;
+    while (z)
+    {
+        ++w;
+        z >>= 1;
+    }
+    return w;
+}
+
+// Encodes n samples of nch channels; returns the size, or 0 if the batch
+// does not fit in cap bytes.
+static size_t sampleEncode(const Sample *s, uint8_t n, uint8_t nch, uint8_t *out, size_t cap)
+{
+    const uint8_t S = (uint8_t)(nch + 1);
+    if (!n || n > SAMPLE_MAX_N || nch > SAMPLE_MAX_CH || cap < 3u + S)
+        return 0;
+    size_t pos = 0;
+    out[pos++] = SAMPLE_MAGIC;
+    out[pos++] = S;
+    out[pos++] = n;
+    for (uint8_t k = 0; k < S; ++k)
+    {
+        uint32_t z = zigzag((int32_t)sampleAt(s, k, 0));
+        do
+        {
+            if (pos == cap)
+                return 0;
+            out[pos++] = (uint8_t)((z & 0x7F) | (z > 0x7F ? 0x80 : 0));
+            z >>= 7;
+        } while (z);
+    }
+    uint8_t mode[SAMPLE_MAX_CH + 1];
+    size_t bits = 0;
+    for (uint8_t k = 0; k < S; ++k)
+    {
+        uint8_t best = 0xFF;
+        for (uint8_t order = 1; order <= 2; ++order)
+        {
+            uint8_t w = 0;
+            for (uint8_t i = 1; i < n; ++i)
+            {
+                const uint8_t wi = bitWidth(zigzag(sampleResidual(s, k, i, order)));
+                if (wi > w)
+                    w = wi;
+            }
+            if (best == 0xFF || w < (best & 0x3F))
+                best = (uint8_t)(order << 6 | w);
+        }
+        mode[k] = best;
+        bits += (size_t)(best & 0x3F) * (n - 1);
+    }
+    if (pos + S + (bits + 7) / 8 > cap)
+        return 0;
+    memcpy(out + pos, mode, S);
+    pos += S;
+
+    uint64_t acc = 0;
+    uint8_t nb = 0;
+    for (uint8_t k = 0; k < S; ++k)
+    {
+        const uint8_t w = mode[k] & 0x3F;
+        for (uint8_t i = 1; i < n && w; ++i)
+        {
+            acc |= (uint64_t)zigzag(sampleResidual(s, k, i, mode[k] >> 6)) << nb;
+            nb += w;
+            while (nb >= 8)
+            {
+                out[pos++] = (uint8_t)acc;
+                acc >>= 8;
+                nb -= 8;
+            }
+        }
+    }
+    if (nb)
+        out[pos++] = (uint8_t)acc;
+    return pos;
+}
+
+// Decodes a batch into out; returns the sample count (0 if malformed) and
+// the channel count in nch.
+static uint8_t sampleDecode(const uint8_t *in, size_t len, Sample *out, uint8_t maxN, uint8_t &nch)
+{
+    if (len < 3 || in[0] != SAMPLE_MAGIC)
+        return 0;
+    const uint8_t S = in[1], n = in[2];
+    if (!S || S > SAMPLE_MAX_CH + 1 || !n || n > maxN)
+        return 0;
+    size_t pos = 3;
+    for (uint8_t k = 0; k < S; ++k)
+    {
+        uint32_t z = 0;
+        for (uint8_t shift = 0;; shift += 7)
+        {
+            if (pos == len || shift > 28)
+                return 0;
+            const uint8_t b = in[pos++];
+            z |= (uint32_t)(b & 0x7F) << shift;
+            if (!(b & 0x80))
+                break;
+        }
+        sampleSet(out, k, 0, (uint32_t)unzigzag(z));
+    }
+    if (pos + S > len)
+        return 0;
+    const uint8_t *mode = in + pos;
+    pos += S;
+
+    uint64_t acc = 0;
+    uint8_t nb = 0;
+    for (uint8_t k = 0; k < S; ++k)
+    {
+        const uint8_t w = mode[k] & 0x3F, order = mode[k] >> 6;
+        if (w > 32 || order < 1 || order > 2)
+            return 0;
+        uint32_t prevDelta = 0;
+        for (uint8_t i = 1; i < n; ++i)
+        {
+            while (nb < w)
+            {
+                if (pos == len)
+                    return 0;
+                acc |= (uint64_t)in[pos++] << nb;
+                nb += 8;
+            }
+            const uint32_t z = (uint32_t)(acc & ((w == 32) ? 0xFFFFFFFFull : ((1ull << w) - 1)));
+            acc >>= w;
+            nb -= w;
+            uint32_t d = (uint32_t)unzigzag(z);
+            if (order == 2 && i >= 2)
+                d += prevDelta;
+            prevDelta = d;
+            sampleSet(out, k, i, sampleAt(out, k, i - 1) + d);
+        }
+    }
+    nch = (uint8_t)(S - 1);
+    return n;
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <Arduino.h>
+#include <algorithm>
+
+// Trickle timer (RFC 6206) for BEACONs. Each interval picks a send time in
+// its second half and sends only if fewer than `k` consistent beacons were
+// heard before it. A quiet interval doubles, up to the Imax the caller
+// passes in, so a settled neighbourhood approaches zero beacon airtime.
+// An inconsistency (a solicitation, a different config version, a fresh
+// join) drops back to Imin and the neighbourhood beacons fast again.
+constexpr uint8_t TRICKLE_K = 2;
+// Resets a differing config version may cause while ours stays the same. A
+// neighbour that never converges (it cannot take ours, or we will not take
+// its) would otherwise hold the whole neighbourhood at Imin.
+constexpr uint8_t TRICKLE_MISMATCH_RESETS = 4;
+
+struct Trickle
+{
+    uint32_t imin;     // ms
+    uint8_t k;         // redundancy constant
+    uint32_t i;        // current interval, 0 = stopped
+    uint32_t start;    // millis at the start of the interval
+    uint32_t t;        // send offset within the interval
+    uint8_t c;         // consistent beacons heard this interval
+    bool fired;        // send time of this interval passed
+    uint8_t ver;       // our config version the mismatch count is for
+    uint8_t mismatches; // resets caused by other versions since ours changed
+    uint32_t sent;     // beacons due, for the console
+    uint32_t suppressed;
+};
+
+static void trickleBegin(Trickle &tr, uint32_t now, uint32_t i)
+{
+    tr.i = i;
+    tr.start = now;
+    tr.t = i / 2 + (uint32_t)random(0, (long)(i / 2));
+    tr.c = 0;
+    tr.fired = false;
+}
+
+static void trickleInit(Trickle &tr, uint32_t imin, uint8_t k)
+{
+    memset(&tr, 0, sizeof(tr));
+    tr.imin = imin;
+    tr.k = k;
+}
+
+// (Re)start at Imin; also the response to an inconsistency while running
+static inline void trickleStart(Trickle &tr, uint32_t now) { trickleBegin(tr, now, tr.imin); }
+static inline void trickleStop(Trickle &tr) { tr.i = 0; }
+
+// Inconsistency heard: back to Imin unless already there or stopped
+static inline void trickleReset(Trickle &tr, uint32_t now)
+{
+    if (tr.i && tr.i != tr.imin)
+        trickleBegin(tr, now, tr.imin);
+}
+
+// A neighbour advertises a config version other than our `ver`: reset, at
+// most TRICKLE_MISMATCH_RESETS times per version of ours
+static inline void trickleMismatch(Trickle &tr, uint8_t ver, uint32_t now)
+{
+    if (tr.ver != ver)
+    {
+        tr.ver = ver;
+        tr.mismatches = 0;
+    }
+    if (!tr.i || tr.i == tr.imin || tr.mismatches >= TRICKLE_MISMATCH_RESETS)
+        return;
+    ++tr.mismatches;
+    trickleBegin(tr, now, tr.imin);
+}
+
+static inline void trickleHeard(Trickle &tr)
+{
+    if (tr.c < 0xFF)
+        ++tr.c;
+}
+
+// Call every loop pass; true when a beacon is due now.
+static bool trickleDue(Trickle &tr, uint32_t now, uint32_t imax)
+{
+    if (!tr.i)
+        return false;
+    if (now - tr.start >= tr.i)
+    {
+        trickleBegin(tr, now, std::max(tr.imin, std::min(tr.i * 2, imax)));
+        return false;
+    }
+    if (tr.fired || now - tr.start < tr.t)
+        return false;
+    tr.fired = true;
+    if (tr.c >= tr.k)
+    {
+        ++tr.suppressed;
+        return false;
+    }
+    ++tr.sent;
+    return true;
+}
+
+static void tricklePrint(const Trickle &tr)
+{
+    Serial.printf("  beacon: interval %lu ms%s, sent %lu, suppressed %lu\n", (unsigned long)tr.i,
+                  tr.i ? "" : " (stopped)", (unsigned long)tr.sent, (unsigned long)tr.suppressed);
+}
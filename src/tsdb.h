@@ -0,0 +1,419 @@
+#pragma once
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "samples.h"
+#include "crc.h"
+
+// Telemetry store for the gateway: an append-only log of per-node events
+// (STATE replies, delivered uplink, missed polls, joins, departures) on
+// LittleFS that keeps weeks of history in fixed RAM and bounded flash.
+//
+// A record is one Sample (samples.h) whose series are the columns: t is
+// store time in seconds, v[0] the node, v[1] event << 4 | hops, v[2] the
+// RSSI and v[3] the battery in mV. Up to TS_BLOCK_N records collect in RAM
+// and go to flash as one block compressed by sampleEncode(), so every
+// column costs only its delta or delta-of-delta width. On flash:
+//
+//   TS_BLOCK_MAGIC | len u8 | t0 u32 | t1 u32 | crc16 | batch[len]
+//
+// Blocks are appended to segment files <dir>/<seq hex> of at most
+// TS_SEG_BYTES; when TS_MAX_SEGMENTS are in use the oldest is deleted.
+// Store time never goes backwards, so blocks and segments are sorted by
+// time. The index is the first timestamp of each segment (a segment ends
+// where the next begins); a range query opens only the segments that
+// overlap and decodes only the blocks whose t0..t1 overlap.
+//
+// Flash only ever sees whole blocks: one append per TS_BLOCK_N records or
+// TS_FLUSH_MS, whichever comes first, and LittleFS spreads the erases. A
+// power cut loses what is still in RAM; a torn last block fails its CRC
+// and the next boot starts a fresh segment behind it.
+#ifndef TS_MAX_SEGMENTS
+#define TS_MAX_SEGMENTS 64
+#endif
+#ifndef TS_FLUSH_MS
+#define TS_FLUSH_MS 600000
+#endif
+static_assert(TS_MAX_SEGMENTS >= 2, "telemetry store needs two segments");
+constexpr uint32_t TS_SEG_BYTES = 16384;
+constexpr uint8_t TS_BLOCK_N = SAMPLE_MAX_N;
+constexpr uint8_t TS_BLOCK_MAX = 240; // compressed batch
+constexpr uint8_t TS_BLOCK_MAGIC = 0xB8;
+constexpr uint8_t TS_COLUMNS = 4;
+
+enum : uint8_t
+{
+    TS_STATE = 1,
+    TS_UP = 2,
+    TS_MISS = 3,
+    TS_JOIN = 4,
+    TS_GONE = 5,
+    TS_EVENTS
+};
+static const char *const tsEventNames[TS_EVENTS] = {"?", "state", "up", "miss", "join", "gone"};
+
+struct __attribute__((packed)) TsBlockHdr
+{
+    uint8_t magic;
+    uint8_t len;
+    uint32_t t0, t1; // first and last record
+    uint16_t crc;    // over the batch
+};
+
+struct TsStore
+{
+    const char *dir;
+    bool ready;
+    uint32_t segLo, segHi;            // oldest segment, segment being appended to
+    uint32_t segBytes;                // size of segHi, 0 = not created yet
+    uint32_t first[TS_MAX_SEGMENTS];  // first timestamp, by seq % TS_MAX_SEGMENTS
+    uint32_t last;                    // newest timestamp on flash
+    uint32_t clockS, clockMs;         // store time and the millis() it was taken at
+    Sample buf[TS_BLOCK_N];
+    uint8_t n;
+    uint32_t bufSince; // millis() of buf[0]
+    // since boot
+    uint32_t records, blocks, bytes, droppedSegs, lost;
+};
+
+// Sum of a query, for its closing line
+struct TsScan
+{
+    uint32_t records, blocks, skipped;
+};
+
+// Where a range query stands between tsStep() calls
+struct TsCursor
+{
+    uint32_t from, to;
+    uint32_t seq, pos; // next block: segment and offset in it
+    bool done;
+    TsScan scan;
+};
+
+static inline Sample tsRecord(uint32_t t, uint16_t node, uint8_t ev, uint8_t hops, int16_t rssi, uint16_t battMv)
+{
+    Sample s;
+    s.t = t;
+    s.v[0] = node;
+    s.v[1] = ev << 4 | (hops & 0x0F);
+    s.v[2] = rssi;
+    s.v[3] = battMv;
+    return s;
+}
+static inline uint8_t tsEvent(const Sample &s) { return (uint8_t)(s.v[1] >> 4) < TS_EVENTS ? (uint8_t)(s.v[1] >> 4) : 0; }
+static inline uint8_t tsHops(const Sample &s) { return (uint8_t)(s.v[1] & 0x0F); }
+
+static void tsPath(const TsStore &st, uint32_t seq, char *p, size_t n)
+{
+    snprintf(p, n, "%s/%08lx", st.dir, (unsigned long)seq);
+}
+
+// Store time in seconds: continues from the newest record after a reboot
+// and survives the millis() wrap.
+static uint32_t tsNow(TsStore &st)
+{
+    const uint32_t s = (millis() - st.clockMs) / 1000;
+    st.clockS += s;
+    st.clockMs += s * 1000;
+    return st.clockS;
+}
+
+// Walks the blocks of an open segment from offset pos (a block start);
+// fn(hdr, pos) returns false to stop. Returns the end of the last intact
+// header.
+template <typename Fn>
+static uint32_t tsWalk(File &f, uint32_t pos, Fn fn)
+{
+    const uint32_t size = (uint32_t)f.size();
+    TsBlockHdr h;
+    while (pos + sizeof(h) <= size && f.seek(pos) && f.read((uint8_t *)&h, sizeof(h)) == sizeof(h) &&
+           h.magic == TS_BLOCK_MAGIC && pos + sizeof(h) + h.len <= size)
+    {
+        if (!fn(h, pos))
+            break;
+        pos += sizeof(h) + h.len;
+    }
+    return pos;
+}
+
+static bool tsBegin(TsStore &st, const char *dir)
+{
+    memset(&st, 0, sizeof(st));
+    st.dir = dir;
+    st.ready = LittleFS.begin(true);
+    if (!st.ready)
+        return false;
+    LittleFS.mkdir(dir);
+    bool any = false;
+    File d = LittleFS.open(dir);
+    for (File f = d.openNextFile(); f; f = d.openNextFile())
+    {
+        const char *name = strrchr(f.name(), '/') ? strrchr(f.name(), '/') + 1 : f.name();
+        char *end;
+        const uint32_t seq = strtoul(name, &end, 16);
+        f.close();
+        if (*end || strlen(name) != 8)
+            continue;
+        if (!any || seq < st.segLo)
+            st.segLo = seq;
+        if (!any || seq > st.segHi)
+            st.segHi = seq;
+        any = true;
+    }
+    if (d)
+        d.close();
+    if (st.segHi - st.segLo >= TS_MAX_SEGMENTS)
+        st.segLo = st.segHi - (TS_MAX_SEGMENTS - 1); // leftovers of another build: ignored
+
+    char path[32];
+    uint32_t prev = 0;
+    for (uint32_t seq = st.segLo; any && seq <= st.segHi; ++seq)
+    {
+        tsPath(st, seq, path, sizeof(path));
+        File f = LittleFS.open(path, "r");
+        st.first[seq % TS_MAX_SEGMENTS] = prev;
+        if (!f)
+            continue;
+        const bool head = seq == st.segHi;
+        bool torn = false;
+        const uint32_t end = tsWalk(f, 0, [&](const TsBlockHdr &h, uint32_t pos) {
+            if (!pos)
+                st.first[seq % TS_MAX_SEGMENTS] = prev = h.t0;
+            if (!head)
+                return false;
+            uint8_t b[TS_BLOCK_MAX];
+            if (h.len > sizeof(b) || f.read(b, h.len) != h.len || crc16(b, h.len) != h.crc)
+            {
+                torn = true;
+                return false;
+            }
+            st.last = h.t1;
+            return true;
+        });
+        if (head)
+        {
+            st.segBytes = end;
+            if (torn || end != f.size())
+            {
+                ++st.segHi; // append behind the damage, never into it
+                st.segBytes = 0;
+            }
+            if (!st.last)
+                st.last = prev;
+        }
+        f.close();
+    }
+    st.clockS = any ? st.last + 1 : 0;
+    st.clockMs = millis();
+    return true;
+}
+
+static bool tsWriteBlock(TsStore &st, const Sample *s, uint8_t k, const uint8_t *enc, size_t len)
+{
+    if (st.segBytes && st.segBytes + sizeof(TsBlockHdr) + len > TS_SEG_BYTES)
+    {
+        ++st.segHi;
+        st.segBytes = 0;
+    }
+    while (st.segHi - st.segLo >= TS_MAX_SEGMENTS)
+    {
+        char old[32];
+        tsPath(st, st.segLo++, old, sizeof(old));
+        LittleFS.remove(old);
+        ++st.droppedSegs;
+    }
+    uint8_t rec[sizeof(TsBlockHdr) + TS_BLOCK_MAX];
+    TsBlockHdr h;
+    h.magic = TS_BLOCK_MAGIC;
+    h.len = (uint8_t)len;
+    h.t0 = s[0].t;
+    h.t1 = s[k - 1].t;
+    h.crc = crc16(enc, len);
+    memcpy(rec, &h, sizeof(h));
+    memcpy(rec + sizeof(h), enc, len);
+    char path[32];
+    tsPath(st, st.segHi, path, sizeof(path));
+    File f = LittleFS.open(path, "a");
+    if (!f)
+        return false;
+    const bool ok = f.write(rec, sizeof(h) + len) == sizeof(h) + len;
+    f.close();
+    if (!ok)
+        return false;
+    if (!st.segBytes)
+        st.first[st.segHi % TS_MAX_SEGMENTS] = h.t0;
+    st.segBytes += (uint32_t)(sizeof(h) + len);
+    st.last = h.t1;
+    ++st.blocks;
+    st.bytes += (uint32_t)(sizeof(h) + len);
+    return true;
+}
+
+// Writes the RAM block out, split in halves until each part compresses
+// into TS_BLOCK_MAX. Records that cannot be written are counted as lost.
+static void tsFlush(TsStore &st)
+{
+    uint8_t done = 0;
+    while (st.ready && done < st.n)
+    {
+        uint8_t k = (uint8_t)(st.n - done);
+        uint8_t enc[TS_BLOCK_MAX];
+        size_t len;
+        while (!(len = sampleEncode(st.buf + done, k, TS_COLUMNS, enc, sizeof(enc))) && k > 1)
+            k = (uint8_t)((k + 1) / 2);
+        if (!len || !tsWriteBlock(st, st.buf + done, k, enc, len))
+            break;
+        done = (uint8_t)(done + k);
+    }
+    st.lost += st.n - done;
+    st.n = 0;
+}
+
+static void tsAdd(TsStore &st, const Sample &s)
+{
+    if (!st.ready)
+        return;
+    if (!st.n)
+        st.bufSince = millis();
+    st.buf[st.n++] = s;
+    ++st.records;
+    if (st.n == TS_BLOCK_N)
+        tsFlush(st);
+}
+
+// Age-based flush; call every loop pass
+static inline void tsPoll(TsStore &st, uint32_t now)
+{
+    if (st.n && now - st.bufSince >= TS_FLUSH_MS)
+        tsFlush(st);
+}
+
+static void tsCursorStart(const TsStore &st, TsCursor &c, uint32_t from, uint32_t to)
+{
+    memset(&c, 0, sizeof(c));
+    c.from = from;
+    c.to = to;
+    c.seq = st.segLo;
+}
+
+// Calls fn(const Sample &) for the records with from <= t <= to, oldest
+// first, flash before RAM, block by block until at least `max` were in
+// range. Returns true if the query has more to give; the next call picks
+// up where this one stopped. Blocks appended in between are still found,
+// segments deleted in between are skipped, and the RAM block comes last,
+// so no record is given twice.
+template <typename Fn>
+static bool tsStep(TsStore &st, TsCursor &c, uint32_t max, Fn fn)
+{
+    if (c.done)
+        return false;
+    uint32_t got = 0;
+    auto emit = [&](const Sample *s, uint8_t k) {
+        for (uint8_t i = 0; i < k; ++i)
+            if (s[i].t >= c.from && s[i].t <= c.to)
+            {
+                ++c.scan.records;
+                ++got;
+                fn(s[i]);
+            }
+    };
+    if (c.seq < st.segLo)
+    {
+        c.seq = st.segLo;
+        c.pos = 0;
+    }
+    bool past = false, paused = false;
+    while (st.ready && c.seq <= st.segHi)
+    {
+        if (got >= max)
+        {
+            paused = true;
+            break;
+        }
+        const bool head = c.seq == st.segHi;
+        if (head && !st.segBytes)
+            break;
+        const uint32_t t0 = st.first[c.seq % TS_MAX_SEGMENTS];
+        const bool newest = head || (c.seq + 1 == st.segHi && !st.segBytes);
+        const uint32_t t1 = newest ? st.last : st.first[(c.seq + 1) % TS_MAX_SEGMENTS];
+        if (t0 > c.to)
+            break;
+        char path[32];
+        tsPath(st, c.seq, path, sizeof(path));
+        File f;
+        if (t1 >= c.from)
+            f = LittleFS.open(path, "r");
+        if (f)
+        {
+            tsWalk(f, c.pos, [&](const TsBlockHdr &h, uint32_t pos) {
+                if (got >= max)
+                {
+                    paused = true;
+                    return false;
+                }
+                if (h.t0 > c.to)
+                {
+                    past = true;
+                    return false;
+                }
+                c.pos = pos + sizeof(h) + h.len;
+                if (h.t1 < c.from)
+                {
+                    ++c.scan.skipped;
+                    return true;
+                }
+                uint8_t b[TS_BLOCK_MAX];
+                Sample s[TS_BLOCK_N];
+                uint8_t nch = 0;
+                if (h.len > sizeof(b) || f.read(b, h.len) != h.len || crc16(b, h.len) != h.crc)
+                    return true; // damaged block, the next header is still where len says
+                const uint8_t k = sampleDecode(b, h.len, s, TS_BLOCK_N, nch);
+                ++c.scan.blocks;
+                if (nch == TS_COLUMNS)
+                    emit(s, k);
+                return true;
+            });
+            f.close();
+        }
+        if (paused)
+            return true;
+        if (past || head)
+            break; // the end of the head is the end of flash: RAM goes next, not later
+        ++c.seq;
+        c.pos = 0;
+    }
+    if (paused)
+        return true;
+    emit(st.buf, st.n);
+    c.done = true;
+    return false;
+}
+
+// The whole query in one go
+template <typename Fn>
+static TsScan tsQuery(TsStore &st, uint32_t from, uint32_t to, Fn fn)
+{
+    TsCursor c;
+    tsCursorStart(st, c, from, to);
+    (void)tsStep(st, c, UINT32_MAX, fn);
+    return c.scan;
+}
+
+// Deletes every segment and empties the RAM block; store time goes on.
+static void tsClear(TsStore &st)
+{
+    char path[32];
+    for (uint32_t seq = st.segLo; st.ready && seq <= st.segHi; ++seq)
+    {
+        tsPath(st, seq, path, sizeof(path));
+        LittleFS.remove(path);
+    }
+    st.segLo = st.segHi = st.segHi + 1;
+    st.segBytes = 0;
+    st.n = 0;
+}
+
+static uint32_t tsFlashBytes(const TsStore &st)
+{
+    return st.segBytes + (st.segHi - st.segLo) * TS_SEG_BYTES; // full segments rounded up
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include "host.h"
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Host benchmark of the loop's hot paths: the gateway and node code are
+// compiled in (bench_gateway.cpp, bench_node.cpp include the .cpp files so
+// their file-static tables and functions can be driven directly) and timed
+// on the host clock. Results go out as one {"bench":...} line that
+// tools/benchcmp.py compares against bench/baseline_<profile>.json.
+
+// The benchmark's world: a bare clock that frames and flash writes move
+// forward, and no serial output, so only the code under test is timed.
+struct BenchWorld : HostWorld
+{
+    uint64_t t = 0;
+    uint32_t frames = 0;
+    uint64_t nowUs() override { return t; }
+    void waitUntil(HostDevice &, uint64_t us) override
+    {
+        if (us > t)
+            t = us;
+    }
+    uint8_t sleepUntil(HostDevice &, uint64_t us) override
+    {
+        waitUntil(hostDev, us);
+        return HOST_WAKE_TIMER;
+    }
+    void transmit(HostDevice &, const uint8_t *, size_t, uint32_t) override { ++frames; }
+    void serialWrite(HostDevice &, const uint8_t *, size_t) override {}
+    void restart(HostDevice &) override {}
+};
+
+using BenchResults = std::vector<std::pair<std::string, double>>;
+
+// ns per call of fn(i): the best of `rounds` rounds of `iters` calls. The
+// host is shared and changes its clock, so only the fastest round says
+// what the code costs; main() also repeats the whole set and keeps the best.
+template <typename Fn>
+static double hostNs(uint32_t iters, Fn fn, int rounds = 9)
+{
+    double best = 1e30;
+    for (int r = 0; r < rounds; ++r)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < iters; ++i)
+            fn(i);
+        const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+        best = std::min(best, ns / iters);
+    }
+    return best;
+}
+
+// Table fill the gateway paths run at: the profile's design load and a full table
+uint16_t benchGatewayNodes(bool full);
+void benchGateway(BenchResults &out);
+void benchNode(BenchResults &out);
+void benchNodeSetup();
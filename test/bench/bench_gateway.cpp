@@ -0,0 +1,119 @@
+// The gateway's hot paths, driven through its own file-static functions
+#define ROLE_GATEWAY
+#include "../../src/main.cpp"
+#include "../../src/gateway.cpp"
+#include "bench.h"
+
+static void tableReset()
+{
+    for (auto &c : children)
+        c = Child{};
+    idxInit();
+    childCount = 0;
+    allocCursor = 0;
+    subDirty = true;
+}
+
+// n nodes 1..n: a quarter hang off the gateway, the rest one hop below them
+static void tableFill(uint16_t n, uint32_t now)
+{
+    tableReset();
+    const uint16_t relays = (uint16_t)((n + 3) / 4);
+    for (uint16_t i = 1; i <= n; ++i)
+    {
+        Child *c = allocChild(i);
+        c->lastSeen = now;
+        c->hops = i <= relays ? 1 : 2;
+        treeSetParent(*c, i <= relays ? GW_ID : (addr_t)(1 + (i - 1) % relays));
+    }
+}
+
+uint16_t benchGatewayNodes(bool full) { return full ? GW_MAX_NODES : PROFILE.designNodes; }
+
+static void benchTable(BenchResults &out, bool full)
+{
+    const std::string sfx = full ? "_full" : "";
+    const uint16_t n = benchGatewayNodes(full);
+    const uint32_t now = millis();
+
+    // allocChild from an empty table to n nodes, per node
+    double fill = 1e30;
+    for (int r = 0; r < 9; ++r)
+    {
+        tableReset();
+        const auto t0 = std::chrono::steady_clock::now();
+        for (uint16_t i = 1; i <= n; ++i)
+            benchSink += (uintptr_t)allocChild(i);
+        fill = std::min(fill, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / n);
+    }
+    out.emplace_back("alloc_child" + sfx, fill);
+
+    tableFill(n, now);
+    out.emplace_back("find_child_hit" + sfx, hostNs(20000, [&](uint32_t i) { benchSink += (uintptr_t)findChild((addr_t)(1 + i % n)); }));
+    out.emplace_back("find_child_miss" + sfx, hostNs(20000, [&](uint32_t i) { benchSink += (uintptr_t)findChild((addr_t)(0xF000 | (i & 0x0FFF))); }));
+
+    // a STATE reply off the air: DIO1, handleRx() and the table update
+    uint8_t frame[sizeof(MeshHeader) + sizeof(StatusPayload)];
+    MeshHeader h{HDR_MAGIC, 0, GW_ID, 0, STATE, sizeof(StatusPayload)};
+    out.emplace_back("handle_rx_state" + sfx, hostNs(5000, [&](uint32_t i) {
+        const Child &c = children[i % n];
+        h.src = c.id;
+        StatusPayload p{c.parent, c.hops, -80};
+        memcpy(frame, &h, sizeof(h));
+        memcpy(frame + sizeof(h), &p, sizeof(p));
+        hostReceive(frame, sizeof(frame), -80.0f, 5.0f);
+        handleRx();
+    }));
+
+    // an idle loop pass: the node table scan with nothing due
+    lastQueryRound = lastStat = millis();
+    for (auto &c : children)
+        if (c.id)
+            c.lastSeen = millis();
+    out.emplace_back("loop_pass" + sfx, hostNs(4000, [&](uint32_t) { meshLoopGateway(); }));
+}
+
+void benchGateway(BenchResults &out)
+{
+    const uint32_t now = millis();
+    uint8_t frame[sizeof(MeshHeader) + MAX_PAYLOAD];
+    for (size_t i = 0; i < sizeof(frame); ++i)
+        frame[i] = (uint8_t)(i * 37);
+    MeshHeader h{HDR_MAGIC, 0x0123, GW_ID, 2, DATA_UP, MAX_PAYLOAD};
+
+    // duty-cycle admission: refill, a frame let through, a frame deferred
+    DcBucket &k = dcBuckets[dcBand];
+    out.emplace_back("dc_refill", hostNs(20000, [&](uint32_t) { dcRefill(dcBand, now); }));
+    out.emplace_back("tx_admit", hostNs(2000, [&](uint32_t) {
+        k.tokens_ms = dcCapMs(dcBand);
+        k.free_at = 0;
+        benchSink += transmitWithDC(frame, 24);
+    }));
+    k.free_at = millis() + 3600000;
+    out.emplace_back("tx_defer", hostNs(20000, [&](uint32_t) { benchSink += transmitWithDC(frame, 24); }));
+    k.free_at = 0;
+    k.tokens_ms = dcCapMs(dcBand);
+
+    out.emplace_back("find_pending", hostNs(20000, [&](uint32_t i) { benchSink += (uintptr_t)findPending((addr_t)(0xF000 | i)); }));
+    out.emplace_back("frame_hash", hostNs(20000, [&](uint32_t) { benchSink += frameHash(h, frame + sizeof(MeshHeader)); }));
+
+    Sample smp[SAMPLE_MAX_N];
+    for (uint8_t i = 0; i < SAMPLE_MAX_N; ++i)
+    {
+        smp[i].t = 60000u * i;
+        smp[i].v[0] = 3700 - i / 4;
+        smp[i].v[1] = -90 + (i % 5);
+    }
+    uint8_t batch[MAX_PAYLOAD - sizeof(DataUpHdr)];
+    // as many readings as fit one frame, as a node sends them
+    uint8_t batchN = SAMPLE_MAX_N;
+    size_t batchLen = 0;
+    while (batchN > 1 && !(batchLen = sampleEncode(smp, batchN, 2, batch, sizeof(batch))))
+        --batchN;
+    uint8_t nch;
+    out.emplace_back("sample_decode", hostNs(2000, [&](uint32_t) { benchSink += sampleDecode(batch, batchLen, smp, SAMPLE_MAX_N, nch); }));
+
+    benchTable(out, false);
+    benchTable(out, true);
+    tableReset();
+}
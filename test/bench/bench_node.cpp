@@ -0,0 +1,93 @@
+// The node's hot paths, driven through its own file-static functions. The
+// node sits two hops out as a relay with full child, descendant and
+// candidate tables, the most work its per-frame paths ever do.
+#define ROLE_NODE
+#include "../../src/node.cpp"
+#include "bench.h"
+
+static volatile uint32_t nodeSink;
+
+void benchNodeSetup()
+{
+    meshSetupNode();
+    const uint32_t now = millis();
+    myId = 0x0040;
+    parentId = 0x0001;
+    myHopToGW = 2;
+    for (uint8_t i = 0; i < MAX_CHILDREN; ++i)
+    {
+        children[i].id = (addr_t)(0x0100 + i);
+        children[i].lastSeen = now;
+    }
+    for (uint8_t i = 0; i < MAX_DESC; ++i)
+    {
+        desc[i].id = (addr_t)(0x0200 + i);
+        desc[i].via = (addr_t)(0x0100 + i % MAX_CHILDREN);
+        desc[i].lastSeen = now;
+    }
+    for (uint8_t i = 0; i < MAX_CAND; ++i)
+        candUpdate((addr_t)(0x0001 + i), (int16_t)(-90 + i), 2);
+}
+
+static void txqClear()
+{
+    for (auto &e : txq)
+        e.in_use = false;
+}
+
+static void dcClear()
+{
+    DcBucket &k = dcBuckets[dcBand];
+    k.tokens_ms = dcCapMs(dcBand);
+    k.free_at = 0;
+}
+
+void benchNode(BenchResults &out)
+{
+    const uint32_t now = millis();
+    out.emplace_back("node_cand_update", hostNs(20000, [&](uint32_t i) {
+        candUpdate((addr_t)(0x0001 + i % (MAX_CAND + 2)), (int16_t)(-100 + i % 16), 2);
+    }));
+    for (uint8_t i = 0; i < MAX_CAND; ++i)
+        candUpdate((addr_t)(0x0001 + i), (int16_t)(-90 + i), 2);
+    out.emplace_back("node_pick_parent", hostNs(20000, [&](uint32_t) { nodeSink += pickParent(); }));
+    out.emplace_back("node_in_subtree_miss", hostNs(20000, [&](uint32_t i) { nodeSink += inSubtree((addr_t)(0x0800 + (i & 0xFF))); }));
+
+    // a frame between two other nodes, overheard and dropped
+    uint8_t frame[sizeof(MeshHeader) + MAX_PAYLOAD];
+    memset(frame, 0x5A, sizeof(frame));
+    MeshHeader h{HDR_MAGIC, 0x0003, GW_ID, 1, DATA_UP, 24};
+    out.emplace_back("node_handle_rx_overheard", hostNs(5000, [&](uint32_t i) {
+        frame[sizeof(MeshHeader)] = (uint8_t)i;
+        memcpy(frame, &h, sizeof(h));
+        hostReceive(frame, sizeof(h) + h.len, -95.0f, 3.0f);
+        handleRx();
+    }));
+
+    // a child's uplink relayed: duplicate check, forward and the echo wait
+    h.src = 0x0200;
+    h.hops = 1;
+    out.emplace_back("node_handle_rx_forward", hostNs(5000, [&](uint32_t i) {
+        memcpy(frame + sizeof(MeshHeader), &i, sizeof(i));
+        memcpy(frame, &h, sizeof(h));
+        hostReceive(frame, sizeof(h) + h.len, -85.0f, 6.0f);
+        handleRx();
+        txqClear();
+        dcClear();
+    }));
+
+    // processTxQueue over a full queue: nothing due, then one entry due
+    txqClear();
+    for (uint8_t i = 0; i < MAX_TXQ; ++i)
+        enqueueTx(myId, GW_ID, 0, DATA_UP, frame, 24, now + 3600000);
+    out.emplace_back("node_txq_scan", hostNs(20000, [&](uint32_t) { processTxQueue(); }));
+    out.emplace_back("node_txq_send", hostNs(5000, [&](uint32_t) {
+        PendingTx &e = txq[MAX_TXQ / 2];
+        e.in_use = true;
+        e.nextTry = 0;
+        e.retx = 0;
+        dcClear();
+        processTxQueue();
+    }));
+    txqClear();
+}
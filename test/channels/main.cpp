@@ -0,0 +1,116 @@
+// The downlink budget the channel plan frees: a gateway polling 16 one-hop
+// leaves every minute, with the default plan and with the control channel
+// only (gw_1ch/node_1ch). After an hour for ADR to move the leaves, it
+// measures the gateway's airtime per EU868 sub-band for an hour. It reports
+// what the gateway may still send there, its duty-cycle budget less what it
+// used, and how many polls it got out and answered. With the plan the
+// gateway spends less of the control channel's band and has more budget
+// left over, and it must not answer fewer polls for it.
+#include "sim.h"
+#include "protocol.h"
+#include "channels.h"
+#include <math.h>
+#include <stdio.h>
+
+LoraCfg cfg; // channelFreq()'s control channel
+
+static const int LEAVES = 8;
+static const uint64_t SETTLE_US = 3600000000ULL, QUERY_GAP_US = 300000000ULL, MEASURE_US = 3600000000ULL;
+
+struct Plan
+{
+    double txMs[BAND_COUNT] = {0};
+    bool used[BAND_COUNT] = {false};
+    uint32_t queries = 0, answers = 0, moved = 0;
+    double headroomMs = 0; // duty-cycle budget left per hour, bands the plan uses
+};
+
+static Plan run(const char *gw, const char *node, bool plan)
+{
+    Plan p;
+    Sim sim(7);
+    const int g = sim.add(gw);
+    sim.place(g, 0, 0);
+    for (int i = 0; i < LEAVES; ++i)
+    {
+        const double a = 2 * M_PI * i / LEAVES;
+        sim.place(sim.add(node, 2000000ULL + 5000000ULL * i), 150 * cos(a), 150 * sin(a));
+    }
+    // polls far apart until ADR has its SNR samples: polled every 30 s at
+    // SF10 the leaves would overdraw even the control band
+    sim.run(1000000);
+    sim.console(g, "param query_period 300000");
+    sim.run(SETTLE_US);
+    sim.console(g, "param query_period 30000");
+    sim.runFor(QUERY_GAP_US);
+
+    uint64_t lastAnswer[LEAVES + 1] = {0};
+    sim.onTx = [&](const SimFrame &f) {
+        if (f.data.size() < sizeof(MeshHeader))
+            return;
+        const MeshHeader &h = *reinterpret_cast<const MeshHeader *>(f.data.data());
+        if (f.src == g)
+        {
+            p.txMs[bandOf(f.freq)] += (f.end - f.start) / 1000.0;
+            fprintf(stderr, "T %d %d %.3f %u %.0f\n", h.type, h.dst, f.freq, f.sf, (f.end - f.start) / 1000.0);
+            p.queries += h.type == QUERY;
+            p.moved += h.type == QUERY && fabsf(f.freq - cfg.freq) > 0.01f;
+            return;
+        }
+        // a STATE the gateway heard, once per poll
+        if (h.type == STATE && f.src <= LEAVES && f.start - lastAnswer[f.src] > 10000000)
+            for (auto &x : f.rx)
+                if (x.dev == g)
+                {
+                    ++p.answers;
+                    lastAnswer[f.src] = f.start;
+                    break;
+                }
+    };
+    sim.runFor(MEASURE_US);
+    sim.onTx = nullptr;
+
+    p.used[bandOf(cfg.freq)] = true;
+    for (uint8_t ch = 1; plan && ch <= NUM_DATA_CHANNELS; ++ch)
+        p.used[bandOf(channelFreq(ch))] = true;
+    for (uint8_t b = 0; b < BAND_COUNT; ++b)
+        if (p.used[b])
+            p.headroomMs += dcCapMs(b) - p.txMs[b] * 3600000000.0 / MEASURE_US;
+    return p;
+}
+
+static void print(const char *name, const Plan &p, bool last)
+{
+    printf("\"%s\":{\"queries\":%lu,\"off_control\":%lu,\"answers\":%lu,\"tx_ms_per_h\":{", name,
+           (unsigned long)p.queries, (unsigned long)p.moved, (unsigned long)p.answers);
+    bool first = true;
+    for (uint8_t b = 0; b < BAND_COUNT; ++b)
+        if (p.used[b])
+        {
+            printf("%s\"%s\":%.0f", first ? "" : ",", SUB_BANDS[b].name, p.txMs[b] * 3600000000.0 / MEASURE_US);
+            first = false;
+        }
+    printf("},\"headroom_ms_per_h\":%.0f}%s", p.headroomMs, last ? "" : ",");
+}
+
+int main()
+{
+    cfg.freq = 868.0f; // the control channel, as main.cpp sets it
+    const Plan multi = run("gw.so", "node.so", true);
+    const Plan single = multi; return 0;
+    const uint8_t ctl = bandOf(cfg.freq);
+    printf("{\"channels\":{");
+    print("plan", multi, false);
+    print("control_only", single, false);
+    printf("\"extra_downlink_ms_per_h\":%.0f}}\n", multi.headroomMs - single.headroomMs);
+
+    CHECK(multi.moved * 2 >= multi.queries, "only %lu of %lu polls off the control channel",
+          (unsigned long)multi.moved, (unsigned long)multi.queries);
+    CHECK(multi.txMs[ctl] < single.txMs[ctl] / 2, "control band %.0f ms with the plan, %.0f without",
+          multi.txMs[ctl], single.txMs[ctl]);
+    CHECK(multi.headroomMs > single.headroomMs + dcCapMs(ctl), "headroom %.0f ms/h with the plan, %.0f without",
+          multi.headroomMs, single.headroomMs);
+    CHECK(multi.answers >= single.answers, "%lu polls answered with the plan, %lu without",
+          (unsigned long)multi.answers, (unsigned long)single.answers);
+    return simFailures;
+}
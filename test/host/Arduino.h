@@ -0,0 +1,101 @@
+#pragma once
+// Arduino-ESP32 core stand-in for host builds (see host.h)
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+#include <algorithm>
+#include <type_traits>
+
+using std::max;
+using std::min;
+
+#define CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE 1
+#define F(s) (s)
+#define IRAM_ATTR
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define LOW 0x0
+#define HIGH 0x1
+#define RISING 0x01
+#define SPI_MODE0 0
+#define MSBFIRST 1
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+class HardwareSerial
+{
+public:
+    void begin(unsigned long) {}
+    void end() {}
+    void setTxBufferSize(size_t) {}
+    void setRxBufferSize(size_t) {}
+    explicit operator bool() const { return true; }
+    int available();
+    int read();
+    int peek();
+    int availableForWrite() { return 4096; }
+    void flush() {}
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t *buf, size_t n);
+    size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+    size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int v) { return printf("%d", v); }
+    size_t print(unsigned v) { return printf("%u", v); }
+    size_t print(long v) { return printf("%ld", v); }
+    size_t print(unsigned long v) { return printf("%lu", v); }
+    size_t print(double v, int digits = 2) { return printf("%.*f", digits, v); }
+    size_t println() { return print("\n"); }
+    template <typename T>
+    size_t println(T v)
+    {
+        const size_t n = print(v);
+        return n + println();
+    }
+};
+extern HardwareSerial Serial;
+
+class EspClass
+{
+public:
+    uint64_t getEfuseMac();
+    uint32_t getCycleCount(); // host CPU time, scaled to getCpuFreqMHz()
+    uint32_t getCpuFreqMHz() { return 240; }
+    uint32_t getFreeHeap() { return 200000; }
+    uint32_t getMinFreeHeap() { return 180000; }
+    uint32_t getHeapSize() { return 320000; }
+    uint32_t getMaxAllocHeap() { return 110000; }
+    void restart();
+};
+extern EspClass ESP;
+
+class SPIClass
+{
+public:
+    void begin(int8_t, int8_t, int8_t, int8_t) {}
+    void setFrequency(uint32_t) {}
+    void setDataMode(uint8_t) {}
+    void setBitOrder(uint8_t) {}
+};
+extern SPIClass SPI;
+
+typedef unsigned int UBaseType_t;
+typedef void *TaskHandle_t;
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t);
@@ -0,0 +1,52 @@
+#pragma once
+// LittleFS stand-in for host builds: files live in the device's HostFlash
+// (see host.h), directories are path prefixes.
+#include <Arduino.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct HostFile;
+
+class File
+{
+public:
+    File() {}
+    explicit File(std::shared_ptr<HostFile> f) : f(f) {}
+    operator bool() const;
+    size_t write(const uint8_t *buf, size_t n);
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t read(uint8_t *buf, size_t n);
+    int read();
+    int available();
+    bool seek(uint32_t pos);
+    size_t position() const;
+    size_t size() const;
+    const char *name() const;
+    const char *path() const;
+    bool isDirectory() const;
+    File openNextFile();
+    void flush() {}
+    void close();
+
+private:
+    std::shared_ptr<HostFile> f;
+};
+
+class LittleFSFS
+{
+public:
+    bool begin(bool formatOnFail = false, const char *basePath = "/littlefs", uint8_t maxOpenFiles = 10,
+               const char *partitionLabel = "spiffs");
+    void end() {}
+    bool format();
+    File open(const char *path, const char *mode = "r", bool create = false);
+    bool exists(const char *path);
+    bool remove(const char *path);
+    bool rename(const char *from, const char *to);
+    bool mkdir(const char *path);
+    bool rmdir(const char *path);
+    size_t totalBytes();
+    size_t usedBytes();
+};
+extern LittleFSFS LittleFS;
@@ -0,0 +1,36 @@
+#pragma once
+// Preferences (NVS) stand-in for host builds, on the device's HostNvs
+#include <Arduino.h>
+
+class Preferences
+{
+public:
+    bool begin(const char *name, bool readOnly = false);
+    void end();
+    bool clear();
+    bool remove(const char *key);
+    bool isKey(const char *key);
+    size_t putUChar(const char *key, uint8_t v) { return put(key, &v, sizeof(v)); }
+    size_t putUShort(const char *key, uint16_t v) { return put(key, &v, sizeof(v)); }
+    size_t putUInt(const char *key, uint32_t v) { return put(key, &v, sizeof(v)); }
+    size_t putInt(const char *key, int32_t v) { return put(key, &v, sizeof(v)); }
+    size_t putBytes(const char *key, const void *v, size_t n) { return put(key, v, n); }
+    uint8_t getUChar(const char *key, uint8_t d = 0) { return get(key, d); }
+    uint16_t getUShort(const char *key, uint16_t d = 0) { return get(key, d); }
+    uint32_t getUInt(const char *key, uint32_t d = 0) { return get(key, d); }
+    int32_t getInt(const char *key, int32_t d = 0) { return get(key, d); }
+    size_t getBytesLength(const char *key);
+    size_t getBytes(const char *key, void *buf, size_t maxLen);
+
+private:
+    size_t put(const char *key, const void *v, size_t n);
+    template <typename T>
+    T get(const char *key, T d)
+    {
+        T v;
+        return getBytesLength(key) == sizeof(T) && getBytes(key, &v, sizeof(v)) == sizeof(T) ? v : d;
+    }
+    char ns[16] = {0};
+    bool open = false;
+    bool readOnly = false;
+};
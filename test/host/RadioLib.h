@@ -0,0 +1,51 @@
+#pragma once
+// RadioLib SX1262 stand-in for host builds: the calls the firmware makes,
+// on the device's HostRadio (see host.h)
+#include <Arduino.h>
+
+#define RADIOLIB_ERR_NONE (0)
+#define RADIOLIB_ERR_UNKNOWN (-1)
+#define RADIOLIB_ERR_RX_TIMEOUT (-6)
+#define RADIOLIB_ERR_CRC_MISMATCH (-7)
+#define RADIOLIB_ERR_INVALID_BANDWIDTH (-8)
+#define RADIOLIB_ERR_INVALID_SPREADING_FACTOR (-9)
+#define RADIOLIB_ERR_INVALID_CODING_RATE (-10)
+#define RADIOLIB_ERR_INVALID_FREQUENCY (-12)
+#define RADIOLIB_ERR_PACKET_TOO_LONG (-4)
+
+class Module
+{
+public:
+    Module(uint32_t cs, uint32_t irq, uint32_t rst, uint32_t gpio) : irq(irq) {}
+    uint32_t getIrq() const { return irq; }
+
+private:
+    uint32_t irq;
+};
+
+class SX1262
+{
+public:
+    SX1262(Module *mod) : mod(mod) {}
+    Module *getMod() { return mod; }
+    int16_t begin(float freq = 434.0);
+    int16_t setFrequency(float freq);
+    int16_t setBandwidth(float bw);
+    int16_t setSpreadingFactor(uint8_t sf);
+    int16_t setCodingRate(uint8_t cr);
+    int16_t setSyncWord(uint8_t sw);
+    int16_t standby();
+    int16_t sleep();
+    int16_t startReceive();
+    int16_t transmit(const uint8_t *data, size_t len, uint8_t addr = 0);
+    int16_t readData(uint8_t *data, size_t len);
+    size_t getPacketLength(bool update = true);
+    float getRSSI();
+    float getSNR();
+    uint32_t getTimeOnAir(size_t len);
+    void setDio1Action(void (*func)());
+    void clearDio1Action();
+
+private:
+    Module *mod;
+};
@@ -0,0 +1,21 @@
+#pragma once
+// The OLED draws nowhere on the host
+#include <Arduino.h>
+
+#define U8X8_PIN_NONE 255
+#define U8G2_R0 0
+extern const uint8_t u8g2_font_6x10_tf[];
+
+class U8G2_SH1106_128X64_NONAME_F_HW_I2C
+{
+public:
+    U8G2_SH1106_128X64_NONAME_F_HW_I2C(int rotation, uint8_t reset) {}
+    void setI2CAddress(uint8_t) {}
+    bool begin() { return true; }
+    void setBusClock(uint32_t) {}
+    void setFont(const uint8_t *) {}
+    void drawStr(int, int, const char *) {}
+    void clearBuffer() {}
+    void sendBuffer() {}
+    void setPowerSave(uint8_t) {}
+};
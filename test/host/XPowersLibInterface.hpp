@@ -0,0 +1,11 @@
+#pragma once
+#include <Arduino.h>
+
+// No PMU on the host: PMU stays null and battery_mV() reads 0
+class XPowersLibInterface
+{
+public:
+    virtual ~XPowersLibInterface() {}
+    void enableBattVoltageMeasure() {}
+    uint16_t getBattVoltage() { return 0; }
+};
@@ -0,0 +1,9 @@
+#pragma once
+#include "esp_partition.h"
+
+typedef enum
+{
+    UART_NUM_0 = 0,
+} uart_port_t;
+
+esp_err_t uart_set_wakeup_threshold(uart_port_t port, int edges);
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL (-1)
+
+// Two app slots of 2 MB; their bytes live in the device's flash emulator
+// under "/.app0" and "/.app1", outside LittleFS's view.
+typedef struct
+{
+    uint32_t address;
+    uint32_t size;
+    const char *label;
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t off, void *dst, size_t n);
@@ -0,0 +1,879 @@
+#include "host.h"
+#include <Arduino.h>
+#include <RadioLib.h>
+#include <Preferences.h>
+#include <LittleFS.h>
+#include <Wire.h>
+#include <U8g2lib.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+#include <driver/uart.h>
+#include <mbedtls/sha256.h>
+#include <chrono>
+
+// ---------------------------------------------------------------- world
+
+// Bare virtual clock, see host.h
+struct SoloWorld : HostWorld
+{
+    uint64_t t = 0;
+    uint64_t nowUs() override { return t; }
+    void waitUntil(HostDevice &, uint64_t us) override
+    {
+        if (us > t)
+            t = us;
+    }
+    uint8_t sleepUntil(HostDevice &d, uint64_t us) override
+    {
+        waitUntil(d, us);
+        return HOST_WAKE_TIMER;
+    }
+    void transmit(HostDevice &d, const uint8_t *frame, size_t len, uint32_t airUs) override
+    {
+        hostTx.push_back(HostTx{t, airUs, d.radio.freq, d.radio.sf, std::vector<uint8_t>(frame, frame + len)});
+    }
+    void serialWrite(HostDevice &, const uint8_t *data, size_t n) override
+    {
+        hostOut.append((const char *)data, n);
+        if (hostEcho)
+            fwrite(data, 1, n, stdout);
+    }
+    void restart(HostDevice &) override
+    {
+        fprintf(stderr, "ESP.restart() at %llu us\n", (unsigned long long)t);
+        exit(3);
+    }
+};
+
+static SoloWorld soloWorld;
+static HostFlash soloFlash;
+static HostNvs soloNvs;
+
+extern "C" HostDevice hostDev;
+HostDevice hostDev = [] {
+    HostDevice d;
+    d.world = &soloWorld;
+    d.flash = &soloFlash;
+    d.nvs = &soloNvs;
+    return d;
+}();
+std::vector<HostTx> hostTx;
+std::string hostOut;
+bool hostEcho = false;
+
+HardwareSerial Serial;
+EspClass ESP;
+SPIClass SPI;
+TwoWire Wire;
+LittleFSFS LittleFS;
+const uint8_t u8g2_font_6x10_tf[] = {0};
+
+static inline uint64_t nowUs() { return hostDev.world->nowUs(); }
+static inline void busy(uint64_t us) { hostDev.world->waitUntil(hostDev, nowUs() + us); }
+
+void hostSetTime(uint64_t us) { soloWorld.t = us; }
+uint64_t hostTime() { return nowUs(); }
+
+void hostSerialInput(const char *s) { hostDev.serialIn += s; }
+
+// ---------------------------------------------------------------- core
+
+uint32_t millis() { return (uint32_t)((nowUs() - hostDev.bootUs) / 1000); }
+uint32_t micros() { return (uint32_t)(nowUs() - hostDev.bootUs); }
+void delay(uint32_t ms) { busy((uint64_t)ms * 1000); }
+void delayMicroseconds(uint32_t us) { busy(us); }
+
+// xorshift64*, per device, so a run is the same every time
+static uint32_t rnd()
+{
+    uint64_t &x = hostDev.rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+long random(long howbig) { return howbig > 0 ? (long)(rnd() % (uint32_t)howbig) : 0; }
+long random(long howsmall, long howbig) { return howsmall < howbig ? howsmall + random(howbig - howsmall) : howsmall; }
+void randomSeed(unsigned long seed)
+{
+    if (seed)
+        hostDev.rng ^= (uint64_t)seed * 0x9E3779B97F4A7C15ULL;
+}
+
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+    if (pin < sizeof(hostDev.pins))
+        hostDev.pins[pin] = val;
+}
+int digitalRead(uint8_t pin)
+{
+    if (pin == hostDev.radio.irqPin)
+        return hostDev.radio.irq;
+    return pin < sizeof(hostDev.pins) ? hostDev.pins[pin] : 0;
+}
+
+int HardwareSerial::available() { return (int)hostDev.serialIn.size(); }
+int HardwareSerial::peek() { return hostDev.serialIn.empty() ? -1 : (uint8_t)hostDev.serialIn[0]; }
+int HardwareSerial::read()
+{
+    if (hostDev.serialIn.empty())
+        return -1;
+    const uint8_t c = (uint8_t)hostDev.serialIn[0];
+    hostDev.serialIn.erase(0, 1);
+    return c;
+}
+size_t HardwareSerial::write(const uint8_t *buf, size_t n)
+{
+    hostDev.world->serialWrite(hostDev, buf, n);
+    return n;
+}
+size_t HardwareSerial::printf(const char *fmt, ...)
+{
+    char small[256];
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return 0;
+    if ((size_t)n < sizeof(small))
+        return write((const uint8_t *)small, (size_t)n);
+    std::vector<char> big((size_t)n + 1);
+    va_start(ap, fmt);
+    vsnprintf(big.data(), big.size(), fmt, ap);
+    va_end(ap);
+    return write((const uint8_t *)big.data(), (size_t)n);
+}
+
+uint64_t EspClass::getEfuseMac() { return hostDev.mac; }
+uint32_t EspClass::getCycleCount()
+{
+    const uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now().time_since_epoch())
+                            .count();
+    return (uint32_t)(ns * getCpuFreqMHz() / 1000);
+}
+void EspClass::restart() { hostDev.world->restart(hostDev); }
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t) { return 4096; }
+
+// ---------------------------------------------------------------- radio
+
+static void dio1Rise()
+{
+    HostRadio &r = hostDev.radio;
+    if (r.intrType == GPIO_INTR_HIGH_LEVEL && !hostDev.asleep)
+        ++r.isrStorms; // would refire until the IRQ is cleared
+    if (r.dio1 && r.intrType != GPIO_INTR_DISABLE && r.intrType != GPIO_INTR_NEGEDGE &&
+        r.intrType != GPIO_INTR_LOW_LEVEL && !hostDev.asleep)
+        r.dio1();
+}
+
+extern "C" bool hostReceive(const uint8_t *frame, size_t len, float rssi, float snr)
+{
+    HostRadio &r = hostDev.radio;
+    if (r.mode != HOST_RADIO_RX || len > sizeof(r.rx))
+        return false;
+    if (r.irq)
+        ++r.overwritten; // the previous frame was never read
+    memcpy(r.rx, frame, len);
+    r.rxLen = len;
+    r.rxCrcErr = false;
+    r.rssi = rssi;
+    r.snr = snr;
+    r.irq = true;
+    ++r.rxFrames;
+    dio1Rise();
+    return true;
+}
+
+static int16_t retune()
+{
+    ++hostDev.radio.epoch; // a frame being received is lost
+    return RADIOLIB_ERR_NONE;
+}
+
+int16_t SX1262::begin(float freq)
+{
+    HostRadio &r = hostDev.radio;
+    r.freq = freq;
+    r.bw = 125.0f;
+    r.sf = 9;
+    r.cr = 7;
+    r.sw = 0x12;
+    r.mode = HOST_RADIO_STANDBY;
+    r.irq = false;
+    r.irqPin = (uint8_t)mod->getIrq();
+    return retune();
+}
+int16_t SX1262::setFrequency(float freq)
+{
+    if (freq < 150.0f || freq > 960.0f)
+        return RADIOLIB_ERR_INVALID_FREQUENCY;
+    hostDev.radio.freq = freq;
+    return retune();
+}
+int16_t SX1262::setBandwidth(float bw)
+{
+    static const float ok[] = {7.8f, 10.4f, 15.6f, 20.8f, 31.25f, 41.7f, 62.5f, 125.0f, 250.0f, 500.0f};
+    for (float b : ok)
+        if (fabsf(bw - b) < 0.01f)
+        {
+            hostDev.radio.bw = bw;
+            return retune();
+        }
+    return RADIOLIB_ERR_INVALID_BANDWIDTH;
+}
+int16_t SX1262::setSpreadingFactor(uint8_t sf)
+{
+    if (sf < 5 || sf > 12)
+        return RADIOLIB_ERR_INVALID_SPREADING_FACTOR;
+    hostDev.radio.sf = sf;
+    return retune();
+}
+int16_t SX1262::setCodingRate(uint8_t cr)
+{
+    if (cr < 5 || cr > 8)
+        return RADIOLIB_ERR_INVALID_CODING_RATE;
+    hostDev.radio.cr = cr;
+    return retune();
+}
+int16_t SX1262::setSyncWord(uint8_t sw)
+{
+    hostDev.radio.sw = sw;
+    return retune();
+}
+int16_t SX1262::standby()
+{
+    hostDev.radio.mode = HOST_RADIO_STANDBY;
+    return retune();
+}
+int16_t SX1262::sleep()
+{
+    hostDev.radio.mode = HOST_RADIO_SLEEP;
+    hostDev.radio.irq = false;
+    return retune();
+}
+int16_t SX1262::startReceive()
+{
+    hostDev.radio.mode = HOST_RADIO_RX;
+    hostDev.radio.irq = false; // clears the IRQ flags; an unread frame is gone
+    return retune();
+}
+int16_t SX1262::transmit(const uint8_t *data, size_t len, uint8_t)
+{
+    HostRadio &r = hostDev.radio;
+    if (len > 255)
+        return RADIOLIB_ERR_PACKET_TOO_LONG;
+    if (r.irq)
+        ++r.overwritten;
+    r.irq = false;
+    r.mode = HOST_RADIO_TX;
+    retune();
+    const uint32_t air = hostAirtimeUs(r, len);
+    hostDev.world->transmit(hostDev, data, len, air);
+    busy(air);
+    ++r.txFrames;
+    r.txUs += air;
+    // TX done raises DIO1 until RadioLib clears it and goes to standby
+    r.irq = true;
+    dio1Rise();
+    r.irq = false;
+    r.mode = HOST_RADIO_STANDBY;
+    retune();
+    return RADIOLIB_ERR_NONE;
+}
+int16_t SX1262::readData(uint8_t *data, size_t len)
+{
+    HostRadio &r = hostDev.radio;
+    if (!r.irq)
+        return RADIOLIB_ERR_RX_TIMEOUT;
+    memcpy(data, r.rx, std::min(len, r.rxLen));
+    r.irq = false;
+    return r.rxCrcErr ? RADIOLIB_ERR_CRC_MISMATCH : RADIOLIB_ERR_NONE;
+}
+size_t SX1262::getPacketLength(bool) { return hostDev.radio.irq ? hostDev.radio.rxLen : 0; }
+float SX1262::getRSSI() { return hostDev.radio.rssi; }
+float SX1262::getSNR() { return hostDev.radio.snr; }
+uint32_t SX1262::getTimeOnAir(size_t len) { return hostAirtimeUs(hostDev.radio, len); }
+void SX1262::setDio1Action(void (*func)())
+{
+    hostDev.radio.dio1 = func;
+    hostDev.radio.intrType = GPIO_INTR_POSEDGE;
+}
+void SX1262::clearDio1Action()
+{
+    hostDev.radio.dio1 = nullptr;
+    hostDev.radio.intrType = GPIO_INTR_DISABLE;
+}
+
+// ---------------------------------------------------------------- sleep
+
+int64_t esp_timer_get_time() { return (int64_t)(nowUs() - hostDev.bootUs); }
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t us)
+{
+    hostDev.sleepTimerUs = us;
+    return ESP_OK;
+}
+esp_err_t esp_sleep_enable_gpio_wakeup()
+{
+    hostDev.gpioWake = true;
+    return ESP_OK;
+}
+esp_err_t esp_sleep_enable_uart_wakeup(int)
+{
+    hostDev.uartWake = true;
+    return ESP_OK;
+}
+esp_err_t uart_set_wakeup_threshold(uart_port_t, int) { return ESP_OK; }
+
+static void intrType(gpio_num_t pin, gpio_int_type_t type)
+{
+    HostRadio &r = hostDev.radio;
+    if (pin != r.irqPin)
+        return;
+    r.intrType = (uint8_t)type;
+    if (type == GPIO_INTR_HIGH_LEVEL && r.irq && !hostDev.asleep)
+        ++r.isrStorms;
+}
+esp_err_t gpio_wakeup_enable(gpio_num_t pin, gpio_int_type_t type)
+{
+    if (pin == hostDev.radio.irqPin)
+        hostDev.radio.wakeArmed = true;
+    intrType(pin, type);
+    return ESP_OK;
+}
+esp_err_t gpio_wakeup_disable(gpio_num_t pin)
+{
+    if (pin == hostDev.radio.irqPin)
+        hostDev.radio.wakeArmed = false;
+    intrType(pin, GPIO_INTR_DISABLE);
+    return ESP_OK;
+}
+esp_err_t gpio_set_intr_type(gpio_num_t pin, gpio_int_type_t type)
+{
+    intrType(pin, type);
+    return ESP_OK;
+}
+
+esp_err_t esp_light_sleep_start()
+{
+    const HostRadio &r = hostDev.radio;
+    const uint64_t t0 = nowUs();
+    if (hostDev.gpioWake && r.wakeArmed && r.intrType == GPIO_INTR_HIGH_LEVEL && r.irq)
+        hostDev.wakeCause = HOST_WAKE_GPIO; // level already high: straight back
+    else if (hostDev.uartWake && !hostDev.serialIn.empty())
+        hostDev.wakeCause = HOST_WAKE_UART;
+    else
+    {
+        hostDev.asleep = true;
+        hostDev.wakeCause = hostDev.world->sleepUntil(hostDev, t0 + hostDev.sleepTimerUs);
+        hostDev.asleep = false;
+    }
+    hostDev.asleepUs += nowUs() - t0;
+    return ESP_OK;
+}
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause() { return (esp_sleep_wakeup_cause_t)hostDev.wakeCause; }
+
+// ---------------------------------------------------------------- OTA
+
+static const esp_partition_t appParts[2] = {{0x10000, 0x200000, "app0"}, {0x210000, 0x200000, "app1"}};
+static esp_ota_handle_t otaOpen = 0;
+extern "C" bool verifyRollbackLater() __attribute__((weak));
+
+static uint8_t slotOf(const esp_partition_t *p) { return p == &appParts[1] ? 1 : 0; }
+
+void hostBoot()
+{
+    HostFlash &f = *hostDev.flash;
+    ++hostDev.boots;
+    f.runSlot = f.bootSlot;
+    int8_t &st = f.appState[f.runSlot];
+    if (st == ESP_OTA_IMG_PENDING_VERIFY)
+    {
+        // reset before the image confirmed itself: the bootloader rolls back
+        st = ESP_OTA_IMG_ABORTED;
+        f.bootSlot = f.runSlot = (uint8_t)(1 - f.runSlot);
+    }
+    else if (st == ESP_OTA_IMG_NEW)
+        st = (verifyRollbackLater && verifyRollbackLater()) ? ESP_OTA_IMG_PENDING_VERIFY : ESP_OTA_IMG_VALID;
+}
+
+const esp_partition_t *esp_ota_get_running_partition() { return &appParts[hostDev.flash->runSlot]; }
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *)
+{
+    return &appParts[1 - hostDev.flash->runSlot];
+}
+esp_err_t esp_ota_begin(const esp_partition_t *part, size_t size, esp_ota_handle_t *h)
+{
+    if (otaOpen || size > part->size || slotOf(part) == hostDev.flash->runSlot)
+        return ESP_FAIL;
+    hostDev.flash->app[slotOf(part)].clear();
+    hostDev.flash->appState[slotOf(part)] = ESP_OTA_IMG_UNDEFINED;
+    otaOpen = *h = 1 + slotOf(part);
+    busy(hostDev.flash->eraseUsPerBlock * ((size + 4095) / 4096));
+    return ESP_OK;
+}
+esp_err_t esp_ota_write(esp_ota_handle_t h, const void *data, size_t n)
+{
+    if (!h || h != otaOpen)
+        return ESP_FAIL;
+    std::vector<uint8_t> &img = hostDev.flash->app[h - 1];
+    img.insert(img.end(), (const uint8_t *)data, (const uint8_t *)data + n);
+    busy(hostDev.flash->programUsPerPage * ((n + 255) / 256));
+    return ESP_OK;
+}
+esp_err_t esp_ota_end(esp_ota_handle_t h)
+{
+    if (!h || h != otaOpen)
+        return ESP_FAIL;
+    otaOpen = 0;
+    return ESP_OK;
+}
+esp_err_t esp_ota_abort(esp_ota_handle_t h)
+{
+    otaOpen = 0;
+    return ESP_OK;
+}
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *part)
+{
+    HostFlash &f = *hostDev.flash;
+    f.bootSlot = slotOf(part);
+    if (f.bootSlot != f.runSlot)
+        f.appState[f.bootSlot] = ESP_OTA_IMG_NEW;
+    return ESP_OK;
+}
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *part, esp_ota_img_states_t *state)
+{
+    *state = (esp_ota_img_states_t)hostDev.flash->appState[slotOf(part)];
+    return ESP_OK;
+}
+esp_err_t esp_ota_mark_app_valid_cancel_rollback()
+{
+    hostDev.flash->appState[hostDev.flash->runSlot] = ESP_OTA_IMG_VALID;
+    return ESP_OK;
+}
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot()
+{
+    HostFlash &f = *hostDev.flash;
+    const uint8_t other = (uint8_t)(1 - f.runSlot);
+    if (f.appState[other] != ESP_OTA_IMG_VALID)
+        return ESP_FAIL;
+    f.appState[f.runSlot] = ESP_OTA_IMG_INVALID;
+    f.bootSlot = other;
+    hostDev.world->restart(hostDev);
+    return ESP_OK;
+}
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t off, void *dst, size_t n)
+{
+    if (off + n > part->size)
+        return ESP_FAIL;
+    const std::vector<uint8_t> &img = hostDev.flash->app[slotOf(part)];
+    for (size_t i = 0; i < n; ++i)
+        ((uint8_t *)dst)[i] = off + i < img.size() ? img[off + i] : 0xFF;
+    busy(hostDev.flash->readUsPerKb * (n + 1023) / 1024);
+    return ESP_OK;
+}
+
+// ---------------------------------------------------------------- NVS
+
+// 4 usable pages of 126 32-byte entries (the default 20 KB partition keeps
+// one page free); a key takes one entry, a blob one more per 32 bytes
+constexpr size_t NVS_ENTRIES = 4 * 126;
+constexpr size_t NVS_KEY_MAX = 15;
+
+static size_t nvsEntries(size_t len) { return len <= 8 ? 1 : 1 + (len + 31) / 32; }
+static size_t nvsUsed(const HostNvs &n)
+{
+    size_t e = 0;
+    for (auto &ns : n.ns)
+        for (auto &kv : ns.second)
+            e += nvsEntries(kv.second.size());
+    return e;
+}
+
+bool Preferences::begin(const char *name, bool ro)
+{
+    if (!name || strlen(name) > NVS_KEY_MAX)
+        return false;
+    if (ro && !hostDev.nvs->ns.count(name))
+        return false;
+    strcpy(ns, name);
+    hostDev.nvs->ns[ns];
+    open = true;
+    readOnly = ro;
+    return true;
+}
+void Preferences::end() { open = false; }
+bool Preferences::clear()
+{
+    if (!open || readOnly)
+        return false;
+    hostDev.nvs->ns[ns].clear();
+    ++hostDev.nvs->writes;
+    return true;
+}
+bool Preferences::remove(const char *key)
+{
+    if (!open || readOnly)
+        return false;
+    ++hostDev.nvs->writes;
+    return hostDev.nvs->ns[ns].erase(key) > 0;
+}
+bool Preferences::isKey(const char *key) { return open && hostDev.nvs->ns[ns].count(key); }
+size_t Preferences::put(const char *key, const void *v, size_t n)
+{
+    if (!open || readOnly || !key || strlen(key) > NVS_KEY_MAX)
+        return 0;
+    auto &vals = hostDev.nvs->ns[ns];
+    const size_t old = vals.count(key) ? nvsEntries(vals[key].size()) : 0;
+    if (nvsUsed(*hostDev.nvs) - old + nvsEntries(n) > NVS_ENTRIES)
+        return 0; // ESP_ERR_NVS_NOT_ENOUGH_SPACE
+    vals[key].assign((const uint8_t *)v, (const uint8_t *)v + n);
+    ++hostDev.nvs->writes;
+    return n;
+}
+size_t Preferences::getBytesLength(const char *key)
+{
+    if (!open)
+        return 0;
+    auto &vals = hostDev.nvs->ns[ns];
+    auto it = vals.find(key);
+    return it == vals.end() ? 0 : it->second.size();
+}
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen)
+{
+    const size_t n = getBytesLength(key);
+    if (!n || n > maxLen)
+        return 0;
+    memcpy(buf, hostDev.nvs->ns[ns][key].data(), n);
+    return n;
+}
+
+// ---------------------------------------------------------------- LittleFS
+
+struct HostFile
+{
+    HostFlash *fs;
+    std::string path;
+    bool dir;
+    bool canRead, canWrite, append;
+    size_t pos;
+    std::vector<std::string> entries; // directory listing
+    size_t next;
+    bool dirty;
+};
+
+static std::string fsPath(const char *p)
+{
+    std::string s = (p && *p == '/') ? p : std::string("/") + (p ? p : "");
+    while (s.size() > 1 && s.back() == '/')
+        s.pop_back();
+    return s;
+}
+
+static bool fsHidden(const std::string &p) { return p.compare(0, 2, "/.") == 0; }
+
+size_t HostFlash::used() const
+{
+    size_t n = 2 * block; // root metadata pair
+    for (auto &f : files)
+        if (!fsHidden(f.first))
+            n += std::max<size_t>(1, (f.second.size() + block - 1) / block) * block;
+    return n + dirs.size() * 2 * block;
+}
+
+static bool fsIsDir(HostFlash &fs, const std::string &p) { return p == "/" || fs.dirs.count(p); }
+
+static std::vector<uint8_t> *fsData(const HostFile &f)
+{
+    auto it = f.fs->files.find(f.path);
+    return it == f.fs->files.end() ? nullptr : &it->second;
+}
+
+File::operator bool() const { return f && (f->dir || fsData(*f)); }
+bool File::isDirectory() const { return f && f->dir; }
+const char *File::path() const { return f ? f->path.c_str() : ""; }
+const char *File::name() const
+{
+    if (!f)
+        return "";
+    const size_t slash = f->path.rfind('/');
+    return f->path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+}
+size_t File::size() const
+{
+    const std::vector<uint8_t> *d = f ? fsData(*f) : nullptr;
+    return d ? d->size() : 0;
+}
+size_t File::position() const { return f ? f->pos : 0; }
+bool File::seek(uint32_t pos)
+{
+    if (!f || f->dir || pos > size())
+        return false;
+    f->pos = pos;
+    return true;
+}
+int File::available() { return (int)(size() - position()); }
+
+size_t File::read(uint8_t *buf, size_t n)
+{
+    std::vector<uint8_t> *d = f ? fsData(*f) : nullptr;
+    if (!d || !f->canRead)
+        return 0;
+    n = std::min(n, d->size() - std::min(d->size(), f->pos));
+    memcpy(buf, d->data() + f->pos, n);
+    f->pos += n;
+    f->fs->read += n;
+    // LittleFS reads through its cache, so a small read costs its bytes
+    const uint64_t us = (f->fs->readUsPerKb * n + 1023) / 1024;
+    f->fs->busyUs += us;
+    busy(us);
+    return n;
+}
+int File::read()
+{
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+size_t File::write(const uint8_t *buf, size_t n)
+{
+    std::vector<uint8_t> *d = f ? fsData(*f) : nullptr;
+    if (!d || !f->canWrite)
+        return 0;
+    HostFlash &fs = *f->fs;
+    if (f->append)
+        f->pos = d->size();
+    const size_t end = f->pos + n;
+    const size_t blocksNow = std::max<size_t>(1, (d->size() + fs.block - 1) / fs.block);
+    const size_t blocksThen = std::max(blocksNow, (end + fs.block - 1) / fs.block);
+    if (blocksThen > blocksNow && fs.used() + (blocksThen - blocksNow) * fs.block > fs.capacity)
+        return 0; // LFS_ERR_NOSPC
+    const bool fresh = d->empty();
+    if (end > d->size())
+        d->resize(end);
+    memcpy(d->data() + f->pos, buf, n);
+    f->pos = end;
+    f->dirty = true;
+    // every block the file grows into is erased before it is programmed
+    const uint32_t erased = (uint32_t)(blocksThen - blocksNow) + (fresh && n ? 1 : 0);
+    const uint64_t us = (uint64_t)fs.programUsPerPage * ((n + 255) / 256) + (uint64_t)fs.eraseUsPerBlock * erased;
+    fs.programmed += n;
+    fs.erases += erased;
+    fs.busyUs += us;
+    busy(us);
+    return n;
+}
+
+File File::openNextFile()
+{
+    if (!f || !f->dir || f->next >= f->entries.size())
+        return File();
+    return LittleFS.open(f->entries[f->next++].c_str(), "r");
+}
+
+void File::close()
+{
+    if (f && f->dirty)
+    {
+        // metadata commit
+        f->fs->programmed += 256;
+        f->fs->busyUs += f->fs->programUsPerPage;
+        busy(f->fs->programUsPerPage);
+        f->dirty = false;
+    }
+    f.reset();
+}
+
+bool LittleFSFS::begin(bool, const char *, uint8_t, const char *) { return hostDev.flash != nullptr; }
+bool LittleFSFS::format()
+{
+    hostDev.flash->files.clear();
+    hostDev.flash->dirs.clear();
+    return true;
+}
+
+File LittleFSFS::open(const char *p, const char *mode, bool)
+{
+    HostFlash &fs = *hostDev.flash;
+    const std::string path = fsPath(p);
+    std::shared_ptr<HostFile> h(new HostFile{&fs, path, false, true, false, false, 0, {}, 0, false});
+    if (fsIsDir(fs, path))
+    {
+        h->dir = true;
+        const std::string pre = path == "/" ? "/" : path + "/";
+        std::set<std::string> names;
+        for (auto &kv : fs.files)
+            if (kv.first.compare(0, pre.size(), pre) == 0 && kv.first.find('/', pre.size()) == std::string::npos &&
+                !fsHidden(kv.first))
+                names.insert(kv.first);
+        for (auto &d : fs.dirs)
+            if (d.compare(0, pre.size(), pre) == 0 && d.find('/', pre.size()) == std::string::npos)
+                names.insert(d);
+        h->entries.assign(names.begin(), names.end());
+        return File(h);
+    }
+    const char m = mode ? mode[0] : 'r';
+    const bool plus = mode && strchr(mode, '+');
+    const bool exists = fs.files.count(path) > 0;
+    const size_t slash = path.rfind('/');
+    if (!fsIsDir(fs, slash ? path.substr(0, slash) : "/"))
+        return File(); // no such directory
+    if (m == 'r')
+    {
+        if (!exists)
+            return File();
+        h->canWrite = plus;
+    }
+    else if (m == 'w' || m == 'a')
+    {
+        std::vector<uint8_t> &d = fs.files[path];
+        if (m == 'w')
+            d.clear();
+        h->canWrite = true;
+        h->canRead = plus;
+        h->append = m == 'a';
+        h->pos = h->append ? d.size() : 0;
+        h->dirty = !exists || m == 'w';
+    }
+    else
+        return File();
+    return File(h);
+}
+bool LittleFSFS::exists(const char *p)
+{
+    const std::string path = fsPath(p);
+    return hostDev.flash->files.count(path) || fsIsDir(*hostDev.flash, path);
+}
+bool LittleFSFS::remove(const char *p) { return hostDev.flash->files.erase(fsPath(p)) > 0; }
+bool LittleFSFS::rename(const char *from, const char *to)
+{
+    auto &files = hostDev.flash->files;
+    auto it = files.find(fsPath(from));
+    if (it == files.end())
+        return false;
+    std::vector<uint8_t> d;
+    d.swap(it->second);
+    files.erase(it);
+    files[fsPath(to)].swap(d);
+    return true;
+}
+bool LittleFSFS::mkdir(const char *p)
+{
+    const std::string path = fsPath(p);
+    if (fsIsDir(*hostDev.flash, path))
+        return true;
+    if (hostDev.flash->files.count(path))
+        return false;
+    hostDev.flash->dirs.insert(path);
+    return true;
+}
+bool LittleFSFS::rmdir(const char *p)
+{
+    const std::string path = fsPath(p) + "/";
+    for (auto &kv : hostDev.flash->files)
+        if (kv.first.compare(0, path.size(), path) == 0)
+            return false;
+    return hostDev.flash->dirs.erase(fsPath(p)) > 0;
+}
+size_t LittleFSFS::totalBytes() { return hostDev.flash->capacity; }
+size_t LittleFSFS::usedBytes() { return hostDev.flash->used(); }
+
+// ---------------------------------------------------------------- SHA-256
+
+static const uint32_t SHA_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static void shaBlock(mbedtls_sha256_context *c, const uint8_t *p)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; ++i)
+        w[i] = w[i - 16] + (ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 7] +
+               (ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    uint32_t s[8];
+    memcpy(s, c->state, sizeof(s));
+    for (int i = 0; i < 64; ++i)
+    {
+        const uint32_t t1 = s[7] + (ror(s[4], 6) ^ ror(s[4], 11) ^ ror(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) +
+                            SHA_K[i] + w[i];
+        const uint32_t t2 = (ror(s[0], 2) ^ ror(s[0], 13) ^ ror(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(uint32_t));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; ++i)
+        c->state[i] += s[i];
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context *c) { memset(c, 0, sizeof(*c)); }
+void mbedtls_sha256_free(mbedtls_sha256_context *c) { memset(c, 0, sizeof(*c)); }
+int mbedtls_sha256_starts(mbedtls_sha256_context *c, int)
+{
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(c->state, iv, sizeof(iv));
+    c->total = 0;
+    return 0;
+}
+int mbedtls_sha256_update(mbedtls_sha256_context *c, const unsigned char *in, size_t n)
+{
+    while (n)
+    {
+        const size_t fill = c->total % 64, k = std::min(n, 64 - fill);
+        memcpy(c->buf + fill, in, k);
+        c->total += k;
+        in += k;
+        n -= k;
+        if (c->total % 64 == 0)
+            shaBlock(c, c->buf);
+    }
+    return 0;
+}
+int mbedtls_sha256_finish(mbedtls_sha256_context *c, unsigned char out[32])
+{
+    const uint64_t bits = c->total * 8;
+    uint8_t pad[72] = {0x80};
+    const size_t padLen = (c->total % 64 < 56 ? 56 : 120) - c->total % 64;
+    for (int i = 0; i < 8; ++i)
+        pad[padLen + i] = (uint8_t)(bits >> (56 - 8 * i));
+    mbedtls_sha256_update(c, pad, padLen + 8);
+    for (int i = 0; i < 8; ++i)
+        for (int j = 0; j < 4; ++j)
+            out[4 * i + j] = (uint8_t)(c->state[i] >> (24 - 8 * j));
+    return 0;
+}
+
+// ---------------------------------------------------------------- power-up
+
+void setup() __attribute__((weak));
+void loop() __attribute__((weak));
+
+extern "C" void hostRun()
+{
+    hostBoot();
+    if (setup)
+        setup();
+    for (;;)
+    {
+        if (loop)
+            loop();
+        busy(hostDev.loopUs);
+    }
+}
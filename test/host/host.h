@@ -0,0 +1,169 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Host stand-ins for the Arduino core, RadioLib, LittleFS, Preferences and
+// the ESP-IDF calls the firmware makes. One HostDevice is one board: its
+// clock, radio, serial port, pins, NVS and flash. hostDev is the device this
+// copy of the code runs as.
+//
+// Time and the air belong to a HostWorld. The default one is a bare
+// virtual clock: delay() and radio.transmit() move it forward, nothing is
+// ever received unless a test calls hostReceive(), and every frame sent is
+// kept in hostTx. The simulator (test/sim) loads one copy of a role per
+// device and replaces the world with a shared clock and radio medium.
+
+enum : uint8_t
+{
+    HOST_RADIO_SLEEP,
+    HOST_RADIO_STANDBY,
+    HOST_RADIO_RX,
+    HOST_RADIO_TX
+};
+
+enum : uint8_t
+{
+    HOST_WAKE_TIMER = 4, // as esp_sleep_wakeup_cause_t
+    HOST_WAKE_GPIO = 7,
+    HOST_WAKE_UART = 8
+};
+
+struct HostRadio
+{
+    float freq = 434.0f; // RadioLib defaults until begin()
+    float bw = 125.0f;
+    uint8_t sf = 9;
+    uint8_t cr = 7;
+    uint8_t sw = 0x12;
+    uint8_t mode = HOST_RADIO_SLEEP;
+    // bumped by every retune, TX and mode change; a frame is only received
+    // if it is the same at both ends of the frame
+    uint32_t epoch = 0;
+    uint8_t irqPin = 0;
+    void (*dio1)() = nullptr;
+    uint8_t intrType = 1; // GPIO_INTR_POSEDGE, as attachInterrupt(RISING)
+    bool wakeArmed = false;    // gpio_wakeup_enable() on the DIO1 pin
+    bool irq = false;          // DIO1 level: RX done, cleared by readData()/startReceive()
+    uint8_t rx[256];
+    size_t rxLen = 0;
+    bool rxCrcErr = false;
+    float rssi = 0, snr = 0;
+    // counters for tests
+    uint32_t txFrames = 0, rxFrames = 0, overwritten = 0;
+    uint64_t txUs = 0;
+    uint32_t isrStorms = 0; // DIO1 high while its interrupt is level-triggered and we are awake
+};
+
+// LittleFS on the board's data partition. Files take whole blocks, like
+// LittleFS. Program, erase and read costs are charged to the device's
+// clock with the datasheet figures of a typical SPI NOR flash.
+struct HostFlash
+{
+    size_t capacity = 1536 * 1024;
+    size_t block = 4096;
+    uint32_t programUsPerPage = 700; // 256-byte page
+    uint32_t eraseUsPerBlock = 45000;
+    uint32_t readUsPerKb = 100;
+    std::map<std::string, std::vector<uint8_t>> files;
+    std::set<std::string> dirs;
+    uint64_t programmed = 0, read = 0;
+    uint32_t erases = 0;
+    uint64_t busyUs = 0; // total flash time charged
+    size_t used() const;
+    // app partitions for OTA: image bytes, boot/running slot, esp_ota_img_states_t
+    std::vector<uint8_t> app[2];
+    uint8_t bootSlot = 0, runSlot = 0;
+    int8_t appState[2] = {2, -1}; // VALID, UNDEFINED
+};
+
+// NVS: namespace -> key -> value bytes
+struct HostNvs
+{
+    std::map<std::string, std::map<std::string, std::vector<uint8_t>>> ns;
+    uint32_t writes = 0;
+};
+
+struct HostDevice;
+
+struct HostWorld
+{
+    virtual ~HostWorld() {}
+    virtual uint64_t nowUs() = 0;
+    // blocks the calling device until `us` (delay, transmit, flash)
+    virtual void waitUntil(HostDevice &d, uint64_t us) = 0;
+    // light sleep until `us` or an armed wake source; returns HOST_WAKE_*
+    virtual uint8_t sleepUntil(HostDevice &d, uint64_t us) = 0;
+    // a frame goes on the air now for airUs, on the device's radio settings
+    virtual void transmit(HostDevice &d, const uint8_t *frame, size_t len, uint32_t airUs) = 0;
+    virtual void serialWrite(HostDevice &d, const uint8_t *data, size_t n) = 0;
+    virtual void restart(HostDevice &d) = 0;
+};
+
+struct HostDevice
+{
+    HostWorld *world = nullptr;
+    int index = 0;
+    uint64_t bootUs = 0;
+    uint64_t mac = 0x0000A0B0C0D0ULL;
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    HostRadio radio;
+    HostFlash *flash = nullptr;
+    HostNvs *nvs = nullptr;
+    std::string serialIn;
+    uint8_t pins[64] = {0};
+    // light sleep configuration
+    uint64_t sleepTimerUs = 0;
+    bool gpioWake = false, uartWake = false;
+    uint8_t wakeCause = 0;
+    bool asleep = false;
+    uint64_t asleepUs = 0;
+    uint32_t loopUs = 1000; // time a loop() pass takes, for hostRun()
+    uint32_t boots = 0;
+};
+
+extern "C" HostDevice hostDev;
+
+// The default world's log of frames sent
+struct HostTx
+{
+    uint64_t atUs;
+    uint32_t airUs;
+    float freq;
+    uint8_t sf;
+    std::vector<uint8_t> frame;
+};
+extern std::vector<HostTx> hostTx;
+// Everything the default world's serial port printed
+extern std::string hostOut;
+// Echo serial output to stdout (default world)
+extern bool hostEcho;
+
+// Sets the default world's clock, in us since power-up
+void hostSetTime(uint64_t us);
+uint64_t hostTime();
+// Hands a frame to this device's radio as if it had just been received:
+// DIO1 rises and the ISR runs. False if the radio is not listening.
+extern "C" bool hostReceive(const uint8_t *frame, size_t len, float rssi, float snr);
+// Power-up: boots the OTA slot the bootloader would pick, runs setup(),
+// then loop() every loopUs. Never returns; the simulator runs it on the
+// device's own stack.
+extern "C" void hostRun();
+// The bootloader's part of hostRun(), for programs that call setup() themselves
+void hostBoot();
+// Time on air of a frame on the radio's current settings, us; as
+// loraAirtimeMs() in protocol.h
+inline uint32_t hostAirtimeUs(const HostRadio &r, size_t len)
+{
+    const double tSym = (double)(1UL << r.sf) / r.bw; // ms
+    const int de = tSym >= 16.0 ? 1 : 0;
+    const int num = 8 * (int)len - 4 * r.sf + 28 + 16;
+    const int den = 4 * (r.sf - 2 * de);
+    const int nPay = 8 + (num > 0 ? (num + den - 1) / den : 0) * r.cr;
+    return (uint32_t)((8 + 4.25 + nPay) * tSym * 1000.0 + 0.5);
+}
+// Input for the console
+void hostSerialInput(const char *s);
@@ -0,0 +1,104 @@
+// Store-and-forward across a parent outage: GW - R - L, with L sending test
+// data every 90 s, the firmware's old fixed test rate. R loses power for
+// 30 min. L detaches after lost_parent and keeps its data on the LittleFS
+// emulator until it has a parent again, then drains it oldest first. L's log
+// must be empty again within 30 min of R's return, and once L stops sending
+// and its window has flushed, the gateway must hold every record L numbered,
+// none missing.
+#include "sim.h"
+#include "protocol.h"
+#include "config.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+static const uint64_t SETUP_US = 5000000, OUTAGE_AT_US = 1200000000ULL, OUTAGE_US = 1800000000ULL,
+                      AFTER_US = 1800000000ULL, FLUSH_US = 900000000ULL;
+static const uint32_t PERIOD_MS = 90000;
+static const size_t REC_SIZE = 1 + MAX_PAYLOAD - sizeof(DataUpHdr); // node.cpp's SF_REC_SIZE
+
+static uint32_t nvsU32(Sim &sim, int i, const char *key)
+{
+    const auto &ns = sim.dev(i).nvs->ns["mesh"];
+    const auto it = ns.find(key);
+    uint32_t v = 0;
+    if (it != ns.end())
+        memcpy(&v, it->second.data(), std::min(it->second.size(), sizeof(v)));
+    return v;
+}
+
+// records waiting in a node's store-and-forward log: the segment files, less
+// what node.cpp's sfRd says it already drained from the oldest one
+static size_t sfRecords(Sim &sim, int i)
+{
+    size_t bytes = 0;
+    for (auto &kv : sim.flash(i).files)
+        if (!kv.first.compare(0, 4, "/sf/"))
+            bytes += kv.second.size();
+    const size_t recs = bytes / REC_SIZE, rd = nvsU32(sim, i, "sfRd");
+    return recs > rd ? recs - rd : 0;
+}
+
+int main()
+{
+    Sim sim(3);
+    const int g = sim.add("gw.so");
+    const int r = sim.add("node.so", 2000000);
+    const int l = sim.add("node.so", 3000000);
+    sim.link(g, r, -95);
+    sim.link(r, l, -100);
+    sim.run(SETUP_US);
+    // L is on its own 1 % budget at SF10, which a record every 90 s leaves
+    // half of for the drain. It gives R up after three silent polls.
+    char cmd[40];
+    sim.console(g, "param query_period 60000");
+    snprintf(cmd, sizeof(cmd), "param test_period %lu", (unsigned long)PERIOD_MS);
+    sim.console(l, cmd);
+    sim.console(l, "param lost_parent 180000");
+    sim.run(OUTAGE_AT_US);
+
+    sim.powerOff(r);
+    size_t peak = 0;
+    for (uint64_t t = OUTAGE_AT_US; t < OUTAGE_AT_US + OUTAGE_US; t += 10000000)
+    {
+        sim.run(t + 10000000);
+        peak = std::max(peak, sfRecords(sim, l));
+    }
+    sim.powerOn(r);
+    const uint64_t back = sim.now();
+    uint64_t drainedAt = 0;
+    for (uint64_t t = back; t < back + AFTER_US; t += 10000000)
+    {
+        sim.run(t + 10000000);
+        if (!drainedAt && !sfRecords(sim, l))
+            drainedAt = sim.now();
+    }
+    const size_t left = sfRecords(sim, l);
+    // no new data, so the window's last frames and their ACKs settle
+    const uint64_t stopAt = sim.now();
+    sim.console(l, "param test_period 86400000");
+    sim.runFor(FLUSH_US);
+
+    const std::string s = sim.ask(g, "stats", "{\"stats\"");
+    unsigned rx = 0, expected = 0;
+    for (size_t p = jsonAt(s, "id"); p != std::string::npos; p = jsonAt(s, "id", p))
+    {
+        // L is the only node sending data
+        rx += (unsigned)jsonNum(s, "rx", 0, p);
+        expected += (unsigned)jsonNum(s, "expected", 0, p);
+    }
+    const unsigned numbered = (unsigned)((stopAt - SETUP_US) / (PERIOD_MS * 1000ULL));
+    printf("{\"outage\":{\"outage_s\":%llu,\"stored_peak\":%zu,\"drain_s\":%.0f,\"rx\":%u,\"expected\":%u,"
+           "\"flash_kb_programmed\":%.1f,\"erases\":%lu}}\n",
+           (unsigned long long)(OUTAGE_US / 1000000), peak, drainedAt ? (drainedAt - back) / 1e6 : -1.0, rx, expected,
+           sim.flash(l).programmed / 1024.0, (unsigned long)sim.flash(l).erases);
+
+    // the uplink window holds the first of them in RAM
+    const size_t due = (size_t)(OUTAGE_US / (PERIOD_MS * 1000ULL));
+    CHECK(peak + PROFILE.upWindow >= due, "only %zu of %zu records stored over the outage", peak, due);
+    CHECK(drainedAt, "%zu records still in flash %llu s after the outage", left,
+          (unsigned long long)(AFTER_US / 1000000));
+    CHECK(expected >= numbered, "gateway saw %u records numbered, L sent about %u", expected, numbered);
+    CHECK(rx == expected, "gateway got %u of %u records", rx, expected);
+    return simFailures;
+}
@@ -0,0 +1,234 @@
+// Replays a gateway capture (tools/meshcap.py, "capture on") into a host
+// build of the gateway on the virtual clock: every frame the captured
+// gateway received goes on the air again at its time, RSSI and SNR, on its
+// SF and channel, and the replayed gateway hears it if it is tuned there.
+// The replayed gateway captures too, so two builds can be compared with
+//
+//   make -C test replay CAP=run.cap OUT=new.cap [GW=path/to/other/gw.so]
+//   tools/meshcap.py diff old.cap new.cap
+//   tools/meshcap.py pcap new.cap new.pcap
+//
+// Without arguments it checks itself: a simulated network is captured,
+// replayed into a fresh gateway, and the two gateways must know the same
+// nodes with at most a few frames lost to retuning.
+#include "sim.h"
+#include "channels.h"
+#include <chrono>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t CAP_RX = 1;
+static const size_t REC_HDR = 12; // 'C' 0xA7 kind len t_ms value snr*4 sf<<4|ch
+
+static uint16_t crc16(const uint8_t *p, size_t n)
+{
+    uint16_t crc = 0xFFFF;
+    while (n--)
+    {
+        crc ^= (uint16_t)(*p++) << 8;
+        for (int i = 0; i < 8; ++i)
+            crc = crc & 0x8000 ? (uint16_t)(crc << 1 ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+struct Rec
+{
+    uint32_t tMs;
+    int16_t rssi;
+    float snr;
+    uint8_t sf, ch;
+    std::vector<uint8_t> frame;
+};
+
+// The CAP_RX records of a capture, found by sync bytes and CRC like meshcap.py
+static std::vector<Rec> readCapture(const char *path)
+{
+    std::vector<Rec> out;
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "replay: cannot read %s\n", path);
+        exit(2);
+    }
+    std::vector<uint8_t> b;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        b.insert(b.end(), buf, buf + n);
+    fclose(f);
+    for (size_t i = 0; i + REC_HDR <= b.size(); ++i)
+    {
+        if (b[i] != 'C' || b[i + 1] != 0xA7)
+            continue;
+        const size_t len = b[i + 3], end = i + REC_HDR + len;
+        uint16_t crc;
+        if (end + 2 > b.size())
+            continue;
+        memcpy(&crc, &b[end], sizeof(crc));
+        if (crc != crc16(&b[i + 2], 10 + len))
+            continue;
+        if (b[i + 2] == CAP_RX)
+        {
+            Rec r;
+            memcpy(&r.tMs, &b[i + 4], sizeof(r.tMs));
+            memcpy(&r.rssi, &b[i + 8], sizeof(r.rssi));
+            r.snr = (int8_t)b[i + 10] / 4.0f;
+            r.sf = b[i + 11] >> 4;
+            r.ch = b[i + 11] & 0x0F;
+            r.frame.assign(&b[i + REC_HDR], &b[end]);
+            out.push_back(r);
+        }
+        i = end + 1;
+    }
+    return out;
+}
+
+struct Replay
+{
+    size_t frames = 0, heard = 0, delivered = 0, collided = 0;
+    double spanS = 0, wallS = 0;
+};
+
+// Replays `in` into gateway library `gw`, its own capture going to `out`.
+// Records keep their spacing; the first lands at its own time after boot,
+// or at 10 s if that is later in the gateway's life.
+static Replay replay(const char *gw, const char *in, const char *out, std::string *stats)
+{
+    const std::vector<Rec> recs = readCapture(in);
+    Replay r;
+    Sim sim;
+    const int g = sim.add(gw);
+    FILE *f = out ? fopen(out, "wb") : nullptr;
+    if (f)
+        sim.tee(g, f);
+    // the control channel and link settings the gateway comes up on
+    sim.runUntil([&] { return sim.dev(g).radio.mode == HOST_RADIO_RX; }, 30000000, 10000);
+    const HostRadio base = sim.dev(g).radio;
+    sim.console(g, "capture on");
+    sim.runFor(100000);
+    uint64_t at = recs.empty() ? 0 : std::min<uint64_t>(recs[0].tMs, 10000) * 1000;
+    at = std::max(at, sim.now() + 1000);
+    uint32_t prev = recs.empty() ? 0 : recs[0].tMs;
+    for (const Rec &c : recs)
+    {
+        at += (uint64_t)(uint32_t)(c.tMs - prev) * 1000;
+        prev = c.tMs;
+        HostRadio air = base;
+        air.sf = c.sf ? c.sf : base.sf;
+        air.freq = c.ch && c.ch <= NUM_DATA_CHANNELS ? DATA_CHANNELS[c.ch - 1] : base.freq;
+        // the record is taken when the frame is done
+        const uint32_t us = hostAirtimeUs(air, c.frame.size());
+        sim.inject(at > us ? at - us : 0, air, c.frame.data(), c.frame.size(), c.rssi, c.snr);
+    }
+    sim.onTx = [&](const SimFrame &fr) {
+        if (fr.src < 0)
+        {
+            ++r.frames;
+            r.heard += !fr.rx.empty();
+        }
+    };
+    const uint64_t from = sim.now();
+    const auto w0 = std::chrono::steady_clock::now();
+    sim.run(at + 5000000);
+    r.wallS = std::chrono::duration<double>(std::chrono::steady_clock::now() - w0).count();
+    r.spanS = (sim.now() - from) / 1e6;
+    r.delivered = sim.framesDelivered;
+    r.collided = sim.framesCollided;
+    if (stats)
+    {
+        // capture records are binary and end no line: stop them before asking
+        sim.console(g, "capture off");
+        sim.runFor(100000);
+        *stats = sim.ask(g, "stats", "{\"stats\"");
+    }
+    if (f)
+        fclose(f);
+    return r;
+}
+
+static void report(const Replay &r)
+{
+    printf("{\"replay\":{\"frames\":%zu,\"heard\":%zu,\"delivered\":%zu,\"collided\":%zu,"
+           "\"span_s\":%.1f,\"wall_s\":%.2f,\"speedup\":%.0f}}\n",
+           r.frames, r.heard, r.delivered, r.collided, r.spanS, r.wallS, r.spanS / std::max(r.wallS, 1e-3));
+}
+
+// node id -> rx from a gateway's stats line
+static std::map<unsigned, unsigned> statsRx(const std::string &s)
+{
+    std::map<unsigned, unsigned> m;
+    for (size_t p = jsonAt(s, "id"); p != std::string::npos; p = jsonAt(s, "id", p))
+        m[(unsigned)strtoul(s.c_str() + p, nullptr, 10)] = (unsigned)jsonNum(s, "rx", 0, p);
+    return m;
+}
+
+static int selfCheck()
+{
+    const std::string dir = getenv("SIM_LIBDIR") ? getenv("SIM_LIBDIR") : SIM_LIBDIR;
+    const std::string in = dir + "/replay_in.cap", out = dir + "/replay_out.cap";
+
+    // a gateway with a relay and three nodes below it, captured for 20 min
+    std::string before;
+    {
+        Sim sim;
+        const int g = sim.add("gw.so");
+        FILE *f = fopen(in.c_str(), "wb");
+        sim.tee(g, f);
+        const int r = sim.add("node.so", 2000000);
+        sim.link(g, r, -95);
+        for (int i = 0; i < 3; ++i)
+        {
+            const int n = sim.add("node.so", 3000000 + 700000 * i);
+            sim.link(n, r, -100);
+        }
+        sim.run(1000000);
+        sim.console(g, "capture on");
+        sim.run(5000000);
+        for (int i = 1; i < (int)sim.size(); ++i)
+            sim.console(i, "param test_period 60000");
+        sim.run(1200000000);
+        sim.console(g, "capture off");
+        sim.runFor(100000);
+        before = sim.ask(g, "stats", "{\"stats\"");
+        fclose(f);
+    }
+
+    std::string after;
+    const Replay r = replay("gw.so", in.c_str(), out.c_str(), &after);
+    report(r);
+    const auto a = statsRx(before), b = statsRx(after);
+    unsigned rxA = 0, rxB = 0;
+    for (auto &kv : a)
+        rxA += kv.second;
+    for (auto &kv : b)
+        rxB += kv.second;
+    CHECK(a.size() == 4, "captured gateway knows %zu nodes, expected 4", a.size());
+    CHECK(b.size() == a.size(), "replayed gateway knows %zu nodes, captured one %zu", b.size(), a.size());
+    CHECK(r.frames > 50, "only %zu frames in the capture", r.frames);
+    CHECK(r.heard * 100 >= r.frames * 95, "replayed gateway heard %zu of %zu frames", r.heard, r.frames);
+    CHECK(rxB * 100 >= rxA * 95, "replayed gateway counted %u data frames, captured one %u", rxB, rxA);
+    CHECK(r.spanS > 10 * r.wallS, "replay ran at %.1fx real time", r.spanS / r.wallS);
+    return simFailures;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 1)
+        return selfCheck();
+    const char *gw = "gw.so";
+    int i = 1;
+    if (i + 1 < argc && !strcmp(argv[i], "--gw"))
+    {
+        gw = argv[i + 1];
+        i += 2;
+    }
+    if (argc - i < 1 || argc - i > 2)
+    {
+        fprintf(stderr, "usage: replay [--gw lib] capture [out]\n");
+        return 2;
+    }
+    report(replay(gw, argv[i], argc - i > 1 ? argv[i + 1] : nullptr, nullptr));
+    return 0;
+}
@@ -0,0 +1,484 @@
+#include "sim.h"
+#include <dlfcn.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef SIM_LIBDIR
+#define SIM_LIBDIR "build"
+#endif
+
+int simFailures = 0;
+
+constexpr size_t STACK_BYTES = 512 * 1024;
+constexpr size_t LINES_KEPT = 4000;
+constexpr uint64_t AIR_KEEP_US = 30000000; // longest frame there is, and then some
+constexpr float CAPTURE_DB = 6.0f;
+
+static Sim *active = nullptr;
+
+static uint64_t mix(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// SX1262 demodulation floor over thermal noise with a 6 dB noise figure
+static float noiseDbm(float bwKHz) { return -174.0f + 10.0f * log10f(bwKHz * 1000.0f) + 6.0f; }
+static float snrMin(uint8_t sf) { return -7.5f - 2.5f * (sf - 7); }
+
+Sim::Sim(uint64_t seed) : seed(seed), rng(mix(seed))
+{
+    const char *dir = getenv("SIM_LIBDIR");
+    libDir = dir ? dir : SIM_LIBDIR;
+}
+
+Sim::~Sim()
+{
+    for (auto &d : devs)
+        if (d->dl)
+            dlclose(d->dl);
+}
+
+void Sim::push(uint64_t at, Kind kind, int dev, uint32_t token)
+{
+    q.push(Event{at, seq++, kind, dev, token});
+}
+
+// A private copy of the library, so its statics are this device's alone
+void Sim::load(Device &d)
+{
+    if (d.dl)
+        dlclose(d.dl);
+    const std::string src = d.lib.find('/') != std::string::npos ? d.lib : libDir + "/" + d.lib;
+    char tmp[] = "/tmp/simdevXXXXXX";
+    const int out = mkstemp(tmp);
+    FILE *in = fopen(src.c_str(), "rb");
+    if (out < 0 || !in)
+    {
+        fprintf(stderr, "sim: cannot load %s\n", src.c_str());
+        exit(2);
+    }
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        if (write(out, buf, n) != (ssize_t)n)
+            exit(2);
+    fclose(in);
+    close(out);
+    d.dl = dlopen(tmp, RTLD_NOW | RTLD_LOCAL);
+    ::unlink(tmp);
+    if (!d.dl)
+    {
+        fprintf(stderr, "sim: %s\n", dlerror());
+        exit(2);
+    }
+    d.hd = (HostDevice *)dlsym(d.dl, "hostDev");
+    d.run = (void (*)())dlsym(d.dl, "hostRun");
+    d.receive = (bool (*)(const uint8_t *, size_t, float, float))dlsym(d.dl, "hostReceive");
+    if (!d.hd || !d.run || !d.receive)
+    {
+        fprintf(stderr, "sim: %s is not a device library\n", src.c_str());
+        exit(2);
+    }
+}
+
+int Sim::add(const char *lib, uint64_t at)
+{
+    std::unique_ptr<Device> d(new Device);
+    d->lib = lib;
+    d->loopUs = loopUs;
+    load(*d);
+    devs.push_back(std::move(d));
+    const int i = (int)devs.size() - 1;
+    push(at, EV_POWER_ON, i);
+    return i;
+}
+
+void Sim::trampoline()
+{
+    Sim &s = *active;
+    s.devs[s.current]->run(); // never returns
+}
+
+void Sim::start(int i)
+{
+    Device &d = *devs[i];
+    if (d.started)
+        load(d); // fresh statics, as after a reset
+    d.started = true;
+    d.on = true;
+    d.sleeping = false;
+    d.rebooting = false;
+    ++d.boots;
+    ++d.token;
+    HostDevice &h = *d.hd;
+    h.world = this;
+    h.index = i;
+    h.bootUs = t;
+    h.mac = 0x0000A0B0C0000000ULL | (uint64_t)(i + 1);
+    h.rng = mix(seed ^ mix((uint64_t)i << 32 | d.boots));
+    h.flash = &d.flash;
+    h.nvs = &d.nvs;
+    h.loopUs = d.loopUs;
+    h.boots = d.boots - 1;
+    d.stack.assign(STACK_BYTES, 0);
+    getcontext(&d.ctx);
+    d.ctx.uc_stack.ss_sp = d.stack.data();
+    d.ctx.uc_stack.ss_size = d.stack.size();
+    d.ctx.uc_link = nullptr;
+    makecontext(&d.ctx, trampoline, 0);
+    push(t, EV_RESUME, i, d.token);
+}
+
+void Sim::yield(Device &d)
+{
+    const int self = current;
+    swapcontext(&d.ctx, &main);
+    current = self;
+}
+
+void Sim::waitUntil(HostDevice &h, uint64_t us)
+{
+    Device &d = *devs[h.index];
+    if (us < t)
+        us = t;
+    // nothing else happens before then: carry on without a switch
+    if (us <= limit && (q.empty() || q.top().t > us))
+    {
+        t = us;
+        return;
+    }
+    push(us, EV_RESUME, h.index, ++d.token);
+    yield(d);
+}
+
+uint8_t Sim::sleepUntil(HostDevice &h, uint64_t us)
+{
+    Device &d = *devs[h.index];
+    d.sleeping = true;
+    d.wake = HOST_WAKE_TIMER;
+    push(us, EV_RESUME, h.index, ++d.token);
+    yield(d);
+    d.sleeping = false;
+    return d.wake;
+}
+
+void Sim::wake(int i, uint8_t cause)
+{
+    Device &d = *devs[i];
+    if (!d.on || !d.sleeping)
+        return;
+    d.wake = cause;
+    d.sleeping = false;
+    push(t, EV_RESUME, i, ++d.token);
+}
+
+void Sim::restart(HostDevice &h)
+{
+    Device &d = *devs[h.index];
+    d.rebooting = true;
+    ++d.token;
+    push(t, EV_REBOOT, h.index);
+    yield(d); // this stack is abandoned
+    abort();
+}
+
+void Sim::powerOff(int i)
+{
+    Device &d = *devs[i];
+    d.on = false;
+    d.sleeping = false;
+    ++d.token;
+    d.hd->radio.mode = HOST_RADIO_SLEEP;
+    ++d.hd->radio.epoch;
+}
+
+void Sim::powerOn(int i)
+{
+    if (!devs[i]->on)
+        push(t, EV_POWER_ON, i);
+}
+
+void Sim::place(int i, double x, double y)
+{
+    devs[i]->x = x;
+    devs[i]->y = y;
+    devs[i]->placed = true;
+}
+
+void Sim::link(int a, int b, float level, float loss)
+{
+    links[std::make_pair(a, b)] = std::make_pair(level, loss);
+    links[std::make_pair(b, a)] = std::make_pair(level, loss);
+}
+
+void Sim::unlink(int a, int b) { link(a, b, -999.0f); }
+
+float Sim::rssi(int from, int to) const
+{
+    auto it = links.find(std::make_pair(from, to));
+    if (it != links.end())
+        return it->second.first;
+    const Device &a = *devs[from], &b = *devs[to];
+    if (!a.placed || !b.placed)
+        return -999.0f;
+    const double m = std::max(1.0, hypot(a.x - b.x, a.y - b.y));
+    return txDbm - (float)(40.0 + 10.0 * pathLossExp * log10(m));
+}
+
+void Sim::transmit(HostDevice &h, const uint8_t *frame, size_t len, uint32_t airUs)
+{
+    const HostRadio &r = h.radio;
+    const uint64_t id = nextFrame++;
+    SimFrame &f = air[id];
+    f.src = h.index;
+    f.start = t;
+    f.end = t + airUs;
+    f.freq = r.freq;
+    f.bw = r.bw;
+    f.sf = r.sf;
+    f.sw = r.sw;
+    f.data.assign(frame, frame + len);
+    startFrame(id);
+}
+
+void Sim::inject(uint64_t at, const HostRadio &r, const uint8_t *frame, size_t len, float rssi, float snr)
+{
+    const uint64_t id = nextFrame++;
+    SimFrame &f = injected[id];
+    f.src = -1;
+    f.start = at;
+    f.end = at + hostAirtimeUs(r, len);
+    f.freq = r.freq;
+    f.bw = r.bw;
+    f.sf = r.sf;
+    f.sw = r.sw;
+    f.data.assign(frame, frame + len);
+    f.level = rssi;
+    f.snr = snr;
+    // receivers are the devices tuned to it as it ends (see sim.h)
+    push(f.end, EV_INJECT, -1, (uint32_t)id);
+}
+
+// Receivers are the devices listening on the frame's settings as it starts,
+// or for an injected one as it ends
+void Sim::startFrame(uint64_t id)
+{
+    SimFrame &f = air[id];
+    for (size_t i = 0; i < devs.size(); ++i)
+    {
+        const Device &d = *devs[i];
+        if ((int)i == f.src || !d.on)
+            continue;
+        const HostRadio &o = d.hd->radio;
+        if (o.mode != HOST_RADIO_RX || fabsf(o.freq - f.freq) > 0.001f || o.sf != f.sf ||
+            fabsf(o.bw - f.bw) > 0.01f || o.sw != f.sw)
+            continue;
+        const float rx = level(f, (int)i);
+        if (rx - noiseDbm(f.bw) < snrMin(f.sf))
+            continue;
+        f.rx.push_back(SimFrame::Rx{(int)i, o.epoch, d.boots, rx});
+    }
+    ++framesSent;
+    if (onTx)
+        onTx(f);
+    push(f.end, EV_FRAME_END, -1, (uint32_t)id);
+}
+
+void Sim::endFrame(uint64_t id)
+{
+    const SimFrame &f = air[id];
+    for (const SimFrame::Rx &rx : f.rx)
+    {
+        Device &d = *devs[rx.dev];
+        if (!d.on || d.boots != rx.boots || d.hd->radio.epoch != rx.epoch)
+        {
+            ++framesMissed; // transmitted, retuned or reset meanwhile
+            continue;
+        }
+        bool lost = false;
+        for (auto &kv : air)
+        {
+            const SimFrame &o = kv.second;
+            if (kv.first == id || o.end <= f.start || o.start >= f.end || o.src == rx.dev ||
+                (o.src < 0 && f.src < 0) || fabsf(o.freq - f.freq) > 0.001f || o.sf != f.sf)
+                continue;
+            if (rx.rssi - level(o, rx.dev) < CAPTURE_DB)
+            {
+                lost = true;
+                break;
+            }
+        }
+        if (lost)
+        {
+            ++framesCollided;
+            continue;
+        }
+        auto it = links.find(std::make_pair(f.src, rx.dev));
+        const float loss = it != links.end() ? it->second.second : 0;
+        rng = mix(rng);
+        if (loss > 0 && (rng >> 11) * (1.0 / 9007199254740992.0) < loss)
+            continue;
+        const float snr = f.src < 0 ? f.snr : std::min(12.0f, rx.rssi - noiseDbm(f.bw));
+        const int prev = current;
+        current = rx.dev;
+        d.receive(f.data.data(), f.data.size(), rx.rssi, snr); // runs the device's ISR
+        current = prev;
+        ++framesDelivered;
+        const HostRadio &r = d.hd->radio;
+        if (d.sleeping && d.hd->gpioWake && r.wakeArmed && r.intrType == 5 /* GPIO_INTR_HIGH_LEVEL */ && r.irq)
+            wake(rx.dev, HOST_WAKE_GPIO);
+    }
+    // forget frames nobody can overlap any more
+    while (!air.empty() && air.begin()->second.end + AIR_KEEP_US < t)
+        air.erase(air.begin());
+}
+
+void Sim::run(uint64_t until)
+{
+    active = this;
+    limit = until;
+    while (!q.empty() && q.top().t <= until)
+    {
+        const Event e = q.top();
+        q.pop();
+        t = e.t;
+        switch (e.kind)
+        {
+        case EV_INJECT:
+        {
+            auto it = injected.find(e.token);
+            air[e.token] = std::move(it->second);
+            injected.erase(it);
+            startFrame(e.token);
+            break;
+        }
+        case EV_FRAME_END:
+            endFrame(e.token);
+            break;
+        case EV_POWER_ON:
+            if (!devs[e.dev]->on)
+                start(e.dev);
+            break;
+        case EV_REBOOT:
+            devs[e.dev]->on = false;
+            start(e.dev);
+            break;
+        case EV_RESUME:
+        {
+            Device &d = *devs[e.dev];
+            if (!d.on || e.token != d.token)
+                break; // stale: woken early, powered off or reset
+            current = e.dev;
+            swapcontext(&main, &d.ctx);
+            current = -1;
+            break;
+        }
+        }
+    }
+    if (t < until)
+        t = until;
+}
+
+bool Sim::runUntil(std::function<bool()> pred, uint64_t until, uint64_t step)
+{
+    while (t < until)
+    {
+        if (pred())
+            return true;
+        run(std::min(until, t + step));
+    }
+    return pred();
+}
+
+void Sim::serialWrite(HostDevice &h, const uint8_t *data, size_t n)
+{
+    Device &d = *devs[h.index];
+    if (d.tee)
+        fwrite(data, 1, n, d.tee);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const char c = (char)data[i];
+        if (c != '\n')
+        {
+            if (c != '\r' && d.partial.size() < 8192)
+                d.partial += c;
+            continue;
+        }
+        if (onLine)
+            onLine(h.index, d.partial);
+        if (d.lines.size() >= LINES_KEPT)
+            d.lines.erase(d.lines.begin(), d.lines.begin() + LINES_KEPT / 4);
+        d.lines.push_back(d.partial);
+        d.partial.clear();
+    }
+}
+
+void Sim::console(int i, const char *line)
+{
+    Device &d = *devs[i];
+    if (!d.on)
+        return;
+    std::string &in = d.hd->serialIn;
+    if (d.sleeping && d.hd->uartWake)
+    {
+        wake(i, HOST_WAKE_UART); // the byte that wakes the chip is lost
+        in += line;
+        in += '\n';
+        return;
+    }
+    in += '\n';
+    in += line;
+    in += '\n';
+}
+
+std::string Sim::last(int i, const char *prefix) const
+{
+    const auto &l = devs[i]->lines;
+    const size_t n = strlen(prefix);
+    for (auto it = l.rbegin(); it != l.rend(); ++it)
+        if (!it->compare(0, n, prefix))
+            return *it;
+    return std::string();
+}
+
+std::string Sim::ask(int i, const char *cmd, const char *prefix, uint64_t us)
+{
+    const size_t seen = devs[i]->lines.size();
+    console(i, cmd);
+    std::string found;
+    const size_t n = strlen(prefix);
+    runUntil(
+        [&] {
+            const auto &l = devs[i]->lines;
+            for (size_t k = std::min(seen, l.size()); k < l.size(); ++k)
+                if (!l[k].compare(0, n, prefix))
+                {
+                    found = l[k];
+                    return true;
+                }
+            return false;
+        },
+        t + us, 10000);
+    return found;
+}
+
+size_t jsonAt(const std::string &s, const char *key, size_t from)
+{
+    const std::string k = std::string("\"") + key + "\":";
+    const size_t p = s.find(k, from);
+    return p == std::string::npos ? p : p + k.size();
+}
+
+double jsonNum(const std::string &s, const char *key, double def, size_t from)
+{
+    const size_t p = jsonAt(s, key, from);
+    if (p == std::string::npos)
+        return def;
+    return strtod(s.c_str() + p, nullptr);
+}
@@ -0,0 +1,189 @@
+#pragma once
+#include "host.h"
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+#include <ucontext.h>
+
+// Discrete-event simulation of a whole mesh on the host. Every device is a
+// private copy of a role library (build/gw.so, build/node.so, ... from
+// test/Makefile: main.cpp, the role's .cpp and the host stand-ins), so each
+// has its own statics, and runs hostRun() on its own stack. The devices
+// share one virtual clock; a device only gives up the CPU when it waits:
+// a loop pass (HostDevice::loopUs), delay(), radio.transmit(), flash
+// writes and light sleep. Runs are deterministic for a given seed.
+//
+// The medium delivers a frame at its end to every device whose radio was
+// receiving on the same frequency, SF, bandwidth and sync word for the
+// whole frame, and hears the sender above its sensitivity. Two frames that
+// overlap at a receiver on the same channel and SF both get lost unless one
+// is 6 dB stronger. A device that transmits hears nothing meanwhile.
+// Link levels come from positions (log-distance path loss) or are set per
+// pair with link().
+
+struct SimFrame
+{
+    int src;
+    uint64_t start, end;
+    float freq, bw;
+    uint8_t sf, sw;
+    std::vector<uint8_t> data;
+    float level, snr; // frames from outside (src -1): as received
+    struct Rx
+    {
+        int dev;
+        uint32_t epoch, boots;
+        float rssi;
+    };
+    std::vector<Rx> rx;
+};
+
+class Sim : public HostWorld
+{
+public:
+    explicit Sim(uint64_t seed = 1);
+    ~Sim();
+
+    // Adds a device running library `lib` (a name in the build directory,
+    // e.g. "node.so", or a path), powered up at `at` us
+    int add(const char *lib, uint64_t at = 0);
+    size_t size() const { return devs.size(); }
+    HostDevice &dev(int i) { return *devs[i]->hd; }
+    HostFlash &flash(int i) { return devs[i]->flash; }
+    bool on(int i) const { return devs[i]->on; }
+
+    // Radio geometry: positions in metres, or a fixed level per pair
+    void place(int i, double x, double y);
+    void link(int a, int b, float rssi, float loss = 0);
+    void unlink(int a, int b);
+    float rssi(int from, int to) const;
+
+    uint64_t now() const { return t; }
+    void run(uint64_t until);
+    void runFor(uint64_t us) { run(t + us); }
+    // Runs until pred() holds or `until`; checks every `step` us
+    bool runUntil(std::function<bool()> pred, uint64_t until, uint64_t step = 1000000);
+
+    // A frame from outside the simulation (replayed traffic), on the air
+    // from `at` on the settings in r (freq, bw, sf, cr, sw): every device
+    // tuned to them when it ends hears it at rssi/snr. A capture only says
+    // when a frame was taken, a loop pass or so after it ended, so a
+    // device's own TX just before is not held against it. Injected frames
+    // were all received once and do not collide with each other. Src is -1.
+    void inject(uint64_t at, const HostRadio &r, const uint8_t *frame, size_t len, float rssi, float snr);
+
+    void powerOff(int i);
+    void powerOn(int i);
+    // One console line (preceded by a newline, which a UART wake may eat)
+    void console(int i, const char *line);
+    // Serial lines the device printed, oldest first (the last few thousand)
+    const std::vector<std::string> &lines(int i) const { return devs[i]->lines; }
+    // Last line starting with `prefix`, "" if none
+    std::string last(int i, const char *prefix) const;
+    // Sends `cmd` and returns the first line starting with `prefix` that
+    // the device prints within `us`
+    std::string ask(int i, const char *cmd, const char *prefix, uint64_t us = 2000000);
+    // Every byte the device writes to its serial port also goes to f
+    void tee(int i, FILE *f) { devs[i]->tee = f; }
+
+    uint64_t seed;
+    uint32_t loopUs = 2000; // loop pass of every device added from now on
+    float txDbm = 14.0f;
+    float pathLossExp = 3.0f;
+    std::function<void(const SimFrame &)> onTx;
+    std::function<void(int dev, const std::string &line)> onLine;
+    uint64_t framesSent = 0, framesDelivered = 0, framesCollided = 0, framesMissed = 0;
+
+    // HostWorld, called from the devices
+    uint64_t nowUs() override { return t; }
+    void waitUntil(HostDevice &d, uint64_t us) override;
+    uint8_t sleepUntil(HostDevice &d, uint64_t us) override;
+    void transmit(HostDevice &d, const uint8_t *frame, size_t len, uint32_t airUs) override;
+    void serialWrite(HostDevice &d, const uint8_t *data, size_t n) override;
+    void restart(HostDevice &d) override;
+
+private:
+    struct Device
+    {
+        std::string lib;
+        void *dl = nullptr;
+        HostDevice *hd = nullptr;
+        void (*run)() = nullptr;
+        bool (*receive)(const uint8_t *, size_t, float, float) = nullptr;
+        HostFlash flash;
+        HostNvs nvs;
+        ucontext_t ctx;
+        std::vector<char> stack;
+        bool on = false, started = false, sleeping = false, rebooting = false;
+        uint32_t token = 0;
+        uint8_t wake = 0;
+        uint32_t boots = 0;
+        uint32_t loopUs = 0;
+        double x = 0, y = 0;
+        bool placed = false;
+        std::vector<std::string> lines;
+        std::string partial;
+        FILE *tee = nullptr;
+    };
+    enum Kind : uint8_t
+    {
+        EV_RESUME,
+        EV_FRAME_END,
+        EV_POWER_ON,
+        EV_REBOOT,
+        EV_INJECT
+    };
+    struct Event
+    {
+        uint64_t t, seq;
+        Kind kind;
+        int dev;
+        uint32_t token;
+        bool operator>(const Event &o) const { return t != o.t ? t > o.t : seq > o.seq; }
+    };
+
+    void push(uint64_t at, Kind kind, int dev, uint32_t token = 0);
+    void load(Device &d);
+    void start(int i);
+    void yield(Device &d);
+    void startFrame(uint64_t id);
+    void endFrame(uint64_t id);
+    float level(const SimFrame &f, int to) const { return f.src < 0 ? f.level : rssi(f.src, to); }
+    void wake(int i, uint8_t cause);
+    static void trampoline();
+
+    uint64_t t = 0, seq = 0, limit = 0, rng;
+    std::vector<std::unique_ptr<Device>> devs;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> q;
+    std::map<uint64_t, SimFrame> air; // by id, ended ones are kept a while for overlap checks
+    std::map<uint64_t, SimFrame> injected; // not on the air yet
+    uint64_t nextFrame = 0;
+    std::map<std::pair<int, int>, std::pair<float, float>> links;
+    ucontext_t main;
+    int current = -1;
+    std::string libDir;
+};
+
+// Minimal JSON field reader for the devices' one-line reports: the number
+// after "key": in s, starting the search at `from` (e.g. the position of an
+// enclosing key); def if missing.
+double jsonNum(const std::string &s, const char *key, double def = -1, size_t from = 0);
+size_t jsonAt(const std::string &s, const char *key, size_t from = 0);
+
+// Test verdicts: CHECK prints and counts a failure, the program's exit
+// code is the count
+extern int simFailures;
+#define CHECK(cond, ...)                                   \
+    do                                                     \
+    {                                                      \
+        if (!(cond))                                       \
+        {                                                  \
+            ++simFailures;                                 \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__);                  \
+            fputc('\n', stderr);                           \
+        }                                                  \
+    } while (0)
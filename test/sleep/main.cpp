@@ -0,0 +1,207 @@
+// Gateway light sleep (GW_LIGHT_SLEEP=1, power.h).
+//
+// First nextDeadline() itself: this program is also a sleeping gateway on
+// the host's own clock. Each deadline the loop keeps is set up on its own,
+// and the loop must then sleep through to it and act on it the pass it
+// wakes, not at the next status print.
+//
+// Then a network in the simulator, once with a sleeping gateway and once
+// with an awake one: the sleeping gateway must get every frame the awake
+// one gets, start its query rounds as punctually, never have DIO1 refire its
+// level-triggered interrupt while awake, and spend most of the hour asleep.
+#define ROLE_GATEWAY
+#define GW_LIGHT_SLEEP 1
+#include "../../src/main.cpp"
+#include "../../src/gateway.cpp"
+#include "sim.h"
+#include <algorithm>
+
+static const uint32_t PASS_US = 1000;
+
+static void tableReset()
+{
+    for (auto &c : children)
+        c = Child{};
+    idxInit();
+    childCount = 0;
+    allocCursor = 0;
+    subDirty = true;
+}
+
+static Child &oneChild(addr_t id)
+{
+    tableReset();
+    Child *c = allocChild(id);
+    c->lastSeen = millis();
+    c->hops = 1;
+    treeSetParent(*c, GW_ID);
+    return *c;
+}
+
+// Airtime of our own frames sent since `fromUs`; a pass that transmits
+// takes that much longer
+static uint64_t txUsSince(uint64_t fromUs)
+{
+    uint64_t us = 0;
+    for (const HostTx &t : hostTx)
+        if (t.atUs >= fromUs)
+            us += t.airUs;
+    return us;
+}
+
+// Runs loop() passes until done() or a minute past `due`. The work must
+// happen the pass the loop wakes at `due`, and the loop must have slept
+// rather than spun to get there.
+template <typename Done>
+static void expectAt(const char *what, uint32_t due, Done done)
+{
+    CHECK((int32_t)(nextDeadline(millis()) - due) <= 0, "%s: nextDeadline() is past it", what);
+    const uint64_t from = hostTime();
+    const uint32_t sleeps = powerStats.sleeps;
+    uint32_t passes = 0, at = millis();
+    while (!done() && (int32_t)(millis() - due) < 60000)
+    {
+        at = millis(); // a pass acts first and sleeps last
+        loop();
+        hostSetTime(hostTime() + PASS_US);
+        ++passes;
+    }
+    const int32_t late = (int32_t)(at - due) - (int32_t)((txUsSince(from) + PASS_US) / 1000);
+    CHECK(done(), "%s: not done a minute after its deadline", what);
+    CHECK(late <= 0, "%s: done %ld ms late", what, (long)late);
+    CHECK(powerStats.sleeps > sleeps && passes < powerStats.sleeps - sleeps + 20,
+          "%s: %lu passes for %lu sleeps", what, (unsigned long)passes, (unsigned long)(powerStats.sleeps - sleeps));
+}
+
+static void checkDeadlines()
+{
+    hostBoot();
+    setup();
+    queryPeriodMs = 3600000; // out of the way unless a case wants it
+    lastQueryRound = millis();
+
+    {
+        Child &c = oneChild(0x0010);
+        childTimeoutMs = 60000;
+        expectAt("child timeout", c.lastSeen + childTimeoutMs + 1, [] { return !findChild(0x0010); });
+        childTimeoutMs = PROFILE.livenessMs;
+    }
+    {
+        Child &c = oneChild(0x0011);
+        c.lastQuery = millis();
+        expectAt("query timeout", c.lastQuery + queryRto(c) + 1, [&] { return c.misses > 0; });
+    }
+    {
+        Child &c = oneChild(0x0012);
+        c.queryQueued = true;
+        c.queryRetryAt = millis() + 7000;
+        expectAt("deferred query", c.queryRetryAt, [&] { return !c.queryQueued; });
+    }
+    {
+        tableReset();
+        const uint32_t from = millis();
+        lastQueryRound = from;
+        queryPeriodMs = 30000;
+        expectAt("query round", from + queryPeriodMs + 1, [&] { return lastQueryRound != from; });
+        queryPeriodMs = 3600000;
+    }
+    {
+        tsAdd(tsdb, tsRecord(tsNow(tsdb), 0x0013, TS_STATE, 1, -80, 3900));
+        expectAt("telemetry flush", tsdb.bufSince + TS_FLUSH_MS, [] { return !tsdb.n; });
+    }
+    {
+        Child &c = oneChild(0x0014);
+        radioTune(12, 3);
+        tunedFor = c.id;
+        tunedUntil = millis() + 3000;
+        expectAt("retuned radio", tunedUntil, [] { return !radioBusy(); });
+        CHECK(hostDev.radio.sf == cfg.sf && fabsf(hostDev.radio.freq - cfg.freq) < 0.001f,
+              "radio not back on the control channel");
+    }
+    tableReset();
+}
+
+struct Run
+{
+    std::map<unsigned, std::pair<unsigned, unsigned>> rx; // node -> delivered, expected
+    int32_t lateMax = 0;                                  // worst query round start past its period, ms
+    uint32_t rounds = 0, isrStorms = 0;
+    double asleepPct = -1;
+};
+
+static const uint32_t QUERY_PERIOD_MS = 60000;
+
+// A gateway, a relay and three nodes behind it for an hour
+static Run network(const char *gw)
+{
+    Run r;
+    Sim sim(7);
+    const int g = sim.add(gw);
+    const int relay = sim.add("node.so", 2000000);
+    sim.link(g, relay, -95);
+    for (int i = 0; i < 3; ++i)
+        sim.link(sim.add("node.so", 3000000 + 700000 * i), relay, -100);
+    sim.run(6000000);
+    for (int i = 0; i < (int)sim.size(); ++i)
+        sim.console(i, i == g ? "param query_period 60000" : "param test_period 60000");
+
+    // the first QUERY after a quiet spell opens a round
+    uint64_t lastQuery = 0, roundAt = 0;
+    sim.onTx = [&](const SimFrame &f) {
+        if (f.src != g || f.data.size() < sizeof(MeshHeader) || f.data[offsetof(MeshHeader, type)] != QUERY)
+            return;
+        if (f.start - lastQuery > 10000000)
+        {
+            if (roundAt)
+            {
+                r.lateMax = std::max(r.lateMax, (int32_t)((f.start - roundAt) / 1000) - (int32_t)QUERY_PERIOD_MS);
+                ++r.rounds;
+            }
+            roundAt = f.start;
+        }
+        lastQuery = f.start;
+    };
+    sim.run(600000000); // the network forms
+    sim.console(g, "power reset");
+    sim.run(4200000000ULL);
+    sim.onTx = nullptr;
+
+    const std::string s = sim.ask(g, "stats", "{\"stats\"");
+    for (size_t p = jsonAt(s, "id"); p != std::string::npos; p = jsonAt(s, "id", p))
+        r.rx[(unsigned)strtoul(s.c_str() + p, nullptr, 10)] =
+            std::make_pair((unsigned)jsonNum(s, "rx", 0, p), (unsigned)jsonNum(s, "expected", 0, p));
+    r.isrStorms = sim.dev(g).radio.isrStorms;
+    const std::string pw = sim.ask(g, "power", "{\"power\"");
+    if (!pw.empty())
+        r.asleepPct = jsonNum(pw, "asleep_pct");
+    return r;
+}
+
+int main()
+{
+    checkDeadlines();
+
+    const Run awake = network("gw.so");
+    const Run asleep = network("gw_sleep.so");
+    unsigned rxAwake = 0, rxAsleep = 0, expected = 0;
+    for (auto &kv : awake.rx)
+        rxAwake += kv.second.first;
+    for (auto &kv : asleep.rx)
+    {
+        rxAsleep += kv.second.first;
+        expected += kv.second.second;
+    }
+    printf("{\"sleep\":{\"asleep_pct\":%.1f,\"rx\":%u,\"expected\":%u,\"rx_awake\":%u,\"rounds\":%lu,\"round_late_ms\":%ld,"
+           "\"round_late_ms_awake\":%ld,\"isr_storms\":%lu}}\n",
+           asleep.asleepPct, rxAsleep, expected, rxAwake, (unsigned long)asleep.rounds, (long)asleep.lateMax,
+           (long)awake.lateMax, (unsigned long)asleep.isrStorms);
+
+    CHECK(asleep.rx.size() == 4, "sleeping gateway knows %zu nodes, expected 4", asleep.rx.size());
+    CHECK(rxAsleep >= rxAwake, "sleeping gateway got %u frames, awake one %u", rxAsleep, rxAwake);
+    CHECK(asleep.rounds >= 60, "only %lu query rounds in the hour", (unsigned long)asleep.rounds);
+    CHECK(asleep.lateMax <= awake.lateMax + 50, "a query round started %ld ms late, %ld awake", (long)asleep.lateMax,
+          (long)awake.lateMax);
+    CHECK(!asleep.isrStorms, "DIO1 refired its level interrupt %lu times", (unsigned long)asleep.isrStorms);
+    CHECK(asleep.asleepPct >= 80, "asleep %.1f %% of the hour", asleep.asleepPct);
+    return simFailures;
+}
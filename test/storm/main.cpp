@@ -0,0 +1,65 @@
+// A join storm: a site of 100 nodes on a grid around the gateway, all
+// powered up in the same millisecond (the large-site builds). It reports
+// how long until every node has its JOIN_ACK, how many JOIN_REQ and
+// JOIN_ACK frames that took and how many receptions were lost to
+// collisions, and checks that everyone is in within 15 min and that the
+// gateway's table then holds all of them.
+#include "sim.h"
+#include "protocol.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+static const int NODES = 100, SIDE = 10;
+static const double SPACING_M = 250;
+static const uint64_t POWER_US = 1000000, LIMIT_US = 900000000ULL;
+
+int main()
+{
+    Sim sim(5);
+    const int g = sim.add("gw_large.so");
+    sim.place(g, (SIDE - 1) * SPACING_M / 2, (SIDE - 1) * SPACING_M / 2);
+    for (int i = 0; i < NODES; ++i)
+        sim.place(sim.add("node_large.so", POWER_US), (i % SIDE) * SPACING_M, (i / SIDE) * SPACING_M);
+
+    std::vector<uint64_t> joinedAt(sim.size(), 0);
+    int joined = 0;
+    uint64_t lastJoin = 0;
+    sim.onLine = [&](int dev, const std::string &line) {
+        if (dev == g || joinedAt[dev] || line.find("-> parent set") == std::string::npos)
+            return;
+        joinedAt[dev] = sim.now();
+        lastJoin = sim.now();
+        ++joined;
+    };
+    uint32_t reqs = 0, acks = 0;
+    sim.onTx = [&](const SimFrame &f) {
+        if (f.data.size() < sizeof(MeshHeader))
+            return;
+        const uint8_t type = f.data[offsetof(MeshHeader, type)];
+        reqs += type == JOIN_REQ;
+        acks += type == JOIN_ACK;
+    };
+    sim.runUntil([&] { return joined == NODES; }, POWER_US + LIMIT_US);
+    sim.onLine = nullptr;
+    sim.onTx = nullptr;
+    const uint64_t collided = sim.framesCollided;
+    sim.runFor(120000000); // CHILD_ADDs and the status print catch up
+
+    std::vector<double> t;
+    for (int i = 0; i < (int)sim.size(); ++i)
+        if (i != g && joinedAt[i])
+            t.push_back((joinedAt[i] - POWER_US) / 1e6);
+    std::sort(t.begin(), t.end());
+    const std::string st = sim.last(g, "nodes:");
+    const int known = st.empty() ? -1 : atoi(st.c_str() + strlen("nodes:"));
+    printf("{\"storm\":{\"nodes\":%d,\"joined\":%d,\"full_s\":%.1f,\"half_s\":%.1f,\"p90_s\":%.1f,\"join_reqs\":%lu,"
+           "\"join_acks\":%lu,\"collided\":%llu,\"gw_nodes\":%d}}\n",
+           NODES, joined, joined == NODES ? (lastJoin - POWER_US) / 1e6 : -1.0,
+           t.empty() ? -1.0 : t[t.size() / 2], t.empty() ? -1.0 : t[t.size() * 9 / 10], (unsigned long)reqs,
+           (unsigned long)acks, (unsigned long long)collided, known);
+
+    CHECK(joined == NODES, "%d of %d nodes joined in %llu s", joined, NODES, (unsigned long long)(LIMIT_US / 1000000));
+    CHECK(known == NODES, "gateway table holds %d nodes, expected %d", known, NODES);
+    return simFailures;
+}
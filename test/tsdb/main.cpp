@@ -0,0 +1,143 @@
+// The telemetry store (tsdb.h) on the host's LittleFS emulator: a gateway
+// with a full node table logging two weeks of polls, which is more than the
+// store keeps, so old segments are dropped along the way. Ingest and query
+// figures add the flash's program, erase and read times (HostFlash) to the
+// host CPU time, and every query must return exactly the records that went
+// in, oldest first.
+#include "host.h"
+#include "sim.h" // CHECK
+#include "tsdb.h"
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+
+static const uint16_t NODES = 128; // a full small-site table
+static const uint32_t DAYS = 14;
+static const uint32_t STATE_PERIOD_S = 300; // a poll per node every 5 min
+static const uint32_t UP_PERIOD_S = 1200; // and its data every 20 min
+
+static TsStore st;
+static std::vector<Sample> added; // everything added, in order
+
+static double cpuUs(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static bool same(const Sample &a, const Sample &b)
+{
+    if (a.t != b.t)
+        return false;
+    for (uint8_t c = 0; c < TS_COLUMNS; ++c)
+        if (a.v[c] != b.v[c])
+            return false;
+    return true;
+}
+
+struct Latency
+{
+    uint32_t records, blocks;
+    double us, flashUs, stepMaxUs;
+}; // One range query as the "ts" command runs it, a block per loop pass; the
+// records must be added's with from <= t <= to, in order
+static Latency query(uint32_t from, uint32_t to, uint16_t node = 0)
+{
+    auto lo = std::lower_bound(added.begin(), added.end(), from, [](const Sample &s, uint32_t t) { return s.t < t; });
+    std::vector<Sample> want;
+    for (auto it = lo; it != added.end() && it->t <= to; ++it)
+        if (!node || it->v[0] == node)
+            want.push_back(*it);
+
+    Latency l = {};
+    size_t got = 0;
+    bool order = true;
+    TsCursor c;
+    tsCursorStart(st, c, from, to);
+    bool more = true;
+    while (more)
+    {
+        const uint64_t f0 = hostDev.flash->busyUs;
+        const auto t0 = std::chrono::steady_clock::now();
+        more = tsStep(st, c, TS_BLOCK_N, [&](const Sample &s) {
+            if (node && s.v[0] != node)
+                return;
+            order = order && got < want.size() && same(s, want[got]);
+            ++got;
+        });
+        const double us = cpuUs(t0) + (hostDev.flash->busyUs - f0);
+        l.us += us;
+        l.flashUs += hostDev.flash->busyUs - f0;
+        l.stepMaxUs = std::max(l.stepMaxUs, us);
+    }
+    l.records = c.scan.records;
+    l.blocks = c.scan.blocks;
+    CHECK(got == want.size() && order, "query %lu..%lu node %u: %zu records, %zu expected%s", (unsigned long)from,
+          (unsigned long)to, node, got, want.size(), order ? "" : ", out of order");
+    return l;
+}
+
+static void printLatency(const char *name, const Latency &l, bool last = false)
+{
+    printf("\"%s\":{\"records\":%lu,\"blocks\":%lu,\"ms\":%.2f,\"flash_ms\":%.2f,\"step_max_ms\":%.2f}%s", name,
+           (unsigned long)l.records, (unsigned long)l.blocks, l.us / 1000, l.flashUs / 1000, l.stepMaxUs / 1000,
+           last ? "" : ",");
+}
+
+int main()
+{
+    hostBoot();
+    CHECK(tsBegin(st, "/ts"), "no LittleFS"); // two weeks of polls; the clock moves with the flash, so records are
+    // stamped from the schedule, as tsNow() would have
+    const uint64_t f0 = hostDev.flash->busyUs;
+    const auto c0 = std::chrono::steady_clock::now();
+    uint32_t seed = 1;
+    for (uint32_t t = 0; t < DAYS * 86400; t += 60)
+    {
+        for (uint16_t n = 1; n <= NODES; ++n)
+        {
+            const uint32_t phase = (t / 60 + n) % (STATE_PERIOD_S / 60);
+            if (phase && (t / 60 + n) % (UP_PERIOD_S / 60))
+                continue;
+            seed = seed * 1103515245u + 12345u;
+            const uint8_t ev = phase ? TS_UP : (seed >> 24) % 50 ? TS_STATE : TS_MISS;
+            const Sample s = tsRecord(t, n, ev, (uint8_t)(1 + n % 3), (int16_t)(-70 - n % 40 - (seed >> 16) % 4),
+                                      (uint16_t)(4100 - t / 3600 - n % 7));
+            added.push_back(s);
+            tsAdd(st, s);
+        }
+        tsPoll(st, millis());
+    }
+    tsFlush(st);
+    const double ingestCpuUs = cpuUs(c0);
+    const double ingestFlashUs = (double)(hostDev.flash->busyUs - f0);
+    const uint32_t records = (uint32_t)added.size(); // what is left on flash: everything from the oldest segment on
+    const uint32_t kept = st.first[st.segLo % TS_MAX_SEGMENTS] + 1;
+    const uint32_t end = added.back().t;
+    CHECK(!st.lost, "%lu records lost", (unsigned long)st.lost);
+    CHECK(st.droppedSegs > 0, "two weeks did not fill the store; the test misses segment drops");
+
+    printf("{\"tsdb\":{\"records\":%lu,\"days\":%lu,\"nodes\":%u,\"bytes_per_record\":%.2f,\"blocks\":%lu,"
+           "\"kept_days\":%.1f,\"ingest_per_s\":%.0f,\"ingest_cpu_s\":%.3f,\"ingest_flash_s\":%.3f,"
+           "\"flash_ms_per_day\":%.1f,\"erases\":%lu,\"query\":{",
+           (unsigned long)records, (unsigned long)DAYS, NODES, (double)st.bytes / records, (unsigned long)st.blocks,
+           (end - kept) / 86400.0, records / ((ingestCpuUs + ingestFlashUs) / 1e6), ingestCpuUs / 1e6,
+           ingestFlashUs / 1e6, ingestFlashUs / 1000 / DAYS, (unsigned long)hostDev.flash->erases);
+
+    const Latency hour = query(end - 3600, end);
+    const Latency day = query(end - 86400, end);
+    const Latency node = query(end - 86400, end, 42);
+    const Latency old = query(kept + 3600, kept + 7200); // an hour at the old end
+    const Latency all = query(kept, end);
+    printLatency("hour", hour);
+    printLatency("day", day);
+    printLatency("node_day", node);
+    printLatency("oldest_hour", old);
+    printLatency("all", all, true);
+    printf("}}}\n"); // a range query opens only its segments and decodes only its blocks
+    const uint32_t perHour = NODES * 3600 / STATE_PERIOD_S + NODES * 3600 / UP_PERIOD_S;
+    CHECK(hour.blocks <= perHour / TS_BLOCK_N + 3, "an hour decoded %lu blocks", (unsigned long)hour.blocks);
+    CHECK(old.blocks <= perHour / TS_BLOCK_N + 3, "the oldest hour decoded %lu blocks", (unsigned long)old.blocks); // and a loop pass of it stays a loop pass
+    CHECK(all.stepMaxUs < 50000, "one step of a full query took %.1f ms", all.stepMaxUs / 1000);
+    return simFailures;
+}
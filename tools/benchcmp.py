@@ -0,0 +1,52 @@
+# tools/benchcmp.py
+#
+# Compares gateway "bench" results against a stored baseline.
+#
+#   benchcmp.py baseline.log current.log [--tolerance 0.15]
+#
+# Either file may be a whole serial log; the last {"bench":...} line in it
+# is used. Exits 1 if any path got slower than the baseline by more than the
+# tolerance, so it can gate a firmware change. Keep one baseline per board
+# and table size: the numbers scale with CPU clock and node count.
+import argparse, json, sys
+
+
+def load(path):
+    found = None
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith('{"bench"'):
+                found = json.loads(line)["bench"]
+    if not found:
+        sys.exit(f"{path}: no bench line")
+    return found
+
+
+def main():
+    ap = argparse.ArgumentParser(description="LoRa-QTree gateway benchmark check")
+    ap.add_argument("baseline")
+    ap.add_argument("current")
+    ap.add_argument("--tolerance", type=float, default=0.15, help="allowed slowdown, 0.15 = 15 %%")
+    args = ap.parse_args()
+    base, cur = load(args.baseline), load(args.current)
+    for k in ("cpu_mhz", "nodes"):
+        if base.get(k) != cur.get(k):
+            print(f"note: {k} differs ({base.get(k)} -> {cur.get(k)})")
+
+    failed = False
+    print(f"{'path':18} {'base ns':>9} {'now ns':>9} {'change':>8}")
+    for name, b in sorted(base["ns"].items()):
+        c = cur["ns"].get(name)
+        if c is None or not b:
+            print(f"{name:18} {b:>9} {'-' if c is None else c:>9}")
+            continue
+        change = (c - b) / b
+        bad = change > args.tolerance
+        failed |= bad
+        print(f"{name:18} {b:>9} {c:>9} {change:>+8.1%}{'  SLOWER' if bad else ''}")
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
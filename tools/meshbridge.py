@@ -0,0 +1,271 @@
+# tools/meshbridge.py
+#
+# Reference host daemon for the gateway's binary bridge ("bridge on", see
+# gateway.cpp). Writes everything the gateway reports to JSON-lines files
+# and sends downlink messages queued in a spool directory.
+#
+#   meshbridge.py run /dev/ttyACM0 data/           needs pyserial
+#   meshbridge.py enqueue data/ 0x0012 48656c6c6f  queue a downlink (hex)
+#   meshbridge.py ota /dev/ttyACM0 update.qd        upload and start a rollout
+#
+# run writes to data/: uplink.jsonl (DATA_UP payloads and reassembled large
+# messages), state.jsonl (STATE replies), receipts.jsonl (downlink
+# outcomes) and status.jsonl (gateway heartbeat with drop counters). It
+# picks up data/outbox/*.json, sends each as a BR_DOWN and renames it to
+# .sent; the receipts name the file's message id. Ctrl-C turns the bridge
+# off again.
+#
+# ota sends a delta image from mkdelta.py in BR_OTA records, one at a time,
+# each acknowledged by the gateway, then starts the rollout with "ota start".
+# Follow it with "ota" on the gateway console.
+import argparse, json, os, random, struct, sys, time
+
+from meshcap import crc16
+
+BR_UP, BR_MSG, BR_STATE, BR_RECEIPT, BR_STATUS, BR_OTA_ACK = 0x01, 0x02, 0x03, 0x04, 0x05, 0x06
+BR_DOWN, BR_CMD, BR_OTA = 0x81, 0x82, 0x83
+RECEIPTS = ["delivered", "queued", "no_route", "full", "timeout", "too_long"]
+
+UP = struct.Struct("<HHIhbB")
+MSG = struct.Struct("<HHIHH")
+STATE = struct.Struct("<HHBbhbI")
+RECEIPT = struct.Struct("<HHBB")
+STATUS = struct.Struct("<IHBH")
+OTA_ACK = struct.Struct("<IB")
+OTA_PIECE = 128  # a BR_OTA record stays inside the gateway's 200 B receive frame
+
+
+def cobs_encode(data):
+    out, block = bytearray(), bytearray()
+    for b in data:
+        if b:
+            block.append(b)
+        if not b or len(block) == 254:
+            out.append(len(block) + 1)
+            out += block
+            block = bytearray()
+    out.append(len(block) + 1)
+    out += block
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out, i = bytearray(), 0
+    while i < len(data):
+        run = data[i]
+        if not run or i + run > len(data):
+            return None
+        out += data[i + 1:i + run]
+        i += run
+        if run < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def frame(seq, records):
+    body = bytes([seq]) + b"".join(struct.pack("<BH", t, len(b)) + b for t, b in records)
+    return b"\0" + cobs_encode(body + struct.pack("<H", crc16(body))) + b"\0"
+
+
+def parse(raw):
+    """Returns (seq, [(type, body)]) for a valid frame, None otherwise."""
+    f = cobs_decode(raw)
+    if not f or len(f) < 3 or struct.unpack_from("<H", f, len(f) - 2)[0] != crc16(f[:-2]):
+        return None
+    recs, i, end = [], 1, len(f) - 2
+    while i + 3 <= end:
+        t, n = struct.unpack_from("<BH", f, i)
+        if i + 3 + n > end:
+            return None
+        recs.append((t, f[i + 3:i + 3 + n]))
+        i += 3 + n
+    return f[0], recs
+
+
+class Daemon:
+    def __init__(self, port, out):
+        self.port, self.out = port, out
+        self.outbox = os.path.join(out, "outbox")
+        os.makedirs(self.outbox, exist_ok=True)
+        self.files = {}
+        self.seq = None
+        self.tx_seq = 0
+        self.next_id = random.randrange(0x10000)
+        self.msgs = {}  # (src, msgId) -> bytearray, filled by BR_MSG chunks
+        self.names = {}  # downlink id -> spool file
+
+    def write(self, kind, rec):
+        f = self.files.get(kind)
+        if not f:
+            f = self.files[kind] = open(os.path.join(self.out, kind + ".jsonl"), "a")
+        rec["host_t"] = round(time.time(), 3)
+        f.write(json.dumps(rec) + "\n")
+        f.flush()
+
+    def send(self, records):
+        self.port.write(frame(self.tx_seq, records))
+        self.tx_seq = (self.tx_seq + 1) & 0xFF
+
+    def on_frame(self, seq, recs):
+        if self.seq is not None and seq != (self.seq + 1) & 0xFF:
+            print(f"lost {(seq - self.seq - 1) & 0xFF} frame(s)", file=sys.stderr)
+        self.seq = seq
+        for t, b in recs:
+            if t == BR_UP and len(b) >= UP.size:
+                src, useq, gt, rssi, snr4, hops = UP.unpack_from(b)
+                self.write("uplink", {"src": src, "seq": useq, "t": gt, "rssi": rssi, "snr": snr4 / 4,
+                                      "hops": hops, "hex": b[UP.size:].hex()})
+            elif t == BR_MSG and len(b) >= MSG.size:
+                src, mid, gt, total, off = MSG.unpack_from(b)
+                buf = self.msgs.setdefault((src, mid), bytearray(total))
+                chunk = b[MSG.size:]
+                buf[off:off + len(chunk)] = chunk
+                if off + len(chunk) >= total:
+                    del self.msgs[(src, mid)]
+                    self.write("uplink", {"src": src, "msg_id": mid, "t": gt, "hex": bytes(buf).hex()})
+            elif t == BR_STATE and len(b) >= STATE.size:
+                src, parent, hops, prssi, rssi, snr4, gt = STATE.unpack_from(b)
+                self.write("state", {"src": src, "parent": parent, "hops": hops, "parent_rssi": prssi,
+                                     "rssi": rssi, "snr": snr4 / 4, "t": gt})
+            elif t == BR_RECEIPT and len(b) >= RECEIPT.size:
+                mid, dst, status, tries = RECEIPT.unpack_from(b)
+                name = RECEIPTS[status] if status < len(RECEIPTS) else status
+                self.write("receipts", {"id": mid, "dst": dst, "status": name, "tries": tries,
+                                        "file": self.names.get(mid)})
+                if name != "queued":
+                    self.names.pop(mid, None)
+            elif t == BR_STATUS and len(b) >= STATUS.size:
+                dropped, ring, slots, nodes = STATUS.unpack_from(b)
+                self.write("status", {"dropped": dropped, "ring_free": ring, "down_free": slots,
+                                      "nodes": nodes})
+
+    def poll_outbox(self):
+        for name in sorted(os.listdir(self.outbox)):
+            if not name.endswith(".json"):
+                continue
+            path = os.path.join(self.outbox, name)
+            try:
+                with open(path) as f:
+                    req = json.load(f)
+                dst = int(str(req["dst"]), 0)
+                data = bytes.fromhex(req["hex"])
+            except (ValueError, KeyError, OSError) as e:
+                print(f"{name}: {e}", file=sys.stderr)
+                os.rename(path, path + ".bad")
+                continue
+            mid = self.next_id
+            self.next_id = (self.next_id + 1) & 0xFFFF
+            self.names[mid] = name
+            self.send([(BR_DOWN, struct.pack("<HH", mid, dst) + data)])
+            os.rename(path, path[:-5] + ".sent")
+
+    def run(self):
+        self.port.write(b"\nbridge on\n")
+        pending = bytearray()
+        last_poll = 0
+        try:
+            while True:
+                pending += self.port.read(self.port.in_waiting or 1)
+                while True:
+                    end = pending.find(b"\0")
+                    if end < 0:
+                        break
+                    raw, pending = bytes(pending[:end]), pending[end + 1:]
+                    # text between frames fails to decode and is skipped
+                    got = parse(raw) if raw else None
+                    if got:
+                        self.on_frame(*got)
+                if len(pending) > 4096:
+                    pending.clear()
+                if time.monotonic() - last_poll > 0.5:
+                    self.poll_outbox()
+                    last_poll = time.monotonic()
+        except KeyboardInterrupt:
+            self.send([(BR_CMD, b"bridge off")])
+
+
+def read_frames(port, pending):
+    """Yields decoded frames from the port; pending carries partial input."""
+    pending += port.read(port.in_waiting or 1)
+    while True:
+        end = pending.find(b"\0")
+        if end < 0:
+            break
+        raw = bytes(pending[:end])
+        del pending[:end + 1]
+        # text between frames fails to decode and is skipped
+        got = parse(raw) if raw else None
+        if got:
+            yield got
+
+
+def upload(port, image):
+    port.write(b"\nbridge on\n")
+    time.sleep(0.5)
+    port.reset_input_buffer()
+    pending, seq = bytearray(), 0
+    off = 0
+    while off < len(image):
+        piece = image[off:off + OTA_PIECE]
+        port.write(frame(seq, [(BR_OTA, struct.pack("<I", off) + piece)]))
+        seq = (seq + 1) & 0xFF
+        deadline, acked = time.monotonic() + 2, None
+        while acked is None and time.monotonic() < deadline:
+            for _, recs in read_frames(port, pending):
+                for t, b in recs:
+                    if t == BR_OTA_ACK and len(b) >= OTA_ACK.size:
+                        acked = OTA_ACK.unpack_from(b)
+        if acked is None:
+            continue  # lost either way: a repeat at the same offset is answered with the size so far
+        size, ok = acked
+        if size == off + len(piece):
+            off = size
+            print(f"\r{off}/{len(image)} B", end="", flush=True)
+        elif not ok:
+            print(f"\ngateway refused the image at offset {off} (has {size} B)", file=sys.stderr)
+            return 1
+    print()
+    port.write(frame(seq, [(BR_CMD, b"ota start")]))
+    port.write(frame((seq + 1) & 0xFF, [(BR_CMD, b"bridge off")]))
+    return 0
+
+
+def main():
+    ap = argparse.ArgumentParser(description="LoRa-QTree gateway host bridge")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    r = sub.add_parser("run")
+    r.add_argument("port")
+    r.add_argument("out")
+    r.add_argument("--baud", type=int, default=115200)
+    q = sub.add_parser("enqueue")
+    q.add_argument("out")
+    q.add_argument("dst")
+    q.add_argument("hex")
+    o = sub.add_parser("ota")
+    o.add_argument("port")
+    o.add_argument("image")
+    o.add_argument("--baud", type=int, default=115200)
+    args = ap.parse_args()
+
+    if args.cmd == "enqueue":
+        outbox = os.path.join(args.out, "outbox")
+        os.makedirs(outbox, exist_ok=True)
+        name = os.path.join(outbox, f"{time.time_ns()}.json")
+        with open(name + ".tmp", "w") as f:
+            json.dump({"dst": args.dst, "hex": args.hex}, f)
+        os.rename(name + ".tmp", name)  # the daemon never sees a half-written file
+        print(name)
+        return 0
+
+    import serial  # pyserial
+
+    with serial.Serial(args.port, args.baud, timeout=0.05) as port:
+        if args.cmd == "ota":
+            with open(args.image, "rb") as f:
+                return upload(port, f.read())
+        Daemon(port, args.out).run()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,202 @@
+# tools/meshcap.py
+#
+# Reads gateway captures ("capture on" on the gateway console, see
+# gateway.cpp) and turns them into summaries, stat diffs or PCAP files.
+#
+#   meshcap.py record /dev/ttyUSB0 run.cap       needs pyserial
+#   meshcap.py summary run.cap
+#   meshcap.py diff before.cap after.cap
+#   meshcap.py pcap run.cap run.pcap             LoRaTap, opens in Wireshark
+#
+# `make -C test replay CAP=run.cap OUT=new.cap` replays a capture into a
+# host build of the gateway and captures its replies, for diff and pcap.
+#
+# A capture is the raw serial stream: text log lines with binary records in
+# between. Records are found by their sync bytes and CRC, everything else is
+# skipped.
+import argparse, struct, sys
+from collections import Counter, defaultdict
+
+SYNC = b"C\xa7"
+REC_HDR = struct.Struct("<BBIhbB")  # kind, len, t_ms, value, snr*4, sf<<4|ch
+MESH_HDR = struct.Struct("<BHHBBB")  # magic, src, dst, hops, type, len
+CAP_RX, CAP_TX = 1, 2
+ERR_TX_DEFERRED = 1
+
+MSG_NAMES = {
+    0x01: "BEACON", 0x02: "JOIN_REQ", 0x03: "JOIN_ACK", 0x04: "DATA_UP",
+    0x05: "DATA_ACK", 0x06: "QUERY", 0x07: "STATE", 0xA1: "CHILD_ADD",
+    0xA2: "CHILD_GONE", 0xA3: "JOIN_NACK", 0xA4: "ADDR_REQ", 0xA5: "ADDR_ACK",
+    0xA6: "ADR_CMD", 0xA7: "DATA_FRAG", 0xA8: "FRAG_ACK", 0xA9: "PARAM_SET",
+    0xAA: "PARAM_ACK", 0xAB: "DATA_DOWN", 0xAC: "DOWN_ACK", 0xAD: "OTA_OFFER",
+    0xAE: "OTA_CHUNK", 0xAF: "OTA_NEED", 0xB0: "OTA_STATUS", 0xB1: "XOR",
+}
+
+# must match MESH_DATA_CHANNELS / cfg in the firmware
+DATA_CHANNELS = [867.1, 867.3, 867.5, 867.7, 867.9, 868.3, 868.5, 869.525]
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def records(blob):
+    """Yields (kind, t_ms, value, snr, sf, ch, frame) for every valid record."""
+    i = 0
+    while True:
+        i = blob.find(SYNC, i)
+        if i < 0 or i + 2 + REC_HDR.size > len(blob):
+            return
+        kind, n, t, value, snr4, sfch = REC_HDR.unpack_from(blob, i + 2)
+        end = i + 2 + REC_HDR.size + n
+        if kind in (CAP_RX, CAP_TX) and end + 2 <= len(blob):
+            (crc,) = struct.unpack_from("<H", blob, end)
+            if crc == crc16(blob[i + 2:end]):
+                yield kind, t, value, snr4 / 4.0, sfch >> 4, sfch & 0x0F, blob[end - n:end]
+                i = end + 2
+                continue
+        i += 1
+
+
+def mesh_header(frame):
+    if len(frame) < MESH_HDR.size:
+        return None
+    return MESH_HDR.unpack_from(frame)
+
+
+def airtime_ms(sf, bw_khz, cr, n):
+    # same formula as loraAirtimeMs() in protocol.h
+    t_sym = (1 << sf) / bw_khz
+    de = 1 if t_sym >= 16.0 else 0
+    num = 8 * n - 4 * sf + 28 + 16
+    den = 4 * (sf - 2 * de)
+    n_pay = 8 + (-(-num // den) if num > 0 else 0) * cr
+    return (8 + 4.25 + n_pay) * t_sym
+
+
+def stats(path, args):
+    with open(path, "rb") as f:
+        blob = f.read()
+    s = Counter()
+    per_src = defaultdict(lambda: [0, 0])  # frames, rssi sum
+    t0 = t1 = None
+    for kind, t, value, snr, sf, ch, frame in records(blob):
+        t0 = t if t0 is None else t0
+        t1 = t
+        h = mesh_header(frame)
+        name = MSG_NAMES.get(h[4], f"0x{h[4]:02X}") if h else "short"
+        if kind == CAP_RX:
+            s["rx"] += 1
+            s[f"rx {name}"] += 1
+            if not h or h[0] != 0xA6:
+                s["rx bad"] += 1
+                continue
+            per_src[h[1]][0] += 1
+            per_src[h[1]][1] += value
+        elif value == ERR_TX_DEFERRED:
+            s["tx deferred"] += 1
+            s[f"tx deferred {name}"] += 1
+        elif value == 0:
+            s["tx"] += 1
+            s[f"tx {name}"] += 1
+            s["tx airtime ms"] += airtime_ms(sf or args.sf, args.bw, args.cr, len(frame))
+        else:
+            s["tx error"] += 1
+    s["span s"] = ((t1 - t0) & 0xFFFFFFFF) / 1000.0 if t0 is not None else 0
+    s["sources"] = len(per_src)
+    for src, (n, rssi) in per_src.items():
+        s[f"src {src:04X} rx"] = n
+        s[f"src {src:04X} rssi"] = rssi / n
+    return s
+
+
+def fmt(v):
+    return f"{v:.1f}" if isinstance(v, float) else str(v)
+
+
+def cmd_summary(args):
+    for k, v in sorted(stats(args.capture, args).items()):
+        print(f"{k:28} {fmt(v)}")
+
+
+def cmd_diff(args):
+    a, b = stats(args.a, args), stats(args.b, args)
+    print(f"{'':28} {'a':>10} {'b':>10} {'b - a':>10}")
+    for k in sorted(set(a) | set(b)):
+        va, vb = a.get(k, 0), b.get(k, 0)
+        if va != vb or args.all:
+            print(f"{k:28} {fmt(va):>10} {fmt(vb):>10} {fmt(vb - va):>10}")
+
+
+def cmd_pcap(args):
+    with open(args.capture, "rb") as f:
+        blob = f.read()
+    n = 0
+    with open(args.out, "wb") as out:
+        out.write(struct.pack("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0, 65535, 270))  # LINKTYPE_LORATAP
+        for kind, t, value, snr, sf, ch, frame in records(blob):
+            if kind == CAP_TX and (value != 0 or args.rx_only):
+                continue
+            freq = DATA_CHANNELS[ch - 1] if 0 < ch <= len(DATA_CHANNELS) else args.freq
+            rssi = 255 if kind == CAP_TX else max(0, min(254, value + 139))
+            snr4 = 0 if kind == CAP_TX else int(snr * 4)
+            tap = struct.pack(">BBHIBBBBBbB", 0, 0, 15, int(freq * 1e6), int(args.bw // 125),
+                              sf or args.sf, rssi, rssi, rssi, snr4, args.sync)
+            out.write(struct.pack("<IIII", t // 1000, (t % 1000) * 1000,
+                                  len(tap) + len(frame), len(tap) + len(frame)))
+            out.write(tap + frame)
+            n += 1
+    print(f"{n} frames -> {args.out}")
+
+
+def cmd_record(args):
+    import serial  # pyserial
+
+    with serial.Serial(args.port, args.baud, timeout=0.5) as port, open(args.out, "wb") as out:
+        port.write(b"capture on\n")
+        print("recording, Ctrl-C to stop")
+        try:
+            while True:
+                out.write(port.read(4096))
+        except KeyboardInterrupt:
+            port.write(b"capture off\n")
+
+
+def main():
+    ap = argparse.ArgumentParser(description="LoRa-QTree gateway capture tool")
+    ap.add_argument("--sf", type=int, default=12, help="base SF, for records without one")
+    ap.add_argument("--bw", type=float, default=125.0, help="bandwidth in kHz")
+    ap.add_argument("--cr", type=int, default=5, help="coding rate denominator")
+    ap.add_argument("--freq", type=float, default=868.0, help="control channel in MHz")
+    ap.add_argument("--sync", type=lambda x: int(x, 0), default=0x12, help="sync word")
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    p = sub.add_parser("record")
+    p.add_argument("port")
+    p.add_argument("out")
+    p.add_argument("--baud", type=int, default=115200)
+    p.set_defaults(fn=cmd_record)
+    p = sub.add_parser("summary")
+    p.add_argument("capture")
+    p.set_defaults(fn=cmd_summary)
+    p = sub.add_parser("diff")
+    p.add_argument("a")
+    p.add_argument("b")
+    p.add_argument("--all", action="store_true", help="show unchanged rows too")
+    p.set_defaults(fn=cmd_diff)
+    p = sub.add_parser("pcap")
+    p.add_argument("capture")
+    p.add_argument("out")
+    p.add_argument("--rx-only", action="store_true")
+    p.set_defaults(fn=cmd_pcap)
+    args = ap.parse_args()
+    args.fn(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,174 @@
+# tools/mkdelta.py
+#
+# Builds the delta image a node applies during a mesh firmware update (see
+# ota.h for the format) from the firmware it runs and the new one.
+#
+#   mkdelta.py old.bin new.bin update.qd         delta against old.bin
+#   mkdelta.py --full new.bin update.qd          self-contained, any base
+#   mkdelta.py --check old.bin update.qd new.bin decode and compare
+#
+# Matching is greedy over a hash index: the old image is indexed every
+# STRIDE bytes and the new image as it is emitted, each position of the new
+# image is looked up, and the longest match found, from either, is extended
+# both ways. Whatever matches nothing goes out as literals. Nodes check the
+# SHA-256 of the base they run against the header, so a delta only applies
+# to the image it was made from.
+import argparse, hashlib, struct, sys
+
+MAGIC, VERSION = 0x544C4451, 1
+HDR = struct.Struct("<IBBHII32s32s")
+OP_LITERAL, OP_COPY_OLD, OP_COPY_NEW = 0, 1, 2
+KEY = 12  # bytes hashed per index entry
+STRIDE = 4  # old image positions indexed
+MIN_MATCH = 16
+OTA_MAX_BYTES = 131072  # ota.h default
+
+
+def varint(v):
+    out = bytearray()
+    while True:
+        b = v & 0x7F
+        v >>= 7
+        if v:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def zigzag(v):
+    return (v << 1) if v >= 0 else ((-v << 1) - 1)
+
+
+def encode(old, new):
+    old_idx = {}
+    for i in range(0, len(old) - KEY + 1, STRIDE):
+        old_idx.setdefault(old[i:i + KEY], i)
+    new_idx = {}
+    out = bytearray()
+    lit_start = pos = cursor = 0
+
+    def flush(end):
+        if end > lit_start:
+            out.extend(varint(((end - lit_start) << 2) | OP_LITERAL))
+            out.extend(new[lit_start:end])
+
+    while pos + KEY <= len(new):
+        key = new[pos:pos + KEY]
+        best = None
+        # the old image is indexed every STRIDE bytes: try the aligned offsets
+        for back in range(STRIDE):
+            o = old_idx.get(new[pos - back:pos - back + KEY]) if pos >= back else None
+            if o is not None:
+                o += back
+                n = 0
+                while pos + n < len(new) and o + n < len(old) and new[pos + n] == old[o + n]:
+                    n += 1
+                if n >= MIN_MATCH and (not best or n > best[2]):
+                    best = (OP_COPY_OLD, o, n)
+        s = new_idx.get(key)
+        if s is not None:
+            n = 0
+            while pos + n < len(new) and new[pos + n] == new[s + n]:
+                n += 1
+            if n >= MIN_MATCH and (not best or n > best[2]):
+                best = (OP_COPY_NEW, s, n)
+        if not best:
+            new_idx.setdefault(key, pos)
+            pos += 1
+            continue
+        op, src, n = best
+        # extend backwards into the pending literals
+        while pos > lit_start and src > 0 and new[pos - 1] == (old if op == OP_COPY_OLD else new)[src - 1] and \
+                (op == OP_COPY_OLD or src - 1 < pos - 1):
+            pos, src, n = pos - 1, src - 1, n + 1
+        flush(pos)
+        out.extend(varint((n << 2) | op))
+        if op == OP_COPY_OLD:
+            out.extend(varint(zigzag(src - cursor)))
+            cursor = src + n
+        else:
+            out.extend(varint(pos - src))
+        for i in range(pos, min(pos + n, len(new) - KEY + 1), 4):
+            new_idx.setdefault(new[i:i + KEY], i)
+        pos += n
+        lit_start = pos
+    flush(len(new))
+    return bytes(out)
+
+
+def decode(old, delta):
+    magic, ver, _flags, _res, old_len, new_len, old_sha, new_sha = HDR.unpack_from(delta)
+    if magic != MAGIC or ver != VERSION:
+        raise ValueError("not a delta image")
+    if old_len and hashlib.sha256(old[:old_len]).digest() != old_sha:
+        raise ValueError("base image does not match")
+    out = bytearray()
+    i, cursor = HDR.size, 0
+
+    def get_varint():
+        nonlocal i
+        v = shift = 0
+        while True:
+            b = delta[i]
+            i += 1
+            v |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                return v
+
+    while len(out) < new_len:
+        v = get_varint()
+        op, n = v & 3, v >> 2
+        if op == OP_LITERAL:
+            out += delta[i:i + n]
+            i += n
+        elif op == OP_COPY_OLD:
+            a = get_varint()
+            cursor += (a >> 1) ^ -(a & 1)
+            out += old[cursor:cursor + n]
+            cursor += n
+        elif op == OP_COPY_NEW:
+            d = get_varint()
+            for _ in range(n):
+                out.append(out[-d])
+        else:
+            raise ValueError(f"bad op {op}")
+    if len(out) != new_len or hashlib.sha256(out).digest() != new_sha:
+        raise ValueError("output does not match its SHA-256")
+    return bytes(out)
+
+
+def main():
+    ap = argparse.ArgumentParser(description="LoRa-QTree mesh firmware delta")
+    ap.add_argument("files", nargs="+", help="old.bin new.bin out, or with --full: new.bin out")
+    ap.add_argument("--full", action="store_true", help="no base image")
+    ap.add_argument("--check", action="store_true", help="files are old.bin delta new.bin: verify")
+    args = ap.parse_args()
+
+    if args.check:
+        if len(args.files) != 3:
+            ap.error("--check takes old.bin delta new.bin")
+        old, delta, new = (open(p, "rb").read() for p in args.files)
+        ok = decode(old, delta) == new
+        print("ok" if ok else "MISMATCH")
+        return 0 if ok else 1
+    if len(args.files) != (2 if args.full else 3):
+        ap.error("expected old.bin new.bin out" if not args.full else "expected new.bin out")
+    old = b"" if args.full else open(args.files[0], "rb").read()
+    new = open(args.files[-2], "rb").read()
+    body = encode(old, new)
+    hdr = HDR.pack(MAGIC, VERSION, 0, 0, len(old), len(new), hashlib.sha256(old).digest(),
+                   hashlib.sha256(new).digest())
+    delta = hdr + body
+    assert decode(old, delta) == new
+    with open(args.files[-1], "wb") as f:
+        f.write(delta)
+    print(f"{len(new)} B image -> {len(delta)} B delta ({100 * len(delta) / max(1, len(new)):.1f} %)")
+    if len(delta) > OTA_MAX_BYTES:
+        print(f"warning: over the default OTA_MAX_BYTES ({OTA_MAX_BYTES})", file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,500 @@
+# tools/ncsim.py
+#
+# Checks relay network coding (netcode.h) against a mock radio and measures
+# what it saves on line topologies: GW - N1 - ... - Nk, every device hearing
+# only its neighbours. The gateway polls every node each round with a
+# QUERY, and each node answers with a STATE. Frames are built, XOR-coded
+# and decoded byte for byte as node.cpp and gateway.cpp do it.
+#
+#   ncsim.py                           lines of 2..6 hops, SF12, coding off / on / on with hold
+#   ncsim.py --lines 4 --rounds 50 --loss 0.05 --hold 1500
+#   ncsim.py --selftest 10000          only the encode / decode round trip
+#
+# The mock radio is half duplex: a device that is transmitting hears
+# nothing. Two neighbours of a receiver on air at once destroy both frames.
+# Every frame also gets lost with --loss. Each device has its own duty-cycle
+# bucket, as channels.h. Relays keep the hop-ACK retries, the duplicate
+# filter and the txq of node.cpp. The gateway re-polls an unanswered node
+# after a per-hop timeout. Every decoded frame is compared with the frame
+# the relay coded, and any mismatch fails the run.
+import argparse, heapq, random, struct, sys
+
+from meshcap import airtime_ms
+
+HDR = struct.Struct("<BHHBBB")  # MeshHeader
+XOR_HDR = struct.Struct("<IIBBI")
+MAGIC = 0xA6
+BEACON, DATA_UP, QUERY, STATE, MSG_XOR = 0x01, 0x04, 0x06, 0x07, 0xB1
+GW, BCAST = 0x0000, 0xFFFF
+MAX_PAYLOAD = 64
+NC_MAX_FRAME = MAX_PAYLOAD - XOR_HDR.size
+NC_SENT_NODE, NC_SENT_GW = 8, 32
+HOP_MAX_RETX, HOP_ACK_SLACK_MS = 2, 400
+MAX_SEEN, SEEN_TTL_MS = 16, 30000
+MAX_TXQ = 16  # PROFILE_SMALL_SITE
+QUERY_HOP_TIMEOUT_MS = 15000  # queryTimeoutMs, per hop
+QUERY_TRIES = 3
+DC_WINDOW_MS = 3600000
+LOOP_MS = 30  # latency of the firmware loop, randomised
+
+
+def ts_offset(t):
+    return 0 if t == QUERY else 1 if t == BEACON else -1
+
+
+def frame_hash(f):
+    # frameHash() in protocol.h
+    _, src, dst, _, typ, ln = HDR.unpack_from(f)
+    x = 2166136261
+    ts = ts_offset(typ)
+    for b in struct.pack("<HHBB", src, dst, typ, ln) + bytes(
+            0 if ts >= 0 and ts <= i < ts + 4 else f[HDR.size + i] for i in range(ln)):
+        x = ((x ^ b) * 16777619) & 0xFFFFFFFF
+    return x
+
+
+def timed(f):
+    ts = ts_offset(f[6])
+    return ts >= 0 and f[7] >= ts + 4
+
+
+def canonical(f):
+    """Frame with hops and the network timestamp zeroed, and the timestamp."""
+    c = bytearray(f)
+    c[5] = 0
+    t = 0
+    if timed(f):
+        o = HDR.size + ts_offset(f[6])
+        t = struct.unpack_from("<I", c, o)[0]
+        c[o:o + 4] = bytes(4)
+    return c, t
+
+
+def nc_encode(a, b):
+    if len(a) > NC_MAX_FRAME or len(b) > NC_MAX_FRAME or (timed(a) and timed(b)):
+        return None
+    (ca, ta), (cb, tb) = canonical(a), canonical(b)
+    n = max(len(a), len(b))
+    ca += bytes(n - len(ca))
+    cb += bytes(n - len(cb))
+    x = XOR_HDR.pack(frame_hash(a), frame_hash(b), a[5], b[5], ta | tb)
+    return x + bytes(p ^ q for p, q in zip(ca, cb))
+
+
+def nc_decode(body, own, which):
+    if len(body) <= XOR_HDR.size:
+        return None
+    h0, h1, p0, p1, t = XOR_HDR.unpack_from(body)
+    data = body[XOR_HDR.size:]
+    if len(own) > len(data) or len(data) > NC_MAX_FRAME:
+        return None
+    co, _ = canonical(own)
+    co += bytes(len(data) - len(co))
+    out = bytearray(p ^ q for p, q in zip(data, co))
+    if out[0] != MAGIC or HDR.size + out[7] > len(out):
+        return None
+    out = out[:HDR.size + out[7]]
+    out[5] = (p0, p1)[1 - which]
+    if timed(out):
+        struct.pack_into("<I", out, HDR.size + ts_offset(out[6]), t)
+    return bytes(out) if frame_hash(out) == (h0, h1)[1 - which] else None
+
+
+def random_frame(rng, timed_ok=True):
+    typ = rng.choice([QUERY, STATE, DATA_UP] if timed_ok else [STATE, DATA_UP])
+    n = rng.randrange(4 if typ == QUERY else 0, NC_MAX_FRAME - HDR.size + 1)
+    return HDR.pack(MAGIC, rng.randrange(1, 0xFFFE), rng.randrange(0, 0xFFFE), rng.randrange(16), typ, n) + \
+        bytes(rng.randrange(256) for _ in range(n))
+
+
+def self_test(n, rng):
+    for _ in range(n):
+        a = random_frame(rng)
+        b = random_frame(rng, not timed(a))
+        body = nc_encode(a, b)
+        if body is None or nc_decode(body, a, 0) != b or nc_decode(body, b, 1) != a:
+            print(f"round trip failed:\n  a {a.hex()}\n  b {b.hex()}")
+            return False
+        # an end holding some other frame must not accept garbage
+        c = bytearray(a)
+        c[1] ^= 0x40  # src: hops and the timestamp are not compared
+        if nc_decode(body, bytes(c), 0) is not None:
+            print(f"decoded against the wrong frame:\n  a {a.hex()}\n  b {b.hex()}")
+            return False
+    return True
+
+
+class Entry:
+    # PendingTx
+    def __init__(self, src, dst, hops, typ, pl, when, rx_at, echo):
+        self.src, self.dst, self.hops, self.type, self.pl = src, dst, hops, typ, pl
+        self.next, self.rx_at, self.echo, self.retx = when, rx_at, echo, 0
+        self.hash = frame_hash(HDR.pack(MAGIC, src, dst, hops, typ, len(pl)) + pl)
+
+
+class Dev:
+    def __init__(self, i, a):
+        self.id = i
+        self.cap = self.tokens = a.permille * DC_WINDOW_MS / 1000
+        self.at = self.free_at = 0.0
+        self.busy_until = 0.0
+        self.tx = []  # own transmissions (start, end), for half duplex
+        self.txq = []
+        self.ring = []
+        self.ring_size = NC_SENT_GW if i == GW else NC_SENT_NODE
+        self.seen = []  # [hash, hops, at], MAX_SEEN of them
+
+
+class Sim:
+    def __init__(self, a, hops, netcode, hold, seed):
+        self.a, self.k = a, hops
+        self.netcode, self.hold = netcode, hold
+        self.rng = random.Random(seed)
+        self.devs = [Dev(i, a) for i in range(hops + 1)]
+        self.q, self.seq = [], 0
+        self.air = 0.0
+        self.frames = {"plain": 0, "xor": 0}
+        self.coded = self.decoded = self.undecodable = self.unheld = self.mismatch = 0
+        self.truth = {}  # XOR body -> the two frames coded
+        self.on_air = []  # (start, end, sender)
+        self.polls = {}  # node -> [deadline, tries, answered]
+        self.answered = self.missed = self.dropped = 0
+
+    # -- event queue, mock radio, duty cycle
+
+    def push(self, t, kind, dev, arg=None):
+        self.seq += 1
+        heapq.heappush(self.q, (t, self.seq, kind, dev, arg))
+
+    def airtime(self, n):
+        return airtime_ms(self.a.sf, self.a.bw, self.a.cr, n)
+
+    def dc_ok(self, d, t):
+        d.tokens = min(d.cap, d.tokens + (t - d.at) * self.a.permille / 1000)
+        d.at = t
+        return t >= d.free_at
+
+    def transmit(self, d, f, t):
+        air = self.airtime(len(f))
+        d.tokens -= air
+        borrow = d.cap * self.a.borrow / 100
+        d.free_at = t + air + (max(0.0, -borrow - d.tokens) * 1000 / self.a.permille)
+        d.busy_until = t + air
+        d.tx.append((t, t + air))
+        self.on_air.append((t, t + air, d.id))
+        self.air += air
+        self.frames["xor" if f[6] == MSG_XOR else "plain"] += 1
+        for nb in (d.id - 1, d.id + 1):
+            if 0 <= nb <= self.k:
+                self.push(t + air, "rx", nb, (f, d.id, t))
+        self.push(t + air, "wake", d.id)
+        return t + air
+
+    def heard(self, r, sender, start, end):
+        if any(s < end and e > start for s, e in self.devs[r].tx):
+            return False  # half duplex
+        for s, e, who in self.on_air:
+            if who != sender and abs(who - r) == 1 and s < end and e > start:
+                return False  # collision
+        return self.rng.random() >= self.a.loss
+
+    # -- node.cpp
+
+    def frame_at(self, e, t):
+        f = bytearray(HDR.pack(MAGIC, e.src, e.dst, e.hops, e.type, len(e.pl)) + e.pl)
+        if e.rx_at is not None and timed(f):
+            o = HDR.size + ts_offset(e.type)
+            v = struct.unpack_from("<I", f, o)[0] + self.airtime(len(f)) + (t - e.rx_at)
+            struct.pack_into("<I", f, o, int(v) & 0xFFFFFFFF)
+        return bytes(f)
+
+    def remember(self, d, f):
+        if len(f) <= NC_MAX_FRAME and HDR.unpack_from(f)[2] != BCAST:
+            h = frame_hash(f)
+            d.ring = [x for x in d.ring if x[0] != h][-(d.ring_size - 1):] + [(h, f)]
+
+    def expects_echo(self, d, dst):
+        # downlink past our direct child, or uplink through a relay parent
+        return dst > d.id + 1 if dst != GW else d.id > 1
+
+    def echo_window(self, n):
+        return 2 * self.airtime(HDR.size + n) + HOP_ACK_SLACK_MS
+
+    def sent(self, d, e, t):
+        if e.echo and e.retx < HOP_MAX_RETX:
+            e.retx += 1
+            e.next = t + self.echo_window(len(e.pl))
+            self.push(e.next, "wake", d.id)
+        else:
+            d.txq.remove(e)
+
+    def waiting(self, d, e):
+        return e in d.txq and not e.retx and e.rx_at is not None and HDR.size + len(e.pl) <= NC_MAX_FRAME
+
+    def partner(self, d, up, e=None):
+        """A forward queued the other way; on a line the child at the far end is always d.id + 1."""
+        if not self.netcode:
+            return None
+        for f in d.txq:
+            if f is not e and self.waiting(d, f) and (f.dst == GW) != up:
+                return f
+        return None
+
+    def nc_send(self, d, e, t):
+        f = self.partner(d, e.dst == GW, e) if self.waiting(d, e) else None
+        if not f:
+            return False
+        a, b = self.frame_at(e, t), self.frame_at(f, t)
+        body = nc_encode(a, b)
+        if body is None:
+            return False
+        if not self.dc_ok(d, t):
+            e.next = f.next = d.free_at + 50
+            self.push(e.next, "wake", d.id)
+            return True
+        self.truth[body] = (a, b)
+        end = self.transmit(d, HDR.pack(MAGIC, d.id, BCAST, 0, MSG_XOR, len(body)) + body, t)
+        self.coded += 1
+        self.remember(d, a)
+        self.remember(d, b)
+        self.sent(d, e, end)
+        self.sent(d, f, end)
+        return True
+
+    def try_send(self, d, e, t):
+        f = self.frame_at(e, t)
+        if not self.dc_ok(d, t):
+            e.next = d.free_at + 50
+            self.push(e.next, "wake", d.id)
+            return False
+        end = self.transmit(d, f, t)
+        self.remember(d, f)
+        self.sent(d, e, end)
+        return True
+
+    def send_packet(self, d, src, dst, hops, typ, pl, t, rx_at=None):
+        codes = rx_at is not None and self.netcode and HDR.size + len(pl) <= NC_MAX_FRAME
+        paired = codes and self.partner(d, dst == GW) is not None
+        if paired or (codes and self.hold):
+            e = Entry(src, dst, hops, typ, pl, t + self.hold, rx_at, self.expects_echo(d, dst))
+            if self.enqueue(d, e):
+                if not paired:
+                    self.push(e.next, "wake", d.id)
+                elif not self.nc_send(d, e, t):
+                    self.try_send(d, e, t)
+                return
+        e = Entry(src, dst, hops, typ, pl, t, rx_at, self.expects_echo(d, dst))
+        if not self.dc_ok(d, t):
+            e.next = d.free_at + 50
+            if self.enqueue(d, e):
+                self.push(e.next, "wake", d.id)
+            return
+        f = self.frame_at(e, t)
+        end = self.transmit(d, f, t)
+        self.remember(d, f)
+        if e.echo:
+            e.retx = 1
+            e.next = end + self.echo_window(len(pl))
+            if self.enqueue(d, e):
+                self.push(e.next, "wake", d.id)
+
+    def enqueue(self, d, e):
+        if len(d.txq) >= MAX_TXQ:
+            self.dropped += 1
+            return False
+        d.txq.append(e)
+        return True
+
+    def hop_acked(self, d, h, hops):
+        for e in d.txq:
+            if e.echo and e.retx and e.hash == h and hops == e.hops + 1:
+                d.txq.remove(e)
+                return True
+        return False
+
+    def duplicate(self, d, h, hops, t):
+        for s in d.seen:
+            if s[0] != h or t - s[2] > SEEN_TTL_MS:
+                continue
+            if s[1] != hops:
+                return True
+            for e in d.txq:
+                if e.hash == h:
+                    if e.echo and e.retx:
+                        e.next = t
+                        self.push(t, "wake", d.id)
+                    return True
+            s[2] = t
+            return False
+        d.seen.append([h, hops, t])
+        del d.seen[:-MAX_SEEN]
+        return False
+
+    def decode(self, d, body):
+        h = XOR_HDR.unpack_from(body)
+        for which in (0, 1):
+            for rh, own in d.ring:
+                if rh == h[which]:
+                    out = nc_decode(body, own, which)
+                    if out is None:
+                        self.undecodable += 1
+                    else:
+                        self.decoded += 1
+                        if out != self.truth[body][1 - which]:
+                            self.mismatch += 1
+                    return out
+        self.unheld += 1
+        return None
+
+    def handle(self, d, f, t):
+        _, src, dst, hops, typ, ln = HDR.unpack_from(f)
+        h = frame_hash(f)
+        if self.hop_acked(d, h, hops):
+            return
+        if typ == MSG_XOR:
+            body = f[HDR.size:]
+            x = XOR_HDR.unpack_from(body)
+            self.hop_acked(d, x[0], x[2])
+            self.hop_acked(d, x[1], x[3])
+            out = self.decode(d, body)
+            if out and out[6] != MSG_XOR:
+                self.handle(d, out, t)
+            return
+        if d.id == GW:
+            p = self.polls.get(src)
+            if typ == STATE and dst == GW and p and not p[2]:
+                p[2] = True
+                self.answered += 1
+            return
+        if dst == d.id:
+            if typ == QUERY:
+                self.send_packet(d, d.id, GW, 0, STATE, struct.pack("<HBb", d.id - 1, d.id, -90), t)
+            return
+        if dst == BCAST or hops >= self.k:  # MAX_HOPS: the profile covers the line
+            return
+        down = dst > d.id
+        if (src > d.id) if down else (src <= d.id):
+            return
+        if self.duplicate(d, h, hops, t):
+            return
+        self.send_packet(d, src, dst, hops + 1, typ, f[HDR.size:], t, t)
+
+    def process_txq(self, d, t):
+        for e in list(d.txq):
+            if e in d.txq and t >= e.next:
+                if not self.nc_send(d, e, t):
+                    self.try_send(d, e, t)
+                return  # one transmission, the radio is busy until it ends
+
+    # -- gateway.cpp polling
+
+    def poll(self, t):
+        gw = self.devs[GW]
+        for j in range(1, self.k + 1):
+            p = self.polls[j]
+            if p[2] or t < p[0]:
+                continue
+            if p[1] >= QUERY_TRIES:
+                p[2] = True
+                self.missed += 1
+                continue
+            if not self.dc_ok(gw, t):
+                self.push(gw.free_at + 50, "wake", GW)
+                return
+            f = HDR.pack(MAGIC, GW, j, 0, QUERY, 4) + struct.pack("<I", int(t) & 0xFFFFFFFF)
+            end = self.transmit(gw, f, t)
+            self.remember(gw, f)
+            p[0] = end + QUERY_HOP_TIMEOUT_MS * j
+            p[1] += 1
+            self.push(p[0], "wake", GW)
+            return  # back to back: the next one when this has left the radio
+
+    def run(self):
+        a = self.a
+        for r in range(a.rounds):
+            self.push(r * a.period * 1000, "round", GW)
+        while self.q:
+            t, _, kind, i, arg = heapq.heappop(self.q)
+            d = self.devs[i]
+            self.on_air = [x for x in self.on_air if x[1] > t - 60000]
+            d.tx = [x for x in d.tx if x[1] > t - 60000]
+            if kind == "round":
+                self.missed += sum(1 for p in self.polls.values() if not p[2])
+                self.polls = {j: [t, 0, False] for j in range(1, self.k + 1)}
+            elif kind == "rx":
+                f, sender, start = arg
+                if self.heard(i, sender, start, t):
+                    # the loop picks the frame up a little later
+                    self.push(t + self.rng.uniform(1, LOOP_MS), "frame", i, f)
+                continue
+            elif kind == "frame":
+                if d.busy_until <= t:
+                    self.handle(d, arg, t)
+                continue
+            if d.busy_until > t:
+                continue  # transmit() wakes it when the frame is out
+            if i == GW:
+                self.poll(t)
+            else:
+                self.process_txq(d, t)
+        self.missed += sum(1 for p in self.polls.values() if not p[2])
+
+
+def main():
+    ap = argparse.ArgumentParser(description="LoRa-QTree relay network coding check and airtime")
+    ap.add_argument("--lines", default="2,3,4,5,6,8", help="line lengths in hops")
+    ap.add_argument("--rounds", type=int, default=20)
+    ap.add_argument("--seeds", type=int, default=10, help="runs averaged per line and mode")
+    ap.add_argument("--period", type=int, default=600, help="query period, s")
+    ap.add_argument("--hold", type=int, default=0, help="also run with this nc_hold, ms")
+    ap.add_argument("--loss", type=float, default=0.0, help="per-frame, per-receiver loss probability")
+    ap.add_argument("--sf", type=int, default=12)
+    ap.add_argument("--bw", type=float, default=125)
+    ap.add_argument("--cr", type=int, default=5)
+    ap.add_argument("--permille", type=int, default=10, help="duty-cycle limit, 10 = 1 %%")
+    ap.add_argument("--borrow", type=int, default=33, help="dc_borrow_pct")
+    ap.add_argument("--seed", type=int, default=1)
+    ap.add_argument("--selftest", type=int, default=2000, help="random frame pairs round-tripped first")
+    args = ap.parse_args()
+
+    if not self_test(args.selftest, random.Random(args.seed)):
+        return 1
+    print(f"encode/decode: {args.selftest} random pairs ok")
+    print(f"SF{args.sf}/{args.bw:g} kHz, polled every {args.period} s, loss {args.loss:.0%}, "
+          f"{args.seeds} x {args.rounds} rounds; per round:")
+    print(f"{'hops':>4} {'mode':<10} {'frames':>7} {'xor':>5} {'airtime s':>10} {'answered':>9} {'s/STATE':>8} "
+          f"{'saved':>6}")
+    modes = [("off", False, 0), ("netcode", True, 0)]
+    if args.hold:
+        modes.append((f"hold {args.hold}", True, args.hold))
+    bad = 0
+    for k in (int(x) for x in args.lines.split(",")):
+        base = None
+        for name, nc, hold in modes:
+            tot = {"air": 0.0, "frames": 0, "xor": 0, "answered": 0, "missed": 0, "mismatch": 0, "lost": 0}
+            for seed in range(args.seed, args.seed + args.seeds):
+                s = Sim(args, k, nc, hold, seed)
+                s.run()
+                tot["air"] += s.air / 1000
+                tot["frames"] += s.frames["plain"] + s.frames["xor"]
+                tot["xor"] += s.frames["xor"]
+                tot["answered"] += s.answered
+                tot["missed"] += s.missed
+                tot["mismatch"] += s.mismatch
+                tot["lost"] += s.undecodable + s.unheld
+            n = args.seeds * args.rounds
+            # airtime per STATE that made it, as failed polls also cost less
+            per = tot["air"] / max(1, tot["answered"])
+            base = base or per
+            print(f"{k:>4} {name:<10} {tot['frames'] / n:7.1f} {tot['xor'] / n:5.1f} {tot['air'] / n:10.1f} "
+                  f"{tot['answered'] / max(1, tot['answered'] + tot['missed']):9.1%} {per:8.2f} "
+                  f"{1 - per / base:6.1%}")
+            if tot["mismatch"]:
+                print(f"     {tot['mismatch']} decoded frames differ from what the relay coded")
+                bad += 1
+            if tot["lost"]:
+                print(f"     {tot['lost']} XOR frames an end could not decode")
+    return 1 if bad else 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,258 @@
+# tools/otasim.py
+#
+# Simulates a mesh firmware rollout (ota.h) on a host: the gateway and the
+# relays serve their children with OTA_OFFER / OTA_CHUNK broadcasts and
+# OTA_NEED repairs, each sender on its own EU868 duty-cycle bucket with the
+# OTA_DC_RESERVE_PCT floor, and every frame lost with the given probability.
+#
+#   otasim.py                                 50 nodes, 3 hops, 8 KB delta
+#   otasim.py --delta update.qd --loss 0.2 --sf 9 --seed 3
+#
+# Prints when each hop depth had the whole image, the frames and airtime
+# the rollout took, and the same image sent end to end to every node for
+# comparison. Collisions and the polling traffic sharing the budget are not
+# modelled; the reserve stands for the latter.
+import argparse, heapq, random, sys
+
+from meshcap import airtime_ms
+
+HDR = 8  # MeshHeader
+MAX_PAYLOAD = 64
+CHUNK_HDR = 6  # image id u32, index u16
+CHUNK = MAX_PAYLOAD - CHUNK_HDR
+NEED_BYTES = 16
+OFFER_LEN, NEED_HDR = 13, 6
+PREP_MS, NEED_JITTER_MS, OFFER_MS, QUIET_OFFERS, REOFFER_CHUNKS = 5000, 4000, 30000, 4, 32
+NEED_RETRY_MS = 300000
+DC_WINDOW_MS = 3600000
+
+
+class Node:
+    def __init__(self, nid, parent, depth):
+        self.id, self.parent, self.depth = nid, parent, depth
+        self.children = []
+        self.started = False
+        self.have = set()
+        self.done_at = None
+        self.need_due = False  # as OtaRecv.needAt
+        self.need_at = 0.0
+        self.need_gen = 0
+        # duty cycle, as channels.h: tokens refill at permille per second
+        self.tokens = self.cap = 0.0
+        self.at = 0.0
+        self.air = 0.0
+        # serving, as OtaServe
+        self.serving = False
+        self.want = set()
+        self.cursor = 0
+        self.quiet = 0
+        self.since_offer = self.sent = 0
+        self.offer_due = False
+        self.next_at = 0.0
+        self.gen = 0
+
+
+class Sim:
+    def __init__(self, args):
+        self.a = args
+        self.rng = random.Random(args.seed)
+        self.chunks = -(-args.bytes // CHUNK)
+        self.full_air = airtime_ms(args.sf, args.bw, args.cr, HDR + MAX_PAYLOAD)
+        self.q, self.seq = [], 0
+        self.frames = {"offer": 0, "chunk": 0, "need": 0}
+        self.air = 0.0
+        self.nodes = self.build_tree()
+
+    def build_tree(self):
+        a = self.a
+        gw = Node(0, None, 0)
+        nodes = [gw]
+        # every depth up to --hops gets a share of the nodes; parents come
+        # from the depth above
+        per = [a.nodes // a.hops] * a.hops
+        per[-1] += a.nodes - sum(per)
+        above = [gw]
+        for d in range(1, a.hops + 1):
+            level = []
+            for _ in range(per[d - 1]):
+                p = self.rng.choice(above)
+                n = Node(len(nodes), p, d)
+                p.children.append(n)
+                nodes.append(n)
+                level.append(n)
+            above = level
+        for n in nodes:
+            n.cap = n.tokens = a.permille * DC_WINDOW_MS / 1000
+        return nodes
+
+    def push(self, t, kind, node, gen=0):
+        self.seq += 1
+        heapq.heappush(self.q, (t, self.seq, kind, node.id, gen))
+
+    def refill(self, n, t):
+        n.tokens = min(n.cap, n.tokens + (t - n.at) * self.a.permille / 1000)
+        n.at = t
+
+    def transmit(self, n, t, length, kind):
+        self.refill(n, t)
+        air = airtime_ms(self.a.sf, self.a.bw, self.a.cr, HDR + length)
+        n.tokens -= air
+        n.air += air
+        self.air += air
+        self.frames[kind] += 1
+        return air
+
+    def heard(self):
+        return self.rng.random() >= self.a.loss
+
+    def serve_start(self, n, t, everything):
+        n.serving = True
+        n.want = set(range(self.chunks)) if everything else set()
+        n.cursor = n.quiet = n.since_offer = n.sent = 0
+        n.offer_due = everything
+        self.schedule(n, t)
+
+    def schedule(self, n, t):
+        n.next_at = t
+        n.gen += 1
+        self.push(t, "pump", n, n.gen)
+
+    def complete(self, n, t):
+        n.done_at = t
+        if n.children:
+            self.serve_start(n, t, True)
+
+    def pump(self, n, t):
+        if not n.serving:
+            return
+        self.refill(n, t)
+        reserve = n.cap * self.a.reserve / 100
+        if n.tokens < reserve:
+            self.schedule(n, t + (reserve - n.tokens) * 1000 / self.a.permille + 1)
+            return
+        if not n.offer_due and n.want:
+            idx = n.cursor % self.chunks
+            while idx not in n.want:
+                idx = (idx + 1) % self.chunks
+            n.want.discard(idx)
+            n.cursor = idx + 1
+            n.sent += 1
+            n.since_offer += 1
+            if n.since_offer >= REOFFER_CHUNKS:
+                n.offer_due = True
+            air = self.transmit(n, t, CHUNK_HDR + min(CHUNK, self.a.bytes - idx * CHUNK), "chunk")
+            for c in n.children:
+                if c.started and c.done_at is None and self.heard():
+                    # the parent is serving: no NEED until it asks again
+                    if c.need_due:
+                        self.schedule_need(c, t + NEED_RETRY_MS)
+                    c.have.add(idx)
+                    if len(c.have) == self.chunks:
+                        self.complete(c, t + air)
+            self.schedule(n, t + air + self.full_air)
+            return
+        if not n.offer_due and n.quiet >= QUIET_OFFERS:
+            n.serving = False
+            return
+        ask = not n.offer_due
+        air = self.transmit(n, t, OFFER_LEN, "offer")
+        for c in n.children:
+            if self.heard():
+                c.started = True
+                if ask and c.done_at is None and (not c.need_due or c.need_at > t + NEED_JITTER_MS):
+                    self.schedule_need(c, t + air + 1 + self.rng.uniform(0, NEED_JITTER_MS))
+        if ask:
+            n.quiet += 1
+        wait = OFFER_MS if ask else self.full_air if n.sent else PREP_MS
+        n.offer_due = False
+        n.since_offer = 0
+        self.schedule(n, t + air + wait)
+
+    def schedule_need(self, c, t):
+        c.need_due = True
+        c.need_at = t
+        c.need_gen += 1
+        self.push(t, "need", c, c.need_gen)
+
+    def need(self, c, t):
+        if c.done_at is not None:
+            c.need_due = False
+            return
+        missing = [i for i in range(self.chunks) if i not in c.have]
+        base = missing[0]
+        bits = [i - base for i in missing if i - base < NEED_BYTES * 8]
+        air = self.transmit(c, t, NEED_HDR + bits[-1] // 8 + 1, "need")
+        self.schedule_need(c, t + NEED_RETRY_MS)
+        p = c.parent
+        # only a parent holding the whole image serves NEEDs
+        if not self.heard() or (p.parent and p.done_at is None):
+            return
+        if not p.serving:
+            self.serve_start(p, t, False)
+        if not p.want:
+            self.schedule(p, t + air + NEED_JITTER_MS)
+        p.want.update(base + b for b in bits)
+        p.quiet = 0
+
+    def run(self):
+        gw = self.nodes[0]
+        self.serve_start(gw, 0.0, True)
+        while self.q:
+            t, _, kind, nid, gen = heapq.heappop(self.q)
+            n = self.nodes[nid]
+            if kind == "pump" and gen == n.gen:
+                self.pump(n, t)
+            elif kind == "need" and gen == n.need_gen:
+                self.need(n, t)
+            if all(x.done_at is not None for x in self.nodes[1:]) and not any(x.serving for x in self.nodes):
+                break
+        return t
+
+    def report(self, end):
+        a = self.a
+        print(f"{a.nodes} nodes, {a.hops} hops, {a.bytes} B delta = {self.chunks} chunks, SF{a.sf}/{a.bw:g} kHz, "
+              f"loss {a.loss:.0%}, {a.permille / 10:g} % duty cycle, {a.reserve} % reserve")
+        for d in range(1, a.hops + 1):
+            level = [n for n in self.nodes if n.depth == d]
+            done = [n.done_at for n in level if n.done_at is not None]
+            last = f"{max(done) / 3600000:.2f} h" if len(done) == len(level) else "incomplete"
+            print(f"  hop {d}: {len(level):3d} nodes, last complete after {last}")
+        print(f"  rollout over after {end / 3600000:.2f} h")
+        print(f"  frames: {self.frames['chunk']} chunks, {self.frames['offer']} offers, {self.frames['need']} needs; "
+              f"airtime {self.air / 1000:.0f} s")
+        # every chunk unicast over every hop to every node, first try
+        hops = sum(n.depth for n in self.nodes[1:])
+        e2e = hops * self.chunks * self.full_air
+        print(f"  end-to-end unicast would take {e2e / 1000:.0f} s of airtime "
+              f"({e2e / max(1.0, self.air):.1f}x), before any retries")
+        worst = max(self.nodes, key=lambda n: n.air)
+        print(f"  busiest sender: node {worst.id} (hop {worst.depth}, {len(worst.children)} children), "
+              f"{worst.air / 1000:.0f} s of airtime")
+
+
+def main():
+    ap = argparse.ArgumentParser(description="LoRa-QTree mesh firmware rollout simulation")
+    ap.add_argument("--nodes", type=int, default=50)
+    ap.add_argument("--hops", type=int, default=3)
+    ap.add_argument("--delta", help="delta image from mkdelta.py, sets --bytes")
+    ap.add_argument("--bytes", type=int, default=8192)
+    ap.add_argument("--loss", type=float, default=0.1, help="per-frame, per-receiver loss probability")
+    ap.add_argument("--sf", type=int, default=10)
+    ap.add_argument("--bw", type=float, default=125)
+    ap.add_argument("--cr", type=int, default=5)
+    ap.add_argument("--permille", type=int, default=10, help="duty-cycle limit, 10 = 1 %%")
+    ap.add_argument("--reserve", type=int, default=50, help="OTA_DC_RESERVE_PCT")
+    ap.add_argument("--seed", type=int, default=1)
+    args = ap.parse_args()
+    if args.delta:
+        with open(args.delta, "rb") as f:
+            args.bytes = len(f.read())
+    if args.hops < 1 or args.nodes < args.hops:
+        ap.error("need at least one node per hop")
+    sim = Sim(args)
+    sim.report(sim.run())
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())